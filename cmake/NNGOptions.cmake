@@ -138,11 +138,15 @@ CMAKE_DEPENDENT_OPTION(NNG_TRANSPORT_WSS "Enable WSS transport." ON
         "NNG_ENABLE_TLS" OFF)
 mark_as_advanced(NNG_TRANSPORT_WSS)
 
+# MQTT WebSocket transport
+option (NNG_TRANSPORT_MQTT_WS "Enable MQTT WebSocket transport." ON)
+mark_as_advanced(NNG_TRANSPORT_MQTT_WS)
+
 # ZeroTier
 option (NNG_TRANSPORT_ZEROTIER "Enable ZeroTier transport (requires libzerotiercore)." OFF)
 mark_as_advanced(NNG_TRANSPORT_ZEROTIER)
 
-if (NNG_TRANSPORT_WS OR NNG_TRANSPORT_WSS)
+if (NNG_TRANSPORT_WS OR NNG_TRANSPORT_WSS OR NNG_TRANSPORT_MQTT_WS)
     # Make sure things we *MUST* have are enabled.
     set(NNG_SUPP_WEBSOCKET ON)
     set(NNG_SUPP_HTTP ON)
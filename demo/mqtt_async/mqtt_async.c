@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -140,9 +141,17 @@ alloc_work(nng_socket sock)
 void
 connect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
 {
+	static bool subscribed = false;
+
 	printf("%s: connected!\n", __FUNCTION__);
 	nng_socket sock = *(nng_socket *) arg;
 
+	// The client subscribes again by itself after a reconnect.
+	if (subscribed) {
+		return;
+	}
+	subscribed = true;
+
 	nng_mqtt_topic_qos topic_qos[] = {
 		{ .qos     = 0,
 		    .topic = { .buf = (uint8_t *) SUB_TOPIC1,
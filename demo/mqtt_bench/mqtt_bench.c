@@ -0,0 +1,250 @@
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+//
+// This is a throughput benchmark of the MQTT client with many threads
+// publishing and receiving on one connection.
+//
+// Each worker has a context it publishes from with QoS 0 to its own topic,
+// and a context subscribed to that topic that it receives on, both in
+// threads of their own.  The benchmark runs with 1, 2, 4, ... workers up
+// to the given number, and prints the rate of messages sent and received
+// for each, which shows how the client scales across cores.  The server
+// must route the messages back to us, so any broker will do.
+//
+// # Example:
+//
+// Run up to 8 workers for 5 seconds each, with 64 byte payloads:
+// ```
+// $ ./mqtt_bench mqtt-tcp://127.0.0.1:1883 8 5 64
+// ```
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nng/mqtt/mqtt_client.h>
+#include <nng/nng.h>
+#include <nng/supplemental/util/platform.h>
+
+struct worker {
+	nng_socket  sock;
+	char        topic[32];
+	uint8_t *   payload;
+	uint32_t    payload_len;
+	nng_time    end;
+	uint64_t    sent;
+	uint64_t    received;
+	nng_thread *pub_thr;
+	nng_thread *sub_thr;
+	nng_ctx     sub_ctx;
+};
+
+static void
+fatal(const char *msg, int rv)
+{
+	fprintf(stderr, "%s: %s\n", msg, nng_strerror(rv));
+	exit(1);
+}
+
+static void
+publisher(void *arg)
+{
+	struct worker *w = arg;
+	nng_ctx        ctx;
+	nng_aio *      aio;
+	nng_msg *      msg;
+	int            rv;
+
+	if ((rv = nng_ctx_open(&ctx, w->sock)) != 0) {
+		fatal("nng_ctx_open", rv);
+	}
+	if ((rv = nng_aio_alloc(&aio, NULL, NULL)) != 0) {
+		fatal("nng_aio_alloc", rv);
+	}
+	while (nng_clock() < w->end) {
+		nng_mqtt_msg_alloc(&msg, 0);
+		nng_mqtt_msg_set_packet_type(msg, NNG_MQTT_PUBLISH);
+		nng_mqtt_msg_set_publish_qos(msg, 0);
+		nng_mqtt_msg_set_publish_topic(msg, w->topic);
+		nng_mqtt_msg_set_publish_payload(
+		    msg, w->payload, w->payload_len);
+
+		nng_aio_set_msg(aio, msg);
+		nng_ctx_send(ctx, aio);
+		nng_aio_wait(aio);
+		if ((rv = nng_aio_result(aio)) != 0) {
+			nng_msg_free(nng_aio_get_msg(aio));
+			if (rv == NNG_ECLOSED) {
+				break;
+			}
+			continue;
+		}
+		w->sent++;
+	}
+	nng_aio_free(aio);
+	nng_ctx_close(ctx);
+}
+
+static void
+subscriber(void *arg)
+{
+	struct worker *w = arg;
+	nng_aio *      aio;
+	int            rv;
+
+	if ((rv = nng_aio_alloc(&aio, NULL, NULL)) != 0) {
+		fatal("nng_aio_alloc", rv);
+	}
+	// wake up now and then to notice the end of the run
+	nng_aio_set_timeout(aio, 100);
+	while (nng_clock() < w->end) {
+		nng_ctx_recv(w->sub_ctx, aio);
+		nng_aio_wait(aio);
+		if ((rv = nng_aio_result(aio)) == 0) {
+			nng_msg_free(nng_aio_get_msg(aio));
+			w->received++;
+		} else if (rv != NNG_ETIMEDOUT) {
+			break;
+		}
+	}
+	nng_aio_free(aio);
+}
+
+static void
+client_connect(nng_socket *sock, const char *url)
+{
+	nng_dialer dialer;
+	nng_msg *  connmsg;
+	int        rv;
+
+	if ((rv = nng_mqtt_client_open(sock)) != 0) {
+		fatal("nng_mqtt_client_open", rv);
+	}
+	if ((rv = nng_dialer_create(&dialer, *sock, url)) != 0) {
+		fatal("nng_dialer_create", rv);
+	}
+	nng_mqtt_msg_alloc(&connmsg, 0);
+	nng_mqtt_msg_set_packet_type(connmsg, NNG_MQTT_CONNECT);
+	nng_mqtt_msg_set_connect_proto_version(connmsg, 4);
+	nng_mqtt_msg_set_connect_keep_alive(connmsg, 60);
+	nng_mqtt_msg_set_connect_clean_session(connmsg, true);
+	nng_dialer_set_ptr(dialer, NNG_OPT_MQTT_CONNMSG, connmsg);
+
+	// Publishers wait for room rather than have messages dropped.
+	nng_socket_set_int(
+	    *sock, NNG_OPT_MQTT_SEND_POLICY, NNG_MQTT_SEND_BLOCK);
+
+	if ((rv = nng_dialer_start(dialer, 0)) != 0) {
+		fatal("nng_dialer_start", rv);
+	}
+	// The SUBACK also tells us that the connection is up.
+	if ((rv = nng_mqtt_subscribe(*sock, "bench/#")) != 0) {
+		fatal("nng_mqtt_subscribe", rv);
+	}
+}
+
+static void
+run(const char *url, unsigned nworkers, unsigned seconds, uint8_t *payload,
+    uint32_t payload_len)
+{
+	nng_socket     sock;
+	struct worker *workers;
+	uint64_t       sent     = 0;
+	uint64_t       received = 0;
+	nng_time       end;
+	int            rv;
+
+	if ((workers = calloc(nworkers, sizeof(*workers))) == NULL) {
+		fatal("calloc", NNG_ENOMEM);
+	}
+	client_connect(&sock, url);
+
+	end = nng_clock() + (nng_time) seconds * 1000;
+	for (unsigned i = 0; i < nworkers; i++) {
+		struct worker *w = &workers[i];
+
+		w->sock        = sock;
+		w->payload     = payload;
+		w->payload_len = payload_len;
+		w->end         = end;
+		snprintf(w->topic, sizeof(w->topic), "bench/%u", i);
+		if (((rv = nng_ctx_open(&w->sub_ctx, sock)) != 0) ||
+		    ((rv = nng_ctx_set_string(w->sub_ctx,
+		          NNG_OPT_MQTT_CTX_SUBSCRIBE, w->topic)) != 0)) {
+			fatal("subscribe context", rv);
+		}
+	}
+	for (unsigned i = 0; i < nworkers; i++) {
+		struct worker *w = &workers[i];
+
+		if (((rv = nng_thread_create(&w->sub_thr, subscriber, w)) !=
+		        0) ||
+		    ((rv = nng_thread_create(&w->pub_thr, publisher, w)) !=
+		        0)) {
+			fatal("nng_thread_create", rv);
+		}
+	}
+	for (unsigned i = 0; i < nworkers; i++) {
+		nng_thread_destroy(workers[i].pub_thr);
+		nng_thread_destroy(workers[i].sub_thr);
+		nng_ctx_close(workers[i].sub_ctx);
+		sent += workers[i].sent;
+		received += workers[i].received;
+	}
+	nng_close(sock);
+	free(workers);
+
+	printf("workers %3u  sent %12.0f msg/s  received %12.0f msg/s\n",
+	    nworkers, (double) sent / seconds, (double) received / seconds);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned max_workers = 8;
+	unsigned seconds     = 5;
+	uint32_t size        = 64;
+	uint8_t *payload;
+
+	if (argc < 2 || argc > 5) {
+		fprintf(stderr,
+		    "Usage: %s <URL> [<max workers> [<seconds> [<size>]]]\n",
+		    argv[0]);
+		return (1);
+	}
+	if (argc > 2) {
+		max_workers = (unsigned) atoi(argv[2]);
+	}
+	if (argc > 3) {
+		seconds = (unsigned) atoi(argv[3]);
+	}
+	if (argc > 4) {
+		size = (uint32_t) atoi(argv[4]);
+	}
+	if (max_workers == 0 || seconds == 0) {
+		fprintf(stderr, "workers and seconds must be positive\n");
+		return (1);
+	}
+	if ((payload = malloc(size > 0 ? size : 1)) == NULL) {
+		fatal("malloc", NNG_ENOMEM);
+	}
+	memset(payload, 'x', size);
+
+	for (unsigned n = 1; n <= max_workers; n *= 2) {
+		run(argv[1], n, seconds, payload, size);
+		if (n < max_workers && n * 2 > max_workers) {
+			// finish with the exact number asked for
+			run(argv[1], max_workers, seconds, payload, size);
+		}
+	}
+	free(payload);
+	return (0);
+}
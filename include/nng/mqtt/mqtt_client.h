@@ -100,13 +100,13 @@ extern "C" {
 
 #define NNG_OPT_MQTT_WILL_DELAY "will-delay"
 
-// NNG_OPT_MQTT_RECEIVE_MAX is used with QoS 1 or 2 (not implemented),
-// and indicates the level of concurrent receives it is willing to
-// process. (TODO: Implementation note: we will need to preallocate a complete
-// state machine (aio, plus any state) for each value of this > 0.
-// It's not clear whether this should be tunable.)  This is read-only
+// NNG_OPT_MQTT_RECEIVE_MAX is the number of QoS 1 and 2 publishes the
+// server is willing to process concurrently.  This is a read-only
 // property on the socket, and records the value given from the server.
-// It will be 64K if the server did not indicate a specific value.
+// It will be 64K if the server did not indicate a specific value.  The
+// client keeps no more than this many publishes unacknowledged, whatever
+// NNG_OPT_MQTT_SEND_WINDOW says.  With several connections, each has its
+// own, and the socket reports that of the first.
 #define NNG_OPT_MQTT_RECEIVE_MAX "mqtt-receive-max"
 
 // NNG_OPT_MQTT_SESSION_EXPIRES is an nng_duration.
@@ -117,6 +117,14 @@ extern "C" {
 // expiry interval.
 #define NNG_OPT_MQTT_SESSION_EXPIRES "session-expires"
 
+// NNG_OPT_MQTT_TOPIC_ALIAS_MAX is an int on the client socket, the most
+// MQTT 5.0 topic aliases it will assign to the topics it publishes to with
+// QoS 0.  The server's own Topic Alias Maximum caps it further.  Repeated
+// topics then go out as a two byte alias instead of the topic string.
+// Zero disables outbound aliases.  The default is 1024.  It takes effect
+// on the next connection.  To let the server alias the topics it sends us,
+// set a Topic Alias Maximum on the CONNECT message instead, with
+// nng_mqtt_msg_set_connect_topic_alias_max().
 #define NNG_OPT_MQTT_TOPIC_ALIAS_MAX "alias-max"
 #define NNG_OPT_MQTT_TOPIC_ALIAS "topic-alias"
 #define NNG_OPT_MQTT_MAX_QOS "max-qos"
@@ -128,6 +136,123 @@ extern "C" {
 #define NNG_MAX_SEND_LMQ 16
 #define NNG_TRAN_MAX_LMQ_SIZE 128
 
+// NNG_OPT_MQTT_SEND_BATCH is a size_t byte budget set on the client socket.
+// When non-zero, messages that queue up while a write is in progress are
+// packed together and sent in a single write, until the batch reaches this
+// many bytes.  Zero (the default) sends one packet per write.
+#define NNG_OPT_MQTT_SEND_BATCH "mqtt-send-batch"
+
+// NNG_OPT_MQTT_SEND_POLICY is an integer set on the client socket that
+// decides what happens to a send when there is no room for it, either
+// because the send queue is full or because the in-flight window is.
+// NNG_MQTT_SEND_DROP_OLDEST (the default) discards the oldest queued
+// message to make room, NNG_MQTT_SEND_DROP_NEWEST fails the new send
+// with NNG_EAGAIN, and NNG_MQTT_SEND_BLOCK parks the send until room
+// frees up, subject to the timeout of its aio.  A QoS 1 or 2 publish
+// that does not fit in the window waits for room as under
+// NNG_MQTT_SEND_BLOCK, unless the policy is NNG_MQTT_SEND_DROP_NEWEST.
+// Under NNG_MQTT_SEND_DROP_OLDEST at most NNG_MAX_SEND_LMQ sends wait,
+// and the oldest of them fails with NNG_EAGAIN to make room.
+#define NNG_OPT_MQTT_SEND_POLICY "mqtt-send-policy"
+
+#define NNG_MQTT_SEND_DROP_OLDEST 0
+#define NNG_MQTT_SEND_DROP_NEWEST 1
+#define NNG_MQTT_SEND_BLOCK 2
+
+// A client socket may have several dialers, each with a CONNECT of its
+// own, for instance with a distinct client identifier.  Every connection
+// they make is a shard of the socket.  Subscriptions are made on all of
+// them, so to have the server hand each message to one connection only,
+// subscribe to a shared subscription ("$share/<group>/<filter>").
+// Received messages from all connections are merged.
+//
+// NNG_OPT_MQTT_SHARD_POLICY is an integer set on the client socket that
+// decides which connection a publish goes out on.  NNG_MQTT_SHARD_TOPIC
+// (the default) picks it by a hash of the topic, which keeps publishes to
+// one topic in order for as long as the same connections are up, and
+// NNG_MQTT_SHARD_ROUND_ROBIN takes the connections in turn.  Other
+// packets go on the first connection.
+#define NNG_OPT_MQTT_SHARD_POLICY "mqtt-shard-policy"
+
+#define NNG_MQTT_SHARD_TOPIC 0
+#define NNG_MQTT_SHARD_ROUND_ROBIN 1
+
+// NNG_OPT_MQTT_RECV_QUEUE is an integer set on the client socket giving
+// how many received publishes may wait on each queue, that of every
+// context and that of the connection for contexts without subscriptions.
+// It defaults to NNG_MAX_RECV_LMQ, and takes effect at once.
+#define NNG_OPT_MQTT_RECV_QUEUE "mqtt-recv-queue"
+
+// NNG_OPT_MQTT_RECV_POLICY is an integer set on the client socket that
+// decides what happens to a received publish when its queue is full.
+// NNG_MQTT_RECV_DROP_NEWEST (the default) discards it, and
+// NNG_MQTT_RECV_DROP_OLDEST discards the oldest queued one instead.
+// NNG_MQTT_RECV_GROW lets the queue grow for as long as it holds no more
+// than NNG_OPT_MQTT_RECV_BUDGET bytes, then drops the newest.
+// NNG_MQTT_RECV_BLOCK stops reading from the connection until the
+// application takes messages off the queue, which pushes back on the
+// server through TCP flow control.  Dropped messages are counted by the
+// rx_drop and rx_drop_bytes statistics of the pipe.
+#define NNG_OPT_MQTT_RECV_POLICY "mqtt-recv-policy"
+
+#define NNG_MQTT_RECV_DROP_OLDEST 0
+#define NNG_MQTT_RECV_DROP_NEWEST 1
+#define NNG_MQTT_RECV_BLOCK 2
+#define NNG_MQTT_RECV_GROW 3
+
+// NNG_OPT_MQTT_RECV_BUDGET is a size_t, the number of bytes a receive
+// queue may hold under NNG_MQTT_RECV_GROW.  The default is 1 MiB.
+#define NNG_OPT_MQTT_RECV_BUDGET "mqtt-recv-budget"
+
+// NNG_OPT_MQTT_RECV_HIGH_WATER and NNG_OPT_MQTT_RECV_LOW_WATER are size_t
+// byte counts set on the client socket.  Once received messages waiting
+// for the application add up to the high watermark, the client stops
+// reading from the connection, and it starts again when they are down
+// to the low watermark.  Meanwhile the kernel socket buffer and the
+// server's own flow control hold back the rest.  They default to 1 MiB
+// and 256 KiB; a high watermark of zero reads regardless.  The rx_stalls
+// statistic of the pipe counts the stops.
+#define NNG_OPT_MQTT_RECV_HIGH_WATER "mqtt-recv-high-water"
+#define NNG_OPT_MQTT_RECV_LOW_WATER "mqtt-recv-low-water"
+
+// NNG_OPT_MQTT_SEND_WINDOW is an integer (1 to 65535) limiting how many
+// packets may await acknowledgement from the server at once, on each
+// connection.  The server's Receive Maximum lowers it further when it is
+// smaller.
+#define NNG_OPT_MQTT_SEND_WINDOW "mqtt-send-window"
+
+// NNG_OPT_MQTT_RETRY_INTERVAL is an nng_duration set on the client socket.
+// An unacknowledged QoS 1 or 2 message, subscribe or unsubscribe is sent
+// again (with the DUP flag for publishes) once this much time has passed,
+// and the interval doubles with each further attempt, up to 16 times the
+// configured value.  The default is 60 seconds.
+#define NNG_OPT_MQTT_RETRY_INTERVAL "mqtt-retry-interval"
+
+// NNG_OPT_MQTT_SESSION_FILE is a string naming a file where QoS 1 and 2
+// publishes are kept until they are acknowledged, so that they survive a
+// restart of the application.  It must be set before dialing, and is
+// meant for connections that do not use clean session: the kept messages
+// are sent again if the CONNACK reports a session present, and discarded
+// otherwise.
+#define NNG_OPT_MQTT_SESSION_FILE "mqtt-session-file"
+
+// NNG_OPT_MQTT_SESSION_SYNC is a boolean, true by default, that flushes
+// the session file to stable storage every time a publish is recorded in
+// it, before the publish is sent.  Turning it off is faster, but a power
+// failure may then lose publishes the file was meant to keep.  Either
+// way the file is written while the client holds its socket lock, and
+// writes that fail are counted in the "session_errors" statistic.
+#define NNG_OPT_MQTT_SESSION_SYNC "mqtt-session-sync"
+
+// NNG_OPT_MQTT_CTX_SUBSCRIBE and NNG_OPT_MQTT_CTX_UNSUBSCRIBE are strings
+// set on a client context to add or drop a topic filter, which may use
+// the '+' and '#' wildcards.  A received PUBLISH goes to every context
+// with a matching filter, and only those contexts that subscribed to
+// nothing receive the publishes no filter matches.  They only route what
+// the broker sends; the SUBSCRIBE itself is sent as before.
+#define NNG_OPT_MQTT_CTX_SUBSCRIBE "mqtt-ctx-subscribe"
+#define NNG_OPT_MQTT_CTX_UNSUBSCRIBE "mqtt-ctx-unsubscribe"
+
 // NNG_TLS_xxx options can be set on the client as well.
 // E.g. NNG_OPT_TLS_CA_CERT, etc.
 
@@ -143,19 +268,18 @@ extern "C" {
 // value rather than the value that we got from the server last time.
 #define NNG_OPT_MQTT_KEEP_ALIVE "mqtt-keep-alive"
 
-// NNG_OPT_MQTT_MAX_PACKET_SIZE is the maximum packet size that can
-// be used.  It needs to be set before the client dials.
+// NNG_OPT_MQTT_MAX_PACKET_SIZE is the maximum packet size the server
+// accepts, as a size_t, or zero if it gave none.  This is read-only, and
+// sends of larger packets fail with NNG_EMSGSIZE.
 #define NNG_OPT_MQTT_MAX_PACKET_SIZE "mqtt-max-packet-size"
 #define NNG_OPT_MQTT_USERNAME "username"
 #define NNG_OPT_MQTT_PASSWORD "password"
 
-// Note that MQTT sockets can be connected to at most a single server.
 // Creating the client does not connect it.
 NNG_DECL int nng_mqtt_client_open(nng_socket *);
 
-// Note that there is a single implicit dialer for the client,
-// and options may be set on the socket to configure dial options.
-// Those options should be set before doing nng_dial().
+// Options may be set on the socket to configure dial options.  Those
+// options should be set before doing nng_dial().
 
 // close done via nng_close().
 
@@ -169,12 +293,23 @@ NNG_DECL int nng_mqtt_client_open(nng_socket *);
 // Subscriptions are normally run synchronously from the view of the
 // caller.  Because there is a round-trip message involved, we use
 // a separate method instead of merely relying upon socket options.
+// These subscribe at QoS 0.  SUBSCRIBE and UNSUBSCRIBE messages sent on
+// the client, including those made here, are merged: while one packet
+// waits for its acknowledgement the next requests queue up, and then go
+// out together.  Each caller completes from its own SUBACK return codes,
+// failing with NNG_EPERM if the server refused one.  When an aio form
+// fails, the message left on the aio belongs to the caller.
+// Granted subscriptions are remembered until unsubscribed, and made again
+// by the client when it reconnects to a server without its session.
 // TODO: shared subscriptions.  Subscription options (retain, QoS)
 NNG_DECL int nng_mqtt_subscribe(nng_socket, const char *);
 NNG_DECL int nng_mqtt_subscribe_aio(nng_socket, const char *, nng_aio *);
 NNG_DECL int nng_mqtt_unsubscribe(nng_socket *, const char *);
 NNG_DECL int nng_mqtt_unsubscribe_aio(nng_socket *, const char *, nng_aio *);
 // as with other ctx based methods, we use the aio form exclusively
+// nng_mqtt_ctx_subscribe sets NNG_OPT_MQTT_CTX_SUBSCRIBE on the context
+// and completes the aio, if one is given, with the result.  Trailing
+// arguments are reserved.
 NNG_DECL int nng_mqtt_ctx_subscribe(nng_ctx *, const char *, nng_aio *, ...);
 
 // Message handling.  Note that topic aliases are handled by the library
@@ -186,7 +321,8 @@ typedef enum {
 } nng_mqtt_msg_format_t;
 
 // Message options.  These are convenience wrappers around the above
-// options.
+// options.  A message without an expiry never expires, and one without a
+// payload format is binary.
 
 NNG_DECL int nng_mqtt_set_msg_expiry(nng_msg *, nng_duration);
 NNG_DECL int nng_mqtt_get_msg_expiry(nng_msg *, nng_duration *);
@@ -236,6 +372,37 @@ typedef enum {
 	NNG_MQTT_AUTH        = 0x0F
 } nng_mqtt_packet_type;
 
+// MQTT 5.0 property identifiers.
+typedef enum {
+	NNG_MQTT_PROP_PAYLOAD_FORMAT         = 0x01,
+	NNG_MQTT_PROP_MESSAGE_EXPIRY         = 0x02,
+	NNG_MQTT_PROP_CONTENT_TYPE           = 0x03,
+	NNG_MQTT_PROP_RESPONSE_TOPIC         = 0x08,
+	NNG_MQTT_PROP_CORRELATION_DATA       = 0x09,
+	NNG_MQTT_PROP_SUBSCRIPTION_ID        = 0x0B,
+	NNG_MQTT_PROP_SESSION_EXPIRY         = 0x11,
+	NNG_MQTT_PROP_ASSIGNED_CLIENT_ID     = 0x12,
+	NNG_MQTT_PROP_SERVER_KEEP_ALIVE      = 0x13,
+	NNG_MQTT_PROP_AUTH_METHOD            = 0x15,
+	NNG_MQTT_PROP_AUTH_DATA              = 0x16,
+	NNG_MQTT_PROP_REQUEST_PROBLEM_INFO   = 0x17,
+	NNG_MQTT_PROP_WILL_DELAY             = 0x18,
+	NNG_MQTT_PROP_REQUEST_RESPONSE_INFO  = 0x19,
+	NNG_MQTT_PROP_RESPONSE_INFO          = 0x1A,
+	NNG_MQTT_PROP_SERVER_REFERENCE       = 0x1C,
+	NNG_MQTT_PROP_REASON_STRING          = 0x1F,
+	NNG_MQTT_PROP_RECEIVE_MAX            = 0x21,
+	NNG_MQTT_PROP_TOPIC_ALIAS_MAX        = 0x22,
+	NNG_MQTT_PROP_TOPIC_ALIAS            = 0x23,
+	NNG_MQTT_PROP_MAX_QOS                = 0x24,
+	NNG_MQTT_PROP_RETAIN_AVAILABLE       = 0x25,
+	NNG_MQTT_PROP_USER_PROPERTY          = 0x26,
+	NNG_MQTT_PROP_MAX_PACKET_SIZE        = 0x27,
+	NNG_MQTT_PROP_WILDCARD_SUB_AVAILABLE = 0x28,
+	NNG_MQTT_PROP_SUB_ID_AVAILABLE       = 0x29,
+	NNG_MQTT_PROP_SHARED_SUB_AVAILABLE   = 0x2A
+} nng_mqtt_property_id;
+
 struct mqtt_buf_t {
 	uint32_t length;
 	uint8_t *buf;
@@ -280,10 +447,13 @@ NNG_DECL const char *nng_mqtt_msg_get_connect_will_topic(nng_msg *);
 NNG_DECL uint8_t *   nng_mqtt_msg_get_connect_will_msg(nng_msg *, uint32_t *);
 NNG_DECL bool        nng_mqtt_msg_get_connect_will_retain(nng_msg *);
 NNG_DECL uint8_t     nng_mqtt_msg_get_connect_will_qos(nng_msg *);
+NNG_DECL void     nng_mqtt_msg_set_connect_topic_alias_max(nng_msg *, uint16_t);
+NNG_DECL uint16_t nng_mqtt_msg_get_connect_topic_alias_max(nng_msg *);
 NNG_DECL void        nng_mqtt_msg_set_connack_return_code(nng_msg *, uint8_t);
 NNG_DECL void        nng_mqtt_msg_set_connack_flags(nng_msg *, uint8_t);
 NNG_DECL uint8_t     nng_mqtt_msg_get_connack_return_code(nng_msg *);
 NNG_DECL uint8_t     nng_mqtt_msg_get_connack_flags(nng_msg *);
+NNG_DECL uint16_t    nng_mqtt_msg_get_connack_topic_alias_max(nng_msg *);
 NNG_DECL void        nng_mqtt_msg_set_publish_qos(nng_msg *, uint8_t);
 NNG_DECL uint8_t     nng_mqtt_msg_get_publish_qos(nng_msg *);
 NNG_DECL void        nng_mqtt_msg_set_publish_retain(nng_msg *, bool);
@@ -292,8 +462,18 @@ NNG_DECL void        nng_mqtt_msg_set_publish_dup(nng_msg *, bool);
 NNG_DECL bool        nng_mqtt_msg_get_publish_dup(nng_msg *);
 NNG_DECL void        nng_mqtt_msg_set_publish_topic(nng_msg *, const char *);
 NNG_DECL const char *nng_mqtt_msg_get_publish_topic(nng_msg *, uint32_t *);
+NNG_DECL uint16_t    nng_mqtt_msg_get_publish_packet_id(nng_msg *);
 NNG_DECL void nng_mqtt_msg_set_publish_payload(nng_msg *, uint8_t *, uint32_t);
 NNG_DECL uint8_t *nng_mqtt_msg_get_publish_payload(nng_msg *, uint32_t *);
+
+// nng_mqtt_msg_set_publish_payload_ref sets the payload of a PUBLISH to
+// an application buffer without copying it.  The buffer is written to the
+// connection from where it is, including for retransmits, so it must not
+// change until the release callback is called with its argument.  That
+// happens once no message refers to the buffer any more.  If this fails,
+// the callback is not called.
+NNG_DECL int nng_mqtt_msg_set_publish_payload_ref(
+    nng_msg *, void *, uint32_t, void (*)(void *), void *);
 NNG_DECL nng_mqtt_topic_qos *nng_mqtt_msg_get_subscribe_topics(
     nng_msg *, uint32_t *);
 NNG_DECL void nng_mqtt_msg_set_subscribe_topics(
@@ -306,6 +486,33 @@ NNG_DECL void     nng_mqtt_msg_set_unsubscribe_topics(
 NNG_DECL nng_mqtt_topic *nng_mqtt_msg_get_unsubscribe_topics(
     nng_msg *, uint32_t *);
 
+// MQTT 5.0 properties of a CONNECT, CONNACK, PUBLISH, SUBSCRIBE, SUBACK
+// or UNSUBSCRIBE message, which are only sent on a v5 connection.  A
+// received message keeps its properties in place in the message, and
+// they are only looked at when asked for, so ignoring them costs nothing.
+// Setting a property replaces any earlier one with the same identifier;
+// user properties add up instead.  The integer forms take the byte, two
+// and four byte and variable length integer properties, and the string
+// forms take strings and binary data, which are not NUL terminated and
+// for a received message stay valid until the message is changed.  The
+// getters return NNG_ENOENT for a property the message does not have,
+// NNG_EINVAL for an identifier of another type, and NNG_EPROTO if the
+// properties are malformed.
+NNG_DECL int nng_mqtt_msg_set_property_int(
+    nng_msg *, nng_mqtt_property_id, uint32_t);
+NNG_DECL int nng_mqtt_msg_get_property_int(
+    nng_msg *, nng_mqtt_property_id, uint32_t *);
+NNG_DECL int nng_mqtt_msg_set_property_str(
+    nng_msg *, nng_mqtt_property_id, const uint8_t *, uint32_t);
+NNG_DECL int nng_mqtt_msg_get_property_str(
+    nng_msg *, nng_mqtt_property_id, const uint8_t **, uint32_t *);
+NNG_DECL int nng_mqtt_msg_add_user_property(
+    nng_msg *, const char *, const char *);
+// nng_mqtt_msg_get_user_property gets the user property at an index,
+// counting from zero in the order they appear.
+NNG_DECL int nng_mqtt_msg_get_user_property(
+    nng_msg *, uint32_t, nng_mqtt_buffer *, nng_mqtt_buffer *);
+
 NNG_DECL nng_mqtt_topic *nng_mqtt_topic_array_create(size_t);
 NNG_DECL void nng_mqtt_topic_array_set(nng_mqtt_topic *, size_t, const char *);
 NNG_DECL void nng_mqtt_topic_array_free(nng_mqtt_topic *, size_t);
@@ -0,0 +1,31 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NNG_TRANSPORT_MQTT_WS_WS_H
+#define NNG_TRANSPORT_MQTT_WS_WS_H
+
+#include <nng/nng.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// MQTT over WebSocket, with URLs like "mqtt-ws://host:8083/mqtt", or
+// "mqtt-wss://" for WebSocket over TLS.  Packets go in binary messages of
+// the "mqtt" subprotocol.
+
+#ifndef NNG_ELIDE_DEPRECATED
+NNG_DECL int nng_mqtt_ws_register(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NNG_TRANSPORT_MQTT_WS_WS_H
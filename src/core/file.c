@@ -16,6 +16,12 @@ nni_file_put(const char *name, const void *data, size_t sz)
 	return (nni_plat_file_put(name, data, sz));
 }
 
+int
+nni_file_rename(const char *from, const char *to)
+{
+	return (nni_plat_file_rename(from, to));
+}
+
 int
 nni_file_get(const char *name, void **datap, size_t *szp)
 {
@@ -157,3 +163,43 @@ nni_file_unlock(nni_file_lockh *h)
 	nni_plat_file_unlock(&h->lk);
 	NNI_FREE_STRUCT(h);
 }
+
+struct nni_file_logh {
+	nni_plat_flog lg;
+};
+
+int
+nni_file_log_open(const char *path, nni_file_logh **hp)
+{
+	nni_file_logh *h;
+	int            rv;
+
+	if ((h = NNI_ALLOC_STRUCT(h)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	if ((rv = nni_plat_file_log_open(path, &h->lg)) != 0) {
+		NNI_FREE_STRUCT(h);
+		return (rv);
+	}
+	*hp = h;
+	return (0);
+}
+
+int
+nni_file_log_write(nni_file_logh *h, const void *data, size_t sz)
+{
+	return (nni_plat_file_log_write(&h->lg, data, sz));
+}
+
+int
+nni_file_log_sync(nni_file_logh *h)
+{
+	return (nni_plat_file_log_sync(&h->lg));
+}
+
+void
+nni_file_log_close(nni_file_logh *h)
+{
+	nni_plat_file_log_close(&h->lg);
+	NNI_FREE_STRUCT(h);
+}
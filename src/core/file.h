@@ -31,6 +31,23 @@
 // possible.
 extern int nni_file_put(const char *, const void *, size_t);
 
+// nni_file_log_open opens the named file to append to, creating it (and
+// any missing parent directories) if needed.  The file stays open, so
+// that appending does not cost an open and close each time, until
+// nni_file_log_close.  Nothing written is known to survive a power
+// failure until nni_file_log_sync returns.
+typedef struct nni_file_logh nni_file_logh;
+
+extern int  nni_file_log_open(const char *, nni_file_logh **);
+extern int  nni_file_log_write(nni_file_logh *, const void *, size_t);
+extern int  nni_file_log_sync(nni_file_logh *);
+extern void nni_file_log_close(nni_file_logh *);
+
+// nni_file_rename renames a file, replacing the target if it exists.
+// Writing a new file and renaming it over the old one is the way to
+// replace a file without risking a partially written copy.
+extern int nni_file_rename(const char *, const char *);
+
 // nni_plat_file_get reads the entire named file, allocating storage
 // to receive the data and returning the data and the size in the
 // reference arguments.  The data pointer should be freed with nni_free
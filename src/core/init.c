@@ -42,6 +42,7 @@ nni_init_helper(void)
 	}
 
 	// following never fail
+	nni_msg_sys_init();
 	nni_sp_tran_sys_init();
 	nni_mqtt_tran_sys_init();
 
@@ -71,6 +72,7 @@ nni_fini(void)
 	nni_taskq_sys_fini();
 	nni_reap_sys_fini(); // must be before timer and aio (expire)
 	nni_id_map_sys_fini();
+	nni_msg_sys_fini();
 
 	nni_plat_fini();
 	nni_inited = false;
@@ -116,6 +116,28 @@ nni_lmq_get(nni_lmq *lmq, nng_msg **mp)
 	return (0);
 }
 
+// nni_lmq_peek returns the message nni_lmq_get would take, leaving it on
+// the queue, or NULL if the queue is empty.
+nng_msg *
+nni_lmq_peek(nni_lmq *lmq)
+{
+	if (lmq->lmq_len == 0) {
+		return (NULL);
+	}
+	return (lmq->lmq_msgs[lmq->lmq_get]);
+}
+
+// nni_lmq_peek_at returns the message that is n places behind the one
+// nni_lmq_peek returns, or NULL if the queue is not that long.
+nng_msg *
+nni_lmq_peek_at(nni_lmq *lmq, size_t n)
+{
+	if (n >= lmq->lmq_len) {
+		return (NULL);
+	}
+	return (lmq->lmq_msgs[(lmq->lmq_get + n) & lmq->lmq_mask]);
+}
+
 int
 nni_lmq_resize(nni_lmq *lmq, size_t cap)
 {
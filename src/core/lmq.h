@@ -26,15 +26,17 @@ typedef struct nni_lmq {
 	nng_msg  *lmq_buf[2]; // default minimal buffer
 } nni_lmq;
 
-extern void   nni_lmq_init(nni_lmq *, size_t);
-extern void   nni_lmq_fini(nni_lmq *);
-extern void   nni_lmq_flush(nni_lmq *);
-extern size_t nni_lmq_len(nni_lmq *);
-extern size_t nni_lmq_cap(nni_lmq *);
-extern int    nni_lmq_put(nni_lmq *lmq, nng_msg *msg);
-extern int    nni_lmq_get(nni_lmq *lmq, nng_msg **mp);
-extern int    nni_lmq_resize(nni_lmq *, size_t);
-extern bool   nni_lmq_full(nni_lmq *);
-extern bool   nni_lmq_empty(nni_lmq *);
+extern void     nni_lmq_init(nni_lmq *, size_t);
+extern void     nni_lmq_fini(nni_lmq *);
+extern void     nni_lmq_flush(nni_lmq *);
+extern size_t   nni_lmq_len(nni_lmq *);
+extern size_t   nni_lmq_cap(nni_lmq *);
+extern int      nni_lmq_put(nni_lmq *lmq, nng_msg *msg);
+extern int      nni_lmq_get(nni_lmq *lmq, nng_msg **mp);
+extern nng_msg *nni_lmq_peek(nni_lmq *lmq);
+extern nng_msg *nni_lmq_peek_at(nni_lmq *lmq, size_t);
+extern int      nni_lmq_resize(nni_lmq *, size_t);
+extern bool     nni_lmq_full(nni_lmq *);
+extern bool     nni_lmq_empty(nni_lmq *);
 
 #endif // CORE_LMQ_H
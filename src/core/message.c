@@ -16,12 +16,15 @@
 
 // Message chunk, internal to the message implementation.
 typedef struct {
-	size_t   ch_cap; // allocated size
-	size_t   ch_len; // length in use
-	uint8_t *ch_buf; // underlying buffer
-	uint8_t *ch_ptr; // pointer to actual data
+	size_t   ch_cap;  // allocated size
+	size_t   ch_len;  // length in use
+	uint8_t *ch_buf;  // underlying buffer
+	uint8_t *ch_ptr;  // pointer to actual data
+	bool     ch_pool; // buffer is the message's pool buffer
 } nni_chunk;
 
+typedef struct msg_class msg_class;
+
 // Underlying message structure.
 struct nng_msg {
 	uint32_t           m_header_buf[(NNI_MAX_MAX_TTL + 1)];
@@ -30,8 +33,64 @@ struct nng_msg {
 	nni_proto_msg_ops *m_proto_ops;
 	void *             m_proto_data;
 	nni_atomic_int     m_refcnt;
-	uint32_t           m_pipe; // set on receive
+	uint32_t           m_pipe;     // set on receive
+	msg_class *        m_class;    // size class of the body, if any
+	uint8_t *          m_pool_buf; // class buffer that goes with it
+	nni_msg *          m_next;     // next kept message in the class
+};
+
+// Messages are allocated with room for protocol private data after them,
+// in the same block, for nni_msg_proto_alloc to hand out.  This is enough
+// for MQTT's.
+#define NNI_MSG_PROTO_SIZE 192
+#define NNI_MSG_BLOCK_SIZE (sizeof(nni_msg) + NNI_MSG_PROTO_SIZE)
+
+// Bodies that fit one of a few size classes get a buffer of the class
+// size, and when they are freed, the message is kept with its buffer for
+// the next one of the class, up to a limit.  The buffer stays with the
+// message even if the body outgrows it and moves.  This spares the allocator
+// the stream of small packets an MQTT connection has.  The classes suit
+// it: acks, pings and the like, small publishes, those of a few KB, and
+// those as large as the transports read at once.
+struct msg_class {
+	size_t   mc_size; // size of the body buffer
+	int      mc_max;  // most messages kept
+	int      mc_cnt;  // messages kept now
+	nni_msg *mc_free; // the kept messages
+	nni_mtx  mc_mtx;
+};
+
+static msg_class msg_classes[] = {
+	{ .mc_size = 128, .mc_max = 256, .mc_mtx = NNI_MTX_INITIALIZER },
+	{ .mc_size = 512, .mc_max = 256, .mc_mtx = NNI_MTX_INITIALIZER },
+	{ .mc_size = 4096 + 64, .mc_max = 64, .mc_mtx = NNI_MTX_INITIALIZER },
+	{ .mc_size = 65536 + 64, .mc_max = 8, .mc_mtx = NNI_MTX_INITIALIZER },
+};
+
+#ifdef NNG_ENABLE_STATS
+static const nni_stat_info msg_pool_info = {
+	.si_name = "msgpool",
+	.si_desc = "message pool statistics",
+	.si_type = NNG_STAT_SCOPE,
+};
+static const nni_stat_info msg_pool_hit_info = {
+	.si_name   = "hit",
+	.si_desc   = "messages reused from the pool",
+	.si_type   = NNG_STAT_COUNTER,
+	.si_unit   = NNG_UNIT_MESSAGES,
+	.si_atomic = true,
+};
+static const nni_stat_info msg_pool_miss_info = {
+	.si_name   = "miss",
+	.si_desc   = "messages of a size class newly allocated",
+	.si_type   = NNG_STAT_COUNTER,
+	.si_unit   = NNG_UNIT_MESSAGES,
+	.si_atomic = true,
 };
+static nni_stat_item msg_pool_stat;
+static nni_stat_item msg_pool_hit  = { .si_info = &msg_pool_hit_info };
+static nni_stat_item msg_pool_miss = { .si_info = &msg_pool_miss_info };
+#endif
 
 #if 0
 static void
@@ -83,6 +142,17 @@ nni_msg_dump(const char *banner, const nni_msg *msg)
 }
 #endif
 
+// nni_chunk_release lets go of the chunk's buffer, which is freed unless
+// the message pool owns it.
+static void
+nni_chunk_release(nni_chunk *ch)
+{
+	if (!ch->ch_pool) {
+		nni_free(ch->ch_buf, ch->ch_cap);
+	}
+	ch->ch_pool = false;
+}
+
 // nni_chunk_grow increases the underlying space for a chunk.  It ensures
 // that the desired amount of trailing space (including the length)
 // and headroom (excluding the length) are available.  It also copies
@@ -137,7 +207,7 @@ nni_chunk_grow(nni_chunk *ch, size_t newsz, size_t headwanted)
 		if (ch->ch_len > 0) {
 			memcpy(newbuf + headwanted, ch->ch_ptr, ch->ch_len);
 		}
-		nni_free(ch->ch_buf, ch->ch_cap);
+		nni_chunk_release(ch);
 		ch->ch_buf = newbuf;
 		ch->ch_ptr = newbuf + headwanted;
 		ch->ch_cap = newsz + headwanted;
@@ -151,7 +221,7 @@ nni_chunk_grow(nni_chunk *ch, size_t newsz, size_t headwanted)
 		if ((newbuf = nni_zalloc(newsz + headwanted)) == NULL) {
 			return (NNG_ENOMEM);
 		}
-		nni_free(ch->ch_buf, ch->ch_cap);
+		nni_chunk_release(ch);
 		ch->ch_cap = newsz + headwanted;
 		ch->ch_buf = newbuf;
 	}
@@ -164,7 +234,7 @@ static void
 nni_chunk_free(nni_chunk *ch)
 {
 	if ((ch->ch_cap != 0) && (ch->ch_buf != NULL)) {
-		nni_free(ch->ch_buf, ch->ch_cap);
+		nni_chunk_release(ch);
 	}
 	ch->ch_ptr = NULL;
 	ch->ch_buf = NULL;
@@ -371,33 +441,172 @@ nni_msg_pull_up(nni_msg *m)
 	return (m);
 }
 
-int
-nni_msg_alloc(nni_msg **mp, size_t sz)
+void
+nni_msg_sys_init(void)
+{
+#ifdef NNG_ENABLE_STATS
+	nni_stat_init(&msg_pool_stat, &msg_pool_info);
+	nni_stat_add(&msg_pool_stat, &msg_pool_hit);
+	nni_stat_add(&msg_pool_stat, &msg_pool_miss);
+	nni_stat_register(&msg_pool_stat);
+#endif
+}
+
+void
+nni_msg_sys_fini(void)
 {
 	nni_msg *m;
-	int      rv;
 
-	if ((m = NNI_ALLOC_STRUCT(m)) == NULL) {
+#ifdef NNG_ENABLE_STATS
+	nni_stat_unregister(&msg_pool_stat);
+#endif
+	for (unsigned i = 0; i < NNI_NUM_ELEMENTS(msg_classes); i++) {
+		msg_class *mc = &msg_classes[i];
+
+		nni_mtx_lock(&mc->mc_mtx);
+		while ((m = mc->mc_free) != NULL) {
+			mc->mc_free = m->m_next;
+			nni_free(m->m_pool_buf, mc->mc_size);
+			nni_free(m, NNI_MSG_BLOCK_SIZE);
+		}
+		mc->mc_cnt = 0;
+		nni_mtx_unlock(&mc->mc_mtx);
+	}
+}
+
+// Takes a kept message of the smallest class that has room for a body
+// buffer of sz bytes, or allocates a new one.  If no class is large
+// enough, *mp is left alone.
+static int
+msg_pool_get(nni_msg **mp, size_t sz)
+{
+	msg_class *mc = NULL;
+	nni_msg *  m;
+
+	for (unsigned i = 0; i < NNI_NUM_ELEMENTS(msg_classes); i++) {
+		if (sz <= msg_classes[i].mc_size) {
+			mc = &msg_classes[i];
+			break;
+		}
+	}
+	if (mc == NULL) {
+		return (0);
+	}
+
+	nni_mtx_lock(&mc->mc_mtx);
+	if ((m = mc->mc_free) != NULL) {
+		mc->mc_free = m->m_next;
+		mc->mc_cnt--;
+	}
+	nni_mtx_unlock(&mc->mc_mtx);
+
+	if (m != NULL) {
+#ifdef NNG_ENABLE_STATS
+		nni_stat_inc(&msg_pool_hit, 1);
+#endif
+		*mp = m;
+		return (0);
+	}
+#ifdef NNG_ENABLE_STATS
+	nni_stat_inc(&msg_pool_miss, 1);
+#endif
+	if ((m = nni_zalloc(NNI_MSG_BLOCK_SIZE)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	if ((m->m_pool_buf = nni_alloc(mc->mc_size)) == NULL) {
+		nni_free(m, NNI_MSG_BLOCK_SIZE);
 		return (NNG_ENOMEM);
 	}
+	m->m_class = mc;
+	*mp        = m;
+	return (0);
+}
+
+// Keeps a message with its class buffer for reuse, unless the class has
+// enough kept already.
+static bool
+msg_pool_put(nni_msg *m)
+{
+	msg_class *mc  = m->m_class;
+	uint8_t *  buf = m->m_pool_buf;
+
+	nni_mtx_lock(&mc->mc_mtx);
+	if (mc->mc_cnt >= mc->mc_max) {
+		nni_mtx_unlock(&mc->mc_mtx);
+		return (false);
+	}
+	memset(m, 0, sizeof(*m));
+	m->m_class    = mc;
+	m->m_pool_buf = buf;
+	m->m_next     = mc->mc_free;
+	mc->mc_free   = m;
+	mc->mc_cnt++;
+	nni_mtx_unlock(&mc->mc_mtx);
+	return (true);
+}
+
+// The room for protocol data in the message's own block.
+static void *
+msg_proto_room(nni_msg *m)
+{
+	return ((uint8_t *) m + sizeof(*m));
+}
+
+static void
+msg_proto_free(nni_msg *m)
+{
+	nni_proto_msg_ops *ops = m->m_proto_ops;
+
+	if (m->m_proto_data == msg_proto_room(m)) {
+		if (ops->msg_fini != NULL) {
+			ops->msg_fini(m->m_proto_data);
+		}
+	} else if (ops->msg_free != NULL) {
+		ops->msg_free(m->m_proto_data);
+	}
+}
+
+int
+nni_msg_alloc(nni_msg **mp, size_t sz)
+{
+	nni_msg *m = NULL;
+	size_t   head;
+	int      rv;
 
 	// If the message is less than 1024 bytes, or is not power
 	// of two aligned, then we insert a 32 bytes of headroom
 	// to allow for inlining backtraces, etc.  We also allow the
 	// amount of space at the end for the same reason.  Large aligned
 	// allocations are unmolested to avoid excessive overallocation.
-	if ((sz < 1024) || ((sz & (sz - 1)) != 0)) {
-		rv = nni_chunk_grow(&m->m_body, sz + 32, 32);
-	} else {
-		rv = nni_chunk_grow(&m->m_body, sz, 0);
-	}
-	if (rv != 0) {
-		NNI_FREE_STRUCT(m);
+	head = ((sz < 1024) || ((sz & (sz - 1)) != 0)) ? 32 : 0;
+
+	if ((rv = msg_pool_get(&m, sz + 2 * head)) != 0) {
 		return (rv);
 	}
-	if (nni_chunk_append(&m->m_body, NULL, sz) != 0) {
-		// Should not happen since we just grew it to fit.
-		nni_panic("chunk_append failed");
+	if (m != NULL) {
+		// The capacity is what was asked for, the same as for
+		// any other message, although the buffer may be larger.
+		// The body is the caller's to fill, but the room around
+		// it starts out zeroed, as in a new one.
+		memset(m->m_pool_buf, 0, head);
+		memset(m->m_pool_buf + head + sz, 0, head);
+		m->m_body.ch_buf  = m->m_pool_buf;
+		m->m_body.ch_ptr  = m->m_pool_buf + head;
+		m->m_body.ch_cap  = sz + 2 * head;
+		m->m_body.ch_len  = sz;
+		m->m_body.ch_pool = true;
+	} else {
+		if ((m = nni_zalloc(NNI_MSG_BLOCK_SIZE)) == NULL) {
+			return (NNG_ENOMEM);
+		}
+		if ((rv = nni_chunk_grow(&m->m_body, sz + head, head)) != 0) {
+			nni_free(m, NNI_MSG_BLOCK_SIZE);
+			return (rv);
+		}
+		if (nni_chunk_append(&m->m_body, NULL, sz) != 0) {
+			// Should not happen since we just grew it to fit.
+			nni_panic("chunk_append failed");
+		}
 	}
 
 	// We always start with a single valid reference count.
@@ -416,7 +625,7 @@ nni_msg_dup(nni_msg **dup, const nni_msg *src)
 	struct nni_msg_opt **opp;
 	int                  rv;
 
-	if ((m = NNI_ALLOC_STRUCT(m)) == NULL) {
+	if ((m = nni_zalloc(NNI_MSG_BLOCK_SIZE)) == NULL) {
 		return (NNG_ENOMEM);
 	}
 
@@ -424,7 +633,7 @@ nni_msg_dup(nni_msg **dup, const nni_msg *src)
 	m->m_header_len = src->m_header_len;
 
 	if ((rv = nni_chunk_dup(&m->m_body, &src->m_body)) != 0) {
-		NNI_FREE_STRUCT(m);
+		nni_free(m, NNI_MSG_BLOCK_SIZE);
 		return (rv);
 	}
 
@@ -451,14 +660,19 @@ void
 nni_msg_free(nni_msg *m)
 {
 	if ((m != NULL) && (nni_atomic_dec_nv(&m->m_refcnt) == 0)) {
-		struct nni_msg_opt *mo;
+		if (m->m_proto_ops != NULL) {
+			msg_proto_free(m);
+		}
+		// This leaves the class buffer alone, even if the body
+		// outgrew it and moved.
 		nni_chunk_free(&m->m_body);
-
-		if (m->m_proto_ops != NULL &&
-		    m->m_proto_ops->msg_free != NULL) {
-			m->m_proto_ops->msg_free(m->m_proto_data);
+		if (m->m_class != NULL) {
+			if (msg_pool_put(m)) {
+				return;
+			}
+			nni_free(m->m_pool_buf, m->m_class->mc_size);
 		}
-		NNI_FREE_STRUCT(m);
+		nni_free(m, NNI_MSG_BLOCK_SIZE);
 	}
 }
 
@@ -661,13 +875,25 @@ nni_msg_get_pipe(const nni_msg *m)
 void
 nni_msg_set_proto_data(nng_msg *m, nni_proto_msg_ops *ops, void *data)
 {
-	if (m->m_proto_ops != NULL && m->m_proto_ops->msg_free != NULL) {
-		m->m_proto_ops->msg_free(m->m_proto_data);
+	if (m->m_proto_ops != NULL) {
+		msg_proto_free(m);
 	}
 	m->m_proto_ops  = ops;
 	m->m_proto_data = data;
 }
 
+void *
+nni_msg_proto_alloc(nni_msg *m, size_t sz)
+{
+	void *data = msg_proto_room(m);
+
+	if ((sz > NNI_MSG_PROTO_SIZE) || (m->m_proto_data == data)) {
+		return (nni_zalloc(sz));
+	}
+	memset(data, 0, sz);
+	return (data);
+}
+
 void *
 nni_msg_get_proto_data(nng_msg *m)
 {
@@ -77,6 +77,11 @@ typedef struct nni_proto_msg_ops {
 	// such as by nni_msg_dup() or calling nni_msg_unique() on a
 	// shared message.
 	int (*msg_dup)(void **, const void *);
+
+	// This is used instead of msg_free for data that came from the
+	// message's own block (see nni_msg_proto_alloc), to release what
+	// it refers to without freeing the data itself.
+	void (*msg_fini)(void *);
 } nni_proto_msg_ops;
 
 // nni_msg_set_proto_data is used to set protocol private data, and
@@ -91,6 +96,17 @@ extern void nni_msg_set_proto_data(nng_msg *, nni_proto_msg_ops *, void *);
 // the message is set by it alone.
 extern void *nni_msg_get_proto_data(nng_msg *);
 
+// nni_msg_proto_alloc returns zeroed room for protocol private data of the
+// given size, to be set on the same message.  It comes from the message's
+// own block when that has room and is not in use, and is allocated
+// otherwise.  Protocols that use it must supply msg_fini.
+extern void *nni_msg_proto_alloc(nng_msg *, size_t);
+
+// nni_msg_sys_init and nni_msg_sys_fini set up and tear down the pool of
+// messages that are kept for reuse.
+extern void nni_msg_sys_init(void);
+extern void nni_msg_sys_fini(void);
+
 extern uint8_t nni_msg_get_pub_qos(nng_msg *m);
 
 #endif // CORE_SOCKET_H
@@ -522,6 +522,58 @@ test_msg_reserve(void)
 	nng_msg_free(msg);
 }
 
+#ifdef NNG_ENABLE_STATS
+static uint64_t
+msg_pool_stat(const char *name)
+{
+	nng_stat *stats;
+	nng_stat *item;
+	uint64_t  val = 0;
+
+	NUTS_PASS(nng_stats_get(&stats));
+	NUTS_TRUE((item = nng_stat_find(stats, "msgpool")) != NULL);
+	if ((item = nng_stat_find(item, name)) != NULL) {
+		val = nng_stat_value(item);
+	}
+	nng_stats_free(stats);
+	return (val);
+}
+#endif
+
+void
+test_msg_pool(void)
+{
+	nng_msg *m1;
+	nng_msg *m2;
+#ifdef NNG_ENABLE_STATS
+	uint64_t hits = msg_pool_stat("hit");
+#endif
+
+	// A small message freed is kept, and is the next one of its size.
+	NUTS_PASS(nng_msg_alloc(&m1, 10));
+	NUTS_ASSERT(nng_msg_capacity(m1) == 42);
+	nng_msg_free(m1);
+	NUTS_PASS(nng_msg_alloc(&m2, 20));
+	NUTS_ASSERT(m2 == m1);
+	NUTS_ASSERT(nng_msg_len(m2) == 20);
+	NUTS_ASSERT(nng_msg_capacity(m2) == 52);
+	NUTS_PASS(nng_msg_append(m2, "abc", 4));
+
+	// One whose body outgrew its buffer is still kept with the buffer.
+	NUTS_PASS(nng_msg_realloc(m2, 1000));
+	NUTS_ASSERT(nng_msg_capacity(m2) >= 1000);
+	nng_msg_free(m2);
+	NUTS_PASS(nng_msg_alloc(&m1, 10));
+	NUTS_ASSERT(m1 == m2);
+	NUTS_ASSERT(nng_msg_capacity(m1) == 42);
+	memset(nng_msg_body(m1), 'x', 10);
+	nng_msg_free(m1);
+#ifdef NNG_ENABLE_STATS
+	NUTS_ASSERT(msg_pool_stat("hit") >= hits + 1);
+	NUTS_ASSERT(msg_pool_stat("miss") > 0);
+#endif
+}
+
 TEST_LIST = {
 	{ "msg option", test_msg_option },
 	{ "msg empty", test_msg_empty },
@@ -548,5 +600,6 @@ TEST_LIST = {
 	{ "msg header u64", test_msg_header_uint64 },
 	{ "msg capacity", test_msg_capacity },
 	{ "msg reserve", test_msg_reserve },
+	{ "msg pool", test_msg_pool },
 	{ NULL, NULL },
 };
@@ -456,6 +456,27 @@ extern int nni_plat_udp_sockname(nni_plat_udp *, nni_sockaddr *);
 // access by the entity running the application only.
 extern int nni_plat_file_put(const char *, const void *, size_t);
 
+typedef struct nni_plat_flog nni_plat_flog;
+
+// nni_plat_file_log_open opens the named file to append to, creating it
+// (with the same permissions as nni_plat_file_put) if it is missing.
+// Every write goes to the end of the file.
+extern int nni_plat_file_log_open(const char *, nni_plat_flog *);
+
+// nni_plat_file_log_write appends the data to the file.
+extern int nni_plat_file_log_write(nni_plat_flog *, const void *, size_t);
+
+// nni_plat_file_log_sync returns once everything written to the file
+// has reached stable storage.
+extern int nni_plat_file_log_sync(nni_plat_flog *);
+
+// nni_plat_file_log_close closes the file.
+extern void nni_plat_file_log_close(nni_plat_flog *);
+
+// nni_plat_file_rename renames a file, replacing the target if it
+// exists.  On most platforms this is atomic.
+extern int nni_plat_file_rename(const char *, const char *);
+
 // nni_plat_file_get reads the entire named file, allocating storage
 // to receive the data and returning the data and the size in the
 // reference arguments.  The data pointer should be freed with nni_free
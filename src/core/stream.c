@@ -74,6 +74,16 @@ static struct {
 	    .dialer_alloc   = nni_tls_dialer_alloc,
 	    .listener_alloc = nni_tls_listener_alloc,
 	},
+	{
+	    .scheme         = "mqtt-ws",
+	    .dialer_alloc   = nni_ws_dialer_alloc,
+	    .listener_alloc = nni_ws_listener_alloc,
+	},
+	{
+	    .scheme         = "mqtt-wss",
+	    .dialer_alloc   = nni_ws_dialer_alloc,
+	    .listener_alloc = nni_ws_listener_alloc,
+	},
 	{
 	    .scheme         = "tcp",
 	    .dialer_alloc   = nni_tcp_dialer_alloc,
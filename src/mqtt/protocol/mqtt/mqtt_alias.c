@@ -0,0 +1,199 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "core/nng_impl.h"
+#include "mqtt_alias.h"
+
+typedef struct {
+	uint8_t *topic;
+	size_t   len;
+	uint32_t hash;
+	uint16_t prev; // recency list, most recent after ents[0]
+	uint16_t next;
+} mqtt_alias_ent;
+
+// The entries are indexed by alias, with ents[0] heading the recency
+// list.  The slots are an open addressed hash table of aliases, at most
+// half full, where zero marks an empty slot.
+struct nni_mqtt_alias {
+	mqtt_alias_ent *ents;
+	uint16_t        max;
+	uint16_t        used;
+	uint16_t *      slots;
+	uint32_t        nslots;
+};
+
+static uint32_t
+mqtt_alias_hash(const uint8_t *topic, size_t len)
+{
+	uint32_t hash = 2166136261u; // FNV-1a
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= topic[i];
+		hash *= 16777619u;
+	}
+	return (hash);
+}
+
+// Returns the slot holding the topic, or the empty slot it would go in.
+static uint32_t
+mqtt_alias_find(
+    nni_mqtt_alias *a, const uint8_t *topic, size_t len, uint32_t hash)
+{
+	uint32_t mask = a->nslots - 1;
+	uint32_t i    = hash & mask;
+	uint16_t n;
+
+	while ((n = a->slots[i]) != 0) {
+		mqtt_alias_ent *e = &a->ents[n];
+		if ((e->hash == hash) && (e->len == len) &&
+		    (memcmp(e->topic, topic, len) == 0)) {
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return (i);
+}
+
+// Empties the slot, moving later entries of the same run back so that
+// they can still be found.
+static void
+mqtt_alias_unslot(nni_mqtt_alias *a, uint32_t i)
+{
+	uint32_t mask = a->nslots - 1;
+	uint32_t j    = i;
+	uint32_t home;
+	uint16_t n;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if ((n = a->slots[j]) == 0) {
+			break;
+		}
+		// An entry can fill the hole unless its home slot lies
+		// cyclically after the hole, up to where it is now.
+		home = a->ents[n].hash & mask;
+		if (((j > i) && ((home <= i) || (home > j))) ||
+		    ((j < i) && ((home <= i) && (home > j)))) {
+			a->slots[i] = n;
+			i           = j;
+		}
+	}
+	a->slots[i] = 0;
+}
+
+static void
+mqtt_alias_unlink(nni_mqtt_alias *a, uint16_t n)
+{
+	mqtt_alias_ent *e = &a->ents[n];
+
+	a->ents[e->prev].next = e->next;
+	a->ents[e->next].prev = e->prev;
+}
+
+static void
+mqtt_alias_push(nni_mqtt_alias *a, uint16_t n)
+{
+	mqtt_alias_ent *e = &a->ents[n];
+
+	e->prev               = 0;
+	e->next               = a->ents[0].next;
+	a->ents[e->next].prev = n;
+	a->ents[0].next       = n;
+}
+
+int
+nni_mqtt_alias_init(nni_mqtt_alias **ap, uint16_t max)
+{
+	nni_mqtt_alias *a;
+
+	if (max == 0) {
+		return (NNG_EINVAL);
+	}
+	if ((a = NNI_ALLOC_STRUCT(a)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	a->max    = max;
+	a->nslots = 2;
+	while (a->nslots < 2 * (uint32_t) max) {
+		a->nslots *= 2;
+	}
+	if (((a->ents = NNI_ALLOC_STRUCTS(a->ents, (max + 1))) == NULL) ||
+	    ((a->slots = NNI_ALLOC_STRUCTS(a->slots, a->nslots)) == NULL)) {
+		nni_mqtt_alias_fini(a);
+		return (NNG_ENOMEM);
+	}
+	*ap = a;
+	return (0);
+}
+
+void
+nni_mqtt_alias_fini(nni_mqtt_alias *a)
+{
+	if (a->ents != NULL) {
+		for (uint16_t n = 1; n <= a->used; n++) {
+			nni_free(a->ents[n].topic, a->ents[n].len);
+		}
+		NNI_FREE_STRUCTS(a->ents, (a->max + 1));
+	}
+	if (a->slots != NULL) {
+		NNI_FREE_STRUCTS(a->slots, a->nslots);
+	}
+	NNI_FREE_STRUCT(a);
+}
+
+uint16_t
+nni_mqtt_alias_get(
+    nni_mqtt_alias *a, const uint8_t *topic, size_t len, bool *known)
+{
+	uint32_t        hash;
+	uint32_t        i;
+	uint16_t        n;
+	uint8_t *       copy;
+	mqtt_alias_ent *e;
+
+	if (len == 0) {
+		return (0);
+	}
+	hash = mqtt_alias_hash(topic, len);
+	i    = mqtt_alias_find(a, topic, len, hash);
+	if ((n = a->slots[i]) != 0) {
+		mqtt_alias_unlink(a, n);
+		mqtt_alias_push(a, n);
+		*known = true;
+		return (n);
+	}
+
+	if ((copy = nni_alloc(len)) == NULL) {
+		return (0);
+	}
+	memcpy(copy, topic, len);
+	if (a->used < a->max) {
+		n = ++a->used;
+	} else {
+		// Take over the least recently used alias.
+		n = a->ents[0].prev;
+		e = &a->ents[n];
+		mqtt_alias_unlink(a, n);
+		mqtt_alias_unslot(
+		    a, mqtt_alias_find(a, e->topic, e->len, e->hash));
+		nni_free(e->topic, e->len);
+		i = mqtt_alias_find(a, topic, len, hash);
+	}
+	e           = &a->ents[n];
+	e->topic    = copy;
+	e->len      = len;
+	e->hash     = hash;
+	a->slots[i] = n;
+	mqtt_alias_push(a, n);
+	*known = false;
+	return (n);
+}
@@ -0,0 +1,33 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NNG_MQTT_PROTOCOL_MQTT_MQTT_ALIAS_H
+#define NNG_MQTT_PROTOCOL_MQTT_MQTT_ALIAS_H
+
+#include "core/nng_impl.h"
+
+// An alias table assigns MQTT 5.0 topic aliases to the topics we publish
+// to on one connection.  Once all of them are in use, the alias of the
+// least recently published topic is given to the new one.  Lookups hash
+// the topic, so they cost the same however many aliases there are.  The
+// caller must serialize access.
+typedef struct nni_mqtt_alias nni_mqtt_alias;
+
+// nni_mqtt_alias_init creates a table of aliases 1 through max.
+extern int  nni_mqtt_alias_init(nni_mqtt_alias **, uint16_t);
+extern void nni_mqtt_alias_fini(nni_mqtt_alias *);
+
+// nni_mqtt_alias_get returns the alias of the topic, assigning one if it
+// has none, and sets known if the server has been sent it before.  A new
+// alias must be sent along with the topic to set it up.  It returns zero,
+// meaning no alias, if the topic is empty or we run out of memory.
+extern uint16_t nni_mqtt_alias_get(
+    nni_mqtt_alias *, const uint8_t *, size_t, bool *);
+
+#endif // NNG_MQTT_PROTOCOL_MQTT_MQTT_ALIAS_H
@@ -7,13 +7,19 @@
 // found online at https://opensource.org/licenses/MIT.
 //
 
+#include <string.h>
+
 #include "core/nng_impl.h"
+#include "mqtt_alias.h"
+#include "mqtt_session.h"
+#include "mqtt_trie.h"
 #include "supplemental/mqtt/mqtt_msg.h"
 
 // MQTT client implementation.
 //
-// 1. MQTT client sockets have a single implicit dialer, and cannot
-//    support creation of additional dialers or listeners.
+// 1. MQTT client sockets dial out only.  Each dialer's connection is a
+//    shard: publishes are spread over them, and what they receive is
+//    merged.
 // 2. Send sends PUBLISH messages.
 // 3. Receive is used to receive published data from the server.
 
@@ -22,6 +28,35 @@
 #define NNG_MQTT_PEER 0
 #define NNG_MQTT_PEER_NAME "mqtt-server"
 
+// Each retransmit of a message doubles its retry interval, up to this
+// many times.
+#define MQTT_RETRY_MAX_SHIFT 4
+// Retransmits due together are packed into writes of about this size,
+// unless the socket has a larger send batch budget.
+#define MQTT_RESEND_BATCH 65536
+// Subscribes and unsubscribes waiting together are merged into packets
+// carrying about this many bytes of topic filters.
+#define MQTT_SUB_BATCH 65536
+// Most a SUBSCRIBE or UNSUBSCRIBE takes besides its topic filters: the
+// fixed header, packet id and empty properties.
+#define MQTT_SUB_OVERHEAD 8
+// Topic aliases we assign by default, when the server allows as many.
+#define MQTT_ALIAS_MAX 1024
+// Bytes a receive queue may grow to by default under NNG_MQTT_RECV_GROW.
+#define MQTT_RECV_BUDGET (1024 * 1024)
+// Received bytes waiting for the application at which we stop reading
+// from the connection, and at which we start again, by default.
+#define MQTT_RECV_HIGH_WATER (1024 * 1024)
+#define MQTT_RECV_LOW_WATER (256 * 1024)
+// Most connections a socket has up at once.
+#define MQTT_SHARD_MAX 64
+
+#ifdef NNG_ENABLE_STATS
+#define BUMP_STAT(x, n) nni_stat_inc(x, n)
+#else
+#define BUMP_STAT(x, n)
+#endif
+
 typedef struct mqtt_sock_s mqtt_sock_t;
 typedef struct mqtt_pipe_s mqtt_pipe_t;
 typedef struct mqtt_ctx_s  mqtt_ctx_t;
@@ -41,6 +76,8 @@ static int  mqtt_pipe_start(void *arg);
 static void mqtt_pipe_stop(void *arg);
 static void mqtt_pipe_close(void *arg);
 
+static nni_aio *mqtt_sock_release_packet_id(mqtt_sock_t *s, uint16_t);
+
 static void mqtt_ctx_init(void *arg, void *sock);
 static void mqtt_ctx_fini(void *arg);
 static void mqtt_ctx_send(void *arg, nni_aio *aio);
@@ -48,6 +85,62 @@ static void mqtt_ctx_recv(void *arg, nni_aio *aio);
 
 typedef nni_mqtt_packet_type packet_type_t;
 
+// Outbound packet id states.  QoS 1 publishes, subscribes and unsubscribes
+// wait for their ack; a QoS 2 publish moves on to PUBREL once the server
+// has sent PUBREC, and then waits for PUBCOMP.
+#define MQTT_UNACK_FREE 0
+#define MQTT_UNACK_WAIT_ACK 1
+#define MQTT_UNACK_WAIT_COMP 2
+
+// A mqtt_unack_s is the outbound state of one packet id.  The socket has
+// one for every possible id, so lookups are a plain index.  They outlive
+// the pipe they were sent on, and go out again on the next one.  msg is the
+// encoded packet to retransmit: the original message while waiting for
+// the ack, turned in place into a PUBREL after PUBREC.
+typedef struct mqtt_unack_s {
+	nni_msg *msg;
+	nni_aio *aio;  // completed by the final acknowledgement
+	uint32_t pipe;   // id of the pipe it was last sent on
+	uint32_t dialer; // whose session has it, 0 if not known yet
+	uint8_t  state;
+} mqtt_unack_t;
+
+// A mqtt_retry_s is a retransmit deadline of an unacknowledged message.
+// Entries are kept in a per-socket binary min-heap ordered by deadline.
+// Acknowledged messages leave their entry behind; it is discarded when
+// it surfaces, or when the heap is compacted.
+typedef struct mqtt_retry_s {
+	nni_time due;
+	nni_msg *msg;
+	uint16_t pid;
+	uint8_t  state;
+	uint8_t  tries;
+} mqtt_retry_t;
+
+// Subscribe (or unsubscribe) requests are merged: while one packet is
+// waiting for its SUBACK, new requests queue up, and they all go out
+// together in the next packet once it is in.
+typedef struct {
+	nni_list waitq; // aios not sent yet
+	nni_list sentq; // aios of the packet in flight
+	uint16_t pid;   // packet id of the packet in flight, or 0
+	uint8_t  type;  // NNG_MQTT_SUBSCRIBE or NNG_MQTT_UNSUBSCRIBE
+} mqtt_sub_batch_t;
+
+// A subscription the server acknowledged.  They are made again on a
+// connection that comes up without a session.
+typedef struct {
+	nni_list_node node;
+	char *        topic;
+	uint8_t       qos;
+} mqtt_sub_t;
+
+// A topic filter a context subscribed to.
+typedef struct {
+	nni_list_node node;
+	char *        filter;
+} mqtt_ctx_sub_t;
+
 // A mqtt_ctx_s is our per-ctx protocol private state.
 struct mqtt_ctx_s {
 	mqtt_sock_t *mqtt_sock;
@@ -55,69 +148,285 @@ struct mqtt_ctx_s {
 	nni_aio *  raio;             // recv aio
 	nni_list_node sqnode;
 	nni_list_node rqnode;
+	nni_list      subs;          // topic filters, see mqtt_ctx_sub_t
+	nni_lmq       recv_messages; // matched publishes not yet received
+	size_t        recv_bytes;    // bytes of recv_messages
+	uint64_t      match_gen;     // last dispatch that reached us
 };
 
 // A mqtt_pipe_s is our per-pipe protocol private structure.
 struct mqtt_pipe_s {
 	nni_atomic_bool closed;
-	nni_atomic_int  next_packet_id; // next packet id to use
 	nni_pipe *      pipe;
 	mqtt_sock_t *   mqtt_sock;
-	nni_id_map      sent_unack;    // send messages unacknowledged
 	nni_id_map      recv_unack;    // recv messages unacknowledged
 	nni_aio         send_aio;      // send aio to the underlying transport
 	nni_aio         recv_aio;      // recv aio to the underlying transport
 	nni_aio         time_aio;      // timer aio to resend unack msg
 	nni_lmq         recv_messages; // recv messages queue
+	size_t          recv_bytes;    // bytes of recv_messages
+	bool            recv_full;     // a queue overflowed under RECV_BLOCK
+	bool            recv_stopped;  // recv_aio left idle for backpressure
 	nni_lmq         send_messages; // send messages queue
 	nni_lmq         ctx_aios;      // awaiting aio of QoS
 	bool            busy;
+	int             shard;      // slot in the socket's shards, or -1
+	uint32_t        sent_count; // packet ids awaiting an ack from us
+	mqtt_retry_t *  retry_heap; // retransmit deadlines
+	size_t          retry_len;
+	size_t          retry_cap;
+	uint16_t        rcv_max;    // Receive Maximum granted by the server
+	uint32_t        max_packet; // largest packet the server takes, or 0
+	uint8_t         version;   // protocol level of our CONNECT
+	nni_mqtt_alias *alias_out; // aliases of topics we publish to
+	nni_id_map      alias_in;  // topics the server aliased, by alias
+#ifdef NNG_ENABLE_STATS
+	nni_stat_item stat_rx_drop;
+	nni_stat_item stat_rx_drop_bytes;
+	nni_stat_item stat_rx_stalls;
+	nni_stat_item stat_rx_dup_publish;
+	nni_stat_item stat_rx_stray_pubrel;
+#endif
 };
 
 // A mqtt_sock_s is our per-socket protocol private structure.
+//
+// Sending and receiving are locked apart, so that publishers are not held
+// up by the dispatch of received messages, nor the other way round.  mtx
+// covers the send side: the packet ids, retransmits, batches, send queues
+// and the pipe's send state.  recv_mtx covers the receive side: recv_queue,
+// the topic trie and everything about contexts waiting for messages, and
+// the pipe's receive queues.  Both are held to change shards, so either
+// is enough to look at them.  When both are needed, mtx is taken first.
 struct mqtt_sock_s {
 	nni_atomic_bool closed;
 	nni_atomic_int  ttl;
 	nni_duration    retry;
-	nni_mtx         mtx;    // more fine grained mutual exclusion
+	nni_mtx         mtx;      // send side
+	nni_mtx         recv_mtx; // receive side
+	nni_sock *      sock;
 	mqtt_ctx_t      master; // to which we delegate send/recv calls
-	mqtt_pipe_t *   mqtt_pipe;
+	mqtt_pipe_t *   shards[MQTT_SHARD_MAX]; // connections that are up
+	int             shard_slots;  // slots ever used
+	int             shard_policy; // see NNG_OPT_MQTT_SHARD_POLICY
+	uint32_t        shard_next;   // slot after the last one sent on
+	uint32_t        recv_next;    // slot after the last one read from
+	mqtt_pipe_t *   recv_pipe;    // the pipe dispatching, under recv_mtx
 	nni_list        recv_queue; // ctx pending to receive
 	nni_list        send_queue; // ctx pending to send
+	nni_list        send_waitq; // aios parked by flow control
+	uint32_t        send_parked; // and how many there are
+	size_t          send_batch; // byte budget of a coalesced write
+	int             send_policy;
+	int             recv_policy; // these three under recv_mtx
+	int             recv_depth;
+	size_t          recv_budget;
+	size_t          recv_high;     // stop reading at so many bytes queued
+	size_t          recv_low;      // and start again at this many
+	size_t          recv_buffered; // bytes on all receive queues
+	uint16_t        send_window; // max unacknowledged packets
+	uint16_t        alias_max;   // topic aliases we may assign
+	nni_mqtt_session *session;   // unacked publishes kept on disk
+	bool            session_sync; // flush the store on every publish
+	uint16_t        next_packet_id; // next packet id to use
+	uint32_t        sent_count;     // packet ids in use
+	nni_mqtt_trie * trie;           // ctx subscriptions, made on demand
+	mqtt_sub_batch_t sub_batch;
+	mqtt_sub_batch_t unsub_batch;
+	nni_list         subs;      // active subscriptions, see mqtt_sub_t
+	nni_mqtt_trie *  subs_trie; // the same, by topic filter
+	uint64_t        match_gen;      // bumped for every dispatch
+#ifdef NNG_ENABLE_STATS
+	nni_stat_item stat_tx_drop;
+	nni_stat_item stat_tx_resend;
+	nni_stat_item stat_tx_batches;
+	nni_stat_item stat_tx_batch_msgs;
+	nni_stat_item stat_tx_batch_bytes;
+	nni_stat_item stat_tx_batch_last;
+	nni_stat_item stat_tx_alias_saved;
+	nni_stat_item stat_rx_alias_saved;
+	nni_stat_item stat_session_errors;
+#endif
+	// Indexed by packet id.  The socket is allocated zeroed, which
+	// leaves the pages of unused slots unmapped.
+	mqtt_unack_t sent_unack[0x10000];
 };
 
+static void mqtt_sub_batch_flush(mqtt_sock_t *, mqtt_sub_batch_t *);
+static void mqtt_sub_batch_abort(nni_list *, int);
+static void mqtt_sub_batch_requeue(mqtt_sub_batch_t *);
+static void mqtt_pipe_resubscribe(mqtt_pipe_t *);
+static void mqtt_sock_abort_packet(mqtt_sock_t *, uint16_t, nni_aio *, int);
+
+static void
+mqtt_sub_batch_init(mqtt_sub_batch_t *b, uint8_t type)
+{
+	nni_aio_list_init(&b->waitq);
+	nni_aio_list_init(&b->sentq);
+	b->pid  = 0;
+	b->type = type;
+}
+
 /******************************************************************************
  *                              Sock Implementation                           *
  ******************************************************************************/
 
+#ifdef NNG_ENABLE_STATS
+static void
+mqtt_sock_add_stat(
+    mqtt_sock_t *s, nni_stat_item *item, const nni_stat_info *info)
+{
+	nni_stat_init(item, info);
+	nni_sock_add_stat(s->sock, item);
+}
+#endif
+
 static void
 mqtt_sock_init(void *arg, nni_sock *sock)
 {
-	NNI_ARG_UNUSED(sock);
 	mqtt_sock_t *s = arg;
 
+	s->sock = sock;
+
 	nni_atomic_init_bool(&s->closed);
 	nni_atomic_set_bool(&s->closed, false);
 
 	nni_atomic_init(&s->ttl);
 	nni_atomic_set(&s->ttl, 8);
 
-	// this is "semi random" start for request IDs.
+	// initial retransmit interval, doubled on every retry
 	s->retry = NNI_SECOND * 60;
 
 	nni_mtx_init(&s->mtx);
+	nni_mtx_init(&s->recv_mtx);
 	mqtt_ctx_init(&s->master, s);
 
-	s->mqtt_pipe = NULL;
+	s->shard_slots  = 0;
+	s->shard_policy = NNG_MQTT_SHARD_TOPIC;
+	s->shard_next   = 0;
+	s->recv_next    = 0;
+	s->recv_pipe    = NULL;
 	NNI_LIST_INIT(&s->recv_queue, mqtt_ctx_t, rqnode);
 	NNI_LIST_INIT(&s->send_queue, mqtt_ctx_t, sqnode);
+	nni_aio_list_init(&s->send_waitq);
+	mqtt_sub_batch_init(&s->sub_batch, NNG_MQTT_SUBSCRIBE);
+	mqtt_sub_batch_init(&s->unsub_batch, NNG_MQTT_UNSUBSCRIBE);
+	NNI_LIST_INIT(&s->subs, mqtt_sub_t, node);
+
+	// Coalescing is off until the application asks for it.
+	s->send_batch  = 0;
+	s->send_policy = NNG_MQTT_SEND_DROP_OLDEST;
+	s->send_window = 0xffffu;
+	s->alias_max   = MQTT_ALIAS_MAX;
+	s->recv_policy = NNG_MQTT_RECV_DROP_NEWEST;
+	s->recv_depth  = NNG_MAX_RECV_LMQ;
+	s->recv_budget = MQTT_RECV_BUDGET;
+	s->recv_high   = MQTT_RECV_HIGH_WATER;
+	s->recv_low    = MQTT_RECV_LOW_WATER;
+	s->recv_buffered = 0;
+	s->session     = NULL;
+	s->session_sync = true;
+
+	s->next_packet_id = 1;
+	s->sent_count     = 0;
+
+#ifdef NNG_ENABLE_STATS
+	static const nni_stat_info tx_drop_info = {
+		.si_name   = "tx_drop",
+		.si_desc   = "messages dropped by the send policy",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info tx_resend_info = {
+		.si_name   = "tx_resend",
+		.si_desc   = "messages retransmitted",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info tx_batches_info = {
+		.si_name   = "tx_batches",
+		.si_desc   = "coalesced writes sent",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_atomic = true,
+	};
+	static const nni_stat_info tx_batch_msgs_info = {
+		.si_name   = "tx_batch_msgs",
+		.si_desc   = "messages sent in coalesced writes",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info tx_batch_bytes_info = {
+		.si_name   = "tx_batch_bytes",
+		.si_desc   = "bytes sent in coalesced writes",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_BYTES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info tx_batch_last_info = {
+		.si_name   = "tx_batch_last",
+		.si_desc   = "messages in the most recent coalesced write",
+		.si_type   = NNG_STAT_LEVEL,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	mqtt_sock_add_stat(s, &s->stat_tx_drop, &tx_drop_info);
+	mqtt_sock_add_stat(s, &s->stat_tx_resend, &tx_resend_info);
+	mqtt_sock_add_stat(s, &s->stat_tx_batches, &tx_batches_info);
+	mqtt_sock_add_stat(s, &s->stat_tx_batch_msgs, &tx_batch_msgs_info);
+	mqtt_sock_add_stat(s, &s->stat_tx_batch_bytes, &tx_batch_bytes_info);
+	static const nni_stat_info tx_alias_saved_info = {
+		.si_name   = "tx_alias_saved",
+		.si_desc   = "bytes saved by sending topic aliases",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_BYTES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info rx_alias_saved_info = {
+		.si_name   = "rx_alias_saved",
+		.si_desc   = "bytes saved by the server's topic aliases",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_BYTES,
+		.si_atomic = true,
+	};
+	mqtt_sock_add_stat(s, &s->stat_tx_batch_last, &tx_batch_last_info);
+	mqtt_sock_add_stat(s, &s->stat_tx_alias_saved, &tx_alias_saved_info);
+	mqtt_sock_add_stat(s, &s->stat_rx_alias_saved, &rx_alias_saved_info);
+	static const nni_stat_info session_errors_info = {
+		.si_name   = "session_errors",
+		.si_desc   = "session store writes that failed",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_atomic = true,
+	};
+	mqtt_sock_add_stat(
+	    s, &s->stat_session_errors, &session_errors_info);
+#endif
 }
 
 static void
 mqtt_sock_fini(void *arg)
 {
 	mqtt_sock_t *s = arg;
+	mqtt_sub_t * sub;
+
+	if (s->session != NULL) {
+		nni_mqtt_session_close(s->session);
+	}
 	mqtt_ctx_fini(&s->master);
+	if (s->trie != NULL) {
+		nni_mqtt_trie_fini(s->trie);
+	}
+	while ((sub = nni_list_first(&s->subs)) != NULL) {
+		nni_list_remove(&s->subs, sub);
+		nni_strfree(sub->topic);
+		NNI_FREE_STRUCT(sub);
+	}
+	if (s->subs_trie != NULL) {
+		nni_mqtt_trie_fini(s->subs_trie);
+	}
+	nni_mtx_fini(&s->recv_mtx);
 	nni_mtx_fini(&s->mtx);
 }
 
@@ -135,7 +444,22 @@ mqtt_sock_close(void *arg)
 	nni_aio *aio;
 	nni_msg *msg;
 
+	nni_mtx_lock(&s->mtx);
 	nni_atomic_set_bool(&s->closed, true);
+	while ((aio = nni_list_first(&s->send_waitq)) != NULL) {
+		nni_aio_list_remove(aio);
+		s->send_parked--;
+		nni_aio_finish_error(aio, NNG_ECLOSED);
+	}
+	// Anything still unacknowledged is only kept in the session store.
+	for (uint32_t i = 1; i <= 0xffffu && s->sent_count > 0; i++) {
+		if (s->sent_unack[i].state != MQTT_UNACK_FREE) {
+			aio = mqtt_sock_release_packet_id(s, (uint16_t) i);
+			mqtt_sock_abort_packet(s, (uint16_t) i, aio, NNG_ECLOSED);
+		}
+	}
+	mqtt_sub_batch_abort(&s->sub_batch.waitq, NNG_ECLOSED);
+	mqtt_sub_batch_abort(&s->unsub_batch.waitq, NNG_ECLOSED);
 	//clean ctx queue when pipe was closed.
 	while ((ctx = nni_list_first(&s->send_queue)) != NULL) {
 		// Pipe was closed.  just push an error back to the
@@ -148,6 +472,9 @@ mqtt_sock_close(void *arg)
 		nni_aio_finish_error(aio, NNG_ECLOSED);
 		nni_msg_free(msg);
 	}
+	nni_mtx_unlock(&s->mtx);
+
+	nni_mtx_lock(&s->recv_mtx);
 	while ((ctx = nni_list_first(&s->recv_queue)) != NULL) {
 		// Pipe was closed.  just push an error back to the
 		// entire socket, because we only have one pipe
@@ -159,6 +486,7 @@ mqtt_sock_close(void *arg)
 		nni_aio_finish_error(aio, NNG_ECLOSED);
 		nni_msg_free(msg);
 	}
+	nni_mtx_unlock(&s->recv_mtx);
 }
 
 static void
@@ -179,15 +507,75 @@ mqtt_sock_recv(void *arg, nni_aio *aio)
  *                              Pipe Implementation                           *
  ******************************************************************************/
 
+// Finds a free packet id, or returns 0 if every id is in use.
 static uint16_t
-mqtt_pipe_get_next_packet_id(mqtt_pipe_t *p)
+mqtt_sock_get_next_packet_id(mqtt_sock_t *s)
 {
-	int packet_id;
+	uint16_t packet_id;
+
+	if (s->sent_count >= 0xffffu) {
+		return (0);
+	}
 	do {
-		packet_id = nni_atomic_get(&p->next_packet_id);
-	} while (
-	    !nni_atomic_cas(&p->next_packet_id, packet_id, packet_id + 1));
-	return packet_id & 0xFFFF;
+		packet_id = s->next_packet_id++;
+	} while (packet_id == 0 ||
+	    s->sent_unack[packet_id].state != MQTT_UNACK_FREE);
+	return (packet_id);
+}
+
+// Returns the connection in slot i, or failing that the next one that is
+// up, or NULL if there is none.  Either lock is enough.
+static mqtt_pipe_t *
+mqtt_sock_shard(mqtt_sock_t *s, uint32_t i)
+{
+	mqtt_pipe_t *p;
+
+	for (int n = 0; n < s->shard_slots; n++) {
+		if ((p = s->shards[(i + n) % s->shard_slots]) != NULL) {
+			return (p);
+		}
+	}
+	return (NULL);
+}
+
+// Returns the connection with the given pipe id, if it is still up.
+static mqtt_pipe_t *
+mqtt_sock_find_pipe(mqtt_sock_t *s, uint32_t id)
+{
+	mqtt_pipe_t *p;
+
+	for (int i = 0; i < s->shard_slots; i++) {
+		if (((p = s->shards[i]) != NULL) &&
+		    (nni_pipe_id(p->pipe) == id)) {
+			return (p);
+		}
+	}
+	return (NULL);
+}
+
+// Chooses the connection a message goes out on.  Publishes are spread
+// by the hash of their topic, or in turn; the rest go on the first
+// connection.  Must be called with the socket lock held.
+static mqtt_pipe_t *
+mqtt_sock_pick(mqtt_sock_t *s, nni_msg *msg)
+{
+	const char *topic;
+	uint32_t    len;
+	uint32_t    h = 2166136261u;
+
+	if ((s->shard_slots < 2) ||
+	    (nni_mqtt_msg_get_packet_type(msg) != NNG_MQTT_PUBLISH)) {
+		return (mqtt_sock_shard(s, 0));
+	}
+	if (s->shard_policy == NNG_MQTT_SHARD_ROUND_ROBIN) {
+		return (mqtt_sock_shard(s, s->shard_next));
+	}
+	// FNV-1a
+	topic = nni_mqtt_msg_get_publish_topic(msg, &len);
+	for (uint32_t i = 0; i < len; i++) {
+		h = (h ^ (uint8_t) topic[i]) * 16777619u;
+	}
+	return (mqtt_sock_shard(s, h));
 }
 
 static int
@@ -197,23 +585,87 @@ mqtt_pipe_init(void *arg, nni_pipe *pipe, void *s)
 
 	nni_atomic_init_bool(&p->closed);
 	nni_atomic_set_bool(&p->closed, false);
-	nni_atomic_set(&p->next_packet_id, 0);
 	p->pipe      = pipe;
 	p->mqtt_sock = s;
 	nni_aio_init(&p->send_aio, mqtt_send_cb, p);
 	nni_aio_init(&p->recv_aio, mqtt_recv_cb, p);
 	nni_aio_init(&p->time_aio, mqtt_timer_cb, p);
-	// Packet IDs are 16 bits
-	// We start at a random point, to minimize likelihood of
-	// accidental collision across restarts.
-	nni_id_map_init(&p->sent_unack, 0x0000u, 0xffffu, true);
 	nni_id_map_init(&p->recv_unack, 0x0000u, 0xffffu, true);
 	nni_lmq_init(&p->recv_messages, NNG_MAX_RECV_LMQ);
 	nni_lmq_init(&p->send_messages, NNG_MAX_SEND_LMQ);
+	nni_id_map_init(&p->alias_in, 1, 0xffffu, false);
+	p->rcv_max    = 0xffffu;
+	p->max_packet = 0;
+	p->alias_out  = NULL;
+	p->version   = MQTT_VERSION_3_1_1;
+	p->recv_bytes   = 0;
+	p->recv_full    = false;
+	p->recv_stopped = false;
+	p->shard        = -1;
+	p->sent_count   = 0;
+	p->retry_heap   = NULL;
+	p->retry_len    = 0;
+	p->retry_cap    = 0;
+
+#ifdef NNG_ENABLE_STATS
+	static const nni_stat_info rx_drop_info = {
+		.si_name   = "rx_drop",
+		.si_desc   = "received messages dropped by the receive policy",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info rx_drop_bytes_info = {
+		.si_name   = "rx_drop_bytes",
+		.si_desc   = "bytes of received messages dropped",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_BYTES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info rx_stalls_info = {
+		.si_name   = "rx_stalls",
+		.si_desc   = "times reading stopped for the application",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_atomic = true,
+	};
+	nni_stat_init(&p->stat_rx_drop, &rx_drop_info);
+	nni_stat_init(&p->stat_rx_drop_bytes, &rx_drop_bytes_info);
+	static const nni_stat_info rx_dup_publish_info = {
+		.si_name   = "rx_dup_publish",
+		.si_desc   = "QoS 2 publishes received again before PUBREL",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_unit   = NNG_UNIT_MESSAGES,
+		.si_atomic = true,
+	};
+	static const nni_stat_info rx_stray_pubrel_info = {
+		.si_name   = "rx_stray_pubrel",
+		.si_desc   = "PUBRELs for no QoS 2 publish held",
+		.si_type   = NNG_STAT_COUNTER,
+		.si_atomic = true,
+	};
+	nni_stat_init(&p->stat_rx_stalls, &rx_stalls_info);
+	nni_stat_init(&p->stat_rx_dup_publish, &rx_dup_publish_info);
+	nni_stat_init(&p->stat_rx_stray_pubrel, &rx_stray_pubrel_info);
+	nni_pipe_add_stat(pipe, &p->stat_rx_drop);
+	nni_pipe_add_stat(pipe, &p->stat_rx_drop_bytes);
+	nni_pipe_add_stat(pipe, &p->stat_rx_stalls);
+	nni_pipe_add_stat(pipe, &p->stat_rx_dup_publish);
+	nni_pipe_add_stat(pipe, &p->stat_rx_stray_pubrel);
+#endif
 
 	return (0);
 }
 
+static void
+mqtt_alias_in_free_cb(void *key, void *val)
+{
+	mqtt_buf *topic = val;
+
+	NNI_ARG_UNUSED(key);
+	mqtt_buf_free(topic);
+	NNI_FREE_STRUCT(topic);
+}
+
 static void
 mqtt_pipe_fini(void *arg)
 {
@@ -231,23 +683,277 @@ mqtt_pipe_fini(void *arg)
 	nni_aio_fini(&p->send_aio);
 	nni_aio_fini(&p->recv_aio);
 	nni_aio_fini(&p->time_aio);
-	nni_id_map_fini(&p->sent_unack);
 	nni_id_map_fini(&p->recv_unack);
 	nni_lmq_fini(&p->recv_messages);
 	nni_lmq_fini(&p->send_messages);
+	nni_id_map_foreach(&p->alias_in, mqtt_alias_in_free_cb);
+	nni_id_map_fini(&p->alias_in);
+	if (p->alias_out != NULL) {
+		nni_mqtt_alias_fini(p->alias_out);
+	}
+	if (p->retry_cap > 0) {
+		nni_free(p->retry_heap, p->retry_cap * sizeof(mqtt_retry_t));
+	}
 }
 
-// Should be called with mutex lock hold. and it will unlock mtx.
-static inline void
-mqtt_send_msg(nni_aio *aio, mqtt_ctx_t *arg)
+static void
+mqtt_retry_sift_down(mqtt_pipe_t *p, size_t i)
 {
-	mqtt_ctx_t * ctx = arg;
-	mqtt_sock_t *s   = ctx->mqtt_sock;
-	mqtt_pipe_t *p   = s->mqtt_pipe;
-	uint16_t     ptype, packet_id;
-	uint8_t      qos;
-	nni_msg *    msg;
-	nni_msg *    tmsg;
+	mqtt_retry_t *h = p->retry_heap;
+	mqtt_retry_t  r = h[i];
+	size_t        c;
+
+	while ((c = 2 * i + 1) < p->retry_len) {
+		if (c + 1 < p->retry_len && h[c + 1].due < h[c].due) {
+			c++;
+		}
+		if (r.due <= h[c].due) {
+			break;
+		}
+		h[i] = h[c];
+		i    = c;
+	}
+	h[i] = r;
+}
+
+static bool
+mqtt_retry_valid(mqtt_pipe_t *p, mqtt_retry_t *r)
+{
+	mqtt_unack_t *u = &p->mqtt_sock->sent_unack[r->pid];
+
+	return (u->msg == r->msg && u->state == r->state);
+}
+
+// Drops the entries of messages that have been acknowledged since.
+static void
+mqtt_retry_compact(mqtt_pipe_t *p)
+{
+	size_t i, n;
+
+	for (i = 0, n = 0; i < p->retry_len; i++) {
+		if (mqtt_retry_valid(p, &p->retry_heap[i])) {
+			p->retry_heap[n++] = p->retry_heap[i];
+		}
+	}
+	p->retry_len = n;
+	for (i = n / 2; i > 0; i--) {
+		mqtt_retry_sift_down(p, i - 1);
+	}
+}
+
+static int
+mqtt_retry_push(mqtt_pipe_t *p, nni_time due, uint16_t pid, uint8_t tries)
+{
+	mqtt_retry_t *h;
+	size_t        i, cap;
+
+	if (p->retry_len == p->retry_cap) {
+		mqtt_retry_compact(p);
+	}
+	// Grow unless compacting freed at least half of the heap.
+	if (p->retry_cap == 0 || p->retry_len * 2 > p->retry_cap) {
+		cap = p->retry_cap > 0 ? p->retry_cap * 2 : 64;
+		if ((h = nni_alloc(cap * sizeof(mqtt_retry_t))) == NULL) {
+			if (p->retry_len == p->retry_cap) {
+				return (NNG_ENOMEM);
+			}
+		} else {
+			if (p->retry_cap > 0) {
+				memcpy(h, p->retry_heap,
+				    p->retry_len * sizeof(mqtt_retry_t));
+				nni_free(p->retry_heap,
+				    p->retry_cap * sizeof(mqtt_retry_t));
+			}
+			p->retry_heap = h;
+			p->retry_cap  = cap;
+		}
+	}
+	h = p->retry_heap;
+	i = p->retry_len++;
+	while (i > 0 && h[(i - 1) / 2].due > due) {
+		h[i] = h[(i - 1) / 2];
+		i    = (i - 1) / 2;
+	}
+	h[i].due   = due;
+	h[i].msg   = p->mqtt_sock->sent_unack[pid].msg;
+	h[i].pid   = pid;
+	h[i].state = p->mqtt_sock->sent_unack[pid].state;
+	h[i].tries = tries;
+	return (0);
+}
+
+// Removes the earliest deadline into *r, returns false if there is
+// none that is due by now.
+static bool
+mqtt_retry_pop_due(mqtt_pipe_t *p, nni_time now, mqtt_retry_t *r)
+{
+	if (p->retry_len == 0 || p->retry_heap[0].due > now) {
+		return (false);
+	}
+	*r                = p->retry_heap[0];
+	p->retry_heap[0] = p->retry_heap[--p->retry_len];
+	if (p->retry_len > 0) {
+		mqtt_retry_sift_down(p, 0);
+	}
+	return (true);
+}
+
+// Reports whether msg can be handed to the pipe now.  QoS 1/2 publishes
+// must fit in the in-flight window, and unless the policy allows
+// dropping queued messages, the send queue must have a free slot.
+static bool
+mqtt_pipe_has_room(mqtt_pipe_t *p, nni_msg *msg)
+{
+	mqtt_sock_t *s = p->mqtt_sock;
+	uint16_t     window;
+
+	if (nni_mqtt_msg_get_packet_type(msg) == NNG_MQTT_PUBLISH &&
+	    nni_mqtt_msg_get_publish_qos(msg) > 0) {
+		window = s->send_window < p->rcv_max ? s->send_window
+		                                     : p->rcv_max;
+		if (p->sent_count >= window) {
+			return (false);
+		}
+	}
+	if (p->busy && nni_lmq_full(&p->send_messages) &&
+	    s->send_policy != NNG_MQTT_SEND_DROP_OLDEST) {
+		return (false);
+	}
+	return (true);
+}
+
+// Reports whether a packet of size bytes, fixed header included, is more
+// than the server takes.
+static bool
+mqtt_pipe_too_big(mqtt_pipe_t *p, size_t size)
+{
+	return (p->max_packet > 0 && size > p->max_packet);
+}
+
+// Returns the payload a message carries outside of its body, which is
+// written after it from the application's buffer.  There is none for the
+// packets we make up ourselves or read back from the session store.
+static size_t
+mqtt_msg_ref_len(nni_msg *msg)
+{
+	size_t len;
+
+	if (nni_mqtt_msg_payload_ref(msg, &len) == NULL) {
+		return (0);
+	}
+	return (len);
+}
+
+// Records an unacknowledged packet in the session store.  Failing to
+// store it only costs the message if the application restarts before it
+// is acknowledged, so the packet goes out anyway and the failure is just
+// counted.  Should be called with mutex lock hold.
+static void
+mqtt_sock_session_put(mqtt_sock_t *s, uint16_t packet_id, nni_msg *msg)
+{
+	if (nni_mqtt_session_put(s->session, packet_id, msg) != 0) {
+		BUMP_STAT(&s->stat_session_errors, 1);
+	}
+}
+
+// Drops an acknowledged packet from the session store.  Should be called
+// with mutex lock hold.
+static void
+mqtt_sock_session_remove(mqtt_sock_t *s, uint16_t packet_id)
+{
+	if (nni_mqtt_session_remove(s->session, packet_id) != 0) {
+		BUMP_STAT(&s->stat_session_errors, 1);
+	}
+}
+
+// Rewrites the fixed header after the body of a packet changed length.
+static void
+mqtt_msg_fix_header(nni_msg *msg)
+{
+	uint8_t  hdr[5];
+	uint32_t len = (uint32_t) (nni_msg_len(msg) + mqtt_msg_ref_len(msg));
+	size_t   n   = 0;
+
+	hdr[n++] = ((uint8_t *) nni_msg_header(msg))[0];
+	do {
+		hdr[n] = len & 0x7f;
+		len >>= 7;
+		if (len > 0) {
+			hdr[n] |= 0x80;
+		}
+		n++;
+	} while (len > 0);
+	nni_msg_header_clear(msg);
+	(void) nni_msg_header_append(msg, hdr, n);
+}
+
+// Puts a topic alias into an encoded QoS 0 PUBLISH about to be written.
+// The first time a topic goes out it sets up the alias, after which the
+// topic is left out.  It is done at write time, because the server learns
+// aliases in the order it reads them.  Other publishes keep their topic,
+// as they may be sent again on another connection, where the alias means
+// nothing.  Must be called with the socket lock held.
+static void
+mqtt_pipe_alias_publish(mqtt_pipe_t *p, nni_msg *msg)
+{
+	uint8_t * hdr  = nni_msg_header(msg);
+	uint8_t * body = nni_msg_body(msg);
+	size_t    len  = nni_msg_len(msg);
+	uint8_t   prop[6];
+	uint16_t  tlen;
+	uint16_t  alias;
+	bool      known;
+
+	if ((p->alias_out == NULL) || (nni_msg_header_len(msg) < 2) ||
+	    ((hdr[0] & 0xf6) != 0x30) || nni_msg_shared(msg) || (len < 3)) {
+		return;
+	}
+	NNI_GET16(body, tlen);
+	// An alias takes three bytes, so short topics are not worth one.
+	// Publishes with properties of their own are left alone.
+	if ((tlen <= 3) || (len < (size_t) tlen + 3) ||
+	    (body[tlen + 2] != 0)) {
+		return;
+	}
+	if ((alias = nni_mqtt_alias_get(p->alias_out, body + 2, tlen,
+	         &known)) == 0) {
+		return;
+	}
+	prop[0] = 0;
+	prop[1] = 0;
+	prop[2] = 3; // property length
+	prop[3] = NNG_MQTT_PROP_TOPIC_ALIAS;
+	NNI_PUT16(prop + 4, alias);
+	if (known) {
+		// [len][topic][0] becomes [0 0][3 0x23 alias]
+		nni_msg_trim(msg, tlen - 3);
+		memcpy(nni_msg_body(msg), prop, 6);
+		BUMP_STAT(&p->mqtt_sock->stat_tx_alias_saved, tlen - 3);
+	} else {
+		// [len][topic][0] becomes [len][topic][3 0x23 alias]
+		if (nni_msg_insert(msg, prop, 3) != 0) {
+			return;
+		}
+		body = nni_msg_body(msg);
+		memmove(body, body + 3, tlen + 2);
+		memcpy(body + tlen + 2, prop + 2, 4);
+	}
+	mqtt_msg_fix_header(msg);
+}
+
+// Hands the message on aio to the pipe, writing it straight away or
+// queueing it behind the write in progress.  Should be called with mutex
+// lock hold, after mqtt_pipe_has_room said yes.
+static void
+mqtt_pipe_send_msg(mqtt_pipe_t *p, nni_aio *aio)
+{
+	mqtt_sock_t * s         = p->mqtt_sock;
+	uint16_t      packet_id = 0;
+	uint16_t      ptype;
+	nni_msg *     msg;
+	nni_msg *     tmsg;
+	mqtt_unack_t *u;
+	bool          done = true;
 
 	msg   = nni_aio_get_msg(aio);
 	ptype = nni_mqtt_msg_get_packet_type(msg);
@@ -257,549 +963,2375 @@ mqtt_send_msg(nni_aio *aio, mqtt_ctx_t *arg)
 		break;
 
 	case NNG_MQTT_PUBLISH:
-		qos = nni_mqtt_msg_get_publish_qos(msg);
-		if (0 == qos) {
-			nni_aio_finish(aio, 0, 0);
+		if (0 == nni_mqtt_msg_get_publish_qos(msg)) {
 			break; // QoS 0 need no packet id
 		}
 		// FALLTHROUGH
 	case NNG_MQTT_SUBSCRIBE:
 	case NNG_MQTT_UNSUBSCRIBE:
-		packet_id     = mqtt_pipe_get_next_packet_id(p);
-		nni_mqtt_msg_set_packet_id(msg, packet_id);
-		nni_mqtt_msg_set_aio(msg, aio);
-		tmsg = nni_id_get(&p->sent_unack, packet_id);
-		if (tmsg != NULL) {
-			nni_plat_printf("Warning : msg %d lost due to "
-			                "packetID duplicated!",
-			    packet_id);
-			nni_aio_finish_error(
-			    nni_mqtt_msg_get_aio(tmsg), NNG_EPROTO);
-			nni_msg_free(tmsg);
-			nni_id_remove(&p->sent_unack, packet_id);
+		// completed once the peer acknowledges it
+		if ((packet_id = mqtt_sock_get_next_packet_id(s)) == 0) {
+			nni_aio_finish_error(aio, NNG_EAGAIN);
+			return;
 		}
+		done = false;
+		nni_mqtt_msg_set_packet_id(msg, packet_id);
 		nni_msg_clone(msg);
-		if (nni_id_set(&p->sent_unack, packet_id, msg) != 0) {
-			// nni_println("Warning! QoS msg caching failed");
-			nni_msg_free(msg);
-		}
+		u         = &s->sent_unack[packet_id];
+		u->msg    = msg;
+		u->aio    = aio;
+		u->pipe   = nni_pipe_id(p->pipe);
+		u->dialer = nni_pipe_dialer_id(p->pipe);
+		u->state  = MQTT_UNACK_WAIT_ACK;
+		s->sent_count++;
+		p->sent_count++;
+		(void) mqtt_retry_push(p, nni_clock() + s->retry, packet_id, 0);
 		break;
 
 	default:
-		nni_mtx_unlock(&s->mtx);
 		nni_aio_finish_error(aio, NNG_EPROTO);
 		return;
 	}
+	nni_aio_set_msg(aio, NULL);
+	nni_mqtt_msg_set_protocol_version(msg, p->version);
+	nni_mqtt_msg_encode(msg);
+	if (s->session != NULL && packet_id != 0 &&
+	    ptype == NNG_MQTT_PUBLISH) {
+		mqtt_sock_session_put(s, packet_id, msg);
+	}
 	if (!p->busy) {
 		p->busy = true;
-		nni_mqtt_msg_encode(msg);
+		mqtt_pipe_alias_publish(p, msg);
 		nni_aio_set_msg(&p->send_aio, msg);
 		nni_aio_bump_count(aio,
-		    nni_msg_header_len(msg) + nni_msg_len(msg));
+		    nni_msg_header_len(msg) + nni_msg_len(msg) +
+		        mqtt_msg_ref_len(msg));
+		nni_pipe_send(p->pipe, &p->send_aio);
+	} else {
+		if (nni_lmq_full(&p->send_messages)) {
+			// Only under drop-oldest.  A QoS 1/2 message dropped
+			// here is still held in sent_unack for retransmit.
+			(void) nni_lmq_get(&p->send_messages, &tmsg);
+			nni_msg_free(tmsg);
+			BUMP_STAT(&s->stat_tx_drop, 1);
+		}
+		(void) nni_lmq_put(&p->send_messages, msg);
+	}
+	// round robin carries on from here
+	s->shard_next = (uint32_t) p->shard + 1;
+	if (done) {
+		nni_aio_finish(aio, 0, 0);
+	}
+}
+
+// Sends a packet the protocol generated itself.  These are never dropped
+// by the send policy, the queue grows to take them instead.  Should be
+// called with mutex lock hold.
+static void
+mqtt_pipe_send_raw(mqtt_pipe_t *p, nni_msg *msg)
+{
+	if (!p->busy) {
+		p->busy = true;
+		nni_aio_set_msg(&p->send_aio, msg);
 		nni_pipe_send(p->pipe, &p->send_aio);
-		nni_mtx_unlock(&s->mtx);
-		nni_aio_set_msg(aio, NULL);
 		return;
 	}
 	if (nni_lmq_full(&p->send_messages)) {
-		(void) nni_lmq_get(&p->send_messages, &tmsg);
-		nni_msg_free(tmsg);
+		(void) nni_lmq_resize(
+		    &p->send_messages, nni_lmq_cap(&p->send_messages) * 2);
 	}
-
-	if (0 != nni_lmq_put(&p->send_messages, msg)) {
-		// nni_println("Warning! msg lost due to busy socket");
+	if (nni_lmq_put(&p->send_messages, msg) != 0) {
+		// the retransmit timer will have another go
+		nni_msg_free(msg);
 	}
-	nni_mtx_unlock(&s->mtx);
-	return;
 }
 
-static int
-mqtt_pipe_start(void *arg)
+// Reports whether a PUBREC is the answer to the packet in u: a QoS 2
+// PUBLISH, or its PUBREL when the PUBREC came again.
+static bool
+mqtt_unack_wants_pubrec(mqtt_unack_t *u)
 {
-	mqtt_pipe_t *p = arg;
-	mqtt_sock_t *s = p->mqtt_sock;
-	mqtt_ctx_t  *c = NULL;
+	uint8_t *hdr;
 
-	nni_mtx_lock(&s->mtx);
-	s->mqtt_pipe = p;
-	if ((c = nni_list_first(&s->send_queue)) != NULL) {
-		nni_list_remove(&s->send_queue, c);
-		mqtt_send_msg(c->saio, c);
-		nni_sleep_aio(s->retry, &p->time_aio);
-		nni_pipe_recv(p->pipe, &p->recv_aio);
-		return(0);
+	if (u->state == MQTT_UNACK_WAIT_COMP) {
+		return (true);
 	}
-	nni_mtx_unlock(&s->mtx);
-	//initiate the global resend timer
-	nni_sleep_aio(s->retry, &p->time_aio);
-	nni_pipe_recv(p->pipe, &p->recv_aio);
-	return (0);
+	if ((u->state != MQTT_UNACK_WAIT_ACK) ||
+	    (nni_msg_header_len(u->msg) == 0)) {
+		return (false);
+	}
+	hdr = nni_msg_header(u->msg);
+	return (((hdr[0] & 0xf0) == 0x30) && ((hdr[0] & 0x06) == 0x04));
 }
 
+// Moves a QoS 2 publish on to its second phase after PUBREC, and sends
+// the PUBREL.  The slot's message is rewritten in place into the PUBREL
+// when nothing else holds a reference to it, so that the packet costs no
+// allocation; its protocol data still describes the old PUBLISH and must
+// not be used to encode it again.
 static void
-mqtt_pipe_stop(void *arg)
+mqtt_pipe_send_pubrel(mqtt_pipe_t *p, uint16_t packet_id)
 {
-	mqtt_pipe_t *p = arg;
-	nni_aio_stop(&p->send_aio);
-	nni_aio_stop(&p->recv_aio);
-	nni_aio_stop(&p->time_aio);
+	mqtt_sock_t * s = p->mqtt_sock;
+	mqtt_unack_t *u = &s->sent_unack[packet_id];
+	nni_msg *     msg;
+	uint8_t       pubrel[4] = { 0x62, 0x02, 0x00, 0x00 };
+
+	if (u->state == MQTT_UNACK_WAIT_ACK) {
+		msg = u->msg;
+		if (nni_msg_shared(msg) || mqtt_msg_ref_len(msg) > 0) {
+			// e.g. a duplicate PUBLISH is still being written, or
+			// its payload would be written after the PUBREL
+			if (nni_msg_alloc(&msg, 0) != 0) {
+				return; // PUBLISH again, we'll get PUBREC again
+			}
+			nni_msg_free(u->msg);
+			u->msg = msg;
+		}
+		NNI_PUT16(pubrel + 2, packet_id);
+		nni_msg_clear(msg);
+		nni_msg_header_clear(msg);
+		(void) nni_msg_header_append(msg, pubrel, sizeof(pubrel));
+		u->state = MQTT_UNACK_WAIT_COMP;
+		(void) mqtt_retry_push(
+		    p, nni_clock() + s->retry, packet_id, 0);
+		if (s->session != NULL) {
+			mqtt_sock_session_put(s, packet_id, msg);
+		}
+	}
+	u->pipe = nni_pipe_id(p->pipe);
+	nni_msg_clone(u->msg);
+	mqtt_pipe_send_raw(p, u->msg);
 }
 
-void
-mqtt_close_unack_msg_cb(void *key, void *val)
+// Releases a packet id on its final acknowledgement, and returns the aio
+// to complete.  Should be called with mutex lock hold.
+static nni_aio *
+mqtt_sock_release_packet_id(mqtt_sock_t *s, uint16_t packet_id)
 {
-	NNI_ARG_UNUSED(key);
-
-	nni_msg * msg = val;
-	nni_aio * aio = NULL;
+	mqtt_unack_t *u   = &s->sent_unack[packet_id];
+	nni_aio *     aio = u->aio;
+	mqtt_pipe_t * p;
 
-	aio = nni_mqtt_msg_get_aio(msg);
-	if (aio) {
-		nni_aio_finish_error(aio, NNG_ECLOSED);
+	if ((p = mqtt_sock_find_pipe(s, u->pipe)) != NULL) {
+		p->sent_count--;
 	}
-	nni_msg_free(msg);
-
+	nni_msg_free(u->msg);
+	u->msg    = NULL;
+	u->aio    = NULL;
+	u->pipe   = 0;
+	u->dialer = 0;
+	u->state  = MQTT_UNACK_FREE;
+	s->sent_count--;
+	return (aio);
 }
 
+// Prepares a packet waiting for its ack to be sent again, which for a
+// PUBLISH means setting DUP, or clearing it when it goes to a server that
+// has not seen it before.  Packets are kept encoded, so only the bit
+// in the fixed header changes, and nothing is copied.  Packets loaded
+// from the session store have no protocol data to keep in step.
 static void
-mqtt_pipe_close(void *arg)
+mqtt_msg_set_dup(nni_msg *msg, bool dup)
 {
-	mqtt_pipe_t *p = arg;
-	mqtt_sock_t *s = p->mqtt_sock;
+	uint8_t *hdr = nni_msg_header(msg);
 
-	nni_mtx_lock(&s->mtx);
-	s->mqtt_pipe = NULL;
-	nni_aio_close(&p->send_aio);
-	nni_aio_close(&p->recv_aio);
-	nni_aio_close(&p->time_aio);
-	nni_lmq_flush(&p->recv_messages);
-	nni_lmq_flush(&p->send_messages);
-	nni_id_map_foreach(&p->sent_unack, mqtt_close_unack_msg_cb);
-	nni_id_map_foreach(&p->recv_unack, mqtt_close_unack_msg_cb);
-	nni_mtx_unlock(&s->mtx);
+	if ((nni_msg_header_len(msg) == 0) || ((hdr[0] & 0xf0) != 0x30)) {
+		return;
+	}
+	hdr[0] = dup ? (uint8_t) (hdr[0] | 0x08) : (uint8_t) (hdr[0] & ~0x08);
+	if (nni_msg_get_proto_data(msg) != NULL) {
+		nni_mqtt_msg_set_publish_dup(msg, dup);
+	}
+}
 
-	nni_atomic_set_bool(&p->closed, true);
+// Takes over the packets that an earlier run of the application left
+// unacknowledged in the session store.  Their packet ids are reserved
+// straight away, but nothing is sent until a CONNACK says whether the
+// server still has the session.  Should be called with mutex lock hold.
+static void
+mqtt_sock_load_session(mqtt_sock_t *s)
+{
+	mqtt_unack_t *u;
+	nni_msg *     msg;
+	uint32_t      n;
+
+	n = nni_mqtt_session_count(s->session);
+	for (uint32_t i = 1; i <= 0xffffu && n > 0; i++) {
+		if ((msg = nni_mqtt_session_get(s->session, (uint16_t) i)) ==
+		    NULL) {
+			continue;
+		}
+		n--;
+		nni_msg_clone(msg);
+		u        = &s->sent_unack[i];
+		u->msg   = msg;
+		u->aio   = NULL;
+		u->pipe  = 0;
+		u->state = (((uint8_t *) nni_msg_header(msg))[0] & 0xf0) ==
+		        0x30
+		    ? MQTT_UNACK_WAIT_ACK
+		    : MQTT_UNACK_WAIT_COMP;
+		s->sent_count++;
+	}
 }
 
-static inline void
-mqtt_pipe_recv_msgq_putq(mqtt_pipe_t *p, nni_msg *msg)
-{
-	if (0 != nni_lmq_put(&p->recv_messages, msg)) {
-		// resize to ensure we do not lost messages or just lose it?
-		// add option to drop messages
-		// if (0 !=
-		//     nni_lmq_resize(&p->recv_messages,
-		//         nni_lmq_len(&p->recv_messages) * 2)) {
-		// 	// drop the message when no memory available
-		// 	nni_msg_free(msg);
-		// 	return;
-		// }
-		// nni_lmq_put(&p->recv_messages, msg);
-		nni_msg_free(msg);
+// Picks up the unacknowledged packets of earlier connections on a new
+// one, once its CONNACK is in.  If the server kept the session they are
+// sent again, marked as duplicates; otherwise the server has forgotten
+// them, and they fail, except for subscribe requests which go out again
+// after the subscriptions are made anew.  Packets of another dialer's
+// session were never seen by this one, so a PUBLISH among them is sent
+// as a new one and the rest are treated as forgotten.  Packets already
+// sent on this pipe are left alone, and so are those of the other
+// connections that are up.  Should be called with mutex lock hold.
+static void
+mqtt_pipe_resume_session(mqtt_pipe_t *p, bool present)
+{
+	mqtt_sock_t * s      = p->mqtt_sock;
+	uint32_t      id     = nni_pipe_id(p->pipe);
+	uint32_t      dialer = nni_pipe_dialer_id(p->pipe);
+	uint32_t      n      = s->sent_count;
+	mqtt_unack_t *u;
+	nni_aio *     aio;
+	bool          other;
+
+	// Everything that is kept is sent now.
+	p->retry_len = 0;
+	for (uint32_t i = 1; i <= 0xffffu && n > 0; i++) {
+		u = &s->sent_unack[i];
+		if (u->state == MQTT_UNACK_FREE) {
+			continue;
+		}
+		n--;
+		if (u->pipe != id) {
+			if (mqtt_sock_find_pipe(s, u->pipe) != NULL) {
+				continue;
+			}
+			other = (u->dialer != 0) && (u->dialer != dialer);
+			if (other && (u->state == MQTT_UNACK_WAIT_ACK) &&
+			    ((((uint8_t *) nni_msg_header(u->msg))[0] & 0xf0) ==
+			        0x30)) {
+				mqtt_msg_set_dup(u->msg, false);
+			} else if (!present || other) {
+				aio = mqtt_sock_release_packet_id(s, (uint16_t) i);
+				if (s->session != NULL) {
+					mqtt_sock_session_remove(
+					    s, (uint16_t) i);
+				}
+				if (i == s->sub_batch.pid) {
+					mqtt_sub_batch_requeue(&s->sub_batch);
+				} else if (i == s->unsub_batch.pid) {
+					mqtt_sub_batch_requeue(&s->unsub_batch);
+				} else {
+					mqtt_sock_abort_packet(
+					    s, (uint16_t) i, aio, NNG_ECLOSED);
+				}
+				continue;
+			} else if (u->state == MQTT_UNACK_WAIT_ACK) {
+				mqtt_msg_set_dup(u->msg, true);
+			}
+			u->pipe   = id;
+			u->dialer = dialer;
+			p->sent_count++;
+			nni_msg_clone(u->msg);
+			mqtt_pipe_send_raw(p, u->msg);
+		}
+		(void) mqtt_retry_push(p, nni_clock() + s->retry, i, 0);
+	}
+	if (!present) {
+		mqtt_pipe_resubscribe(p);
 	}
 }
 
-// Timer callback, we use it for retransmitting.
 static void
-mqtt_timer_cb(void *arg)
+mqtt_send_cancel(nni_aio *aio, void *arg, int rv)
 {
-	mqtt_pipe_t *p = arg;
-	mqtt_sock_t *s = p->mqtt_sock;
-	nni_msg *  msg;
-	nni_aio *  aio;
-	uint16_t   pid;
+	mqtt_sock_t *s = arg;
 
-	if (nng_aio_result(&p->time_aio) != 0) {
-		return;
-	}
 	nni_mtx_lock(&s->mtx);
-	if (NULL == p || nni_atomic_get_bool(&p->closed)) {
+	if (!nni_aio_list_active(aio)) {
+		nni_mtx_unlock(&s->mtx);
 		return;
 	}
-	// start message resending
-	msg = nni_id_get_any(&p->sent_unack, &pid);
+	nni_aio_list_remove(aio);
+	s->send_parked--;
+	nni_mtx_unlock(&s->mtx);
+	nni_aio_finish_error(aio, rv);
+}
 
-	if (msg != NULL) {
-		uint16_t ptype;
-		ptype = nni_mqtt_msg_get_packet_type(msg);
-		if (ptype == NNG_MQTT_PUBLISH) {
-			nni_mqtt_msg_set_publish_dup(msg, true);
-		}
-		if (!p->busy) {
-			p->busy = true;
-			nni_msg_clone(msg);
-			aio     = nni_mqtt_msg_get_aio(msg);
-			nni_aio_bump_count(
-			    aio, nni_msg_header_len(msg) + nni_msg_len(msg));
-			nni_mqtt_msg_encode(msg);
-			nni_aio_set_msg(&p->send_aio, msg);
-			nni_pipe_send(p->pipe, &p->send_aio);
-			nni_mtx_unlock(&s->mtx);
-			nni_aio_set_msg(aio, NULL);
-			nni_sleep_aio(s->retry, &p->time_aio);
-			return;
+// The same for a subscribe or unsubscribe in a batch, which is not one
+// of the parked sends.
+static void
+mqtt_sub_batch_cancel(nni_aio *aio, void *arg, int rv)
+{
+	mqtt_sock_t *s = arg;
+
+	nni_mtx_lock(&s->mtx);
+	if (!nni_aio_list_active(aio)) {
+		nni_mtx_unlock(&s->mtx);
+		return;
+	}
+	nni_aio_list_remove(aio);
+	nni_mtx_unlock(&s->mtx);
+	nni_aio_finish_error(aio, rv);
+}
+
+// Admits parked sends, oldest first, for as long as there is room.
+// Should be called with mutex lock hold.
+static void
+mqtt_send_waiting(mqtt_sock_t *s)
+{
+	mqtt_pipe_t *p;
+	nni_aio *    aio;
+
+	while ((aio = nni_list_first(&s->send_waitq)) != NULL) {
+		if (((p = mqtt_sock_pick(s, nni_aio_get_msg(aio))) == NULL) ||
+		    !mqtt_pipe_has_room(p, nni_aio_get_msg(aio))) {
+			break;
+		}
+		nni_aio_list_remove(aio);
+		s->send_parked--;
+		mqtt_pipe_send_msg(p, aio);
+	}
+	mqtt_sub_batch_flush(s, &s->sub_batch);
+	mqtt_sub_batch_flush(s, &s->unsub_batch);
+}
+
+// Returns the number of topic filters in a SUBSCRIBE or UNSUBSCRIBE,
+// adding their encoded size to *sizep.
+static uint32_t
+mqtt_sub_msg_topics(nni_msg *msg, uint8_t type, size_t *sizep)
+{
+	nni_mqtt_topic_qos *tq;
+	nni_mqtt_topic *    tp;
+	uint32_t            n;
+
+	if (type == NNG_MQTT_SUBSCRIBE) {
+		tq = nni_mqtt_msg_get_subscribe_topics(msg, &n);
+		for (uint32_t i = 0; i < n; i++) {
+			*sizep += tq[i].topic.length + 3;
+		}
+	} else {
+		tp = nni_mqtt_msg_get_unsubscribe_topics(msg, &n);
+		for (uint32_t i = 0; i < n; i++) {
+			*sizep += tp[i].length + 2;
+		}
+	}
+	return (n);
+}
+
+// Builds one packet with the topic filters of the first n requests on
+// list.
+static nni_msg *
+mqtt_sub_batch_msg(
+    mqtt_sub_batch_t *b, nni_list *list, uint32_t n, uint32_t topics)
+{
+	nni_mqtt_topic_qos *tq = NULL;
+	nni_mqtt_topic *    tp = NULL;
+	nni_aio *           aio;
+	nni_msg *           msg;
+	uint32_t            off = 0;
+
+	if (nni_mqtt_msg_alloc(&msg, 0) != 0) {
+		return (NULL);
+	}
+	if ((b->type == NNG_MQTT_SUBSCRIBE &&
+	        (tq = NNI_ALLOC_STRUCTS(tq, topics)) == NULL) ||
+	    (b->type == NNG_MQTT_UNSUBSCRIBE &&
+	        (tp = NNI_ALLOC_STRUCTS(tp, topics)) == NULL)) {
+		nni_msg_free(msg);
+		return (NULL);
+	}
+	aio = nni_list_first(list);
+	for (uint32_t i = 0; i < n; i++) {
+		nni_msg *req = nni_aio_get_msg(aio);
+		uint32_t cnt;
+		if (tq != NULL) {
+			nni_mqtt_topic_qos *src =
+			    nni_mqtt_msg_get_subscribe_topics(req, &cnt);
+			memcpy(&tq[off], src, cnt * sizeof(*src));
 		} else {
-			nni_msg_clone(msg);
-			nni_lmq_put(&p->send_messages, msg);
+			nni_mqtt_topic *src =
+			    nni_mqtt_msg_get_unsubscribe_topics(req, &cnt);
+			memcpy(&tp[off], src, cnt * sizeof(*src));
 		}
+		// the SUBACK return codes of this caller start here
+		nni_aio_set_prov_data(aio, (void *) (uintptr_t) off);
+		off += cnt;
+		aio = nni_list_next(list, aio);
+	}
+	nni_mqtt_msg_set_packet_type(msg, b->type);
+	// The topic filters are copied, the array only borrows them.
+	if (tq != NULL) {
+		nni_mqtt_msg_set_subscribe_topics(msg, tq, topics);
+		NNI_FREE_STRUCTS(tq, topics);
+	} else {
+		nni_mqtt_msg_set_unsubscribe_topics(msg, tp, topics);
+		NNI_FREE_STRUCTS(tp, topics);
 	}
+	return (msg);
+}
 
-	nni_mtx_unlock(&s->mtx);
-	nni_sleep_aio(s->retry, &p->time_aio);
-	return;
+// Sends a packet of our own, one with no caller waiting for it, and keeps
+// it until it is acknowledged.  Must be called with the socket lock held.
+static void
+mqtt_pipe_send_tracked(mqtt_pipe_t *p, nni_msg *msg, uint16_t packet_id)
+{
+	mqtt_sock_t * s = p->mqtt_sock;
+	mqtt_unack_t *u = &s->sent_unack[packet_id];
+
+	nni_mqtt_msg_set_packet_id(msg, packet_id);
+	nni_mqtt_msg_set_protocol_version(msg, p->version);
+	nni_mqtt_msg_encode(msg);
+	nni_msg_clone(msg);
+	u->msg    = msg;
+	u->aio    = NULL;
+	u->pipe   = nni_pipe_id(p->pipe);
+	u->dialer = nni_pipe_dialer_id(p->pipe);
+	u->state  = MQTT_UNACK_WAIT_ACK;
+	s->sent_count++;
+	p->sent_count++;
+	(void) mqtt_retry_push(p, nni_clock() + s->retry, packet_id, 0);
+	mqtt_pipe_send_raw(p, msg);
 }
 
+// Records a subscription the server granted, or replaces its QoS.
 static void
-mqtt_send_cb(void *arg)
+mqtt_sock_sub_add(mqtt_sock_t *s, const nni_mqtt_topic_qos *tq)
 {
-	mqtt_pipe_t *p = arg;
-	mqtt_sock_t *s = p->mqtt_sock;
-	mqtt_ctx_t  *c = NULL;
-	nni_msg     *msg;
+	mqtt_sub_t *sub;
+	char *      topic;
 
-	if (nni_aio_result(&p->send_aio) != 0) {
-		// We failed to send... clean up and deal with it.
-		nni_msg_free(nni_aio_get_msg(&p->send_aio));
-		nni_aio_set_msg(&p->send_aio, NULL);
-		nni_mtx_unlock(&s->mtx);
-		nni_pipe_close(p->pipe);
+	if ((topic = nni_alloc(tq->topic.length + 1)) == NULL) {
 		return;
 	}
-	nni_mtx_lock(&s->mtx);
-
-	p->busy = false;
-	if (nni_atomic_get_bool(&s->closed) ||
-	    nni_atomic_get_bool(&p->closed)) {
-		// This occurs if the mqtt_pipe_close has been called.
-		// In that case we don't want any more processing.
-		nni_mtx_unlock(&s->mtx);
+	memcpy(topic, tq->topic.buf, tq->topic.length);
+	topic[tq->topic.length] = '\0';
+	if ((s->subs_trie != NULL) &&
+	    ((sub = nni_mqtt_trie_find(s->subs_trie, topic)) != NULL)) {
+		sub->qos = tq->qos;
+		nni_strfree(topic);
 		return;
 	}
-	// Check cached ctx in nni_list first
-	// these ctxs are triggered before the pipe is established
-	if ((c = nni_list_first(&s->send_queue)) != NULL) {
-		nni_list_remove(&s->send_queue, c);
-		mqtt_send_msg(c->saio, c);
+	if ((sub = NNI_ALLOC_STRUCT(sub)) == NULL) {
+		nni_strfree(topic);
 		return;
 	}
-	// Then those msg in nni_lmq
-	if (nni_lmq_get(&p->send_messages, &msg) == 0) {
-		p->busy = true;
-		nni_mqtt_msg_encode(msg);
-		nni_aio_set_msg(&p->send_aio, msg);
-		nni_pipe_send(p->pipe, &p->send_aio);
-		nni_mtx_unlock(&s->mtx);
+	sub->topic = topic;
+	sub->qos   = tq->qos;
+	if (((s->subs_trie == NULL) &&
+	        (nni_mqtt_trie_init(&s->subs_trie) != 0)) ||
+	    (nni_mqtt_trie_insert(s->subs_trie, topic, sub) != 0)) {
+		// not remembered, so not made again after a reconnect
+		nni_strfree(topic);
+		NNI_FREE_STRUCT(sub);
 		return;
 	}
-	p->busy = false;
-	nni_mtx_unlock(&s->mtx);
-	return;
+	nni_list_append(&s->subs, sub);
 }
 
 static void
-mqtt_recv_cb(void *arg)
+mqtt_sock_sub_remove(mqtt_sock_t *s, const nni_mqtt_topic *tp)
 {
-	mqtt_pipe_t *p = arg;
-	mqtt_sock_t *s = p->mqtt_sock;
-	nni_aio * user_aio = NULL;
-	nni_msg * cached_msg = NULL;
-	mqtt_ctx_t * ctx;
+	mqtt_sub_t *sub;
+	char *      topic;
+
+	if ((s->subs_trie == NULL) ||
+	    ((topic = nni_alloc(tp->length + 1)) == NULL)) {
+		return;
+	}
+	memcpy(topic, tp->buf, tp->length);
+	topic[tp->length] = '\0';
+	if ((sub = nni_mqtt_trie_find(s->subs_trie, topic)) != NULL) {
+		(void) nni_mqtt_trie_remove(s->subs_trie, topic, sub);
+		nni_list_remove(&s->subs, sub);
+		nni_strfree(sub->topic);
+		NNI_FREE_STRUCT(sub);
+	}
+	nni_strfree(topic);
+}
 
+// Makes the recorded subscriptions again on a connection whose server
+// has no session for us, in as few SUBSCRIBE packets as fit.  Must be
+// called with the socket lock held.
+static void
+mqtt_pipe_resubscribe(mqtt_pipe_t *p)
+{
+	mqtt_sock_t *       s   = p->mqtt_sock;
+	mqtt_sub_t *        sub = nni_list_first(&s->subs);
+	nni_mqtt_topic_qos *tq;
+	nni_msg *           msg;
+	uint16_t            packet_id;
+
+	while (sub != NULL) {
+		mqtt_sub_t *first = sub;
+		uint32_t    n     = 0;
+		size_t      size  = 0;
+
+		while (sub != NULL && (n == 0 || size < MQTT_SUB_BATCH)) {
+			size += strlen(sub->topic) + 3;
+			n++;
+			sub = nni_list_next(&s->subs, sub);
+		}
+		if (((packet_id = mqtt_sock_get_next_packet_id(s)) == 0) ||
+		    ((tq = NNI_ALLOC_STRUCTS(tq, n)) == NULL)) {
+			return;
+		}
+		if (nni_mqtt_msg_alloc(&msg, 0) != 0) {
+			NNI_FREE_STRUCTS(tq, n);
+			return;
+		}
+		sub = first;
+		for (uint32_t i = 0; i < n; i++) {
+			tq[i].topic.buf    = (uint8_t *) sub->topic;
+			tq[i].topic.length = (uint32_t) strlen(sub->topic);
+			tq[i].qos          = sub->qos;
+			sub                = nni_list_next(&s->subs, sub);
+		}
+		nni_mqtt_msg_set_packet_type(msg, NNG_MQTT_SUBSCRIBE);
+		nni_mqtt_msg_set_subscribe_topics(msg, tq, n);
+		NNI_FREE_STRUCTS(tq, n);
+		mqtt_pipe_send_tracked(p, msg, packet_id);
+	}
+}
 
-	if (nni_aio_result(&p->recv_aio) != 0) {
-		nni_pipe_close(p->pipe);
+// Puts the requests of a packet the server forgot back in front of the
+// waiting ones, to go out again on the new connection.
+static void
+mqtt_sub_batch_requeue(mqtt_sub_batch_t *b)
+{
+	nni_aio *aio;
+
+	b->pid = 0;
+	while ((aio = nni_list_last(&b->sentq)) != NULL) {
+		nni_list_remove(&b->sentq, aio);
+		nni_list_prepend(&b->waitq, aio);
+	}
+}
+
+static void
+mqtt_sub_batch_abort(nni_list *list, int rv)
+{
+	nni_aio *aio;
+
+	while ((aio = nni_list_first(list)) != NULL) {
+		nni_aio_list_remove(aio);
+		nni_aio_finish_error(aio, rv);
+	}
+}
+
+// Sends the waiting requests of the batch together, unless its previous
+// packet is still waiting for an acknowledgement.  The first connection
+// carries the packet the callers wait for, and the others get copies.
+// Must be called with the socket lock held.
+static void
+mqtt_sub_batch_flush(mqtt_sock_t *s, mqtt_sub_batch_t *b)
+{
+	mqtt_pipe_t * p      = mqtt_sock_shard(s, 0);
+	uint32_t      n      = 0;
+	uint32_t      topics = 0;
+	size_t        size   = 0;
+	uint16_t      packet_id;
+	nni_aio *     aio;
+	nni_msg *     msg;
+
+	if ((p == NULL) || (b->pid != 0)) {
+		return;
+	}
+	// A request too large for the server on its own fails by itself.
+	while ((aio = nni_list_first(&b->waitq)) != NULL) {
+		size = MQTT_SUB_OVERHEAD;
+		(void) mqtt_sub_msg_topics(nni_aio_get_msg(aio), b->type, &size);
+		if (!mqtt_pipe_too_big(p, size)) {
+			break;
+		}
+		nni_aio_list_remove(aio);
+		nni_aio_finish_error(aio, NNG_EMSGSIZE);
+	}
+	if (aio == NULL) {
+		return;
+	}
+	if ((packet_id = mqtt_sock_get_next_packet_id(s)) == 0) {
+		return; // tried again when an acknowledgement frees one
+	}
+	size = MQTT_SUB_OVERHEAD;
+	NNI_LIST_FOREACH (&b->waitq, aio) {
+		size_t   more = 0;
+		uint32_t cnt;
+
+		cnt = mqtt_sub_msg_topics(nni_aio_get_msg(aio), b->type, &more);
+		if (n > 0 &&
+		    (size >= MQTT_SUB_BATCH || mqtt_pipe_too_big(p, size + more))) {
+			break;
+		}
+		topics += cnt;
+		size += more;
+		n++;
+	}
+	if ((msg = mqtt_sub_batch_msg(b, &b->waitq, n, topics)) == NULL) {
+		while (n-- > 0) {
+			aio = nni_list_first(&b->waitq);
+			nni_aio_list_remove(aio);
+			nni_aio_finish_error(aio, NNG_ENOMEM);
+		}
 		return;
 	}
+	for (uint32_t i = 0; i < n; i++) {
+		aio = nni_list_first(&b->waitq);
+		nni_aio_list_remove(aio);
+		nni_aio_list_append(&b->sentq, aio);
+	}
+	b->pid = packet_id;
+	mqtt_pipe_send_tracked(p, msg, packet_id);
+
+	// Their acknowledgements complete nothing, and the subscriptions
+	// are recorded from that of the first.
+	for (int i = 0; i < s->shard_slots; i++) {
+		mqtt_pipe_t *sp = s->shards[i];
+
+		if ((sp == NULL) || (sp == p) ||
+		    ((packet_id = mqtt_sock_get_next_packet_id(s)) == 0) ||
+		    ((msg = mqtt_sub_batch_msg(b, &b->sentq, n, topics)) ==
+		        NULL)) {
+			continue;
+		}
+		mqtt_pipe_send_tracked(sp, msg, packet_id);
+	}
+}
 
-	nni_mtx_lock(&s->mtx);
-	nni_msg *msg = nni_aio_get_msg(&p->recv_aio);
-	nni_aio_set_msg(&p->recv_aio, NULL);
-	if (nni_atomic_get_bool(&s->closed) ||
-	    nni_atomic_get_bool(&p->closed)) {
-		//free msg and dont return data when pipe is closed.
-		if (msg) {
-			nni_msg_free(msg);
+// Completes the requests merged into the acknowledged packet: a caller
+// fails if the server refused any of its topic filters.  The record of
+// active subscriptions follows what the server accepted.
+static void
+mqtt_sub_batch_ack(mqtt_sock_t *s, mqtt_sub_batch_t *b, nni_msg *ack)
+{
+	uint8_t *codes  = NULL;
+	uint32_t ncodes = 0;
+	nni_aio *aio;
+
+	if (b->type == NNG_MQTT_SUBSCRIBE) {
+		codes = nni_mqtt_msg_get_suback_return_codes(ack, &ncodes);
+	}
+	b->pid = 0;
+	while ((aio = nni_list_first(&b->sentq)) != NULL) {
+		nni_msg *msg  = nni_aio_get_msg(aio);
+		size_t   off  = (size_t) (uintptr_t) nni_aio_get_prov_data(aio);
+		uint32_t cnt;
+		int      rv = 0;
+
+		nni_aio_list_remove(aio);
+		if (b->type == NNG_MQTT_SUBSCRIBE) {
+			nni_mqtt_topic_qos *tq =
+			    nni_mqtt_msg_get_subscribe_topics(msg, &cnt);
+			if (off + cnt > ncodes) {
+				rv = NNG_EPROTO;
+			}
+			for (uint32_t i = 0; rv != NNG_EPROTO && i < cnt; i++) {
+				if (codes[off + i] < 0x80) {
+					mqtt_sock_sub_add(s, &tq[i]);
+				} else {
+					mqtt_sock_sub_remove(s, &tq[i].topic);
+					rv = NNG_EPERM;
+				}
+			}
+		} else {
+			nni_mqtt_topic *tp =
+			    nni_mqtt_msg_get_unsubscribe_topics(msg, &cnt);
+			for (uint32_t i = 0; i < cnt; i++) {
+				mqtt_sock_sub_remove(s, &tp[i]);
+			}
 		}
+		if (rv != 0) {
+			nni_aio_finish_error(aio, rv);
+			continue;
+		}
+		nni_aio_set_msg(aio, NULL);
+		nni_msg_free(msg);
+		nni_aio_finish(aio, 0, 0);
+	}
+}
+
+// Queues a SUBSCRIBE or UNSUBSCRIBE to go out with the others.  Must be
+// called with the socket lock held, which it releases.
+static void
+mqtt_sub_batch_add(mqtt_sock_t *s, mqtt_sub_batch_t *b, nni_aio *aio)
+{
+	size_t size = 0;
+	int    rv;
+
+	if (mqtt_sub_msg_topics(nni_aio_get_msg(aio), b->type, &size) == 0) {
 		nni_mtx_unlock(&s->mtx);
+		nni_aio_finish_error(aio, NNG_EINVAL);
 		return;
 	}
-	nni_msg_set_pipe(msg, nni_pipe_id(p->pipe));
-	nni_mqtt_msg_proto_data_alloc(msg);
-	nni_mqtt_msg_decode(msg);
+	if ((rv = nni_aio_schedule(aio, mqtt_sub_batch_cancel, s)) != 0) {
+		nni_mtx_unlock(&s->mtx);
+		nni_aio_finish_error(aio, rv);
+		return;
+	}
+	nni_aio_list_append(&b->waitq, aio);
+	mqtt_sub_batch_flush(s, b);
+	nni_mtx_unlock(&s->mtx);
+}
 
-	packet_type_t packet_type = nni_mqtt_msg_get_packet_type(msg);
-	int32_t       packet_id;
-	uint8_t       qos;
+// Fails whoever waited for a packet id that was given up: its caller,
+// or the callers merged into it.
+static void
+mqtt_sock_abort_packet(mqtt_sock_t *s, uint16_t packet_id, nni_aio *aio, int rv)
+{
+	mqtt_sub_batch_t *b = NULL;
 
-	// schedule another receive
-	nni_pipe_recv(p->pipe, &p->recv_aio);
+	if (aio != NULL) {
+		nni_aio_finish_error(aio, rv);
+		return;
+	}
+	if (packet_id == s->sub_batch.pid) {
+		b = &s->sub_batch;
+	} else if (packet_id == s->unsub_batch.pid) {
+		b = &s->unsub_batch;
+	}
+	if (b != NULL) {
+		b->pid = 0;
+		mqtt_sub_batch_abort(&b->sentq, rv);
+	}
+}
 
-	// state transitions
-	switch (packet_type) {
-	case NNG_MQTT_CONNACK:
-		// we have received the CONNACK
+// Should be called with mutex lock hold. and it will unlock mtx.
+static inline void
+mqtt_send_msg(nni_aio *aio, mqtt_ctx_t *arg)
+{
+	mqtt_ctx_t * ctx = arg;
+	mqtt_sock_t *s   = ctx->mqtt_sock;
+	nni_msg *    msg = nni_aio_get_msg(aio);
+	mqtt_pipe_t *p   = mqtt_sock_pick(s, msg);
+	nni_aio *    old;
+	int          rv;
+
+	// The server would drop the connection over a packet larger than it
+	// takes, so refuse it here instead.
+	if (nni_mqtt_msg_get_packet_type(msg) == NNG_MQTT_PUBLISH) {
+		nni_mqtt_msg_set_protocol_version(msg, p->version);
+		if (mqtt_pipe_too_big(
+		        p, nni_mqtt_msg_get_publish_packet_size(msg))) {
+			nni_mtx_unlock(&s->mtx);
+			nni_aio_finish_error(aio, NNG_EMSGSIZE);
+			return;
+		}
+	}
+	// Keep FIFO order behind anything already parked.
+	if (nni_list_empty(&s->send_waitq) && mqtt_pipe_has_room(p, msg)) {
+		mqtt_pipe_send_msg(p, aio);
 		nni_mtx_unlock(&s->mtx);
 		return;
-	case NNG_MQTT_PUBACK:
-		// we have received a PUBACK, successful delivery of a QoS 1
-		// FALLTHROUGH
-	case NNG_MQTT_PUBCOMP:
-		// we have received a PUBCOMP, successful delivery of a QoS 2
-		// FALLTHROUGH
-	case NNG_MQTT_SUBACK:
-		// we have received a SUBACK, successful subscription
-		// FALLTHROUGH
-	case NNG_MQTT_UNSUBACK:
-		// we have received a UNSUBACK, successful unsubscription
-		packet_id  = nni_mqtt_msg_get_packet_id(msg);
-		cached_msg = nni_id_get(&p->sent_unack, packet_id);
-		if (cached_msg != NULL) {
-			nni_id_remove(&p->sent_unack, packet_id);
-			user_aio   = nni_mqtt_msg_get_aio(cached_msg);
-			nni_msg_free(cached_msg);
+	}
+	if (s->send_policy == NNG_MQTT_SEND_DROP_NEWEST) {
+		BUMP_STAT(&s->stat_tx_drop, 1);
+		nni_mtx_unlock(&s->mtx);
+		nni_aio_finish_error(aio, NNG_EAGAIN);
+		return;
+	}
+	// Park until an acknowledgement or a finished write makes room.
+	if ((rv = nni_aio_schedule(aio, mqtt_send_cancel, s)) != 0) {
+		nni_mtx_unlock(&s->mtx);
+		nni_aio_finish_error(aio, rv);
+		return;
+	}
+	// Under drop-oldest no more than a send queue's worth wait, and the
+	// oldest of them gives way.
+	if ((s->send_policy == NNG_MQTT_SEND_DROP_OLDEST) &&
+	    (s->send_parked >= NNG_MAX_SEND_LMQ) &&
+	    ((old = nni_list_first(&s->send_waitq)) != NULL)) {
+		nni_aio_list_remove(old);
+		s->send_parked--;
+		BUMP_STAT(&s->stat_tx_drop, 1);
+		nni_aio_finish_error(old, NNG_EAGAIN);
+	}
+	nni_aio_list_append(&s->send_waitq, aio);
+	s->send_parked++;
+	nni_mtx_unlock(&s->mtx);
+}
+
+static int
+mqtt_pipe_start(void *arg)
+{
+	mqtt_pipe_t *p       = arg;
+	mqtt_sock_t *s       = p->mqtt_sock;
+	mqtt_ctx_t  *c       = NULL;
+	nni_msg *    connmsg = NULL;
+	int          rcv_max;
+	size_t       max_packet;
+	int          i;
+
+	// Whether packets carry properties follows the CONNECT we sent.
+	if ((nni_pipe_getopt(p->pipe, NNG_OPT_MQTT_CONNMSG, &connmsg, NULL,
+	         NNI_TYPE_POINTER) == 0) &&
+	    (connmsg != NULL)) {
+		p->version = nni_mqtt_msg_get_connect_proto_version(connmsg);
+	}
+	// The transport keeps the limits from the server's CONNACK.  The
+	// in-flight window shrinks to the Receive Maximum.
+	if ((nni_pipe_getopt(p->pipe, NNG_OPT_MQTT_RECEIVE_MAX, &rcv_max,
+	         NULL, NNI_TYPE_INT32) == 0) &&
+	    (rcv_max > 0) && (rcv_max <= 0xffff)) {
+		p->rcv_max = (uint16_t) rcv_max;
+	}
+	if ((nni_pipe_getopt(p->pipe, NNG_OPT_MQTT_MAX_PACKET_SIZE,
+	         &max_packet, NULL, NNI_TYPE_SIZE) == 0) &&
+	    (max_packet <= 0xffffffffu)) {
+		p->max_packet = (uint32_t) max_packet;
+	}
+
+	nni_mtx_lock(&s->mtx);
+	nni_mtx_lock(&s->recv_mtx);
+	for (i = 0; i < MQTT_SHARD_MAX; i++) {
+		if (s->shards[i] == NULL) {
+			break;
 		}
-		nni_msg_free(msg);
-		break;
+	}
+	if (i == MQTT_SHARD_MAX) {
+		nni_mtx_unlock(&s->recv_mtx);
+		nni_mtx_unlock(&s->mtx);
+		return (NNG_EBUSY);
+	}
+	p->shard     = i;
+	s->shards[i] = p;
+	if (i >= s->shard_slots) {
+		s->shard_slots = i + 1;
+	}
+	nni_mtx_unlock(&s->recv_mtx);
+	if ((c = nni_list_first(&s->send_queue)) != NULL) {
+		nni_list_remove(&s->send_queue, c);
+		mqtt_send_msg(c->saio, c);
+		nni_sleep_aio(s->retry, &p->time_aio);
+		nni_pipe_recv(p->pipe, &p->recv_aio);
+		return(0);
+	}
+	mqtt_send_waiting(s);
+	nni_mtx_unlock(&s->mtx);
+	//initiate the global resend timer
+	nni_sleep_aio(s->retry, &p->time_aio);
+	nni_pipe_recv(p->pipe, &p->recv_aio);
+	return (0);
+}
+
+static void
+mqtt_pipe_stop(void *arg)
+{
+	mqtt_pipe_t *p = arg;
+	nni_aio_stop(&p->send_aio);
+	nni_aio_stop(&p->recv_aio);
+	nni_aio_stop(&p->time_aio);
+}
+
+void
+mqtt_close_unack_msg_cb(void *key, void *val)
+{
+	NNI_ARG_UNUSED(key);
+
+	nni_msg *            msg = val;
+	nni_mqtt_proto_data *proto_data;
+
+	// A received MQTT 3.1.1 QoS 2 publish may still be undecoded, and
+	// then has no aio waiting on it; don't decode it just to find out.
+	proto_data = nni_msg_get_proto_data(msg);
+	if ((proto_data != NULL) && (proto_data->aio != NULL)) {
+		nni_aio_finish_error(proto_data->aio, NNG_ECLOSED);
+	}
+	nni_msg_free(msg);
+}
+
+static void
+mqtt_pipe_close(void *arg)
+{
+	mqtt_pipe_t *p = arg;
+	mqtt_sock_t *s = p->mqtt_sock;
+
+	// Set first, so that callbacks which take a lock after us see it.
+	nni_atomic_set_bool(&p->closed, true);
+
+	nni_mtx_lock(&s->mtx);
+	nni_mtx_lock(&s->recv_mtx);
+	if ((p->shard >= 0) && (s->shards[p->shard] == p)) {
+		s->shards[p->shard] = NULL;
+	}
+	nni_lmq_flush(&p->recv_messages);
+	s->recv_buffered -= p->recv_bytes;
+	p->recv_bytes = 0;
+	nni_id_map_foreach(&p->recv_unack, mqtt_close_unack_msg_cb);
+	nni_mtx_unlock(&s->recv_mtx);
+	nni_aio_close(&p->send_aio);
+	nni_aio_close(&p->recv_aio);
+	nni_aio_close(&p->time_aio);
+	// Unacknowledged packets stay with the socket for the next pipe.
+	nni_lmq_flush(&p->send_messages);
+	nni_mtx_unlock(&s->mtx);
+}
+
+static size_t
+mqtt_recv_msg_size(nni_msg *msg)
+{
+	return (nni_msg_header_len(msg) + nni_msg_len(msg));
+}
+
+static void
+mqtt_pipe_recv_drop(mqtt_pipe_t *p, nni_msg *msg)
+{
+	BUMP_STAT(&p->stat_rx_drop, 1);
+	BUMP_STAT(&p->stat_rx_drop_bytes, mqtt_recv_msg_size(msg));
+	NNI_ARG_UNUSED(p);
+	nni_msg_free(msg);
+}
+
+// Queues a received message for the application on q, which holds
+// *bytes, applying the receive policy when it is full.  Must be called
+// with the receive lock held.
+static void
+mqtt_pipe_recv_putq(mqtt_pipe_t *p, nni_lmq *q, size_t *bytes, nni_msg *msg)
+{
+	mqtt_sock_t *s    = p->mqtt_sock;
+	size_t       size = mqtt_recv_msg_size(msg);
+	nni_msg *    old;
+
+	if (nni_lmq_len(q) >= (size_t) s->recv_depth) {
+		switch (s->recv_policy) {
+		case NNG_MQTT_RECV_DROP_OLDEST:
+			if (nni_lmq_get(q, &old) == 0) {
+				*bytes -= mqtt_recv_msg_size(old);
+				s->recv_buffered -= mqtt_recv_msg_size(old);
+				mqtt_pipe_recv_drop(p, old);
+			}
+			break;
+		case NNG_MQTT_RECV_GROW:
+			if (*bytes + size > s->recv_budget) {
+				mqtt_pipe_recv_drop(p, msg);
+				return;
+			}
+			break;
+		case NNG_MQTT_RECV_BLOCK:
+			// Keep it, but stop reading once the callback is done.
+			p->recv_full = true;
+			break;
+		default:
+			mqtt_pipe_recv_drop(p, msg);
+			return;
+		}
+	}
+	if (nni_lmq_full(q) &&
+	    (nni_lmq_resize(q, nni_lmq_cap(q) * 2) != 0)) {
+		mqtt_pipe_recv_drop(p, msg);
+		return;
+	}
+	(void) nni_lmq_put(q, msg);
+	*bytes += size;
+	s->recv_buffered += size;
+}
+
+// Receives are only scheduled while the application keeps up.  We stop
+// reading when a queue overflowed under NNG_MQTT_RECV_BLOCK, or when more
+// bytes wait on the queues than the high watermark, and leave it to the
+// kernel socket buffer and the server to hold the rest.  Must be called
+// with the receive lock held, at the end of a receive callback.
+static void
+mqtt_pipe_recv_next(mqtt_pipe_t *p)
+{
+	mqtt_sock_t *s = p->mqtt_sock;
+
+	if (p->recv_full ||
+	    ((s->recv_high > 0) && (s->recv_buffered >= s->recv_high))) {
+		// mqtt_pipe_recv_resume picks up from here
+		p->recv_stopped = true;
+		BUMP_STAT(&p->stat_rx_stalls, 1);
+		return;
+	}
+	nni_pipe_recv(p->pipe, &p->recv_aio);
+}
+
+// Starts reading from the connection again, if it had stopped and the
+// application has caught up, down to the low watermark.  Must be called
+// with the receive lock held.
+static void
+mqtt_pipe_recv_resume(mqtt_pipe_t *p)
+{
+	mqtt_sock_t *s = p->mqtt_sock;
+
+	if (p->recv_stopped && !p->recv_full &&
+	    ((s->recv_high == 0) || (s->recv_buffered <= s->recv_low))) {
+		p->recv_stopped = false;
+		nni_pipe_recv(p->pipe, &p->recv_aio);
+	}
+}
+
+// Lets every connection that stopped for want of room read again, if
+// the application has caught up.  With unblock, those that had a queue
+// overflow under NNG_MQTT_RECV_BLOCK are let go as well.  Must be called
+// with the receive lock held.
+static void
+mqtt_sock_recv_resume(mqtt_sock_t *s, bool unblock)
+{
+	mqtt_pipe_t *p;
+
+	for (int i = 0; i < s->shard_slots; i++) {
+		if ((p = s->shards[i]) != NULL) {
+			if (unblock) {
+				p->recv_full = false;
+			}
+			mqtt_pipe_recv_resume(p);
+		}
+	}
+}
+
+// Takes a queued message off q for the application, and starts reading
+// from the connections again if they had stopped for want of room.  Must
+// be called with the receive lock held.
+static int
+mqtt_sock_recv_getq(mqtt_sock_t *s, nni_lmq *q, size_t *bytes, nni_msg **msgp)
+{
+	int rv;
+
+	if ((rv = nni_lmq_get(q, msgp)) != 0) {
+		return (rv);
+	}
+	*bytes -= mqtt_recv_msg_size(*msgp);
+	s->recv_buffered -= mqtt_recv_msg_size(*msgp);
+	mqtt_sock_recv_resume(s, nni_lmq_len(q) < (size_t) s->recv_depth);
+	return (0);
+}
+
+// Collects the unacknowledged messages whose retransmit deadline has
+// passed, marks them as duplicates and packs as many as fit in one write.
+// Each gets a new deadline with the interval doubled.  Must be called with
+// the socket lock held.
+static nni_msg *
+mqtt_pipe_get_resend_msg(mqtt_pipe_t *p, nni_time now)
+{
+	mqtt_sock_t *s = p->mqtt_sock;
+	mqtt_retry_t r;
+	nni_msg *    msg;
+	nni_msg *    first = NULL;
+	nni_msg *    batch = NULL;
+	size_t       budget;
+	uint8_t      shift;
+
+	budget = s->send_batch > MQTT_RESEND_BATCH ? s->send_batch
+	                                           : MQTT_RESEND_BATCH;
+	while (mqtt_retry_pop_due(p, now, &r)) {
+		if (!mqtt_retry_valid(p, &r)) {
+			continue; // acknowledged in the meantime
+		}
+		msg = r.msg;
+		// A payload lent by the application is never copied into a
+		// batch; such a message goes in a write of its own.
+		if (first != NULL && mqtt_msg_ref_len(msg) > 0) {
+			(void) mqtt_retry_push(p, now, r.pid, r.tries);
+			break;
+		}
+		// A PUBREL goes again as it is.
+		if (r.state == MQTT_UNACK_WAIT_ACK) {
+			mqtt_msg_set_dup(msg, true);
+		}
+		shift = r.tries < MQTT_RETRY_MAX_SHIFT ? r.tries + 1
+		                                       : MQTT_RETRY_MAX_SHIFT;
+		(void) mqtt_retry_push(p, now + ((nni_time) s->retry << shift),
+		    r.pid, r.tries + 1);
+		BUMP_STAT(&s->stat_tx_resend, 1);
+
+		if (first == NULL) {
+			nni_msg_clone(msg);
+			first = msg;
+			if (mqtt_msg_ref_len(msg) > 0) {
+				break;
+			}
+		} else if (batch == NULL) {
+			if (nni_msg_alloc(&batch, 0) != 0) {
+				break;
+			}
+			if ((nni_msg_append(batch, nni_msg_header(first),
+			         nni_msg_header_len(first)) != 0) ||
+			    (nni_msg_append(batch, nni_msg_body(first),
+			         nni_msg_len(first)) != 0)) {
+				nni_msg_free(batch);
+				batch = NULL;
+				break;
+			}
+		}
+		if (batch != NULL &&
+		    ((nni_msg_append(batch, nni_msg_header(msg),
+		          nni_msg_header_len(msg)) != 0) ||
+		        (nni_msg_append(batch, nni_msg_body(msg),
+		            nni_msg_len(msg)) != 0))) {
+			break;
+		}
+		if ((batch != NULL ? nni_msg_len(batch)
+		                   : nni_msg_header_len(first) +
+		                    nni_msg_len(first)) >= budget) {
+			break;
+		}
+	}
+	if (batch != NULL) {
+		nni_msg_free(first);
+		return (batch);
+	}
+	return (first);
+}
+
+// Timer callback, we use it for retransmitting.
+static void
+mqtt_timer_cb(void *arg)
+{
+	mqtt_pipe_t *p = arg;
+	mqtt_sock_t *s = p->mqtt_sock;
+	nni_msg *    msg;
+	nni_time     now;
+	nni_duration wait;
+	int          rv;
+
+	// NNG_ECANCELED asks for the sleep to be recomputed, for example
+	// because the retry interval changed.
+	if ((rv = nni_aio_result(&p->time_aio)) != 0 && rv != NNG_ECANCELED) {
+		return;
+	}
+	nni_mtx_lock(&s->mtx);
+	if (nni_atomic_get_bool(&p->closed)) {
+		nni_mtx_unlock(&s->mtx);
+		return;
+	}
+	now = nni_clock();
+	// When busy, the send callback picks up whatever is due as soon
+	// as the write in progress completes.
+	if (!p->busy && (msg = mqtt_pipe_get_resend_msg(p, now)) != NULL) {
+		p->busy = true;
+		nni_aio_set_msg(&p->send_aio, msg);
+		nni_pipe_send(p->pipe, &p->send_aio);
+	}
+	// Messages sent from now on are due no earlier than a full retry
+	// interval away, so never sleep longer than that.
+	wait = s->retry;
+	if (p->retry_len > 0 && p->retry_heap[0].due > now &&
+	    p->retry_heap[0].due - now < (nni_time) wait) {
+		wait = (nni_duration) (p->retry_heap[0].due - now);
+	}
+	nni_mtx_unlock(&s->mtx);
+	nni_sleep_aio(wait, &p->time_aio);
+}
+
+// Takes the next message off the send queue, encoded and ready for the
+// transport.  When a send batch budget is set, further queued messages
+// are packed behind it into one message so that they go out in a single
+// write; packing stops once the budget is reached.  Must be called with
+// the socket lock held.
+static nni_msg *
+mqtt_pipe_get_send_msg(mqtt_pipe_t *p)
+{
+	mqtt_sock_t *s = p->mqtt_sock;
+	nni_msg *    msg;
+	nni_msg *    next;
+	nni_msg *    batch;
+	size_t       count;
+	size_t       size;
+
+	if (nni_lmq_get(&p->send_messages, &msg) != 0) {
+		return (NULL);
+	}
+	mqtt_pipe_alias_publish(p, msg);
+	// A payload lent by the application is never copied into a batch.
+	if (s->send_batch == 0 || nni_lmq_empty(&p->send_messages) ||
+	    nni_msg_header_len(msg) + nni_msg_len(msg) >= s->send_batch ||
+	    mqtt_msg_ref_len(msg) > 0 ||
+	    mqtt_msg_ref_len(nni_lmq_peek(&p->send_messages)) > 0) {
+		return (msg);
+	}
+	// Room for what will go in, rather than the whole budget.
+	size = nni_msg_header_len(msg) + nni_msg_len(msg);
+	for (size_t i = 0; size < s->send_batch; i++) {
+		if (((next = nni_lmq_peek_at(&p->send_messages, i)) == NULL) ||
+		    (mqtt_msg_ref_len(next) > 0)) {
+			break;
+		}
+		size += nni_msg_header_len(next) + nni_msg_len(next);
+	}
+	if (nni_msg_alloc(&batch, 0) != 0) {
+		return (msg);
+	}
+	if (nni_msg_reserve(batch, size) != 0) {
+		nni_msg_free(batch);
+		return (msg);
+	}
+	count = 0;
+	for (;;) {
+		if ((nni_msg_append(batch, nni_msg_header(msg),
+		         nni_msg_header_len(msg)) != 0) ||
+		    (nni_msg_append(batch, nni_msg_body(msg),
+		         nni_msg_len(msg)) != 0)) {
+			// Out of memory; this one is lost like any other
+			// failed send, QoS copies remain in sent_unack.
+			nni_msg_free(msg);
+			break;
+		}
+		nni_msg_free(msg);
+		count++;
+		if ((nni_msg_len(batch) >= s->send_batch) ||
+		    ((msg = nni_lmq_peek(&p->send_messages)) == NULL) ||
+		    (mqtt_msg_ref_len(msg) > 0)) {
+			break;
+		}
+		(void) nni_lmq_get(&p->send_messages, &msg);
+		mqtt_pipe_alias_publish(p, msg);
+	}
+
+	BUMP_STAT(&s->stat_tx_batches, 1);
+	BUMP_STAT(&s->stat_tx_batch_msgs, count);
+	BUMP_STAT(&s->stat_tx_batch_bytes, nni_msg_len(batch));
+#ifdef NNG_ENABLE_STATS
+	nni_stat_set_value(&s->stat_tx_batch_last, count);
+#endif
+	return (batch);
+}
+
+static void
+mqtt_send_cb(void *arg)
+{
+	mqtt_pipe_t *p = arg;
+	mqtt_sock_t *s = p->mqtt_sock;
+	mqtt_ctx_t  *c = NULL;
+	nni_msg     *msg;
+
+	if (nni_aio_result(&p->send_aio) != 0) {
+		// We failed to send... clean up and deal with it.
+		nni_msg_free(nni_aio_get_msg(&p->send_aio));
+		nni_aio_set_msg(&p->send_aio, NULL);
+		nni_pipe_close(p->pipe);
+		return;
+	}
+	nni_mtx_lock(&s->mtx);
+
+	p->busy = false;
+	if (nni_atomic_get_bool(&s->closed) ||
+	    nni_atomic_get_bool(&p->closed)) {
+		// This occurs if the mqtt_pipe_close has been called.
+		// In that case we don't want any more processing.
+		nni_mtx_unlock(&s->mtx);
+		return;
+	}
+	// Check cached ctx in nni_list first
+	// these ctxs are triggered before the pipe is established
+	if ((c = nni_list_first(&s->send_queue)) != NULL) {
+		nni_list_remove(&s->send_queue, c);
+		mqtt_send_msg(c->saio, c);
+		return;
+	}
+	// Then overdue retransmits and those msg in nni_lmq
+	if ((msg = mqtt_pipe_get_resend_msg(p, nni_clock())) != NULL ||
+	    (msg = mqtt_pipe_get_send_msg(p)) != NULL) {
+		p->busy = true;
+		nni_aio_set_msg(&p->send_aio, msg);
+		nni_pipe_send(p->pipe, &p->send_aio);
+	}
+	// The queue has drained, let parked senders in.
+	mqtt_send_waiting(s);
+	nni_mtx_unlock(&s->mtx);
+	return;
+}
+
+// Hands a message received on p to a context: straight to its waiting
+// aio, or onto its queue as the receive policy allows.  Must be called
+// with the receive lock held.
+static void
+mqtt_ctx_deliver(mqtt_pipe_t *p, mqtt_ctx_t *ctx, nni_msg *msg)
+{
+	mqtt_sock_t *s = ctx->mqtt_sock;
+	nni_aio *    aio;
+
+	if ((aio = ctx->raio) != NULL) {
+		nni_list_remove(&s->recv_queue, ctx);
+		ctx->raio = NULL;
+		nni_aio_set_msg(aio, msg);
+		nni_aio_finish(aio, 0, nni_msg_len(msg));
+	} else {
+		mqtt_pipe_recv_putq(
+		    p, &ctx->recv_messages, &ctx->recv_bytes, msg);
+	}
+}
+
+static void
+mqtt_ctx_match_cb(void *sub, void *arg)
+{
+	mqtt_ctx_t *ctx = sub;
+	nni_msg *   msg = arg;
+
+	// A context with overlapping filters gets the message once.
+	if (ctx->match_gen == ctx->mqtt_sock->match_gen) {
+		return;
+	}
+	ctx->match_gen = ctx->mqtt_sock->match_gen;
+	nni_msg_clone(msg);
+	mqtt_ctx_deliver(ctx->mqtt_sock->recv_pipe, ctx, msg);
+}
+
+// Dispatches a received PUBLISH to the contexts subscribed to its topic.
+// Subscribers share the message.  Publishes nobody subscribed to go to
+// the first waiting context without subscriptions, or are queued on the
+// pipe for one.  Must be called with the receive lock held.
+static void
+mqtt_sock_dispatch(mqtt_sock_t *s, mqtt_pipe_t *p, nni_msg *msg)
+{
+	mqtt_ctx_t *ctx;
+	const char *topic;
+	uint32_t    len;
+
+	if (s->trie != NULL) {
+		topic = nni_mqtt_msg_get_publish_topic(msg, &len);
+		s->match_gen++;
+		s->recv_pipe = p; // for mqtt_ctx_match_cb
+		if (nni_mqtt_trie_match(
+		        s->trie, topic, len, mqtt_ctx_match_cb, msg) > 0) {
+			nni_msg_free(msg);
+			return;
+		}
+	}
+	NNI_LIST_FOREACH (&s->recv_queue, ctx) {
+		if (nni_list_empty(&ctx->subs)) {
+			mqtt_ctx_deliver(p, ctx, msg);
+			return;
+		}
+	}
+	mqtt_pipe_recv_putq(p, &p->recv_messages, &p->recv_bytes, msg);
+}
+
+// Resolves the topic alias of a received PUBLISH.  A topic sent along
+// with an alias sets it up; a publish with only the alias gets its topic
+// put back, so that it reads as if the server had sent it in full.
+// Returns NNG_EPROTO for an alias the server never set up.  Must be called
+// with the receive lock held.
+static int
+mqtt_pipe_alias_recv(mqtt_pipe_t *p, nni_msg *msg)
+{
+	uint16_t    alias = nni_mqtt_msg_get_publish_topic_alias(msg);
+	mqtt_buf *  topic;
+	const char *name;
+	uint32_t    len;
+	uint8_t     tlen[2];
+
+	if (alias == 0) {
+		return (0);
+	}
+	name = nni_mqtt_msg_get_publish_topic(msg, &len);
+	topic = nni_id_get(&p->alias_in, alias);
+	if (len > 0) {
+		if (topic == NULL) {
+			if ((topic = NNI_ALLOC_STRUCT(topic)) == NULL) {
+				return (NNG_ENOMEM);
+			}
+			if (nni_id_set(&p->alias_in, alias, topic) != 0) {
+				NNI_FREE_STRUCT(topic);
+				return (NNG_ENOMEM);
+			}
+		} else {
+			mqtt_buf_free(topic);
+		}
+		return (mqtt_buf_create(topic, (const uint8_t *) name, len) == 0
+		        ? 0
+		        : NNG_ENOMEM);
+	}
+	if ((topic == NULL) || (topic->length == 0)) {
+		return (NNG_EPROTO);
+	}
+	// [0 0] becomes [len][topic]
+	NNI_PUT16(tlen, topic->length);
+	nni_msg_trim(msg, 2);
+	if ((nni_msg_insert(msg, topic->buf, topic->length) != 0) ||
+	    (nni_msg_insert(msg, tlen, 2) != 0)) {
+		return (NNG_ENOMEM);
+	}
+	mqtt_msg_fix_header(msg);
+	if (topic->length > 3) {
+		BUMP_STAT(
+		    &p->mqtt_sock->stat_rx_alias_saved, topic->length - 3);
+	}
+	return (nni_mqtt_msg_decode(msg) == 0 ? 0 : NNG_EPROTO);
+}
+
+static void
+mqtt_recv_cb(void *arg)
+{
+	mqtt_pipe_t *p = arg;
+	mqtt_sock_t *s = p->mqtt_sock;
+	nni_aio * user_aio = NULL;
+	nni_msg * cached_msg = NULL;
+	nni_mtx * mtx;
+
+
+	if (nni_aio_result(&p->recv_aio) != 0) {
+		nni_pipe_close(p->pipe);
+		return;
+	}
+
+	nni_msg *msg = nni_aio_get_msg(&p->recv_aio);
+	nni_aio_set_msg(&p->recv_aio, NULL);
+	nni_msg_set_pipe(msg, nni_pipe_id(p->pipe));
+	// The CONNACK comes decoded by the transport already.  An MQTT 3.1.1
+	// PUBLISH is left undecoded: routing only needs its topic, which is
+	// read from the packet, and the codec decodes it if anything else is
+	// asked for.
+	if (nni_msg_get_proto_data(msg) != NULL) {
+		// nothing to do
+	} else if ((p->version != MQTT_VERSION_5_0) &&
+	    ((((uint8_t *) nni_msg_header(msg))[0] & 0xf0) == 0x30)) {
+		if (nni_mqtt_msg_check_publish(msg) != 0) {
+			nni_msg_free(msg);
+			nni_pipe_close(p->pipe);
+			return;
+		}
+	} else {
+		nni_mqtt_msg_proto_data_alloc(msg);
+		nni_mqtt_msg_set_protocol_version(msg, p->version);
+		nni_mqtt_msg_decode(msg);
+	}
+
+	packet_type_t packet_type = nni_mqtt_msg_get_packet_type(msg);
+	int32_t       packet_id;
+	uint8_t       qos;
+
+	// Publishes only need the receive side; acknowledgements and the
+	// rest are about what we sent.
+	mtx = packet_type == NNG_MQTT_PUBLISH || packet_type == NNG_MQTT_PUBREL
+	    ? &s->recv_mtx
+	    : &s->mtx;
+	nni_mtx_lock(mtx);
+	if (nni_atomic_get_bool(&s->closed) ||
+	    nni_atomic_get_bool(&p->closed)) {
+		//free msg and dont return data when pipe is closed.
+		nni_msg_free(msg);
+		nni_mtx_unlock(mtx);
+		return;
+	}
+
+	// schedule another receive, which waits for this one if it needs
+	// the same lock, so messages are still handled in order.  Publishes
+	// wait to see whether the application keeps up with them.
+	if (mtx != &s->recv_mtx) {
+		nni_pipe_recv(p->pipe, &p->recv_aio);
+	}
+
+	// state transitions
+	switch (packet_type) {
+	case NNG_MQTT_CONNACK:
+		// we have received the CONNACK
+		if ((p->version == MQTT_VERSION_5_0) &&
+		    (p->alias_out == NULL)) {
+			uint16_t max =
+			    nni_mqtt_msg_get_connack_topic_alias_max(msg);
+			if (max > s->alias_max) {
+				max = s->alias_max;
+			}
+			if (max > 0) {
+				// without it we just send topics in full
+				(void) nni_mqtt_alias_init(&p->alias_out, max);
+			}
+		}
+		mqtt_pipe_resume_session(
+		    p, (nni_mqtt_msg_get_connack_flags(msg) & 0x01) != 0);
+		nni_msg_free(msg);
+		mqtt_send_waiting(s);
+		nni_mtx_unlock(mtx);
+		return;
+	case NNG_MQTT_PUBACK:
+		// we have received a PUBACK, successful delivery of a QoS 1
+		// FALLTHROUGH
+	case NNG_MQTT_SUBACK:
+		// we have received a SUBACK, successful subscription
+		// FALLTHROUGH
+	case NNG_MQTT_UNSUBACK:
+		// we have received a UNSUBACK, successful unsubscription
+		// FALLTHROUGH
+	case NNG_MQTT_PUBCOMP:
+		// we have received a PUBCOMP, successful delivery of a QoS 2
+		packet_id = nni_mqtt_msg_get_packet_id(msg);
+		if (packet_id <= 0 || packet_id > 0xffff ||
+		    s->sent_unack[packet_id].state !=
+		        (packet_type == NNG_MQTT_PUBCOMP
+		                ? MQTT_UNACK_WAIT_COMP
+		                : MQTT_UNACK_WAIT_ACK) ||
+		    s->sent_unack[packet_id].pipe != nni_pipe_id(p->pipe)) {
+			// stale or duplicate acknowledgement, or one for
+			// a packet id another connection is using
+			nni_msg_free(msg);
+			break;
+		}
+		user_aio = mqtt_sock_release_packet_id(s, packet_id);
+		if (s->session != NULL) {
+			mqtt_sock_session_remove(s, packet_id);
+		}
+		if (packet_type == NNG_MQTT_SUBACK &&
+		    packet_id == s->sub_batch.pid) {
+			mqtt_sub_batch_ack(s, &s->sub_batch, msg);
+		} else if (packet_type == NNG_MQTT_UNSUBACK &&
+		    packet_id == s->unsub_batch.pid) {
+			mqtt_sub_batch_ack(s, &s->unsub_batch, msg);
+		}
+		nni_msg_free(msg);
+		// the in-flight window has a free slot now
+		mqtt_send_waiting(s);
+		break;
+
+	case NNG_MQTT_PINGRESP:
+		// free msg
+		nni_msg_free(msg);
+		nni_mtx_unlock(mtx);
+		return;
+
+	case NNG_MQTT_PUBREC:
+		// first half of a QoS 2 delivery, answer with PUBREL. A
+		// repeated PUBREC gets the PUBREL again.  One for anything
+		// else we sent is ignored.
+		packet_id = nni_mqtt_msg_get_packet_id(msg);
+		nni_msg_free(msg);
+		if (packet_id > 0 && packet_id <= 0xffff &&
+		    mqtt_unack_wants_pubrec(&s->sent_unack[packet_id]) &&
+		    s->sent_unack[packet_id].pipe == nni_pipe_id(p->pipe)) {
+			mqtt_pipe_send_pubrel(p, packet_id);
+		}
+		break;
+
+	case NNG_MQTT_PUBREL:
+		packet_id = nni_mqtt_msg_get_pubrel_packet_id(msg);
+		cached_msg = nni_id_get(&p->recv_unack, packet_id);
+		nni_msg_free(msg);
+		if (cached_msg == NULL) {
+			// Released already, and the server sent the PUBREL
+			// again as our PUBCOMP did not reach it.
+			BUMP_STAT(&p->stat_rx_stray_pubrel, 1);
+			break;
+		}
+		nni_id_remove(&p->recv_unack, packet_id);
+		mqtt_sock_dispatch(s, p, cached_msg);
+		break;
+
+	case NNG_MQTT_PUBLISH:
+		// we have received a PUBLISH
+		if ((p->version == MQTT_VERSION_5_0) &&
+		    (mqtt_pipe_alias_recv(p, msg) != 0)) {
+			nni_msg_free(msg);
+			nni_mtx_unlock(mtx);
+			nni_pipe_close(p->pipe);
+			return;
+		}
+		qos = nni_mqtt_msg_get_publish_qos(msg);
+		if (2 > qos) {
+			// QoS 0, successful receipt
+			// QoS 1, the transport handled sending a PUBACK
+			mqtt_sock_dispatch(s, p, msg);
+		} else {
+			// QoS 2, held until the PUBREL.  The server sends the
+			// publish again if our PUBREC was lost, and the one
+			// already held is the one to deliver, once.
+			packet_id = nni_mqtt_msg_get_publish_packet_id(msg);
+			if (nni_id_get(&p->recv_unack, packet_id) != NULL) {
+				BUMP_STAT(&p->stat_rx_dup_publish, 1);
+				nni_msg_free(msg);
+			} else if (nni_id_set(&p->recv_unack, packet_id, msg) !=
+			    0) {
+				mqtt_pipe_recv_drop(p, msg);
+			}
+		}
+		break;
+
+	default:
+		// unexpected packet type, server misbehaviour
+		nni_mtx_unlock(mtx);
+		nni_pipe_close(p->pipe);
+		return;
+	}
+
+	if (mtx == &s->recv_mtx) {
+		mqtt_pipe_recv_next(p);
+	}
+	nni_mtx_unlock(mtx);
+	if (user_aio) {
+		nni_aio_finish(user_aio, 0, 0);
+	}
+
+	return;
+}
+
+/******************************************************************************
+ *                           Context Implementation                           *
+ ******************************************************************************/
+
+static void
+mqtt_ctx_init(void *arg, void *sock)
+{
+	mqtt_ctx_t * ctx = arg;
+	mqtt_sock_t *s   = sock;
+
+	ctx->mqtt_sock = s;
+	NNI_LIST_NODE_INIT(&ctx->sqnode);
+	NNI_LIST_NODE_INIT(&ctx->rqnode);
+	NNI_LIST_INIT(&ctx->subs, mqtt_ctx_sub_t, node);
+	nni_lmq_init(&ctx->recv_messages, NNG_MAX_RECV_LMQ);
+	ctx->recv_bytes = 0;
+}
+
+static void
+mqtt_ctx_sub_free(mqtt_ctx_sub_t *sub)
+{
+	nni_strfree(sub->filter);
+	NNI_FREE_STRUCT(sub);
+}
+
+static void
+mqtt_ctx_fini(void *arg)
+{
+	mqtt_ctx_t *    ctx = arg;
+	mqtt_sock_t *   s   = ctx->mqtt_sock;
+	mqtt_ctx_sub_t *sub;
+	nni_aio *       aio;
+
+	nni_mtx_lock(&s->mtx);
+	if (nni_list_active(&s->send_queue, ctx)) {
+		if ((aio = ctx->saio) != NULL) {
+			ctx->saio = NULL;
+			nni_list_remove(&s->send_queue, ctx);
+			nni_aio_finish_error(aio, NNG_ECLOSED);
+		}
+	}
+	nni_mtx_unlock(&s->mtx);
+
+	nni_mtx_lock(&s->recv_mtx);
+	if (nni_list_active(&s->recv_queue, ctx)) {
+		if ((aio = ctx->raio) != NULL) {
+			ctx->raio = NULL;
+			nni_list_remove(&s->recv_queue, ctx);
+			nni_aio_finish_error(aio, NNG_ECLOSED);
+		}
+	}
+	while ((sub = nni_list_first(&ctx->subs)) != NULL) {
+		nni_list_remove(&ctx->subs, sub);
+		(void) nni_mqtt_trie_remove(s->trie, sub->filter, ctx);
+		mqtt_ctx_sub_free(sub);
+	}
+	nni_lmq_fini(&ctx->recv_messages);
+	s->recv_buffered -= ctx->recv_bytes;
+	// connections may have stopped for want of room on our queue
+	mqtt_sock_recv_resume(s, true);
+	nni_mtx_unlock(&s->recv_mtx);
+}
+
+static void
+mqtt_ctx_send(void *arg, nni_aio *aio)
+{
+	mqtt_ctx_t * ctx = arg;
+	mqtt_sock_t *s   = ctx->mqtt_sock;
+	mqtt_pipe_t *p;
+	nni_msg *    msg;
+
+	if (nni_aio_begin(aio) != 0) {
+		return;
+	}
+
+	nni_mtx_lock(&s->mtx);
+	p = mqtt_sock_shard(s, 0);
+
+	if (nni_atomic_get_bool(&s->closed)) {
+		nni_mtx_unlock(&s->mtx);
+		nni_aio_finish_error(aio, NNG_ECLOSED);
+		return;
+	}
+
+	msg   = nni_aio_get_msg(aio);
+	if (msg == NULL) {
+		nni_mtx_unlock(&s->mtx);
+		nni_aio_set_msg(aio, NULL);
+		nni_aio_finish_error(aio, NNG_EPROTO);
+		return;
+	}
+	switch (nni_mqtt_msg_get_packet_type(msg)) {
+	case NNG_MQTT_SUBSCRIBE:
+		mqtt_sub_batch_add(s, &s->sub_batch, aio);
+		return;
+	case NNG_MQTT_UNSUBSCRIBE:
+		mqtt_sub_batch_add(s, &s->unsub_batch, aio);
+		return;
+	default:
+		break;
+	}
+	if (p == NULL) {
+		// connection is not established yet
+		// cache ctx
+		ctx->saio = aio;
+		nni_list_append(&s->send_queue, ctx);
+		nni_mtx_unlock(&s->mtx);
+		return;
+	}
+	mqtt_send_msg(aio, ctx);
+	return;
+}
+
+static void
+mqtt_ctx_cancel_recv(nni_aio *aio, void *arg, int rv)
+{
+	mqtt_ctx_t * ctx = arg;
+	mqtt_sock_t *s   = ctx->mqtt_sock;
+
+	nni_mtx_lock(&s->recv_mtx);
+	if (ctx->raio == aio) {
+		ctx->raio = NULL;
+		nni_list_remove(&s->recv_queue, ctx);
+		nni_aio_finish_error(aio, rv);
+	}
+	nni_mtx_unlock(&s->recv_mtx);
+}
+
+static void
+mqtt_ctx_recv(void *arg, nni_aio *aio)
+{
+	mqtt_ctx_t * ctx = arg;
+	mqtt_sock_t *s   = ctx->mqtt_sock;
+	mqtt_pipe_t *p;
+	nni_msg     *msg = NULL;
+	int          rv;
+
+	if (nni_aio_begin(aio) != 0) {
+		return;
+	}
+
+	nni_mtx_lock(&s->recv_mtx);
+	if (mqtt_sock_recv_getq(
+	        s, &ctx->recv_messages, &ctx->recv_bytes, &msg) == 0) {
+		// matched by one of our subscriptions
+		nni_aio_set_msg(aio, msg);
+		nni_mtx_unlock(&s->recv_mtx);
+		nni_aio_finish(aio, 0, nni_msg_len(msg));
+		return;
+	}
+	if (nni_atomic_get_bool(&s->closed)) {
+		nni_mtx_unlock(&s->recv_mtx);
+		nni_aio_finish_error(aio, NNG_ECLOSED);
+		return;
+	}
+
+	// Subscribers only get what their filters match.  The others take
+	// from the queues of the connections in turn.
+	for (int i = 0; nni_list_empty(&ctx->subs) && i < s->shard_slots;
+	     i++) {
+		p = s->shards[(s->recv_next + i) % s->shard_slots];
+		if ((p == NULL) ||
+		    (mqtt_sock_recv_getq(
+		         s, &p->recv_messages, &p->recv_bytes, &msg) != 0)) {
+			continue;
+		}
+		s->recv_next = (uint32_t) p->shard + 1;
+		nni_aio_set_msg(aio, msg);
+		nni_mtx_unlock(&s->recv_mtx);
+		//let user gets a quick reply
+		nni_aio_finish(aio, 0, nni_msg_len(msg));
+		return;
+	}
+
+	// no open pipe or msg wating
+	if (ctx->raio != NULL) {
+		nni_mtx_unlock(&s->recv_mtx);
+		// nni_println("ERROR! former aio not finished!");
+		nni_aio_finish_error(aio, NNG_ESTATE);
+		return;
+	}
+	if ((rv = nni_aio_schedule(aio, mqtt_ctx_cancel_recv, ctx)) != 0) {
+		nni_mtx_unlock(&s->recv_mtx);
+		nni_aio_finish_error(aio, rv);
+		return;
+	}
+	ctx->raio = aio;
+	nni_list_append(&s->recv_queue, ctx);
+	nni_mtx_unlock(&s->recv_mtx);
+	return;
+}
+
+static nni_proto_pipe_ops mqtt_pipe_ops = {
+	.pipe_size  = sizeof(mqtt_pipe_t),
+	.pipe_init  = mqtt_pipe_init,
+	.pipe_fini  = mqtt_pipe_fini,
+	.pipe_start = mqtt_pipe_start,
+	.pipe_close = mqtt_pipe_close,
+	.pipe_stop  = mqtt_pipe_stop,
+};
+
+static int
+mqtt_ctx_set_subscribe(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_ctx_t *    ctx = arg;
+	mqtt_sock_t *   s   = ctx->mqtt_sock;
+	mqtt_ctx_sub_t *sub;
+	int             rv;
+
+	if ((rv = nni_copyin_str(NULL, buf, sz, 0x10000, t)) != 0) {
+		return (rv);
+	}
+	if (!nni_mqtt_topic_filter_valid(buf)) {
+		return (NNG_EINVAL);
+	}
+	nni_mtx_lock(&s->recv_mtx);
+	NNI_LIST_FOREACH (&ctx->subs, sub) {
+		if (strcmp(sub->filter, buf) == 0) {
+			nni_mtx_unlock(&s->recv_mtx);
+			return (0);
+		}
+	}
+	if (((sub = NNI_ALLOC_STRUCT(sub)) == NULL) ||
+	    ((sub->filter = nni_strdup(buf)) == NULL)) {
+		nni_mtx_unlock(&s->recv_mtx);
+		if (sub != NULL) {
+			NNI_FREE_STRUCT(sub);
+		}
+		return (NNG_ENOMEM);
+	}
+	if (((s->trie == NULL) && ((rv = nni_mqtt_trie_init(&s->trie)) != 0)) ||
+	    ((rv = nni_mqtt_trie_insert(s->trie, sub->filter, ctx)) != 0)) {
+		nni_mtx_unlock(&s->recv_mtx);
+		mqtt_ctx_sub_free(sub);
+		return (rv);
+	}
+	NNI_LIST_NODE_INIT(&sub->node);
+	nni_list_append(&ctx->subs, sub);
+	nni_mtx_unlock(&s->recv_mtx);
+	return (0);
+}
+
+static int
+mqtt_ctx_set_unsubscribe(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_ctx_t *    ctx = arg;
+	mqtt_sock_t *   s   = ctx->mqtt_sock;
+	mqtt_ctx_sub_t *sub;
+	int             rv;
+
+	if ((rv = nni_copyin_str(NULL, buf, sz, 0x10000, t)) != 0) {
+		return (rv);
+	}
+	nni_mtx_lock(&s->recv_mtx);
+	NNI_LIST_FOREACH (&ctx->subs, sub) {
+		if (strcmp(sub->filter, buf) == 0) {
+			break;
+		}
+	}
+	if (sub == NULL) {
+		nni_mtx_unlock(&s->recv_mtx);
+		return (NNG_ENOENT);
+	}
+	nni_list_remove(&ctx->subs, sub);
+	(void) nni_mqtt_trie_remove(s->trie, sub->filter, ctx);
+	nni_mtx_unlock(&s->recv_mtx);
+	mqtt_ctx_sub_free(sub);
+	return (0);
+}
+
+static nni_option mqtt_ctx_options[] = {
+	{
+	    .o_name = NNG_OPT_MQTT_CTX_SUBSCRIBE,
+	    .o_set  = mqtt_ctx_set_subscribe,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_CTX_UNSUBSCRIBE,
+	    .o_set  = mqtt_ctx_set_unsubscribe,
+	},
+	{
+	    .o_name = NULL,
+	},
+};
+
+static nni_proto_ctx_ops mqtt_ctx_ops = {
+	.ctx_size    = sizeof(mqtt_ctx_t),
+	.ctx_init    = mqtt_ctx_init,
+	.ctx_fini    = mqtt_ctx_fini,
+	.ctx_recv    = mqtt_ctx_recv,
+	.ctx_send    = mqtt_ctx_send,
+	.ctx_options = mqtt_ctx_options,
+};
+
+static int
+mqtt_sock_set_send_batch(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	size_t       val;
+	int          rv;
+
+	if ((rv = nni_copyin_size(&val, buf, sz, 0, NNI_MAXSZ, t)) == 0) {
+		nni_mtx_lock(&s->mtx);
+		s->send_batch = val;
+		nni_mtx_unlock(&s->mtx);
+	}
+	return (rv);
+}
+
+static int
+mqtt_sock_get_send_batch(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	size_t       val;
+
+	nni_mtx_lock(&s->mtx);
+	val = s->send_batch;
+	nni_mtx_unlock(&s->mtx);
+	return (nni_copyout_size(val, buf, szp, t));
+}
+
+static int
+mqtt_sock_set_send_policy(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
+	int          rv;
+
+	if ((rv = nni_copyin_int(&val, buf, sz, NNG_MQTT_SEND_DROP_OLDEST,
+	         NNG_MQTT_SEND_BLOCK, t)) == 0) {
+		nni_mtx_lock(&s->mtx);
+		s->send_policy = val;
+		nni_mtx_unlock(&s->mtx);
+	}
+	return (rv);
+}
+
+static int
+mqtt_sock_get_send_policy(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
+
+	nni_mtx_lock(&s->mtx);
+	val = s->send_policy;
+	nni_mtx_unlock(&s->mtx);
+	return (nni_copyout_int(val, buf, szp, t));
+}
+
+static int
+mqtt_sock_set_shard_policy(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
+	int          rv;
+
+	if ((rv = nni_copyin_int(&val, buf, sz, NNG_MQTT_SHARD_TOPIC,
+	         NNG_MQTT_SHARD_ROUND_ROBIN, t)) == 0) {
+		nni_mtx_lock(&s->mtx);
+		s->shard_policy = val;
+		nni_mtx_unlock(&s->mtx);
+	}
+	return (rv);
+}
+
+static int
+mqtt_sock_get_shard_policy(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
+
+	nni_mtx_lock(&s->mtx);
+	val = s->shard_policy;
+	nni_mtx_unlock(&s->mtx);
+	return (nni_copyout_int(val, buf, szp, t));
+}
+
+static int
+mqtt_sock_set_recv_queue(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
+	int          rv;
+
+	if ((rv = nni_copyin_int(&val, buf, sz, 1, 1 << 24, t)) == 0) {
+		nni_mtx_lock(&s->recv_mtx);
+		s->recv_depth = val;
+		nni_mtx_unlock(&s->recv_mtx);
+	}
+	return (rv);
+}
+
+static int
+mqtt_sock_get_recv_queue(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
+
+	nni_mtx_lock(&s->recv_mtx);
+	val = s->recv_depth;
+	nni_mtx_unlock(&s->recv_mtx);
+	return (nni_copyout_int(val, buf, szp, t));
+}
+
+static int
+mqtt_sock_set_recv_policy(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
+	int          rv;
+
+	if ((rv = nni_copyin_int(&val, buf, sz, NNG_MQTT_RECV_DROP_OLDEST,
+	         NNG_MQTT_RECV_GROW, t)) == 0) {
+		nni_mtx_lock(&s->recv_mtx);
+		s->recv_policy = val;
+		if (val != NNG_MQTT_RECV_BLOCK) {
+			mqtt_sock_recv_resume(s, true);
+		}
+		nni_mtx_unlock(&s->recv_mtx);
+	}
+	return (rv);
+}
+
+static int
+mqtt_sock_get_recv_policy(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
+
+	nni_mtx_lock(&s->recv_mtx);
+	val = s->recv_policy;
+	nni_mtx_unlock(&s->recv_mtx);
+	return (nni_copyout_int(val, buf, szp, t));
+}
+
+static int
+mqtt_sock_set_recv_budget(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	size_t       val;
+	int          rv;
+
+	if ((rv = nni_copyin_size(&val, buf, sz, 0, NNI_MAXSZ, t)) == 0) {
+		nni_mtx_lock(&s->recv_mtx);
+		s->recv_budget = val;
+		nni_mtx_unlock(&s->recv_mtx);
+	}
+	return (rv);
+}
+
+static int
+mqtt_sock_get_recv_budget(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	size_t       val;
+
+	nni_mtx_lock(&s->recv_mtx);
+	val = s->recv_budget;
+	nni_mtx_unlock(&s->recv_mtx);
+	return (nni_copyout_size(val, buf, szp, t));
+}
+
+static int
+mqtt_sock_set_recv_water(mqtt_sock_t *s, size_t *water, const void *buf,
+    size_t sz, nni_type t)
+{
+	size_t val;
+	int    rv;
+
+	if ((rv = nni_copyin_size(&val, buf, sz, 0, NNI_MAXSZ, t)) == 0) {
+		nni_mtx_lock(&s->recv_mtx);
+		*water = val;
+		mqtt_sock_recv_resume(s, false);
+		nni_mtx_unlock(&s->recv_mtx);
+	}
+	return (rv);
+}
+
+static int
+mqtt_sock_get_recv_water(
+    mqtt_sock_t *s, size_t *water, void *buf, size_t *szp, nni_type t)
+{
+	size_t val;
+
+	nni_mtx_lock(&s->recv_mtx);
+	val = *water;
+	nni_mtx_unlock(&s->recv_mtx);
+	return (nni_copyout_size(val, buf, szp, t));
+}
+
+static int
+mqtt_sock_set_recv_high(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+
+	return (mqtt_sock_set_recv_water(s, &s->recv_high, buf, sz, t));
+}
 
-	case NNG_MQTT_PINGRESP:
-		// free msg
-		nni_msg_free(msg);
-		nni_mtx_unlock(&s->mtx);
-		return;
+static int
+mqtt_sock_get_recv_high(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
 
-	case NNG_MQTT_PUBREC:
-		nni_msg_free(msg);
-		break;
+	return (mqtt_sock_get_recv_water(s, &s->recv_high, buf, szp, t));
+}
 
-	case NNG_MQTT_PUBREL:
-		packet_id = nni_mqtt_msg_get_pubrel_packet_id(msg);
-		cached_msg = nni_id_get(&p->recv_unack, packet_id);
-		nni_msg_free(msg);
-		if (cached_msg == NULL) {
-			nni_plat_printf("ERROR! packet id %d not found\n", packet_id);
-			break;
-		}
-		nni_id_remove(&p->recv_unack, packet_id);
+static int
+mqtt_sock_set_recv_low(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
 
-		if ((ctx = nni_list_first(&s->recv_queue)) == NULL) {
-			// No one waiting to receive yet, putting msg
-			// into lmq
-			mqtt_pipe_recv_msgq_putq(p, cached_msg);
-			nni_mtx_unlock(&s->mtx);
-			// nni_println("ERROR: no ctx found!! create more ctxs!");
-			return;
-		}
-		nni_list_remove(&s->recv_queue, ctx);
-		user_aio  = ctx->raio;
-		ctx->raio = NULL;
-		nni_aio_set_msg(user_aio, cached_msg);
-		nni_mtx_unlock(&s->mtx);
-		nni_aio_finish(user_aio, 0, 0);
-		return;
+	return (mqtt_sock_set_recv_water(s, &s->recv_low, buf, sz, t));
+}
 
-	case NNG_MQTT_PUBLISH:
-		// we have received a PUBLISH
-		qos = nni_mqtt_msg_get_publish_qos(msg);
-		if (2 > qos) {
-			// QoS 0, successful receipt
-			// QoS 1, the transport handled sending a PUBACK
-			if ((ctx = nni_list_first(&s->recv_queue)) == NULL) {
-				// No one waiting to receive yet, putting msg
-				// into lmq
-				mqtt_pipe_recv_msgq_putq(p, msg);
-				nni_mtx_unlock(&s->mtx);
-				// nni_println("ERROR: no ctx found!! create more ctxs!");
-				return;
-			}
-			nni_list_remove(&s->recv_queue, ctx);
-			user_aio = ctx->raio;
-			ctx->raio = NULL;
-			nni_aio_set_msg(user_aio, msg);
-			nni_mtx_unlock(&s->mtx);
-			nni_aio_finish(user_aio, 0, 0);
-			return;
-		} else {
-			//TODO check if this packetid already there
-			packet_id = nni_mqtt_msg_get_publish_packet_id(msg);
-			if ((cached_msg = nni_id_get(
-				         &p->recv_unack, packet_id)) != NULL) {
-					// packetid already exists.
-					// sth wrong with the broker
-					// replace old with new
-					nni_plat_printf(
-					    "ERROR: packet id %d duplicates in", packet_id);
-					nni_msg_free(cached_msg);
-					// nni_id_remove(&pipe->nano_qos_db,
-					// pid);
-				}
-			nni_id_set(&p->recv_unack, packet_id, msg);
-		}
-		break;
+static int
+mqtt_sock_get_recv_low(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
 
-	default:
-		// unexpected packet type, server misbehaviour
+	return (mqtt_sock_get_recv_water(s, &s->recv_low, buf, szp, t));
+}
+
+static int
+mqtt_sock_set_send_window(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
+	int          rv;
+
+	if ((rv = nni_copyin_int(&val, buf, sz, 1, 0xffff, t)) == 0) {
+		nni_mtx_lock(&s->mtx);
+		s->send_window = (uint16_t) val;
+		// a larger window may let parked senders go
+		mqtt_send_waiting(s);
 		nni_mtx_unlock(&s->mtx);
-		nni_pipe_close(p->pipe);
-		return;
 	}
+	return (rv);
+}
 
-	nni_mtx_unlock(&s->mtx);
-	if (user_aio) {
-		nni_aio_finish(user_aio, 0, 0);
-	}
+static int
+mqtt_sock_get_send_window(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
 
-	return;
+	nni_mtx_lock(&s->mtx);
+	val = s->send_window;
+	nni_mtx_unlock(&s->mtx);
+	return (nni_copyout_int(val, buf, szp, t));
 }
 
-/******************************************************************************
- *                           Context Implementation                           *
- ******************************************************************************/
+static int
+mqtt_sock_set_alias_max(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	int          val;
+	int          rv;
 
-static void
-mqtt_ctx_init(void *arg, void *sock)
+	if ((rv = nni_copyin_int(&val, buf, sz, 0, 0xffff, t)) == 0) {
+		nni_mtx_lock(&s->mtx);
+		s->alias_max = (uint16_t) val;
+		nni_mtx_unlock(&s->mtx);
+	}
+	return (rv);
+}
+
+static int
+mqtt_sock_get_alias_max(void *arg, void *buf, size_t *szp, nni_type t)
 {
-	mqtt_ctx_t * ctx = arg;
-	mqtt_sock_t *s   = sock;
+	mqtt_sock_t *s = arg;
+	int          val;
 
-	ctx->mqtt_sock = s;
-	NNI_LIST_NODE_INIT(&ctx->sqnode);
-	NNI_LIST_NODE_INIT(&ctx->rqnode);
+	nni_mtx_lock(&s->mtx);
+	val = s->alias_max;
+	nni_mtx_unlock(&s->mtx);
+	return (nni_copyout_int(val, buf, szp, t));
 }
 
-static void
-mqtt_ctx_fini(void *arg)
+// The server's limits apply to the connection only, and these report
+// those of the first; without one they read as the protocol defaults.
+static int
+mqtt_sock_get_receive_max(void *arg, void *buf, size_t *szp, nni_type t)
 {
-	mqtt_ctx_t * ctx = arg;
-	mqtt_sock_t *s   = ctx->mqtt_sock;
-	nni_aio *  aio;
+	mqtt_sock_t *s   = arg;
+	mqtt_pipe_t *p;
+	int          val = 0xffff;
 
 	nni_mtx_lock(&s->mtx);
-	if (nni_list_active(&s->send_queue, ctx)) {
-		if ((aio = ctx->saio) != NULL) {
-			ctx->saio = NULL;
-			nni_list_remove(&s->send_queue, ctx);
-			nni_aio_finish_error(aio, NNG_ECLOSED);
-		}
-	} else if (nni_list_active(&s->send_queue, ctx)) {
-		if ((aio = ctx->raio) != NULL) {
-			ctx->raio = NULL;
-			nni_list_remove(&s->recv_queue, ctx);
-			nni_aio_finish_error(aio, NNG_ECLOSED);
-		}
+	if ((p = mqtt_sock_shard(s, 0)) != NULL) {
+		val = p->rcv_max;
 	}
 	nni_mtx_unlock(&s->mtx);
+	return (nni_copyout_int(val, buf, szp, t));
 }
 
-static void
-mqtt_ctx_send(void *arg, nni_aio *aio)
+static int
+mqtt_sock_get_max_packet(void *arg, void *buf, size_t *szp, nni_type t)
 {
-	mqtt_ctx_t * ctx = arg;
-	mqtt_sock_t *s   = ctx->mqtt_sock;
-	mqtt_pipe_t *p   = s->mqtt_pipe;
-	nni_msg *    msg;
+	mqtt_sock_t *s   = arg;
+	mqtt_pipe_t *p;
+	size_t       val = 0;
 
-	if (nni_aio_begin(aio) != 0) {
-		return;
+	nni_mtx_lock(&s->mtx);
+	if ((p = mqtt_sock_shard(s, 0)) != NULL) {
+		val = p->max_packet;
 	}
+	nni_mtx_unlock(&s->mtx);
+	return (nni_copyout_size(val, buf, szp, t));
+}
 
-	nni_mtx_lock(&s->mtx);
+static int
+mqtt_sock_set_retry_interval(
+    void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	nni_duration val;
+	int          rv;
 
-	if (nni_atomic_get_bool(&s->closed)) {
-		nni_mtx_unlock(&s->mtx);
-		nni_aio_finish_error(aio, NNG_ECLOSED);
-		return;
+	if ((rv = nni_copyin_ms(&val, buf, sz, t)) != 0) {
+		return (rv);
 	}
-
-	msg   = nni_aio_get_msg(aio);
-	if (msg == NULL) {
-		nni_mtx_unlock(&s->mtx);
-		nni_aio_set_msg(aio, NULL);
-		nni_aio_finish_error(aio, NNG_EPROTO);
+	if (val <= 0) {
+		return (NNG_EINVAL);
 	}
-	if (p == NULL) {
-		// connection is not established yet
-		// cache ctx
-		ctx->saio = aio;
-		ctx->raio = NULL;
-		nni_list_append(&s->send_queue, ctx);
-		nni_mtx_unlock(&s->mtx);
-		return;
+	nni_mtx_lock(&s->mtx);
+	s->retry = val;
+	for (int i = 0; i < s->shard_slots; i++) {
+		if (s->shards[i] != NULL) {
+			nni_aio_abort(&s->shards[i]->time_aio, NNG_ECANCELED);
+		}
 	}
-	mqtt_send_msg(aio, ctx);
-	nni_aio_set_msg(aio, NULL);
-	return;
+	nni_mtx_unlock(&s->mtx);
+	return (0);
 }
 
-static void
-mqtt_ctx_recv(void *arg, nni_aio *aio)
+static int
+mqtt_sock_set_session_file(void *arg, const void *buf, size_t sz, nni_type t)
 {
-	mqtt_ctx_t * ctx = arg;
-	mqtt_sock_t *s   = ctx->mqtt_sock;
-	mqtt_pipe_t *p   = s->mqtt_pipe;
-	nni_msg     *msg = NULL;
+	mqtt_sock_t *     s = arg;
+	nni_mqtt_session *sess;
+	int               rv;
 
-	if (nni_aio_begin(aio) != 0) {
-		return;
+	if ((rv = nni_copyin_str(NULL, buf, sz, NNG_MAXADDRLEN, t)) != 0) {
+		return (rv);
+	}
+	if ((rv = nni_mqtt_session_open(&sess, buf)) != 0) {
+		return (rv);
 	}
-
 	nni_mtx_lock(&s->mtx);
-	if ( p == NULL ) {
-		goto wait;
-	} 
-	if (nni_atomic_get_bool(&s->closed) || nni_atomic_get_bool(&p->closed)) {
+	if (s->session != NULL || mqtt_sock_shard(s, 0) != NULL ||
+	    s->sent_count != 0) {
+		// too late, or already set
 		nni_mtx_unlock(&s->mtx);
-		nni_aio_finish_error(aio, NNG_ECLOSED);
-		return;
+		nni_mqtt_session_close(sess);
+		return (NNG_EBUSY);
 	}
+	nni_mqtt_session_set_sync(sess, s->session_sync);
+	s->session = sess;
+	mqtt_sock_load_session(s);
+	nni_mtx_unlock(&s->mtx);
+	return (0);
+}
 
-	if (nni_lmq_get(&p->recv_messages, &msg) == 0) {
-		nni_aio_set_msg(aio, msg);
-		nni_mtx_unlock(&s->mtx);
-		//let user gets a quick reply
-		nni_aio_finish(aio, 0, nni_msg_len(msg));
-		return;
-	}
+static int
+mqtt_sock_set_session_sync(void *arg, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	bool         val;
+	int          rv;
 
-	// no open pipe or msg wating
-wait:
-	if (ctx->raio != NULL) {
-		nni_mtx_unlock(&s->mtx);
-		// nni_println("ERROR! former aio not finished!");
-		nni_aio_finish_error(aio, NNG_ESTATE);
-		return;
+	if ((rv = nni_copyin_bool(&val, buf, sz, t)) != 0) {
+		return (rv);
+	}
+	nni_mtx_lock(&s->mtx);
+	s->session_sync = val;
+	if (s->session != NULL) {
+		nni_mqtt_session_set_sync(s->session, val);
 	}
-	ctx->raio = aio;
-	ctx->saio = NULL;
-	nni_list_append(&s->recv_queue, ctx);
 	nni_mtx_unlock(&s->mtx);
-	return;
+	return (0);
 }
 
-static nni_proto_pipe_ops mqtt_pipe_ops = {
-	.pipe_size  = sizeof(mqtt_pipe_t),
-	.pipe_init  = mqtt_pipe_init,
-	.pipe_fini  = mqtt_pipe_fini,
-	.pipe_start = mqtt_pipe_start,
-	.pipe_close = mqtt_pipe_close,
-	.pipe_stop  = mqtt_pipe_stop,
-};
+static int
+mqtt_sock_get_session_sync(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	bool         val;
 
-static nni_option mqtt_ctx_options[] = {
-	{
-	    .o_name = NULL,
-	},
-};
+	nni_mtx_lock(&s->mtx);
+	val = s->session_sync;
+	nni_mtx_unlock(&s->mtx);
+	return (nni_copyout_bool(val, buf, szp, t));
+}
 
-static nni_proto_ctx_ops mqtt_ctx_ops = {
-	.ctx_size    = sizeof(mqtt_ctx_t),
-	.ctx_init    = mqtt_ctx_init,
-	.ctx_fini    = mqtt_ctx_fini,
-	.ctx_recv    = mqtt_ctx_recv,
-	.ctx_send    = mqtt_ctx_send,
-	.ctx_options = mqtt_ctx_options,
-};
+static int
+mqtt_sock_get_retry_interval(void *arg, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_sock_t *s = arg;
+	nni_duration val;
+
+	nni_mtx_lock(&s->mtx);
+	val = s->retry;
+	nni_mtx_unlock(&s->mtx);
+	return (nni_copyout_ms(val, buf, szp, t));
+}
 
 static nni_option mqtt_sock_options[] = {
+	{
+	    .o_name = NNG_OPT_MQTT_RETRY_INTERVAL,
+	    .o_get  = mqtt_sock_get_retry_interval,
+	    .o_set  = mqtt_sock_set_retry_interval,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_SEND_POLICY,
+	    .o_get  = mqtt_sock_get_send_policy,
+	    .o_set  = mqtt_sock_set_send_policy,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_SHARD_POLICY,
+	    .o_get  = mqtt_sock_get_shard_policy,
+	    .o_set  = mqtt_sock_set_shard_policy,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_RECV_QUEUE,
+	    .o_get  = mqtt_sock_get_recv_queue,
+	    .o_set  = mqtt_sock_set_recv_queue,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_RECV_POLICY,
+	    .o_get  = mqtt_sock_get_recv_policy,
+	    .o_set  = mqtt_sock_set_recv_policy,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_RECV_BUDGET,
+	    .o_get  = mqtt_sock_get_recv_budget,
+	    .o_set  = mqtt_sock_set_recv_budget,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_RECV_HIGH_WATER,
+	    .o_get  = mqtt_sock_get_recv_high,
+	    .o_set  = mqtt_sock_set_recv_high,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_RECV_LOW_WATER,
+	    .o_get  = mqtt_sock_get_recv_low,
+	    .o_set  = mqtt_sock_set_recv_low,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_SEND_WINDOW,
+	    .o_get  = mqtt_sock_get_send_window,
+	    .o_set  = mqtt_sock_set_send_window,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_SEND_BATCH,
+	    .o_get  = mqtt_sock_get_send_batch,
+	    .o_set  = mqtt_sock_set_send_batch,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_SESSION_FILE,
+	    .o_set  = mqtt_sock_set_session_file,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_SESSION_SYNC,
+	    .o_get  = mqtt_sock_get_session_sync,
+	    .o_set  = mqtt_sock_set_session_sync,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_TOPIC_ALIAS_MAX,
+	    .o_get  = mqtt_sock_get_alias_max,
+	    .o_set  = mqtt_sock_set_alias_max,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_RECEIVE_MAX,
+	    .o_get  = mqtt_sock_get_receive_max,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_MAX_PACKET_SIZE,
+	    .o_get  = mqtt_sock_get_max_packet,
+	},
 	// terminate list
 	{
 	    .o_name = NULL,
@@ -832,3 +3364,15 @@ nng_mqtt_client_open(nng_socket *sock)
 {
 	return (nni_proto_open(sock, &mqtt_proto));
 }
+
+int
+nng_mqtt_ctx_subscribe(nng_ctx *ctx, const char *topic, nng_aio *aio, ...)
+{
+	int rv;
+
+	rv = nng_ctx_set_string(*ctx, NNG_OPT_MQTT_CTX_SUBSCRIBE, topic);
+	if (aio != NULL && nni_aio_begin(aio) == 0) {
+		nni_aio_finish(aio, rv, 0);
+	}
+	return (rv);
+}
@@ -0,0 +1,2031 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include <nng/mqtt/mqtt_client.h>
+#include <nng/nng.h>
+
+#include "core/nng_impl.h"
+#include "supplemental/mqtt/mqtt_msg.h"
+#include "nuts.h"
+
+// These tests run the client against a very small scripted broker,
+// which is just a raw TCP stream that the test reads and writes MQTT
+// packets on directly.
+
+typedef struct {
+	nng_stream_listener *l;
+	nng_stream *         s;
+	nng_aio *            aio;
+	char                 url[64];
+} test_broker;
+
+static void
+broker_start(test_broker *b)
+{
+	char     addr[64];
+	uint16_t port = nuts_next_port();
+
+	(void) snprintf(addr, sizeof(addr), "tcp://127.0.0.1:%u", port);
+	(void) snprintf(b->url, sizeof(b->url), "mqtt-tcp://127.0.0.1:%u", port);
+	b->s = NULL;
+	NUTS_PASS(nng_aio_alloc(&b->aio, NULL, NULL));
+	nng_aio_set_timeout(b->aio, 5000);
+	NUTS_PASS(nng_stream_listener_alloc(&b->l, addr));
+	NUTS_PASS(nng_stream_listener_listen(b->l));
+}
+
+// The same broker behind a WebSocket, as the MQTT servers that are only
+// reachable through HTTP proxies are.
+static void
+broker_start_ws(test_broker *b)
+{
+	char     addr[64];
+	uint16_t port = nuts_next_port();
+
+	(void) snprintf(addr, sizeof(addr), "ws://127.0.0.1:%u/mqtt", port);
+	(void) snprintf(
+	    b->url, sizeof(b->url), "mqtt-ws://127.0.0.1:%u/mqtt", port);
+	b->s = NULL;
+	NUTS_PASS(nng_aio_alloc(&b->aio, NULL, NULL));
+	nng_aio_set_timeout(b->aio, 5000);
+	NUTS_PASS(nng_stream_listener_alloc(&b->l, addr));
+	NUTS_PASS(
+	    nng_stream_listener_set_string(b->l, NNG_OPT_WS_PROTOCOL, "mqtt"));
+	NUTS_PASS(nng_stream_listener_listen(b->l));
+}
+
+static void
+broker_stop(test_broker *b)
+{
+	if (b->s != NULL) {
+		nng_stream_free(b->s);
+	}
+	nng_stream_listener_free(b->l);
+	nng_aio_free(b->aio);
+}
+
+static int
+broker_xfer(test_broker *b, void *buf, size_t len, bool send)
+{
+	uint8_t *ptr = buf;
+	nng_iov  iov;
+	int      rv;
+
+	while (len > 0) {
+		iov.iov_buf = ptr;
+		iov.iov_len = len;
+		NUTS_PASS(nng_aio_set_iov(b->aio, 1, &iov));
+		if (send) {
+			nng_stream_send(b->s, b->aio);
+		} else {
+			nng_stream_recv(b->s, b->aio);
+		}
+		nng_aio_wait(b->aio);
+		if ((rv = nng_aio_result(b->aio)) != 0) {
+			return (rv);
+		}
+		ptr += nng_aio_count(b->aio);
+		len -= nng_aio_count(b->aio);
+	}
+	return (0);
+}
+
+static int
+broker_send(test_broker *b, const void *buf, size_t len)
+{
+	return (broker_xfer(b, (void *) buf, len, true));
+}
+
+// Reads one whole packet.  The first byte of the fixed header is
+// returned in *typep, and the remaining bytes are placed in buf.
+static int
+broker_recv(test_broker *b, uint8_t *typep, uint8_t *buf, size_t *lenp)
+{
+	uint8_t  c;
+	uint32_t len   = 0;
+	int      shift = 0;
+	int      rv;
+
+	if ((rv = broker_xfer(b, typep, 1, false)) != 0) {
+		return (rv);
+	}
+	do {
+		if ((rv = broker_xfer(b, &c, 1, false)) != 0) {
+			return (rv);
+		}
+		len |= (uint32_t) (c & 0x7f) << shift;
+		shift += 7;
+	} while ((c & 0x80) != 0);
+	if (len > *lenp) {
+		return (NNG_EMSGSIZE);
+	}
+	*lenp = len;
+	return (broker_xfer(b, buf, len, false));
+}
+
+// Accepts a connection from the client and answers its CONNECT with the
+// given CONNACK, then waits for the pipe to be added to the socket.
+static void
+broker_accept_with(test_broker *b, const uint8_t *connack, size_t sz)
+{
+	uint8_t type;
+	uint8_t buf[256];
+	size_t  len = sizeof(buf);
+
+	if (b->s != NULL) {
+		nng_stream_free(b->s);
+		b->s = NULL;
+	}
+	nng_stream_listener_accept(b->l, b->aio);
+	nng_aio_wait(b->aio);
+	NUTS_PASS(nng_aio_result(b->aio));
+	b->s = nng_aio_get_output(b->aio, 0);
+	NUTS_ASSERT(b->s != NULL);
+
+	NUTS_PASS(broker_recv(b, &type, buf, &len));
+	NUTS_TRUE(type == 0x10);
+	NUTS_PASS(broker_send(b, connack, sz));
+	NUTS_SLEEP(100);
+}
+
+static void
+broker_accept(test_broker *b, bool present)
+{
+	uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+
+	connack[2] = present ? 0x01 : 0x00;
+	broker_accept_with(b, connack, sizeof(connack));
+}
+
+// Dials the broker from an open client socket.
+static void
+broker_dial(test_broker *b, nng_socket sock, nng_msg **connmsg, bool present)
+{
+	nng_dialer d;
+
+	NUTS_PASS(nng_mqtt_msg_alloc(connmsg, 0));
+	nng_mqtt_msg_set_packet_type(*connmsg, NNG_MQTT_CONNECT);
+	nng_mqtt_msg_set_connect_proto_version(*connmsg, 4);
+	nng_mqtt_msg_set_connect_keep_alive(*connmsg, 60);
+	nng_mqtt_msg_set_connect_client_id(*connmsg, "nuts");
+	nng_mqtt_msg_set_connect_clean_session(*connmsg, !present);
+	NUTS_PASS(nng_dialer_create(&d, sock, b->url));
+	NUTS_PASS(nng_dialer_set_ptr(d, NNG_OPT_MQTT_CONNMSG, *connmsg));
+	NUTS_PASS(nng_dialer_start(d, NNG_FLAG_NONBLOCK));
+	broker_accept(b, present);
+}
+
+static void
+broker_connect(test_broker *b, nng_socket *sock, nng_msg **connmsg)
+{
+	NUTS_PASS(nng_mqtt_client_open(sock));
+	broker_dial(b, *sock, connmsg, false);
+}
+
+static nng_msg *
+publish_msg(const char *topic, uint8_t qos, const void *payload, size_t len)
+{
+	nng_msg *msg;
+
+	NUTS_PASS(nng_mqtt_msg_alloc(&msg, 0));
+	nng_mqtt_msg_set_packet_type(msg, NNG_MQTT_PUBLISH);
+	nng_mqtt_msg_set_publish_topic(msg, topic);
+	nng_mqtt_msg_set_publish_qos(msg, qos);
+	nng_mqtt_msg_set_publish_payload(
+	    msg, (uint8_t *) payload, (uint32_t) len);
+	return (msg);
+}
+
+#ifdef NNG_ENABLE_STATS
+static uint64_t
+sock_stat(nng_socket sock, const char *name)
+{
+	nng_stat *stats;
+	nng_stat *item;
+	uint64_t  val = 0;
+
+	NUTS_PASS(nng_stats_get(&stats));
+	item = nng_stat_find_socket(stats, sock);
+	NUTS_TRUE(item != NULL);
+	if ((item = nng_stat_find(item, name)) != NULL) {
+		val = nng_stat_value(item);
+	}
+	nng_stats_free(stats);
+	return (val);
+}
+
+// Reads a statistic of the pipe the socket has open.
+static uint64_t
+pipe_stat(nng_socket sock, const char *name)
+{
+	nng_stat *stats;
+	nng_stat *item;
+	nng_stat *id;
+	uint64_t  val = 0;
+
+	NUTS_PASS(nng_stats_get(&stats));
+	for (item = nng_stat_child(stats); item != NULL;
+	     item = nng_stat_next(item)) {
+		if ((strcmp(nng_stat_name(item), "pipe") == 0) &&
+		    ((id = nng_stat_find(item, "socket")) != NULL) &&
+		    (nng_stat_value(id) == (uint64_t) nng_socket_id(sock)) &&
+		    ((item = nng_stat_find(item, name)) != NULL)) {
+			val = nng_stat_value(item);
+			break;
+		}
+	}
+	nng_stats_free(stats);
+	return (val);
+}
+#endif
+
+void
+test_send_batch_option(void)
+{
+	nng_socket sock;
+	size_t     sz;
+
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_get_size(sock, NNG_OPT_MQTT_SEND_BATCH, &sz));
+	NUTS_TRUE(sz == 0);
+	NUTS_PASS(nng_socket_set_size(sock, NNG_OPT_MQTT_SEND_BATCH, 4096));
+	NUTS_PASS(nng_socket_get_size(sock, NNG_OPT_MQTT_SEND_BATCH, &sz));
+	NUTS_TRUE(sz == 4096);
+	NUTS_FAIL(nng_socket_set_bool(sock, NNG_OPT_MQTT_SEND_BATCH, true),
+	    NNG_EBADTYPE);
+	NUTS_CLOSE(sock);
+}
+
+void
+test_send_batch(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	uint8_t     type;
+	uint8_t *   buf;
+	size_t      len;
+	size_t      sz = 1024 * 1024;
+	int         i;
+
+	NUTS_TRUE((buf = nng_alloc(sz + 64)) != NULL);
+	memset(buf, 'x', sz);
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_size(sock, NNG_OPT_MQTT_SEND_BATCH, 4 * sz));
+
+	// The broker is not reading yet, so the first publish stalls in
+	// the socket buffers and the rest queue up behind it.
+	for (i = 0; i < 12; i++) {
+		NUTS_PASS(nng_sendmsg(sock, publish_msg("batch", 0, buf, sz), 0));
+	}
+	// Every publish must arrive intact and in order, whether or not
+	// it shared a write with its neighbours.
+	for (i = 0; i < 12; i++) {
+		len = sz + 64;
+		NUTS_PASS(broker_recv(&b, &type, buf, &len));
+		NUTS_TRUE(type == 0x30);
+		NUTS_TRUE(len == 2 + strlen("batch") + sz);
+		NUTS_TRUE(memcmp(buf + 2, "batch", 5) == 0);
+	}
+#ifdef NNG_ENABLE_STATS
+	NUTS_TRUE(sock_stat(sock, "tx_batches") > 0);
+	NUTS_TRUE(sock_stat(sock, "tx_batch_msgs") > 1);
+#endif
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+	nng_free(buf, sz + 64);
+}
+
+void
+test_send_window_options(void)
+{
+	nng_socket sock;
+	int        v;
+
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_get_int(sock, NNG_OPT_MQTT_SEND_POLICY, &v));
+	NUTS_TRUE(v == NNG_MQTT_SEND_DROP_OLDEST);
+	NUTS_PASS(
+	    nng_socket_set_int(sock, NNG_OPT_MQTT_SEND_POLICY, NNG_MQTT_SEND_BLOCK));
+	NUTS_PASS(nng_socket_get_int(sock, NNG_OPT_MQTT_SEND_POLICY, &v));
+	NUTS_TRUE(v == NNG_MQTT_SEND_BLOCK);
+	NUTS_FAIL(nng_socket_set_int(sock, NNG_OPT_MQTT_SEND_POLICY, 3),
+	    NNG_EINVAL);
+	NUTS_PASS(nng_socket_get_int(sock, NNG_OPT_MQTT_SEND_WINDOW, &v));
+	NUTS_TRUE(v == 65535);
+	NUTS_PASS(nng_socket_set_int(sock, NNG_OPT_MQTT_SEND_WINDOW, 10));
+	NUTS_PASS(nng_socket_get_int(sock, NNG_OPT_MQTT_SEND_WINDOW, &v));
+	NUTS_TRUE(v == 10);
+	NUTS_FAIL(
+	    nng_socket_set_int(sock, NNG_OPT_MQTT_SEND_WINDOW, 0), NNG_EINVAL);
+	NUTS_FAIL(nng_socket_set_int(sock, NNG_OPT_MQTT_SEND_WINDOW, 65536),
+	    NNG_EINVAL);
+	NUTS_CLOSE(sock);
+}
+
+void
+test_send_window_block(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_aio *   aio1;
+	nng_aio *   aio2;
+	nng_aio *   aio3;
+	uint8_t     type;
+	uint8_t     buf[256];
+	uint8_t     puback[] = { 0x40, 0x02, 0x00, 0x00 };
+	size_t      len;
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_int(sock, NNG_OPT_MQTT_SEND_WINDOW, 1));
+	NUTS_PASS(
+	    nng_socket_set_int(sock, NNG_OPT_MQTT_SEND_POLICY, NNG_MQTT_SEND_BLOCK));
+	NUTS_PASS(nng_aio_alloc(&aio1, NULL, NULL));
+	NUTS_PASS(nng_aio_alloc(&aio2, NULL, NULL));
+	NUTS_PASS(nng_aio_alloc(&aio3, NULL, NULL));
+
+	// The first publish takes the only slot in the window.
+	nng_aio_set_msg(aio1, publish_msg("window", 1, "one", 3));
+	nng_send_aio(sock, aio1);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x32);
+
+	// The second one parks, and gives up when its timeout expires.
+	nng_aio_set_timeout(aio2, 100);
+	nng_aio_set_msg(aio2, publish_msg("window", 1, "two", 3));
+	nng_send_aio(sock, aio2);
+	nng_aio_wait(aio2);
+	NUTS_FAIL(nng_aio_result(aio2), NNG_ETIMEDOUT);
+	nng_msg_free(nng_aio_get_msg(aio2));
+
+	// The third one goes out once the first is acknowledged.
+	nng_aio_set_msg(aio3, publish_msg("window", 1, "three", 5));
+	nng_send_aio(sock, aio3);
+	NUTS_SLEEP(50);
+	puback[2] = buf[2 + strlen("window")];
+	puback[3] = buf[2 + strlen("window") + 1];
+	NUTS_PASS(broker_send(&b, puback, sizeof(puback)));
+	nng_aio_wait(aio1);
+	NUTS_PASS(nng_aio_result(aio1));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x32);
+	NUTS_TRUE(memcmp(buf + len - 5, "three", 5) == 0);
+
+	NUTS_CLOSE(sock);
+	nng_aio_wait(aio3);
+	nng_aio_free(aio1);
+	nng_aio_free(aio2);
+	nng_aio_free(aio3);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_send_window_drop_newest(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_msg *   msg;
+	nng_aio *   aio;
+	uint8_t     type;
+	uint8_t     buf[256];
+	size_t      len;
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_int(sock, NNG_OPT_MQTT_SEND_WINDOW, 1));
+	NUTS_PASS(nng_socket_set_int(
+	    sock, NNG_OPT_MQTT_SEND_POLICY, NNG_MQTT_SEND_DROP_NEWEST));
+	NUTS_PASS(nng_aio_alloc(&aio, NULL, NULL));
+
+	nng_aio_set_msg(aio, publish_msg("window", 1, "one", 3));
+	nng_send_aio(sock, aio);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+
+	msg = publish_msg("window", 1, "two", 3);
+	NUTS_FAIL(nng_sendmsg(sock, msg, 0), NNG_EAGAIN);
+	nng_msg_free(msg);
+
+	// QoS 0 does not need a slot in the window.
+	NUTS_PASS(nng_sendmsg(sock, publish_msg("window", 0, "three", 5), 0));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x30);
+
+	NUTS_CLOSE(sock);
+	nng_aio_wait(aio);
+	nng_aio_free(aio);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_send_window_drop_oldest(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_aio *   aio;
+	nng_aio *   wait[NNG_MAX_SEND_LMQ + 1];
+	uint8_t     type;
+	uint8_t     buf[256];
+	uint8_t     puback[] = { 0x40, 0x02, 0x00, 0x00 };
+	uint8_t     suback[] = { 0x90, 0x03, 0x00, 0x00, 0x00 };
+	size_t      len;
+	char        c;
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+
+	// A subscribe that gives up is not one of the parked sends.
+	NUTS_PASS(nng_aio_alloc(&aio, NULL, NULL));
+	nng_aio_set_timeout(aio, 100);
+	NUTS_PASS(nng_mqtt_subscribe_aio(sock, "window", aio));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x82);
+	nng_aio_wait(aio);
+	NUTS_FAIL(nng_aio_result(aio), NNG_ETIMEDOUT);
+	nng_msg_free(nng_aio_get_msg(aio));
+	nng_aio_set_timeout(aio, NNG_DURATION_DEFAULT);
+	suback[2] = buf[0];
+	suback[3] = buf[1];
+	NUTS_PASS(broker_send(&b, suback, sizeof(suback)));
+	NUTS_SLEEP(100);
+
+	NUTS_PASS(nng_socket_set_int(sock, NNG_OPT_MQTT_SEND_WINDOW, 1));
+	nng_aio_set_msg(aio, publish_msg("window", 1, "one", 3));
+	nng_send_aio(sock, aio);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+
+	// With the window full, sends wait, and the oldest of them gives
+	// way once too many do.
+	for (int i = 0; i <= NNG_MAX_SEND_LMQ; i++) {
+		c = (char) ('a' + i);
+		NUTS_PASS(nng_aio_alloc(&wait[i], NULL, NULL));
+		nng_aio_set_msg(wait[i], publish_msg("window", 1, &c, 1));
+		nng_send_aio(sock, wait[i]);
+	}
+	nng_aio_wait(wait[0]);
+	NUTS_FAIL(nng_aio_result(wait[0]), NNG_EAGAIN);
+	nng_msg_free(nng_aio_get_msg(wait[0]));
+
+	// The next oldest goes out once the window has room.
+	puback[2] = buf[2 + strlen("window")];
+	puback[3] = buf[2 + strlen("window") + 1];
+	NUTS_PASS(broker_send(&b, puback, sizeof(puback)));
+	nng_aio_wait(aio);
+	NUTS_PASS(nng_aio_result(aio));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x32);
+	NUTS_TRUE(buf[len - 1] == 'b');
+
+	NUTS_CLOSE(sock);
+	for (int i = 1; i <= NNG_MAX_SEND_LMQ; i++) {
+		nng_aio_wait(wait[i]);
+		if (nng_aio_result(wait[i]) != 0) {
+			nng_msg_free(nng_aio_get_msg(wait[i]));
+		}
+		nng_aio_free(wait[i]);
+	}
+	nng_aio_free(wait[0]);
+	nng_aio_free(aio);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_retry_interval_option(void)
+{
+	nng_socket   sock;
+	nng_duration d;
+
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_get_ms(sock, NNG_OPT_MQTT_RETRY_INTERVAL, &d));
+	NUTS_TRUE(d == 60000);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_MQTT_RETRY_INTERVAL, 500));
+	NUTS_PASS(nng_socket_get_ms(sock, NNG_OPT_MQTT_RETRY_INTERVAL, &d));
+	NUTS_TRUE(d == 500);
+	NUTS_FAIL(nng_socket_set_ms(sock, NNG_OPT_MQTT_RETRY_INTERVAL, 0),
+	    NNG_EINVAL);
+	NUTS_CLOSE(sock);
+}
+
+void
+test_retry_backoff(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_aio *   aio[3];
+	uint8_t     type;
+	uint8_t     buf[256];
+	uint8_t     puback[] = { 0x40, 0x02, 0x00, 0x00 };
+	size_t      len;
+	uint64_t    start;
+	uint64_t    first;
+	uint64_t    second;
+	int         i;
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_MQTT_RETRY_INTERVAL, 200));
+
+	start = nuts_clock();
+	for (i = 0; i < 3; i++) {
+		NUTS_PASS(nng_aio_alloc(&aio[i], NULL, NULL));
+		nng_aio_set_msg(aio[i], publish_msg("retry", 1, "x", 1));
+		nng_send_aio(sock, aio[i]);
+	}
+	for (i = 0; i < 3; i++) {
+		len = sizeof(buf);
+		NUTS_PASS(broker_recv(&b, &type, buf, &len));
+		NUTS_TRUE(type == 0x32);
+	}
+
+	// All three fall due together and come back as duplicates.
+	for (i = 0; i < 3; i++) {
+		len = sizeof(buf);
+		NUTS_PASS(broker_recv(&b, &type, buf, &len));
+		NUTS_TRUE(type == 0x3a);
+	}
+	first = nuts_clock() - start;
+	NUTS_TRUE(first >= 190);
+
+	// The next attempt waits twice as long.
+	for (i = 0; i < 3; i++) {
+		len = sizeof(buf);
+		NUTS_PASS(broker_recv(&b, &type, buf, &len));
+		NUTS_TRUE(type == 0x3a);
+	}
+	second = nuts_clock() - start;
+	NUTS_TRUE(second - first >= 390);
+
+	// Nothing more once they are acknowledged.
+	for (i = 0; i < 3; i++) {
+		puback[3] = (uint8_t) (i + 1);
+		NUTS_PASS(broker_send(&b, puback, sizeof(puback)));
+		nng_aio_wait(aio[i]);
+		NUTS_PASS(nng_aio_result(aio[i]));
+		nng_aio_free(aio[i]);
+	}
+	nng_aio_set_timeout(b.aio, 1000);
+	len = sizeof(buf);
+	NUTS_FAIL(broker_recv(&b, &type, buf, &len), NNG_ETIMEDOUT);
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_qos2_publish(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_aio *   aio;
+	uint8_t     type;
+	uint8_t     buf[256];
+	uint8_t     pubrec[]  = { 0x50, 0x02, 0x00, 0x00 };
+	uint8_t     pubcomp[] = { 0x70, 0x02, 0x00, 0x00 };
+	uint8_t     puback[]  = { 0x40, 0x02, 0x00, 0x00 };
+	size_t      len;
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_MQTT_RETRY_INTERVAL, 200));
+
+	NUTS_PASS(nng_aio_alloc(&aio, NULL, NULL));
+	nng_aio_set_msg(aio, publish_msg("qos2", 2, "x", 1));
+	nng_send_aio(sock, aio);
+
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x34);
+	pubrec[2] = pubcomp[2] = buf[2 + strlen("qos2")];
+	pubrec[3] = pubcomp[3] = buf[3 + strlen("qos2")];
+
+	NUTS_PASS(broker_send(&b, pubrec, sizeof(pubrec)));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x62);
+	NUTS_TRUE(len == 2);
+	NUTS_TRUE(memcmp(buf, pubrec + 2, 2) == 0);
+
+	// Once released, the PUBREL is what gets retransmitted.
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x62);
+	NUTS_TRUE(memcmp(buf, pubrec + 2, 2) == 0);
+
+	// A repeated PUBREC is answered with the PUBREL again.
+	NUTS_PASS(broker_send(&b, pubrec, sizeof(pubrec)));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x62);
+
+	NUTS_PASS(broker_send(&b, pubcomp, sizeof(pubcomp)));
+	nng_aio_wait(aio);
+	NUTS_PASS(nng_aio_result(aio));
+
+	// A PUBREC for a QoS 1 publish is not answered.
+	nng_aio_set_msg(aio, publish_msg("qos2", 1, "x", 1));
+	nng_send_aio(sock, aio);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x32);
+	pubrec[2] = puback[2] = buf[2 + strlen("qos2")];
+	pubrec[3] = puback[3] = buf[3 + strlen("qos2")];
+	NUTS_PASS(broker_send(&b, pubrec, sizeof(pubrec)));
+	NUTS_PASS(broker_send(&b, puback, sizeof(puback)));
+	nng_aio_wait(aio);
+	NUTS_PASS(nng_aio_result(aio));
+	nng_aio_set_timeout(b.aio, 300);
+	len = sizeof(buf);
+	NUTS_FAIL(broker_recv(&b, &type, buf, &len), NNG_ETIMEDOUT);
+	nng_aio_free(aio);
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_session_file(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_aio *   aio;
+	uint8_t     type;
+	uint8_t     buf[256];
+	uint8_t     first[256];
+	uint8_t     puback[] = { 0x40, 0x02, 0x00, 0x00 };
+	size_t      len;
+	size_t      first_len;
+	char *      tmpdir;
+	char *      path;
+	char        name[32];
+	bool        sync;
+
+	(void) snprintf(name, sizeof(name), "nuts_session_%u",
+	    (unsigned) nuts_next_port());
+	NUTS_ASSERT((tmpdir = nni_plat_temp_dir()) != NULL);
+	NUTS_ASSERT((path = nni_file_join(tmpdir, name)) != NULL);
+	nng_strfree(tmpdir);
+	(void) nni_file_delete(path);
+
+	// The publish is never acknowledged before the client goes away.
+	broker_start(&b);
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_set_string(sock, NNG_OPT_MQTT_SESSION_FILE, path));
+	NUTS_FAIL(nng_socket_set_string(sock, NNG_OPT_MQTT_SESSION_FILE, path),
+	    NNG_EBUSY);
+	NUTS_PASS(nng_socket_get_bool(sock, NNG_OPT_MQTT_SESSION_SYNC, &sync));
+	NUTS_TRUE(sync);
+	broker_dial(&b, sock, &connmsg, true);
+	NUTS_PASS(nng_aio_alloc(&aio, NULL, NULL));
+	nng_aio_set_msg(aio, publish_msg("session", 1, "kept", 4));
+	nng_send_aio(sock, aio);
+	first_len = sizeof(first);
+	NUTS_PASS(broker_recv(&b, &type, first, &first_len));
+	NUTS_TRUE(type == 0x32);
+#ifdef NNG_ENABLE_STATS
+	NUTS_TRUE(sock_stat(sock, "session_errors") == 0);
+#endif
+	NUTS_CLOSE(sock);
+	nng_aio_wait(aio);
+	NUTS_FAIL(nng_aio_result(aio), NNG_ECLOSED);
+	nng_aio_free(aio);
+	nng_msg_free(connmsg);
+
+	// A new client resumes the session and delivers it.  Without
+	// syncing, the removal still reaches the file.
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_set_string(sock, NNG_OPT_MQTT_SESSION_FILE, path));
+	NUTS_PASS(nng_socket_set_bool(sock, NNG_OPT_MQTT_SESSION_SYNC, false));
+	NUTS_PASS(nng_socket_get_bool(sock, NNG_OPT_MQTT_SESSION_SYNC, &sync));
+	NUTS_TRUE(!sync);
+	broker_dial(&b, sock, &connmsg, true);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x3a);
+	NUTS_TRUE(len == first_len);
+	NUTS_TRUE(memcmp(buf, first, len) == 0);
+	puback[2] = buf[2 + strlen("session")];
+	puback[3] = buf[3 + strlen("session")];
+	NUTS_PASS(broker_send(&b, puback, sizeof(puback)));
+	NUTS_SLEEP(100);
+#ifdef NNG_ENABLE_STATS
+	NUTS_TRUE(sock_stat(sock, "session_errors") == 0);
+#endif
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+
+	// Once acknowledged, it is gone.
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_set_string(sock, NNG_OPT_MQTT_SESSION_FILE, path));
+	broker_dial(&b, sock, &connmsg, true);
+	nng_aio_set_timeout(b.aio, 500);
+	len = sizeof(buf);
+	NUTS_FAIL(broker_recv(&b, &type, buf, &len), NNG_ETIMEDOUT);
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+
+	broker_stop(&b);
+	(void) nni_file_delete(path);
+	nng_strfree(path);
+}
+
+void
+test_reconnect_resend(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_aio *   aio[2];
+	uint8_t     type;
+	uint8_t     buf[256];
+	uint8_t     first[256];
+	uint8_t     puback[] = { 0x40, 0x02, 0x00, 0x00 };
+	size_t      len;
+	size_t      first_len;
+
+	broker_start(&b);
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECONNMINT, 50));
+	broker_dial(&b, sock, &connmsg, true);
+
+	NUTS_PASS(nng_aio_alloc(&aio[0], NULL, NULL));
+	nng_aio_set_msg(aio[0], publish_msg("blip", 1, "x", 1));
+	nng_send_aio(sock, aio[0]);
+	first_len = sizeof(first);
+	NUTS_PASS(broker_recv(&b, &type, first, &first_len));
+	NUTS_TRUE(type == 0x32);
+
+	// The connection drops, the publish is still pending and goes
+	// out again on the next one.
+	broker_accept(&b, true);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x3a);
+	NUTS_TRUE(len == first_len);
+	NUTS_TRUE(memcmp(buf, first, len) == 0);
+	puback[2] = buf[2 + strlen("blip")];
+	puback[3] = buf[3 + strlen("blip")];
+	NUTS_PASS(broker_send(&b, puback, sizeof(puback)));
+	nng_aio_wait(aio[0]);
+	NUTS_PASS(nng_aio_result(aio[0]));
+
+	// Without a session on the server there is nothing to resume.
+	NUTS_PASS(nng_aio_alloc(&aio[1], NULL, NULL));
+	nng_aio_set_msg(aio[1], publish_msg("blip", 1, "x", 1));
+	nng_send_aio(sock, aio[1]);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x32);
+	broker_accept(&b, false);
+	nng_aio_wait(aio[1]);
+	NUTS_FAIL(nng_aio_result(aio[1]), NNG_ECLOSED);
+
+	nng_aio_free(aio[0]);
+	nng_aio_free(aio[1]);
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+// Sends a QoS 0 PUBLISH from the broker.
+static void
+broker_publish(test_broker *b, const char *topic)
+{
+	uint8_t buf[128];
+	size_t  len = strlen(topic);
+
+	buf[0] = 0x30;
+	buf[1] = (uint8_t) (len + 3);
+	buf[2] = 0;
+	buf[3] = (uint8_t) len;
+	memcpy(buf + 4, topic, len);
+	buf[4 + len] = 'x';
+	NUTS_PASS(broker_send(b, buf, len + 5));
+}
+
+// Receives on the context, returning the topic, or NULL on timeout.
+static const char *
+ctx_recv_topic(nng_ctx ctx, nng_aio *aio, char *topic, size_t sz)
+{
+	nng_msg *   msg;
+	const char *t;
+	uint32_t    len;
+
+	nng_ctx_recv(ctx, aio);
+	nng_aio_wait(aio);
+	if (nng_aio_result(aio) != 0) {
+		NUTS_FAIL(nng_aio_result(aio), NNG_ETIMEDOUT);
+		return (NULL);
+	}
+	msg = nng_aio_get_msg(aio);
+	t   = nng_mqtt_msg_get_publish_topic(msg, &len);
+	NUTS_TRUE(len < sz);
+	memcpy(topic, t, len);
+	topic[len] = '\0';
+	nng_msg_free(msg);
+	return (topic);
+}
+
+void
+test_ctx_subscribe(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_ctx     ctx[3];
+	nng_aio *   aio;
+	char        t[64];
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_aio_alloc(&aio, NULL, NULL));
+	nng_aio_set_timeout(aio, 200);
+	for (int i = 0; i < 3; i++) {
+		NUTS_PASS(nng_ctx_open(&ctx[i], sock));
+	}
+	NUTS_PASS(nng_mqtt_ctx_subscribe(&ctx[0], "sport/+", NULL));
+	NUTS_PASS(nng_mqtt_ctx_subscribe(&ctx[1], "sport/#", aio));
+	nng_aio_wait(aio);
+	NUTS_PASS(nng_aio_result(aio));
+	NUTS_PASS(nng_ctx_set_string(
+	    ctx[1], NNG_OPT_MQTT_CTX_SUBSCRIBE, "+/tennis"));
+	NUTS_PASS(nng_ctx_set_string(
+	    ctx[2], NNG_OPT_MQTT_CTX_SUBSCRIBE, "news/#"));
+	NUTS_FAIL(nng_ctx_set_string(
+	              ctx[2], NNG_OPT_MQTT_CTX_SUBSCRIBE, "a/#/b"),
+	    NNG_EINVAL);
+	NUTS_FAIL(
+	    nng_ctx_set_string(ctx[2], NNG_OPT_MQTT_CTX_SUBSCRIBE, "a+"),
+	    NNG_EINVAL);
+	NUTS_FAIL(nng_ctx_set_string(
+	              ctx[2], NNG_OPT_MQTT_CTX_UNSUBSCRIBE, "sport/+"),
+	    NNG_ENOENT);
+
+	// Both sport filters match, the overlapping ones only once.
+	broker_publish(&b, "sport/tennis");
+	broker_publish(&b, "news");
+	broker_publish(&b, "weather");
+	NUTS_ASSERT(ctx_recv_topic(ctx[0], aio, t, sizeof(t)) != NULL);
+	NUTS_MATCH(t, "sport/tennis");
+	NUTS_ASSERT(ctx_recv_topic(ctx[1], aio, t, sizeof(t)) != NULL);
+	NUTS_MATCH(t, "sport/tennis");
+	NUTS_TRUE(ctx_recv_topic(ctx[1], aio, t, sizeof(t)) == NULL);
+	NUTS_ASSERT(ctx_recv_topic(ctx[2], aio, t, sizeof(t)) != NULL);
+	NUTS_MATCH(t, "news");
+	NUTS_TRUE(ctx_recv_topic(ctx[0], aio, t, sizeof(t)) == NULL);
+
+	// Nobody subscribed to it, so it is left for the socket.
+	nng_recv_aio(sock, aio);
+	nng_aio_wait(aio);
+	NUTS_PASS(nng_aio_result(aio));
+	nng_msg_free(nng_aio_get_msg(aio));
+
+	// '$' topics are not matched by leading wildcards.
+	NUTS_PASS(nng_ctx_set_string(
+	    ctx[0], NNG_OPT_MQTT_CTX_UNSUBSCRIBE, "sport/+"));
+	NUTS_PASS(nng_ctx_set_string(ctx[0], NNG_OPT_MQTT_CTX_SUBSCRIBE, "#"));
+	broker_publish(&b, "$SYS/x");
+	broker_publish(&b, "sport/golf");
+	NUTS_ASSERT(ctx_recv_topic(ctx[0], aio, t, sizeof(t)) != NULL);
+	NUTS_MATCH(t, "sport/golf");
+	NUTS_ASSERT(ctx_recv_topic(ctx[1], aio, t, sizeof(t)) != NULL);
+	NUTS_MATCH(t, "sport/golf");
+
+	for (int i = 0; i < 3; i++) {
+		NUTS_PASS(nng_ctx_close(ctx[i]));
+	}
+	nng_aio_free(aio);
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+// Counts the topic filters in a SUBSCRIBE (or UNSUBSCRIBE) body.
+static int
+sub_topics(const uint8_t *buf, size_t len, bool qos)
+{
+	size_t off = 2;
+	int    n   = 0;
+
+	while (off + 2 <= len) {
+		off += 2 + ((buf[off] << 8) | buf[off + 1]) + (qos ? 1 : 0);
+		n++;
+	}
+	return (off == len ? n : -1);
+}
+
+void
+test_subscribe_batch(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_aio *   aio[4];
+	uint8_t     type;
+	uint8_t     buf[256];
+	size_t      len;
+	uint8_t     suback[] = { 0x90, 0x04, 0x00, 0x00, 0x00, 0x80 };
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	for (int i = 0; i < 4; i++) {
+		NUTS_PASS(nng_aio_alloc(&aio[i], NULL, NULL));
+		nng_aio_set_timeout(aio[i], 5000);
+	}
+
+	// The first goes out at once, the others wait for its SUBACK
+	// and then share one packet.
+	NUTS_PASS(nng_mqtt_subscribe_aio(sock, "a/b", aio[0]));
+	NUTS_PASS(nng_mqtt_subscribe_aio(sock, "c/+", aio[1]));
+	NUTS_PASS(nng_mqtt_subscribe_aio(sock, "d/#", aio[2]));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x82);
+	NUTS_TRUE(sub_topics(buf, len, true) == 1);
+	suback[1] = 3;
+	suback[2] = buf[0];
+	suback[3] = buf[1];
+	NUTS_PASS(broker_send(&b, suback, 5));
+	nng_aio_wait(aio[0]);
+	NUTS_PASS(nng_aio_result(aio[0]));
+
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x82);
+	NUTS_TRUE(sub_topics(buf, len, true) == 2);
+	suback[1] = 4;
+	suback[2] = buf[0];
+	suback[3] = buf[1];
+	NUTS_PASS(broker_send(&b, suback, 6));
+	nng_aio_wait(aio[1]);
+	nng_aio_wait(aio[2]);
+	NUTS_PASS(nng_aio_result(aio[1]));
+	NUTS_FAIL(nng_aio_result(aio[2]), NNG_EPERM);
+	nng_msg_free(nng_aio_get_msg(aio[2]));
+
+	NUTS_PASS(nng_mqtt_unsubscribe_aio(&sock, "a/b", aio[3]));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0xa2);
+	NUTS_TRUE(sub_topics(buf, len, false) == 1);
+	suback[0] = 0xb0;
+	suback[1] = 2;
+	suback[2] = buf[0];
+	suback[3] = buf[1];
+	NUTS_PASS(broker_send(&b, suback, 4));
+	nng_aio_wait(aio[3]);
+	NUTS_PASS(nng_aio_result(aio[3]));
+
+	for (int i = 0; i < 4; i++) {
+		nng_aio_free(aio[i]);
+	}
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_resubscribe(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_aio *   aio;
+	uint8_t     type;
+	uint8_t     buf[256];
+	size_t      len;
+	uint8_t     ack[] = { 0x90, 0x03, 0x00, 0x00, 0x00 };
+
+	broker_start(&b);
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECONNMINT, 50));
+	broker_dial(&b, sock, &connmsg, false);
+	NUTS_PASS(nng_aio_alloc(&aio, NULL, NULL));
+
+	// One granted, one refused.
+	NUTS_PASS(nng_mqtt_subscribe_aio(sock, "a/b", aio));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	ack[2] = buf[0];
+	ack[3] = buf[1];
+	NUTS_PASS(broker_send(&b, ack, sizeof(ack)));
+	nng_aio_wait(aio);
+	NUTS_PASS(nng_aio_result(aio));
+	NUTS_PASS(nng_mqtt_subscribe_aio(sock, "x/y", aio));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	ack[2] = buf[0];
+	ack[3] = buf[1];
+	ack[4] = 0x80;
+	NUTS_PASS(broker_send(&b, ack, sizeof(ack)));
+	nng_aio_wait(aio);
+	NUTS_FAIL(nng_aio_result(aio), NNG_EPERM);
+	nng_msg_free(nng_aio_get_msg(aio));
+
+	// A server without our session gets the granted one again.
+	broker_accept(&b, false);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x82);
+	NUTS_TRUE(len == 2 + 2 + 3 + 1);
+	NUTS_TRUE(memcmp(buf + 4, "a/b", 3) == 0);
+	ack[2] = buf[0];
+	ack[3] = buf[1];
+	ack[4] = 0x00;
+	NUTS_PASS(broker_send(&b, ack, sizeof(ack)));
+
+	// One that kept the session does not.
+	broker_accept(&b, true);
+	nng_aio_set_timeout(b.aio, 300);
+	len = sizeof(buf);
+	NUTS_FAIL(broker_recv(&b, &type, buf, &len), NNG_ETIMEDOUT);
+	nng_aio_set_timeout(b.aio, 5000);
+
+	// Nor is anything made again once unsubscribed.
+	NUTS_PASS(nng_mqtt_unsubscribe_aio(&sock, "a/b", aio));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0xa2);
+	ack[0] = 0xb0;
+	ack[1] = 0x02;
+	ack[2] = buf[0];
+	ack[3] = buf[1];
+	NUTS_PASS(broker_send(&b, ack, 4));
+	nng_aio_wait(aio);
+	NUTS_PASS(nng_aio_result(aio));
+	broker_accept(&b, false);
+	nng_aio_set_timeout(b.aio, 300);
+	len = sizeof(buf);
+	NUTS_FAIL(broker_recv(&b, &type, buf, &len), NNG_ETIMEDOUT);
+
+	nng_aio_free(aio);
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_topic_alias(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_msg *   msg;
+	nng_dialer  d;
+	uint8_t     type;
+	uint8_t     buf[256];
+	size_t      len;
+	uint32_t    n;
+	const char *t;
+	int         v;
+	nng_aio *   aio;
+	// v5, the server takes up to two aliases from us
+	uint8_t connack[] = { 0x20, 0x06, 0x00, 0x00, 0x03, 0x22, 0x00, 0x02 };
+	uint8_t in_set[]  = { 0x30, 0x0f, 0x00, 0x08, 'i', 'n', '/', 't', 'o',
+                'p', 'i', 'c', 0x03, 0x23, 0x00, 0x01, 'x' };
+	uint8_t in_use[]  = { 0x30, 0x07, 0x00, 0x00, 0x03, 0x23, 0x00, 0x01,
+                'y' };
+	uint8_t in_bad[]  = { 0x30, 0x07, 0x00, 0x00, 0x03, 0x23, 0x00, 0x03,
+                'z' };
+
+	broker_start(&b);
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_get_int(sock, NNG_OPT_MQTT_TOPIC_ALIAS_MAX, &v));
+	NUTS_TRUE(v == 1024);
+	NUTS_FAIL(nng_socket_set_int(sock, NNG_OPT_MQTT_TOPIC_ALIAS_MAX, -1),
+	    NNG_EINVAL);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECVTIMEO, 1000));
+	NUTS_PASS(nng_mqtt_msg_alloc(&connmsg, 0));
+	nng_mqtt_msg_set_packet_type(connmsg, NNG_MQTT_CONNECT);
+	nng_mqtt_msg_set_connect_proto_version(connmsg, 5);
+	nng_mqtt_msg_set_connect_keep_alive(connmsg, 60);
+	nng_mqtt_msg_set_connect_client_id(connmsg, "nuts");
+	nng_mqtt_msg_set_connect_topic_alias_max(connmsg, 4);
+	NUTS_PASS(nng_dialer_create(&d, sock, b.url));
+	NUTS_PASS(nng_dialer_set_ptr(d, NNG_OPT_MQTT_CONNMSG, connmsg));
+	NUTS_PASS(nng_dialer_start(d, NNG_FLAG_NONBLOCK));
+	broker_accept_with(&b, connack, sizeof(connack));
+	NUTS_PASS(nng_aio_alloc(&aio, NULL, NULL));
+
+	// The first publish sets the alias up, the next one uses it.
+	NUTS_PASS(nng_sendmsg(sock, publish_msg("alias/topic", 0, "a", 1), 0));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x30);
+	NUTS_TRUE(len == 2 + 11 + 4 + 1);
+	NUTS_TRUE(memcmp(buf + 2, "alias/topic", 11) == 0);
+	NUTS_TRUE(memcmp(buf + 13, "\x03\x23\x00\x01" "a", 5) == 0);
+	NUTS_PASS(nng_sendmsg(sock, publish_msg("alias/topic", 0, "b", 1), 0));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(len == 2 + 4 + 1);
+	NUTS_TRUE(memcmp(buf, "\x00\x00\x03\x23\x00\x01" "b", 7) == 0);
+
+	// A third topic takes over the least recently used alias.
+	NUTS_PASS(nng_sendmsg(sock, publish_msg("other/topic", 0, "c", 1), 0));
+	NUTS_PASS(nng_sendmsg(sock, publish_msg("third/topic", 0, "d", 1), 0));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(buf[16] == 2);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(memcmp(buf + 2, "third/topic", 11) == 0);
+	NUTS_TRUE(buf[16] == 1);
+
+	// QoS 1 publishes keep their topic.
+	nng_aio_set_msg(aio, publish_msg("third/topic", 1, "e", 1));
+	nng_send_aio(sock, aio);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x32);
+	NUTS_TRUE(len == 2 + 11 + 2 + 1 + 1);
+
+#ifdef NNG_ENABLE_STATS
+	NUTS_TRUE(sock_stat(sock, "tx_alias_saved") == 11 - 3);
+#endif
+
+	// Aliases from the server resolve to their topic.
+	NUTS_PASS(broker_send(&b, in_set, sizeof(in_set)));
+	NUTS_PASS(broker_send(&b, in_use, sizeof(in_use)));
+	NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+	nng_msg_free(msg);
+	NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+	t = nng_mqtt_msg_get_publish_topic(msg, &n);
+	NUTS_TRUE(n == 8);
+	NUTS_TRUE(memcmp(t, "in/topic", 8) == 0);
+	NUTS_TRUE(*nng_mqtt_msg_get_publish_payload(msg, &n) == 'y');
+	NUTS_TRUE(n == 1);
+	nng_msg_free(msg);
+
+	// One it never set up is a protocol error.
+	NUTS_PASS(broker_send(&b, in_bad, sizeof(in_bad)));
+	len = sizeof(buf);
+	NUTS_TRUE(broker_recv(&b, &type, buf, &len) != 0);
+
+	NUTS_CLOSE(sock);
+	nng_aio_wait(aio);
+	NUTS_FAIL(nng_aio_result(aio), NNG_ECLOSED);
+	nng_aio_free(aio);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_server_limits(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_msg *   msg;
+	nng_dialer  d;
+	nng_aio *   aio;
+	uint8_t     type;
+	uint8_t     buf[256];
+	size_t      len;
+	size_t      sz;
+	int         v;
+	char        big[64];
+	// v5, Receive Maximum 1 and Maximum Packet Size 64
+	uint8_t connack[] = { 0x20, 0x0b, 0x00, 0x00, 0x08, 0x21, 0x00, 0x01,
+		0x27, 0x00, 0x00, 0x00, 0x40 };
+
+	broker_start(&b);
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_get_int(sock, NNG_OPT_MQTT_RECEIVE_MAX, &v));
+	NUTS_TRUE(v == 65535);
+	NUTS_PASS(nng_socket_get_size(sock, NNG_OPT_MQTT_MAX_PACKET_SIZE, &sz));
+	NUTS_TRUE(sz == 0);
+	NUTS_FAIL(nng_socket_set_int(sock, NNG_OPT_MQTT_RECEIVE_MAX, 1),
+	    NNG_EREADONLY);
+	NUTS_PASS(nng_socket_set_int(
+	    sock, NNG_OPT_MQTT_SEND_POLICY, NNG_MQTT_SEND_DROP_NEWEST));
+	NUTS_PASS(nng_mqtt_msg_alloc(&connmsg, 0));
+	nng_mqtt_msg_set_packet_type(connmsg, NNG_MQTT_CONNECT);
+	nng_mqtt_msg_set_connect_proto_version(connmsg, 5);
+	nng_mqtt_msg_set_connect_keep_alive(connmsg, 60);
+	nng_mqtt_msg_set_connect_client_id(connmsg, "nuts");
+	NUTS_PASS(nng_dialer_create(&d, sock, b.url));
+	NUTS_PASS(nng_dialer_set_ptr(d, NNG_OPT_MQTT_CONNMSG, connmsg));
+	NUTS_PASS(nng_dialer_start(d, NNG_FLAG_NONBLOCK));
+	broker_accept_with(&b, connack, sizeof(connack));
+	NUTS_PASS(nng_aio_alloc(&aio, NULL, NULL));
+
+	NUTS_PASS(nng_socket_get_int(sock, NNG_OPT_MQTT_RECEIVE_MAX, &v));
+	NUTS_TRUE(v == 1);
+	NUTS_PASS(nng_socket_get_size(sock, NNG_OPT_MQTT_MAX_PACKET_SIZE, &sz));
+	NUTS_TRUE(sz == 64);
+
+	// Too large for the server, so never sent.
+	memset(big, 'x', sizeof(big));
+	msg = publish_msg("limits", 0, big, sizeof(big));
+	NUTS_FAIL(nng_sendmsg(sock, msg, 0), NNG_EMSGSIZE);
+	nng_msg_free(msg);
+
+	// The window is the server's one slot, not the default.
+	nng_aio_set_msg(aio, publish_msg("limits", 1, "one", 3));
+	nng_send_aio(sock, aio);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x32);
+	msg = publish_msg("limits", 1, "two", 3);
+	NUTS_FAIL(nng_sendmsg(sock, msg, 0), NNG_EAGAIN);
+	nng_msg_free(msg);
+
+	NUTS_CLOSE(sock);
+	nng_aio_wait(aio);
+	nng_aio_free(aio);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+static void
+payload_release(void *arg)
+{
+	nni_atomic_inc((nni_atomic_int *) arg);
+}
+
+void
+test_publish_payload_ref(void)
+{
+	test_broker     b;
+	nng_socket      sock;
+	nng_msg *       connmsg;
+	nng_msg *       msg;
+	nng_aio *       aio;
+	nni_atomic_int  released;
+	uint8_t         type;
+	uint8_t         buf[2048];
+	uint8_t         puback[] = { 0x40, 0x02, 0x00, 0x01 };
+	size_t          len;
+	uint32_t        n;
+	static uint8_t  blob[1500];
+
+	memset(blob, 'b', sizeof(blob));
+	nni_atomic_init(&released);
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_MQTT_RETRY_INTERVAL, 200));
+	NUTS_PASS(nng_aio_alloc(&aio, NULL, NULL));
+
+	msg = publish_msg("blob", 1, "", 0);
+	NUTS_PASS(nng_mqtt_msg_set_publish_payload_ref(
+	    msg, blob, sizeof(blob), payload_release, &released));
+	NUTS_TRUE(nng_mqtt_msg_get_publish_payload(msg, &n) == blob);
+	NUTS_TRUE(n == sizeof(blob));
+	nng_aio_set_msg(aio, msg);
+	nng_send_aio(sock, aio);
+
+	// The payload follows the headers, and is sent again as it is,
+	// only marked as a duplicate.
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x32);
+	NUTS_TRUE(len == 2 + 4 + 2 + sizeof(blob));
+	NUTS_TRUE(memcmp(buf + 8, blob, sizeof(blob)) == 0);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x3a);
+	NUTS_TRUE(len == 2 + 4 + 2 + sizeof(blob));
+	NUTS_TRUE(memcmp(buf + 8, blob, sizeof(blob)) == 0);
+	NUTS_TRUE(nni_atomic_get(&released) == 0);
+
+	// Released once the last copy is gone.
+	NUTS_PASS(broker_send(&b, puback, sizeof(puback)));
+	nng_aio_wait(aio);
+	NUTS_PASS(nng_aio_result(aio));
+	NUTS_SLEEP(100);
+	NUTS_TRUE(nni_atomic_get(&released) == 1);
+
+	NUTS_CLOSE(sock);
+	nng_aio_free(aio);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_recv_undecoded(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_msg *   msg;
+	uint8_t     type;
+	uint8_t     buf[256];
+	size_t      len;
+	uint32_t    n;
+	const char *t;
+	uint8_t *   pl;
+	uint8_t     qos1[] = { 0x33, 0x0a, 0x00, 0x03, 'a', '/', 'b', 0x12,
+                0x34, 'x', 'y', 'z' };
+	uint8_t     qos2[] = { 0x34, 0x0a, 0x00, 0x03, 'a', '/', 'b', 0x56,
+                0x78, 'x', 'y', 'z' };
+	uint8_t     bad[]  = { 0x30, 0x02, 0x00, 0x05 };
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECVTIMEO, 1000));
+
+	// An MQTT 3.1.1 publish is read without being decoded.
+	NUTS_PASS(broker_send(&b, qos1, sizeof(qos1)));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x40);
+	NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+	NUTS_TRUE(nni_msg_get_proto_data(msg) == NULL);
+	NUTS_TRUE(nng_mqtt_msg_get_packet_type(msg) == NNG_MQTT_PUBLISH);
+	NUTS_TRUE(nng_mqtt_msg_get_publish_qos(msg) == 1);
+	NUTS_TRUE(nng_mqtt_msg_get_publish_retain(msg));
+	NUTS_TRUE(!nng_mqtt_msg_get_publish_dup(msg));
+	NUTS_TRUE(nng_mqtt_msg_get_publish_packet_id(msg) == 0x1234);
+	t = nng_mqtt_msg_get_publish_topic(msg, &n);
+	NUTS_TRUE(n == 3 && memcmp(t, "a/b", 3) == 0);
+	pl = nng_mqtt_msg_get_publish_payload(msg, &n);
+	NUTS_TRUE(n == 3 && memcmp(pl, "xyz", 3) == 0);
+	NUTS_TRUE(nng_mqtt_msg_get_connect_client_id(msg) == NULL);
+	NUTS_TRUE(nni_mqtt_msg_get_aio(msg) == NULL);
+	NUTS_TRUE(nni_msg_get_proto_data(msg) == NULL);
+
+	// Setters decode it.
+	nng_mqtt_msg_set_publish_retain(msg, false);
+	NUTS_TRUE(nni_msg_get_proto_data(msg) != NULL);
+	t = nng_mqtt_msg_get_publish_topic(msg, &n);
+	NUTS_TRUE(n == 3 && memcmp(t, "a/b", 3) == 0);
+	NUTS_TRUE(nng_mqtt_msg_get_publish_packet_id(msg) == 0x1234);
+	NUTS_TRUE(!nng_mqtt_msg_get_publish_retain(msg));
+	nng_msg_free(msg);
+
+	// A QoS 2 publish is held undecoded until its PUBREL, and is
+	// released without decoding it if the connection goes first.
+	NUTS_PASS(broker_send(&b, qos2, sizeof(qos2)));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x50);
+
+	// A topic longer than the packet drops the connection.
+	NUTS_PASS(broker_send(&b, bad, sizeof(bad)));
+	len = sizeof(buf);
+	NUTS_TRUE(broker_recv(&b, &type, buf, &len) != 0);
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_recv_qos2_dup(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_msg *   msg;
+	uint8_t     type;
+	uint8_t     buf[256];
+	size_t      len;
+	uint32_t    n;
+	uint8_t *   pl;
+	uint8_t     first[] = { 0x34, 0x0a, 0x00, 0x03, 'a', '/', 'b', 0x00,
+                0x07, 'o', 'n', 'e' };
+	uint8_t     again[] = { 0x3c, 0x0a, 0x00, 0x03, 'a', '/', 'b', 0x00,
+                0x07, 't', 'w', 'o' };
+	uint8_t     pubrel[] = { 0x62, 0x02, 0x00, 0x07 };
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECVTIMEO, 300));
+
+	// The publish sent again before the PUBREL is not a second message.
+	NUTS_PASS(broker_send(&b, first, sizeof(first)));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x50);
+	NUTS_PASS(broker_send(&b, again, sizeof(again)));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x50);
+	NUTS_PASS(broker_send(&b, pubrel, sizeof(pubrel)));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x70);
+	NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+	pl = nng_mqtt_msg_get_publish_payload(msg, &n);
+	NUTS_TRUE(n == 3 && memcmp(pl, "one", 3) == 0);
+	nng_msg_free(msg);
+
+	// Nor is a PUBREL sent again.
+	NUTS_PASS(broker_send(&b, pubrel, sizeof(pubrel)));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x70);
+	NUTS_FAIL(nng_recvmsg(sock, &msg, 0), NNG_ETIMEDOUT);
+#ifdef NNG_ENABLE_STATS
+	NUTS_TRUE(pipe_stat(sock, "rx_dup_publish") == 1);
+	NUTS_TRUE(pipe_stat(sock, "rx_stray_pubrel") == 1);
+#endif
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_recv_queue(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_msg *   msg;
+	uint32_t    n;
+	uint8_t *   pl;
+	int         val;
+	uint8_t     pub[] = { 0x30, 0x04, 0x00, 0x01, 't', '0' };
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECVTIMEO, 500));
+	NUTS_PASS(nng_socket_get_int(sock, NNG_OPT_MQTT_RECV_POLICY, &val));
+	NUTS_TRUE(val == NNG_MQTT_RECV_DROP_NEWEST);
+	NUTS_FAIL(nng_socket_set_int(sock, NNG_OPT_MQTT_RECV_QUEUE, 0),
+	    NNG_EINVAL);
+	NUTS_PASS(nng_socket_set_int(sock, NNG_OPT_MQTT_RECV_QUEUE, 2));
+
+	// With nobody receiving, what does not fit is dropped and counted.
+	for (int i = 0; i < 4; i++) {
+		pub[5] = (uint8_t) ('0' + i);
+		NUTS_PASS(broker_send(&b, pub, sizeof(pub)));
+	}
+	NUTS_SLEEP(200);
+	for (int i = 0; i < 2; i++) {
+		NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+		pl = nng_mqtt_msg_get_publish_payload(msg, &n);
+		NUTS_TRUE(n == 1 && pl[0] == '0' + i);
+		nng_msg_free(msg);
+	}
+	NUTS_FAIL(nng_recvmsg(sock, &msg, 0), NNG_ETIMEDOUT);
+#ifdef NNG_ENABLE_STATS
+	NUTS_TRUE(pipe_stat(sock, "rx_drop") == 2);
+	NUTS_TRUE(pipe_stat(sock, "rx_drop_bytes") == 2 * sizeof(pub));
+#endif
+
+	// Blocking stops reading instead, and loses nothing.
+	NUTS_PASS(nng_socket_set_int(
+	    sock, NNG_OPT_MQTT_RECV_POLICY, NNG_MQTT_RECV_BLOCK));
+	for (int i = 0; i < 8; i++) {
+		pub[5] = (uint8_t) ('0' + i);
+		NUTS_PASS(broker_send(&b, pub, sizeof(pub)));
+	}
+	NUTS_SLEEP(200);
+	for (int i = 0; i < 8; i++) {
+		NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+		pl = nng_mqtt_msg_get_publish_payload(msg, &n);
+		NUTS_TRUE(n == 1 && pl[0] == '0' + i);
+		nng_msg_free(msg);
+	}
+#ifdef NNG_ENABLE_STATS
+	NUTS_TRUE(pipe_stat(sock, "rx_drop") == 2);
+#endif
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_recv_watermark(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_msg *   msg;
+	uint32_t    n;
+	uint8_t *   pl;
+	size_t      sz;
+	uint8_t     pub[] = { 0x30, 0x04, 0x00, 0x01, 't', '0' };
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECVTIMEO, 500));
+	NUTS_PASS(
+	    nng_socket_get_size(sock, NNG_OPT_MQTT_RECV_HIGH_WATER, &sz));
+	NUTS_TRUE(sz == 1024 * 1024);
+
+	// Two publishes fill the queue, and reach the high watermark too,
+	// so the client stops reading rather than drop the rest.
+	NUTS_PASS(nng_socket_set_int(sock, NNG_OPT_MQTT_RECV_QUEUE, 2));
+	NUTS_PASS(nng_socket_set_size(
+	    sock, NNG_OPT_MQTT_RECV_HIGH_WATER, 2 * sizeof(pub)));
+	NUTS_PASS(nng_socket_set_size(sock, NNG_OPT_MQTT_RECV_LOW_WATER, 0));
+	for (int i = 0; i < 8; i++) {
+		pub[5] = (uint8_t) ('0' + i);
+		NUTS_PASS(broker_send(&b, pub, sizeof(pub)));
+	}
+	NUTS_SLEEP(200);
+	for (int i = 0; i < 8; i++) {
+		NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+		pl = nng_mqtt_msg_get_publish_payload(msg, &n);
+		NUTS_TRUE(n == 1 && pl[0] == '0' + i);
+		nng_msg_free(msg);
+	}
+	NUTS_FAIL(nng_recvmsg(sock, &msg, 0), NNG_ETIMEDOUT);
+#ifdef NNG_ENABLE_STATS
+	NUTS_TRUE(pipe_stat(sock, "rx_drop") == 0);
+	NUTS_TRUE(pipe_stat(sock, "rx_stalls") > 0);
+#endif
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_keepalive(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_dialer  d;
+	nng_msg *   connmsg;
+	nng_msg *   msg;
+	uint8_t     type;
+	uint8_t     buf[256];
+	size_t      len;
+	nng_time    start;
+	uint8_t     pingresp[] = { 0xD0, 0x00 };
+	uint8_t     pub[]      = { 0x30, 0x04, 0x00, 0x01, 't', 'x' };
+
+	broker_start(&b);
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_mqtt_msg_alloc(&connmsg, 0));
+	nng_mqtt_msg_set_packet_type(connmsg, NNG_MQTT_CONNECT);
+	nng_mqtt_msg_set_connect_proto_version(connmsg, 4);
+	nng_mqtt_msg_set_connect_keep_alive(connmsg, 1);
+	nng_mqtt_msg_set_connect_client_id(connmsg, "nuts");
+	nng_mqtt_msg_set_connect_clean_session(connmsg, true);
+	NUTS_PASS(nng_dialer_create(&d, sock, b.url));
+	NUTS_PASS(nng_dialer_set_ptr(d, NNG_OPT_MQTT_CONNMSG, connmsg));
+	NUTS_PASS(nng_dialer_start(d, NNG_FLAG_NONBLOCK));
+	broker_accept(&b, false);
+
+	// An idle link is pinged after a keepalive interval.
+	start = nng_clock();
+	len   = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0xC0);
+	NUTS_TRUE(nng_clock() - start < 2000);
+	NUTS_PASS(broker_send(&b, pingresp, sizeof(pingresp)));
+
+	// An answered ping keeps it up, and an unanswered one takes it
+	// down within 1.5 intervals.
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0xC0);
+	start = nng_clock();
+	len   = sizeof(buf);
+	NUTS_TRUE(broker_recv(&b, &type, buf, &len) != NNG_ETIMEDOUT);
+	NUTS_TRUE(nng_clock() - start < 2000);
+	NUTS_CLOSE(sock);
+	broker_stop(&b);
+
+	// While reading is paused for want of room the answer cannot be
+	// heard, so a slow consumer stays up for several intervals.  A new
+	// broker keeps the first client's redial out of the way.
+	broker_start(&b);
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_set_size(
+	    sock, NNG_OPT_MQTT_RECV_HIGH_WATER, sizeof(pub)));
+	NUTS_PASS(nng_socket_set_size(sock, NNG_OPT_MQTT_RECV_LOW_WATER, 0));
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECVTIMEO, 1000));
+	NUTS_PASS(nng_dialer_create(&d, sock, b.url));
+	NUTS_PASS(nng_dialer_set_ptr(d, NNG_OPT_MQTT_CONNMSG, connmsg));
+	NUTS_PASS(nng_dialer_start(d, NNG_FLAG_NONBLOCK));
+	broker_accept(&b, false);
+	NUTS_PASS(broker_send(&b, pub, sizeof(pub)));
+	NUTS_PASS(broker_send(&b, pub, sizeof(pub)));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0xC0);
+	NUTS_PASS(broker_send(&b, pingresp, sizeof(pingresp)));
+	nng_aio_set_timeout(b.aio, 3500);
+	len = sizeof(buf);
+	NUTS_FAIL(broker_recv(&b, &type, buf, &len), NNG_ETIMEDOUT);
+
+	// Once the application catches up, the answer is read and the link
+	// carries on.
+	for (int i = 0; i < 2; i++) {
+		NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+		nng_msg_free(msg);
+	}
+	nng_aio_set_timeout(b.aio, 5000);
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0xC0);
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_ack_batch(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	uint8_t     type;
+	uint8_t     buf[256];
+	size_t      len;
+	uint8_t *   pubs;
+	const int   npubs = 1000;
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+
+	// More QoS 1 publishes at once than the transport keeps acks for.
+	NUTS_TRUE((pubs = nng_alloc(npubs * 8)) != NULL);
+	for (int i = 0; i < npubs; i++) {
+		uint8_t *pub = pubs + i * 8;
+		pub[0]       = 0x32;
+		pub[1]       = 0x06;
+		pub[2]       = 0x00;
+		pub[3]       = 0x01;
+		pub[4]       = 't';
+		pub[5]       = (uint8_t) ((i + 1) >> 8);
+		pub[6]       = (uint8_t) (i + 1);
+		pub[7]       = 'x';
+	}
+	NUTS_PASS(broker_send(&b, pubs, npubs * 8));
+
+	// Every one is acknowledged, in order.
+	for (int i = 0; i < npubs; i++) {
+		len = sizeof(buf);
+		NUTS_PASS(broker_recv(&b, &type, buf, &len));
+		NUTS_TRUE(type == 0x40);
+		NUTS_TRUE(len == 2);
+		NUTS_TRUE(((buf[0] << 8) | buf[1]) == i + 1);
+	}
+	nng_free(pubs, npubs * 8);
+
+	// The packet id is found behind a topic longer than 255 bytes.
+	NUTS_TRUE((pubs = nng_alloc(310)) != NULL);
+	memset(pubs, 't', 310);
+	pubs[0]   = 0x32;
+	pubs[1]   = 0xb3; // 307, as a variable length integer
+	pubs[2]   = 0x02;
+	pubs[3]   = 0x01;
+	pubs[4]   = 0x2c; // 300 bytes of topic
+	pubs[305] = 0x12;
+	pubs[306] = 0x34;
+	NUTS_PASS(broker_send(&b, pubs, 310));
+	len = sizeof(buf);
+	NUTS_PASS(broker_recv(&b, &type, buf, &len));
+	NUTS_TRUE(type == 0x40);
+	NUTS_TRUE(buf[0] == 0x12 && buf[1] == 0x34);
+	nng_free(pubs, 310);
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_recv_large(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_msg *   msg;
+	uint8_t *   buf;
+	uint8_t *   pl;
+	uint32_t    n;
+	size_t      len   = 0;
+	const int   big   = 100000; // more than the transport reads at once
+	uint8_t     pub[] = { 0x30, 0x04, 0x00, 0x01, 't', 'a' };
+
+	broker_start(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECVTIMEO, 1000));
+
+	// A small publish, one larger than the transport's buffer, and
+	// another small one, all in one write.
+	NUTS_TRUE((buf = nng_alloc(big + 32)) != NULL);
+	memcpy(buf, pub, sizeof(pub));
+	len += sizeof(pub);
+	buf[len++] = 0x30;
+	buf[len++] = (uint8_t) (((big + 3) & 0x7f) | 0x80);
+	buf[len++] = (uint8_t) ((((big + 3) >> 7) & 0x7f) | 0x80);
+	buf[len++] = (uint8_t) ((big + 3) >> 14);
+	buf[len++] = 0x00;
+	buf[len++] = 0x01;
+	buf[len++] = 't';
+	for (int i = 0; i < big; i++) {
+		buf[len++] = (uint8_t) i;
+	}
+	memcpy(buf + len, pub, sizeof(pub));
+	buf[len + 5] = 'b';
+	len += sizeof(pub);
+	NUTS_PASS(broker_send(&b, buf, len));
+
+	NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+	pl = nng_mqtt_msg_get_publish_payload(msg, &n);
+	NUTS_TRUE(n == 1 && pl[0] == 'a');
+	nng_msg_free(msg);
+	NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+	pl = nng_mqtt_msg_get_publish_payload(msg, &n);
+	NUTS_TRUE(n == (uint32_t) big);
+	NUTS_TRUE(memcmp(pl, buf + sizeof(pub) + 7, big) == 0);
+	nng_msg_free(msg);
+	NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+	pl = nng_mqtt_msg_get_publish_payload(msg, &n);
+	NUTS_TRUE(n == 1 && pl[0] == 'b');
+	nng_msg_free(msg);
+	nng_free(buf, big + 32);
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+// Sets a small NNG_OPT_RECVMAXSZ, and checks that a packet announcing more
+// is refused, on a broker already started.
+static void
+recv_max_size(test_broker *b)
+{
+	nng_socket sock;
+	nng_msg *  connmsg;
+	nng_msg *  msg;
+	uint8_t    type;
+	uint8_t    buf[16];
+	size_t     len    = sizeof(buf);
+	uint8_t    pub[]  = { 0x30, 0x04, 0x00, 0x01, 't', 'a' };
+	uint8_t    huge[] = { 0x30, 0xff, 0xff, 0xff, 0x7f, 0x00 };
+	int        rv;
+
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_set_size(sock, NNG_OPT_RECVMAXSZ, 1000));
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECVTIMEO, 1000));
+	broker_dial(b, sock, &connmsg, false);
+
+	NUTS_PASS(broker_send(b, pub, sizeof(pub)));
+	NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+	nng_msg_free(msg);
+
+	// This announces the largest packet there is, but carries one byte.
+	// The client hangs up as soon as it sees the length, rather than
+	// allocating for it and waiting for the rest.
+	NUTS_PASS(broker_send(b, huge, sizeof(huge)));
+	rv = broker_recv(b, &type, buf, &len);
+	NUTS_TRUE(rv != 0 && rv != NNG_ETIMEDOUT);
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+}
+
+void
+test_recv_max_size(void)
+{
+	test_broker b;
+
+	broker_start(&b);
+	recv_max_size(&b);
+	broker_stop(&b);
+
+	// The WebSocket stream has a receive limit of its own, which must
+	// not take the place of ours.
+	broker_start_ws(&b);
+	recv_max_size(&b);
+	broker_stop(&b);
+}
+
+void
+test_websocket(void)
+{
+	test_broker b;
+	nng_socket  sock;
+	nng_msg *   connmsg;
+	nng_msg *   msg;
+	uint8_t     type;
+	uint8_t *   buf;
+	uint8_t *   pl;
+	uint32_t    n;
+	size_t      len;
+	const int   big = 200000; // several WebSocket frames
+	const int   sz  = big + 16;
+
+	broker_start_ws(&b);
+	broker_connect(&b, &sock, &connmsg);
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECVTIMEO, 1000));
+
+	NUTS_TRUE((buf = nng_alloc(sz)) != NULL);
+	for (int i = 0; i < big; i++) {
+		buf[i] = (uint8_t) i;
+	}
+	NUTS_PASS(nng_sendmsg(sock, publish_msg("t", 0, buf, big), 0));
+
+	// The broker echoes the publish back.
+	len = sz - 4;
+	NUTS_PASS(broker_recv(&b, &type, buf + 4, &len));
+	NUTS_TRUE(type == 0x30);
+	NUTS_TRUE(len == (size_t) big + 3);
+	buf[0] = 0x30;
+	buf[1] = (uint8_t) ((len & 0x7f) | 0x80);
+	buf[2] = (uint8_t) (((len >> 7) & 0x7f) | 0x80);
+	buf[3] = (uint8_t) (len >> 14);
+	NUTS_PASS(broker_send(&b, buf, len + 4));
+
+	NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+	pl = nng_mqtt_msg_get_publish_payload(msg, &n);
+	NUTS_TRUE(n == (uint32_t) big);
+	for (int i = 0; i < big; i++) {
+		if (pl[i] != (uint8_t) i) {
+			NUTS_FAIL(pl[i], (uint8_t) i);
+			break;
+		}
+	}
+	nng_msg_free(msg);
+	nng_free(buf, sz);
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg);
+	broker_stop(&b);
+}
+
+void
+test_shards(void)
+{
+	test_broker b[2];
+	nng_socket  sock;
+	nng_msg *   connmsg[2];
+	nng_msg *   msg;
+	nng_aio *   aio;
+	nng_aio *   qaio[2];
+	uint8_t     type;
+	uint8_t     buf[256];
+	size_t      len;
+	int         v;
+	int         n[2] = { 0, 0 };
+	uint8_t     pub[] = { 0x30, 0x04, 0x00, 0x01, 'i', 'x' };
+	uint8_t     suback[] = { 0x90, 0x03, 0x00, 0x00, 0x00 };
+	uint8_t     puback[] = { 0x40, 0x02, 0x00, 0x00 };
+
+	broker_start(&b[0]);
+	broker_start(&b[1]);
+	NUTS_PASS(nng_mqtt_client_open(&sock));
+	NUTS_PASS(nng_socket_get_int(sock, NNG_OPT_MQTT_SHARD_POLICY, &v));
+	NUTS_TRUE(v == NNG_MQTT_SHARD_TOPIC);
+	NUTS_FAIL(nng_socket_set_int(sock, NNG_OPT_MQTT_SHARD_POLICY, 2),
+	    NNG_EINVAL);
+	broker_dial(&b[0], sock, &connmsg[0], false);
+	broker_dial(&b[1], sock, &connmsg[1], false);
+
+	// In turn, the connections take one publish each.
+	NUTS_PASS(nng_socket_set_int(
+	    sock, NNG_OPT_MQTT_SHARD_POLICY, NNG_MQTT_SHARD_ROUND_ROBIN));
+	for (int i = 0; i < 4; i++) {
+		NUTS_PASS(nng_sendmsg(sock, publish_msg("rr", 0, "r", 1), 0));
+	}
+	for (int i = 0; i < 4; i++) {
+		len = sizeof(buf);
+		NUTS_PASS(broker_recv(&b[i % 2], &type, buf, &len));
+		NUTS_TRUE(type == 0x30);
+	}
+
+	// By topic, they all go on the same one.
+	NUTS_PASS(nng_socket_set_int(
+	    sock, NNG_OPT_MQTT_SHARD_POLICY, NNG_MQTT_SHARD_TOPIC));
+	for (int i = 0; i < 3; i++) {
+		NUTS_PASS(nng_sendmsg(sock, publish_msg("t/1", 0, "t", 1), 0));
+	}
+	for (int i = 0; i < 2; i++) {
+		nng_aio_set_timeout(b[i].aio, 500);
+		for (;;) {
+			len = sizeof(buf);
+			if (broker_recv(&b[i], &type, buf, &len) != 0) {
+				break;
+			}
+			n[i]++;
+		}
+		nng_aio_set_timeout(b[i].aio, 5000);
+	}
+	NUTS_TRUE(n[0] + n[1] == 3);
+	NUTS_TRUE(n[0] == 0 || n[1] == 0);
+
+	// Subscriptions are made on both, and the caller waits for the
+	// first connection's SUBACK.
+	NUTS_PASS(nng_aio_alloc(&aio, NULL, NULL));
+	nng_aio_set_timeout(aio, 5000);
+	NUTS_PASS(nng_mqtt_subscribe_aio(sock, "$share/g/i", aio));
+	for (int i = 0; i < 2; i++) {
+		len = sizeof(buf);
+		NUTS_PASS(broker_recv(&b[i], &type, buf, &len));
+		NUTS_TRUE(type == 0x82);
+		suback[2] = buf[0];
+		suback[3] = buf[1];
+		NUTS_PASS(broker_send(&b[i], suback, sizeof(suback)));
+	}
+	nng_aio_wait(aio);
+	NUTS_PASS(nng_aio_result(aio));
+	nng_aio_free(aio);
+
+	// What either receives comes out of the socket.
+	NUTS_PASS(broker_send(&b[0], pub, sizeof(pub)));
+	NUTS_PASS(broker_send(&b[1], pub, sizeof(pub)));
+	NUTS_PASS(nng_socket_set_ms(sock, NNG_OPT_RECVTIMEO, 1000));
+	for (int i = 0; i < 2; i++) {
+		NUTS_PASS(nng_recvmsg(sock, &msg, 0));
+		nng_msg_free(msg);
+	}
+
+	// A publish left over from a connection that is gone for good is
+	// new to the other one's session, and is not sent as a duplicate.
+	NUTS_PASS(nng_socket_set_int(
+	    sock, NNG_OPT_MQTT_SHARD_POLICY, NNG_MQTT_SHARD_ROUND_ROBIN));
+	for (int i = 0; i < 2; i++) {
+		NUTS_PASS(nng_aio_alloc(&qaio[i], NULL, NULL));
+		nng_aio_set_msg(qaio[i], publish_msg("q", 1, "q", 1));
+		nng_send_aio(sock, qaio[i]);
+		len = sizeof(buf);
+		NUTS_PASS(broker_recv(&b[i], &type, buf, &len));
+		NUTS_TRUE(type == 0x32);
+	}
+	nng_stream_listener_close(b[0].l);
+	nng_stream_free(b[0].s);
+	b[0].s = NULL;
+	NUTS_SLEEP(100);
+	broker_accept(&b[1], true);
+	for (int i = 0; i < 2; i++) {
+		len = sizeof(buf);
+		NUTS_PASS(broker_recv(&b[1], &type, buf, &len));
+		NUTS_TRUE(type == (i == 0 ? 0x32 : 0x3a));
+		puback[2] = buf[3];
+		puback[3] = buf[4];
+		NUTS_PASS(broker_send(&b[1], puback, sizeof(puback)));
+	}
+	for (int i = 0; i < 2; i++) {
+		nng_aio_wait(qaio[i]);
+		NUTS_PASS(nng_aio_result(qaio[i]));
+		nng_aio_free(qaio[i]);
+	}
+
+	NUTS_CLOSE(sock);
+	nng_msg_free(connmsg[0]);
+	nng_msg_free(connmsg[1]);
+	broker_stop(&b[0]);
+	broker_stop(&b[1]);
+}
+
+TEST_LIST = {
+	{ "send batch option", test_send_batch_option },
+	{ "send batch", test_send_batch },
+	{ "send window options", test_send_window_options },
+	{ "send window block", test_send_window_block },
+	{ "send window drop newest", test_send_window_drop_newest },
+	{ "send window drop oldest", test_send_window_drop_oldest },
+	{ "retry interval option", test_retry_interval_option },
+	{ "retry backoff", test_retry_backoff },
+	{ "qos2 publish", test_qos2_publish },
+	{ "session file", test_session_file },
+	{ "reconnect resend", test_reconnect_resend },
+	{ "ctx subscribe", test_ctx_subscribe },
+	{ "subscribe batch", test_subscribe_batch },
+	{ "resubscribe", test_resubscribe },
+	{ "topic alias", test_topic_alias },
+	{ "server limits", test_server_limits },
+	{ "publish payload ref", test_publish_payload_ref },
+	{ "recv undecoded", test_recv_undecoded },
+	{ "recv qos2 dup", test_recv_qos2_dup },
+	{ "recv queue", test_recv_queue },
+	{ "recv watermark", test_recv_watermark },
+	{ "keepalive", test_keepalive },
+	{ "ack batch", test_ack_batch },
+	{ "recv large", test_recv_large },
+	{ "recv max size", test_recv_max_size },
+	{ "websocket", test_websocket },
+	{ "shards", test_shards },
+	{ NULL, NULL },
+};
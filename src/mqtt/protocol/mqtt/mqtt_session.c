@@ -0,0 +1,365 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "core/nng_impl.h"
+#include "mqtt_session.h"
+#include "supplemental/mqtt/mqtt_msg.h"
+
+// Log records are an operation byte, the packet id and the length of
+// the packet that follows, all big-endian.  A record cut short by a
+// crash is simply dropped when the log is loaded.
+#define MQTT_SESSION_PUT 1
+#define MQTT_SESSION_DEL 2
+#define MQTT_SESSION_REC_HDR 7
+
+// The log is rewritten once it is at least this big, and more than
+// half of it is stale.
+#define MQTT_SESSION_COMPACT_MIN (64 * 1024)
+
+struct nni_mqtt_session {
+	char *         path;
+	char *         tmp_path;
+	nni_file_logh *log;    // open for appending, or NULL
+	nni_msg **     msgs;   // 64K, indexed by packet id
+	uint32_t       count;  // packets recorded
+	size_t         live;   // bytes of the log that are current
+	size_t         size;   // bytes in the log
+	bool           sync;   // flush each put to stable storage
+	bool           broken; // an append failed, the log needs rewriting
+};
+
+// A payload the application lent the message is written out after its
+// body, so that the record holds the whole packet.
+static size_t
+mqtt_session_rec_len(nni_msg *msg)
+{
+	size_t plen = 0;
+
+	(void) nni_mqtt_msg_payload_ref(msg, &plen);
+	return (MQTT_SESSION_REC_HDR + nni_msg_header_len(msg) +
+	    nni_msg_len(msg) + plen);
+}
+
+static void
+mqtt_session_rec_put(uint8_t *buf, uint8_t op, uint16_t pid, nni_msg *msg)
+{
+	size_t      hlen    = msg != NULL ? nni_msg_header_len(msg) : 0;
+	size_t      blen    = msg != NULL ? nni_msg_len(msg) : 0;
+	size_t      plen    = 0;
+	const void *payload = NULL;
+
+	if (msg != NULL) {
+		payload = nni_mqtt_msg_payload_ref(msg, &plen);
+	}
+	buf[0] = op;
+	NNI_PUT16(buf + 1, pid);
+	NNI_PUT32(buf + 3, (uint32_t) (hlen + blen + plen));
+	if (msg != NULL) {
+		memcpy(buf + MQTT_SESSION_REC_HDR, nni_msg_header(msg), hlen);
+		memcpy(buf + MQTT_SESSION_REC_HDR + hlen, nni_msg_body(msg),
+		    blen);
+	}
+	if (payload != NULL) {
+		memcpy(buf + MQTT_SESSION_REC_HDR + hlen + blen, payload,
+		    plen);
+	}
+}
+
+// Rewrites the log with just the current records.  The new log is
+// written aside, flushed, and renamed over the old one, so that a crash
+// leaves one or the other behind.  This also drops whatever a failed
+// append left at the end of the log.
+static int
+mqtt_session_compact(nni_mqtt_session *s)
+{
+	nni_file_logh *tmp;
+	uint8_t *      buf = NULL;
+	size_t         off = 0;
+	uint32_t       n   = 0;
+	int            rv;
+
+	if (s->live > 0 && (buf = nni_alloc(s->live)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	for (uint32_t i = 1; i <= 0xffffu && n < s->count; i++) {
+		nni_msg *msg;
+		if ((msg = s->msgs[i]) == NULL) {
+			continue;
+		}
+		mqtt_session_rec_put(buf + off, MQTT_SESSION_PUT, i, msg);
+		off += mqtt_session_rec_len(msg);
+		n++;
+	}
+	NNI_ASSERT(off == s->live);
+	if (s->log != NULL) {
+		nni_file_log_close(s->log);
+		s->log = NULL;
+	}
+	if (((rv = nni_file_delete(s->tmp_path)) == 0) ||
+	    (rv == NNG_ENOENT)) {
+		rv = nni_file_log_open(s->tmp_path, &tmp);
+	}
+	if (rv == 0) {
+		if ((rv = nni_file_log_write(tmp, buf, off)) == 0) {
+			rv = nni_file_log_sync(tmp);
+		}
+		nni_file_log_close(tmp);
+	}
+	if ((rv == 0) && ((rv = nni_file_rename(s->tmp_path, s->path)) == 0)) {
+		s->size   = off;
+		s->broken = false;
+	}
+	if (buf != NULL) {
+		nni_free(buf, s->live);
+	}
+	return (rv);
+}
+
+// Writes a record at the end of the log.  A write that fails may leave
+// part of the record behind, so nothing more is appended until the log
+// has been rewritten.
+static int
+mqtt_session_append(nni_mqtt_session *s, uint8_t op, uint16_t pid,
+    nni_msg *msg)
+{
+	uint8_t *buf;
+	size_t   len;
+	int      rv;
+
+	if ((s->log == NULL) &&
+	    ((rv = nni_file_log_open(s->path, &s->log)) != 0)) {
+		return (rv);
+	}
+	len = msg != NULL ? mqtt_session_rec_len(msg) : MQTT_SESSION_REC_HDR;
+	if ((buf = nni_alloc(len)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	mqtt_session_rec_put(buf, op, pid, msg);
+	rv = nni_file_log_write(s->log, buf, len);
+	nni_free(buf, len);
+	if (rv != 0) {
+		s->broken = true;
+		return (rv);
+	}
+	s->size += len;
+	if (s->sync && (op == MQTT_SESSION_PUT)) {
+		return (nni_file_log_sync(s->log));
+	}
+	return (0);
+}
+
+// Records a change, given in memory already.  A broken log is rewritten
+// from memory instead, which takes the change along, and a log that is
+// mostly stale is rewritten too.
+static int
+mqtt_session_commit(
+    nni_mqtt_session *s, uint8_t op, uint16_t pid, nni_msg *msg)
+{
+	int rv = 0;
+
+	if (!s->broken) {
+		rv = mqtt_session_append(s, op, pid, msg);
+	}
+	if (s->broken) {
+		return (mqtt_session_compact(s));
+	}
+	if (s->size >= MQTT_SESSION_COMPACT_MIN && s->size > s->live * 2) {
+		// Failing to compact is harmless, the log is still valid.
+		(void) mqtt_session_compact(s);
+	}
+	return (rv);
+}
+
+static void
+mqtt_session_forget(nni_mqtt_session *s, uint16_t pid)
+{
+	nni_msg *msg;
+
+	if ((msg = s->msgs[pid]) != NULL) {
+		s->live -= mqtt_session_rec_len(msg);
+		s->count--;
+		s->msgs[pid] = NULL;
+		nni_msg_free(msg);
+	}
+}
+
+static void
+mqtt_session_keep(nni_mqtt_session *s, uint16_t pid, nni_msg *msg)
+{
+	mqtt_session_forget(s, pid);
+	s->msgs[pid] = msg;
+	s->live += mqtt_session_rec_len(msg);
+	s->count++;
+}
+
+// Splits a stored packet back into the fixed header and the rest.
+static int
+mqtt_session_decode(nni_msg **msgp, const uint8_t *buf, size_t len)
+{
+	nni_msg *msg;
+	size_t   hlen = 1;
+	int      rv;
+
+	do {
+		if (hlen >= len || hlen > 4) {
+			return (NNG_EPROTO);
+		}
+	} while ((buf[hlen++] & 0x80) != 0);
+
+	if ((rv = nni_msg_alloc(&msg, len - hlen)) != 0) {
+		return (rv);
+	}
+	if ((rv = nni_msg_header_append(msg, buf, hlen)) != 0) {
+		nni_msg_free(msg);
+		return (rv);
+	}
+	memcpy(nni_msg_body(msg), buf + hlen, len - hlen);
+	*msgp = msg;
+	return (0);
+}
+
+static int
+mqtt_session_load(nni_mqtt_session *s)
+{
+	uint8_t *data;
+	size_t   size;
+	size_t   off = 0;
+	int      rv;
+
+	if ((rv = nni_file_get(s->path, (void **) &data, &size)) != 0) {
+		return (rv == NNG_ENOENT ? 0 : rv);
+	}
+	while (off + MQTT_SESSION_REC_HDR <= size) {
+		uint8_t  op = data[off];
+		uint16_t pid;
+		uint32_t len;
+		nni_msg *msg;
+
+		NNI_GET16(data + off + 1, pid);
+		NNI_GET32(data + off + 3, len);
+		if (len > size - off - MQTT_SESSION_REC_HDR) {
+			break; // torn write
+		}
+		off += MQTT_SESSION_REC_HDR;
+		if (pid == 0) {
+			rv = NNG_EPROTO;
+			break;
+		}
+		if (op == MQTT_SESSION_PUT) {
+			if ((rv = mqtt_session_decode(&msg, data + off, len)) !=
+			    0) {
+				break;
+			}
+			mqtt_session_keep(s, pid, msg);
+		} else if (op == MQTT_SESSION_DEL) {
+			mqtt_session_forget(s, pid);
+		} else {
+			rv = NNG_EPROTO;
+			break;
+		}
+		off += len;
+	}
+	if (data != NULL) {
+		nni_free(data, size);
+	}
+	if (rv != 0) {
+		return (rv);
+	}
+	s->size = size;
+	if (s->size > s->live) {
+		// drop the stale records, and any torn tail
+		return (mqtt_session_compact(s));
+	}
+	return (0);
+}
+
+int
+nni_mqtt_session_open(nni_mqtt_session **sp, const char *path)
+{
+	nni_mqtt_session *s;
+	size_t            len;
+	int               rv;
+
+	if ((s = NNI_ALLOC_STRUCT(s)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	len = strlen(path) + sizeof(".tmp");
+	if (((s->path = nni_strdup(path)) == NULL) ||
+	    ((s->tmp_path = nni_alloc(len)) == NULL) ||
+	    ((s->msgs = nni_zalloc(0x10000 * sizeof(nni_msg *))) == NULL)) {
+		nni_mqtt_session_close(s);
+		return (NNG_ENOMEM);
+	}
+	(void) snprintf(s->tmp_path, len, "%s.tmp", path);
+	s->sync = true;
+	if ((rv = mqtt_session_load(s)) != 0) {
+		nni_mqtt_session_close(s);
+		return (rv);
+	}
+	*sp = s;
+	return (0);
+}
+
+void
+nni_mqtt_session_close(nni_mqtt_session *s)
+{
+	if (s->log != NULL) {
+		nni_file_log_close(s->log);
+	}
+	if (s->msgs != NULL) {
+		for (uint32_t i = 1; i <= 0xffffu && s->count > 0; i++) {
+			mqtt_session_forget(s, (uint16_t) i);
+		}
+		nni_free(s->msgs, 0x10000 * sizeof(nni_msg *));
+	}
+	if (s->tmp_path != NULL) {
+		nni_free(s->tmp_path, strlen(s->path) + sizeof(".tmp"));
+	}
+	nni_strfree(s->path);
+	NNI_FREE_STRUCT(s);
+}
+
+void
+nni_mqtt_session_set_sync(nni_mqtt_session *s, bool sync)
+{
+	s->sync = sync;
+}
+
+int
+nni_mqtt_session_put(nni_mqtt_session *s, uint16_t pid, nni_msg *msg)
+{
+	nni_msg_clone(msg);
+	mqtt_session_keep(s, pid, msg);
+	return (mqtt_session_commit(s, MQTT_SESSION_PUT, pid, msg));
+}
+
+int
+nni_mqtt_session_remove(nni_mqtt_session *s, uint16_t pid)
+{
+	if (s->msgs[pid] == NULL) {
+		return (0);
+	}
+	mqtt_session_forget(s, pid);
+	return (mqtt_session_commit(s, MQTT_SESSION_DEL, pid, NULL));
+}
+
+nni_msg *
+nni_mqtt_session_get(nni_mqtt_session *s, uint16_t pid)
+{
+	return (s->msgs[pid]);
+}
+
+uint32_t
+nni_mqtt_session_count(nni_mqtt_session *s)
+{
+	return (s->count);
+}
@@ -0,0 +1,57 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NNG_MQTT_PROTOCOL_MQTT_MQTT_SESSION_H
+#define NNG_MQTT_PROTOCOL_MQTT_MQTT_SESSION_H
+
+#include "core/nng_impl.h"
+
+// A session store keeps the outbound QoS 1 and QoS 2 packets that have
+// not been acknowledged yet, keyed by packet id, so that they survive a
+// restart of the client.  Each packet is kept encoded, exactly as it
+// goes on the wire: a PUBLISH, or the PUBREL that replaced it.
+//
+// The store is an append-only log of put and remove records.  The whole
+// log is read back when the store is opened, and it is rewritten with
+// only the current records once most of it is stale.  The log is kept
+// open, and by default each put is flushed to stable storage before it
+// returns; removes are not, as losing one just sends the packet again.
+// All of this is synchronous file I/O, and the caller must serialize
+// access.
+typedef struct nni_mqtt_session nni_mqtt_session;
+
+// nni_mqtt_session_open opens the store kept in the named file, loading
+// whatever it already contains.
+extern int  nni_mqtt_session_open(nni_mqtt_session **, const char *);
+extern void nni_mqtt_session_close(nni_mqtt_session *);
+
+// nni_mqtt_session_set_sync sets whether puts are flushed to stable
+// storage.  Without it a put can be lost to a power failure, though not
+// to the process exiting.
+extern void nni_mqtt_session_set_sync(nni_mqtt_session *, bool);
+
+// nni_mqtt_session_put records the encoded packet for the packet id,
+// replacing any earlier one.  The store holds a reference to the message
+// rather than a copy.  The packet is kept in memory even if the file
+// could not be written, and the error is returned; the file is rewritten
+// on the next change.
+extern int nni_mqtt_session_put(nni_mqtt_session *, uint16_t, nni_msg *);
+
+// nni_mqtt_session_remove forgets the packet id, and like put, returns
+// an error if the file could not be written.
+extern int nni_mqtt_session_remove(nni_mqtt_session *, uint16_t);
+
+// nni_mqtt_session_get returns the packet recorded for the id, or NULL.
+// The message still belongs to the store.
+extern nni_msg *nni_mqtt_session_get(nni_mqtt_session *, uint16_t);
+
+// nni_mqtt_session_count returns the number of packets recorded.
+extern uint32_t nni_mqtt_session_count(nni_mqtt_session *);
+
+#endif // NNG_MQTT_PROTOCOL_MQTT_MQTT_SESSION_H
@@ -0,0 +1,437 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "core/nng_impl.h"
+#include "mqtt_trie.h"
+
+typedef struct mqtt_trie_node mqtt_trie_node;
+
+// The children of a node are kept sorted by level name so that the
+// next level of a topic is found with a binary search.  The wildcard
+// children are kept aside, as every match has to look at them anyway.
+struct mqtt_trie_node {
+	char *           word;
+	size_t           wlen;
+	mqtt_trie_node **kids;
+	size_t           nkids;
+	size_t           kcap;
+	mqtt_trie_node * plus; // '+' child
+	mqtt_trie_node * hash; // '#' child
+	void **          subs;
+	size_t           nsubs;
+	size_t           scap;
+};
+
+struct nni_mqtt_trie {
+	mqtt_trie_node root;
+};
+
+// Returns the length of the level starting at the topic.
+static size_t
+mqtt_trie_level(const char *topic, size_t len)
+{
+	const char *end;
+
+	if ((end = memchr(topic, '/', len)) == NULL) {
+		return (len);
+	}
+	return ((size_t) (end - topic));
+}
+
+static int
+mqtt_trie_word_cmp(const mqtt_trie_node *n, const char *word, size_t len)
+{
+	int rv;
+
+	rv = memcmp(n->word, word, n->wlen < len ? n->wlen : len);
+	if (rv == 0 && n->wlen != len) {
+		rv = n->wlen < len ? -1 : 1;
+	}
+	return (rv);
+}
+
+// Finds the child for the level, or where it would be inserted.
+static mqtt_trie_node *
+mqtt_trie_find(mqtt_trie_node *n, const char *word, size_t len, size_t *posp)
+{
+	size_t lo = 0;
+	size_t hi = n->nkids;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int    rv  = mqtt_trie_word_cmp(n->kids[mid], word, len);
+		if (rv == 0) {
+			*posp = mid;
+			return (n->kids[mid]);
+		}
+		if (rv < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*posp = lo;
+	return (NULL);
+}
+
+static void mqtt_trie_node_free(mqtt_trie_node *);
+
+static void
+mqtt_trie_node_clear(mqtt_trie_node *n)
+{
+	for (size_t i = 0; i < n->nkids; i++) {
+		mqtt_trie_node_free(n->kids[i]);
+	}
+	if (n->plus != NULL) {
+		mqtt_trie_node_free(n->plus);
+	}
+	if (n->hash != NULL) {
+		mqtt_trie_node_free(n->hash);
+	}
+	if (n->kcap > 0) {
+		nni_free(n->kids, n->kcap * sizeof(mqtt_trie_node *));
+	}
+	if (n->scap > 0) {
+		nni_free(n->subs, n->scap * sizeof(void *));
+	}
+}
+
+static void
+mqtt_trie_node_free(mqtt_trie_node *n)
+{
+	mqtt_trie_node_clear(n);
+	nni_free(n->word, n->wlen + 1);
+	NNI_FREE_STRUCT(n);
+}
+
+static bool
+mqtt_trie_node_empty(mqtt_trie_node *n)
+{
+	return (n->nsubs == 0 && n->nkids == 0 && n->plus == NULL &&
+	    n->hash == NULL);
+}
+
+static mqtt_trie_node *
+mqtt_trie_node_alloc(const char *word, size_t len)
+{
+	mqtt_trie_node *n;
+
+	if ((n = NNI_ALLOC_STRUCT(n)) == NULL) {
+		return (NULL);
+	}
+	if ((n->word = nni_alloc(len + 1)) == NULL) {
+		NNI_FREE_STRUCT(n);
+		return (NULL);
+	}
+	memcpy(n->word, word, len);
+	n->word[len] = '\0';
+	n->wlen      = len;
+	return (n);
+}
+
+// Returns the child for the level, creating it if needed.
+static mqtt_trie_node *
+mqtt_trie_child(mqtt_trie_node *n, const char *word, size_t len)
+{
+	mqtt_trie_node * kid;
+	mqtt_trie_node **slot = NULL;
+	size_t           pos;
+
+	if (len == 1 && word[0] == '+') {
+		slot = &n->plus;
+	} else if (len == 1 && word[0] == '#') {
+		slot = &n->hash;
+	}
+	if (slot != NULL) {
+		if (*slot == NULL) {
+			*slot = mqtt_trie_node_alloc(word, len);
+		}
+		return (*slot);
+	}
+
+	if ((kid = mqtt_trie_find(n, word, len, &pos)) != NULL) {
+		return (kid);
+	}
+	if (n->nkids == n->kcap) {
+		mqtt_trie_node **kids;
+		size_t           cap = n->kcap == 0 ? 4 : n->kcap * 2;
+		if ((kids = nni_alloc(cap * sizeof(*kids))) == NULL) {
+			return (NULL);
+		}
+		if (n->kcap > 0) {
+			memcpy(kids, n->kids, n->nkids * sizeof(*kids));
+			nni_free(n->kids, n->kcap * sizeof(*kids));
+		}
+		n->kids = kids;
+		n->kcap = cap;
+	}
+	if ((kid = mqtt_trie_node_alloc(word, len)) == NULL) {
+		return (NULL);
+	}
+	memmove(&n->kids[pos + 1], &n->kids[pos],
+	    (n->nkids - pos) * sizeof(mqtt_trie_node *));
+	n->kids[pos] = kid;
+	n->nkids++;
+	return (kid);
+}
+
+// Detaches the child if nothing hangs off it any more.
+static void
+mqtt_trie_prune(mqtt_trie_node *n, mqtt_trie_node *kid)
+{
+	size_t pos;
+
+	if (!mqtt_trie_node_empty(kid)) {
+		return;
+	}
+	if (kid == n->plus) {
+		n->plus = NULL;
+	} else if (kid == n->hash) {
+		n->hash = NULL;
+	} else if (mqtt_trie_find(n, kid->word, kid->wlen, &pos) == kid) {
+		n->nkids--;
+		memmove(&n->kids[pos], &n->kids[pos + 1],
+		    (n->nkids - pos) * sizeof(mqtt_trie_node *));
+	}
+	mqtt_trie_node_free(kid);
+}
+
+int
+nni_mqtt_trie_init(nni_mqtt_trie **tp)
+{
+	nni_mqtt_trie *t;
+
+	if ((t = NNI_ALLOC_STRUCT(t)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	*tp = t;
+	return (0);
+}
+
+void
+nni_mqtt_trie_fini(nni_mqtt_trie *t)
+{
+	mqtt_trie_node_clear(&t->root);
+	NNI_FREE_STRUCT(t);
+}
+
+static int
+mqtt_trie_add_sub(mqtt_trie_node *n, void *sub)
+{
+	for (size_t i = 0; i < n->nsubs; i++) {
+		if (n->subs[i] == sub) {
+			return (0);
+		}
+	}
+	if (n->nsubs == n->scap) {
+		void **subs;
+		size_t cap = n->scap == 0 ? 4 : n->scap * 2;
+		if ((subs = nni_alloc(cap * sizeof(void *))) == NULL) {
+			return (NNG_ENOMEM);
+		}
+		if (n->scap > 0) {
+			memcpy(subs, n->subs, n->nsubs * sizeof(void *));
+			nni_free(n->subs, n->scap * sizeof(void *));
+		}
+		n->subs = subs;
+		n->scap = cap;
+	}
+	n->subs[n->nsubs++] = sub;
+	return (0);
+}
+
+static int
+mqtt_trie_insert(mqtt_trie_node *n, const char *filter, size_t len, void *sub)
+{
+	size_t          wlen = mqtt_trie_level(filter, len);
+	mqtt_trie_node *kid;
+	int             rv;
+
+	if ((kid = mqtt_trie_child(n, filter, wlen)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	if (wlen < len) {
+		rv = mqtt_trie_insert(
+		    kid, filter + wlen + 1, len - wlen - 1, sub);
+	} else {
+		rv = mqtt_trie_add_sub(kid, sub);
+	}
+	if (rv != 0) {
+		// Drop the levels this call created.
+		mqtt_trie_prune(n, kid);
+	}
+	return (rv);
+}
+
+int
+nni_mqtt_trie_insert(nni_mqtt_trie *t, const char *filter, void *sub)
+{
+	if (!nni_mqtt_topic_filter_valid(filter)) {
+		return (NNG_EINVAL);
+	}
+	return (mqtt_trie_insert(&t->root, filter, strlen(filter), sub));
+}
+
+static int
+mqtt_trie_remove(mqtt_trie_node *n, const char *filter, size_t len, void *sub)
+{
+	size_t          wlen = mqtt_trie_level(filter, len);
+	mqtt_trie_node *kid;
+	size_t          pos;
+	int             rv;
+
+	if (wlen == 1 && filter[0] == '+') {
+		kid = n->plus;
+	} else if (wlen == 1 && filter[0] == '#') {
+		kid = n->hash;
+	} else {
+		kid = mqtt_trie_find(n, filter, wlen, &pos);
+	}
+	if (kid == NULL) {
+		return (NNG_ENOENT);
+	}
+
+	if (wlen < len) {
+		rv = mqtt_trie_remove(
+		    kid, filter + wlen + 1, len - wlen - 1, sub);
+	} else {
+		rv = NNG_ENOENT;
+		for (size_t i = 0; i < kid->nsubs; i++) {
+			if (kid->subs[i] == sub) {
+				kid->subs[i] = kid->subs[--kid->nsubs];
+				rv           = 0;
+				break;
+			}
+		}
+	}
+	if (rv == 0) {
+		mqtt_trie_prune(n, kid);
+	}
+	return (rv);
+}
+
+int
+nni_mqtt_trie_remove(nni_mqtt_trie *t, const char *filter, void *sub)
+{
+	return (mqtt_trie_remove(&t->root, filter, strlen(filter), sub));
+}
+
+void *
+nni_mqtt_trie_find(nni_mqtt_trie *t, const char *filter)
+{
+	mqtt_trie_node *n   = &t->root;
+	size_t          len = strlen(filter);
+	size_t          pos;
+
+	for (;;) {
+		size_t wlen = mqtt_trie_level(filter, len);
+
+		if (wlen == 1 && filter[0] == '+') {
+			n = n->plus;
+		} else if (wlen == 1 && filter[0] == '#') {
+			n = n->hash;
+		} else {
+			n = mqtt_trie_find(n, filter, wlen, &pos);
+		}
+		if (n == NULL) {
+			return (NULL);
+		}
+		if (wlen == len) {
+			break;
+		}
+		filter += wlen + 1;
+		len -= wlen + 1;
+	}
+	return (n->nsubs > 0 ? n->subs[0] : NULL);
+}
+
+static size_t
+mqtt_trie_deliver(mqtt_trie_node *n, nni_mqtt_trie_cb cb, void *arg)
+{
+	if (n == NULL) {
+		return (0);
+	}
+	for (size_t i = 0; i < n->nsubs; i++) {
+		cb(n->subs[i], arg);
+	}
+	return (n->nsubs);
+}
+
+static size_t
+mqtt_trie_match(mqtt_trie_node *n, const char *topic, size_t len, bool top,
+    nni_mqtt_trie_cb cb, void *arg)
+{
+	size_t          wlen = mqtt_trie_level(topic, len);
+	mqtt_trie_node *kids[2];
+	size_t          pos;
+	size_t          cnt = 0;
+
+	// Topics starting with '$' are not matched by a leading wildcard.
+	if (top && wlen > 0 && topic[0] == '$') {
+		kids[0] = NULL;
+	} else {
+		cnt += mqtt_trie_deliver(n->hash, cb, arg);
+		kids[0] = n->plus;
+	}
+	kids[1] = mqtt_trie_find(n, topic, wlen, &pos);
+
+	for (int i = 0; i < 2; i++) {
+		mqtt_trie_node *kid = kids[i];
+		if (kid == NULL) {
+			continue;
+		}
+		if (wlen < len) {
+			cnt += mqtt_trie_match(kid, topic + wlen + 1,
+			    len - wlen - 1, false, cb, arg);
+		} else {
+			// "a/#" also matches "a" itself.
+			cnt += mqtt_trie_deliver(kid, cb, arg);
+			cnt += mqtt_trie_deliver(kid->hash, cb, arg);
+		}
+	}
+	return (cnt);
+}
+
+size_t
+nni_mqtt_trie_match(nni_mqtt_trie *t, const char *topic, size_t len,
+    nni_mqtt_trie_cb cb, void *arg)
+{
+	return (mqtt_trie_match(&t->root, topic, len, true, cb, arg));
+}
+
+bool
+nni_mqtt_topic_filter_valid(const char *filter)
+{
+	size_t len = strlen(filter);
+
+	if (len == 0 || len > 0xffff) {
+		return (false);
+	}
+	for (size_t i = 0; i < len; i++) {
+		bool start = (i == 0) || (filter[i - 1] == '/');
+		bool end   = (i + 1 == len) || (filter[i + 1] == '/');
+		switch (filter[i]) {
+		case '#':
+			if (!start || i + 1 != len) {
+				return (false);
+			}
+			break;
+		case '+':
+			if (!start || !end) {
+				return (false);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return (true);
+}
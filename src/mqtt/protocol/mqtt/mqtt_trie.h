@@ -0,0 +1,51 @@
+//
+// Copyright 2020 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NNG_MQTT_PROTOCOL_MQTT_MQTT_TRIE_H
+#define NNG_MQTT_PROTOCOL_MQTT_MQTT_TRIE_H
+
+#include "core/nng_impl.h"
+
+// A topic trie maps MQTT topic filters to the subscribers of each
+// filter.  There is one node per filter level, so matching a topic
+// visits a number of nodes bounded by the depth of the topic and the
+// wildcards on the way, however many filters are in the trie.  The
+// caller must serialize access.
+typedef struct nni_mqtt_trie nni_mqtt_trie;
+
+// nni_mqtt_trie_cb is called once for every subscriber of every filter
+// that matches the topic, with the subscriber and the caller's argument.
+typedef void (*nni_mqtt_trie_cb)(void *, void *);
+
+extern int  nni_mqtt_trie_init(nni_mqtt_trie **);
+extern void nni_mqtt_trie_fini(nni_mqtt_trie *);
+
+// nni_mqtt_trie_insert adds the subscriber to the filter.  Adding it a
+// second time has no effect.  The filter must be valid.
+extern int nni_mqtt_trie_insert(nni_mqtt_trie *, const char *, void *);
+
+// nni_mqtt_trie_remove takes the subscriber off the filter, returning
+// NNG_ENOENT if it was not there.
+extern int nni_mqtt_trie_remove(nni_mqtt_trie *, const char *, void *);
+
+// nni_mqtt_trie_find returns a subscriber of exactly this filter, or
+// NULL if there is none.
+extern void *nni_mqtt_trie_find(nni_mqtt_trie *, const char *);
+
+// nni_mqtt_trie_match calls back for the subscribers of every filter
+// matching the topic, which is not zero terminated.  It returns the
+// number of calls made.
+extern size_t nni_mqtt_trie_match(
+    nni_mqtt_trie *, const char *, size_t, nni_mqtt_trie_cb, void *);
+
+// nni_mqtt_topic_filter_valid checks the placement of wildcards: '#'
+// only as the whole of the last level and '+' only as a whole level.
+extern bool nni_mqtt_topic_filter_valid(const char *);
+
+#endif // NNG_MQTT_PROTOCOL_MQTT_MQTT_TRIE_H
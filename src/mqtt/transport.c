@@ -55,6 +55,9 @@ extern void nni_mqtt_tcp_register();
 #ifdef NNG_TRANSPORT_MQTT_TLS
 extern void nni_mqtts_tcp_register();
 #endif
+#ifdef NNG_TRANSPORT_MQTT_WS
+extern void nni_mqtt_ws_register();
+#endif
 
 void
 nni_mqtt_tran_sys_init(void)
@@ -68,6 +71,9 @@ nni_mqtt_tran_sys_init(void)
 #ifdef NNG_TRANSPORT_MQTT_TLS
 	nni_mqtts_tcp_register();
 #endif
+#ifdef NNG_TRANSPORT_MQTT_WS
+	nni_mqtt_ws_register();
+#endif
 }
 
 // nni_mqtt_tran_sys_fini finalizes the entire transport system, including all
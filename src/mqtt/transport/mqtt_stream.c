@@ -0,0 +1,1807 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/nng_impl.h"
+#include "mqtt/transport/mqtt_stream.h"
+#include "nng/mqtt/mqtt_client.h"
+#include "supplemental/mqtt/mqtt_msg.h"
+
+// MQTT framing over a byte stream.  This is the whole of the MQTT TCP, TLS
+// and WebSocket transports: they differ only in the stream that their URL
+// schemes select, so anything done here applies to all of them.
+
+typedef struct mqtt_stream_pipe mqtt_stream_pipe;
+typedef struct mqtt_stream_ep   mqtt_stream_ep;
+
+// Bytes read from the connection at once, and so the largest packet that
+// is received without a read of its own.
+#define MQTT_RECV_BUF (64 * 1024)
+// The WebSocket subprotocol of MQTT.
+#define MQTT_WS_PROTOCOL "mqtt"
+// Acknowledgements that may wait while a write of earlier ones is going.
+#define MQTT_ACK_MAX 128
+
+// mqtt_stream_pipe is one connection to the server.
+struct mqtt_stream_pipe {
+	nng_stream *    conn;
+	nni_pipe *      npipe;
+	uint16_t        peer;
+	uint16_t        proto;
+	uint8_t         version; // MQTT protocol level of our CONNECT
+	uint16_t        rcv_max;    // server's Receive Maximum
+	uint32_t        max_packet; // server's Maximum Packet Size, or 0
+	nni_duration    keepalive; // zero for none
+	nni_time        last_tx;   // when we last wrote anything
+	nni_time        last_rx;   // when we last read anything
+	nni_time        ping_time; // when the unanswered PINGREQ went, or 0
+	bool            pinging;   // pingaio is busy
+	uint8_t         pingreq[2];
+	size_t          rcvmax;
+	bool            closed;
+	nni_list_node   node;
+	mqtt_stream_ep *ep;
+	nni_atomic_flag reaped;
+	nni_reap_node   reap;
+	uint8_t         txlen[sizeof(uint64_t)];
+	uint8_t         rxlen[sizeof(uint64_t)]; // CONNACK header
+	uint8_t *       rxbuf; // read ahead of the packets taken from it
+	size_t          rxpos; // where the bytes not taken yet start
+	size_t          rxcnt; // and how many there are
+	size_t          rxgot; // body bytes of rxmsg read so far
+	size_t          rxwant; // and how many it has in all
+	size_t          gottxhead;
+	size_t          gotrxhead;
+	size_t          wanttxhead;
+	size_t          wantrxhead;
+	nni_list        recvq;
+	nni_list        sendq;
+	nni_aio         tmaio;
+	nni_aio         pingaio;
+	nni_aio *       txaio;
+	nni_aio *       rxaio;
+	nni_aio *       qsaio; // writes acks
+	uint8_t         acks[2][MQTT_ACK_MAX * 4]; // filling, and written
+	size_t          ack_len[2];
+	int             ack_fill;    // which half of acks new ones go to
+	bool            ack_sending; // qsaio has the other half
+	bool            ack_stalled; // reading waits for room in acks
+	nni_aio *       negoaio;
+	nni_msg *       rxmsg;
+	nni_msg *       connack; // handed to the protocol first
+	nni_msg *       smsg;
+	nni_mtx         mtx;
+};
+
+struct mqtt_stream_ep {
+	nni_mtx              mtx;
+	uint16_t             proto;
+	size_t               rcvmax;
+	bool                 fini;
+	bool                 started;
+	bool                 closed;
+	nng_url *            url;
+	const char *         host; // for dialers
+	nng_sockaddr         src;
+	int                  refcnt; // active pipes
+	nni_aio *            useraio;
+	nni_aio *            connaio;
+	nni_aio *            timeaio;
+	nni_list             busypipes; // busy pipes -- ones passed to socket
+	nni_list             waitpipes; // pipes waiting to match to socket
+	nni_list             negopipes; // pipes busy negotiating
+	nni_reap_node        reap;
+	nng_stream_dialer *  dialer;
+	nng_stream_listener *listener;
+	nni_dialer *         ndialer;
+	void *               connmsg;
+
+#ifdef NNG_ENABLE_STATS
+	nni_stat_item st_rcv_max;
+#endif
+};
+
+static void     mqtt_stream_pipe_send_start(mqtt_stream_pipe *);
+static void     mqtt_stream_pipe_recv_start(mqtt_stream_pipe *);
+static void     mqtt_stream_pipe_send_cb(void *);
+static void     mqtt_stream_pipe_qos_send_cb(void *);
+static void     mqtt_stream_pipe_recv_cb(void *);
+static void     mqtt_stream_pipe_nego_cb(void *);
+static void     mqtt_stream_pipe_close(void *);
+static void     mqtt_stream_ep_fini(void *);
+static void     mqtt_stream_pipe_fini(void *);
+static uint16_t nni_msg_get_pub_pid(nni_msg *m);
+
+static nni_reap_list stream_ep_reap_list = {
+	.rl_offset = offsetof(mqtt_stream_ep, reap),
+	.rl_func   = mqtt_stream_ep_fini,
+};
+
+static nni_reap_list stream_pipe_reap_list = {
+	.rl_offset = offsetof(mqtt_stream_pipe, reap),
+	.rl_func   = mqtt_stream_pipe_fini,
+};
+
+void
+nni_mqtt_stream_init(void)
+{
+}
+
+void
+nni_mqtt_stream_fini(void)
+{
+}
+
+// Returns the packet id of a QoS 1/2 PUBLISH, or 0 if the topic runs
+// past the end of the packet.
+static uint16_t
+nni_msg_get_pub_pid(nni_msg *m)
+{
+	uint16_t pid;
+	uint16_t len;
+	uint8_t *pos;
+
+	if (nni_msg_len(m) < 2) {
+		return (0);
+	}
+	pos = nni_msg_body(m);
+	NNI_GET16(pos, len);
+	if (nni_msg_len(m) < (size_t) len + 4) {
+		return (0);
+	}
+	NNI_GET16(pos + len + 2, pid);
+	return (pid);
+}
+
+// The keepalive engine.  We ping when either direction has been idle for
+// a keepalive interval, and a server that leaves the ping unanswered for
+// 1.5 intervals is taken to be gone, which catches half-open connections.
+// No answer can be read while reading is paused for the protocol, so the
+// wait starts over until reading goes on; a slow consumer is not a dead
+// server.  Returns false once the server is taken to be gone, for the
+// caller to close the pipe.  Must be called with the lock held.
+static bool
+mqtt_stream_pipe_keepalive(mqtt_stream_pipe *p)
+{
+	nni_time     now = nni_clock();
+	nni_duration ka  = p->keepalive;
+	nni_time     next;
+	nni_iov      iov;
+
+	if (p->ping_time != 0) {
+		if (nni_list_empty(&p->recvq) || p->ack_stalled) {
+			p->ping_time = now;
+		} else if (now >= p->ping_time + ka * 3 / 2) {
+			return (false);
+		}
+	}
+	if ((p->ping_time == 0) && !p->pinging &&
+	    ((now >= p->last_tx + ka) || (now >= p->last_rx + ka))) {
+		p->pingreq[0] = 0xC0;
+		p->pingreq[1] = 0x00;
+		iov.iov_buf   = p->pingreq;
+		iov.iov_len   = 2;
+		p->ping_time  = now;
+		p->pinging    = true;
+		nni_aio_set_iov(&p->pingaio, 1, &iov);
+		nng_stream_send(p->conn, &p->pingaio);
+	}
+	if (p->ping_time != 0) {
+		next = p->ping_time + ka * 3 / 2;
+	} else {
+		next = (p->last_tx < p->last_rx ? p->last_tx : p->last_rx) + ka;
+	}
+	// a ping still being written holds the next one back
+	if (next <= now) {
+		next = now + ka / 2;
+	}
+	nni_sleep_aio((nni_duration) (next - now), &p->tmaio);
+	return (true);
+}
+
+static void
+mqtt_pipe_timer_cb(void *arg)
+{
+	mqtt_stream_pipe *p = arg;
+
+	if (nng_aio_result(&p->tmaio) != 0) {
+		return;
+	}
+	nni_mtx_lock(&p->mtx);
+	if (p->closed || mqtt_stream_pipe_keepalive(p)) {
+		nni_mtx_unlock(&p->mtx);
+		return;
+	}
+	nni_mtx_unlock(&p->mtx);
+	// whatever the reads are doing, nothing will come of them now
+	nni_pipe_bump_error(p->npipe, NNG_ETIMEDOUT);
+	nni_pipe_close(p->npipe);
+}
+
+static void
+mqtt_stream_pipe_ping_cb(void *arg)
+{
+	mqtt_stream_pipe *p = arg;
+
+	nni_mtx_lock(&p->mtx);
+	p->pinging = false;
+	if (nni_aio_result(&p->pingaio) != 0) {
+		nni_mtx_unlock(&p->mtx);
+		mqtt_stream_pipe_close(p);
+		return;
+	}
+	p->last_tx = nni_clock();
+	nni_mtx_unlock(&p->mtx);
+}
+
+static void
+mqtt_stream_pipe_close(void *arg)
+{
+	mqtt_stream_pipe *p = arg;
+
+	nni_mtx_lock(&p->mtx);
+
+	p->closed = true;
+	nni_mtx_unlock(&p->mtx);
+
+	nni_aio_close(p->rxaio);
+	nni_aio_close(p->qsaio);
+	nni_aio_close(p->txaio);
+	nni_aio_close(p->negoaio);
+	nni_aio_close(&p->tmaio);
+	nni_aio_close(&p->pingaio);
+	nng_stream_close(p->conn);
+}
+
+static void
+mqtt_stream_pipe_stop(void *arg)
+{
+	mqtt_stream_pipe *p = arg;
+
+	nni_aio_stop(p->rxaio);
+	nni_aio_stop(p->qsaio);
+	nni_aio_stop(p->txaio);
+	nni_aio_stop(p->negoaio);
+	nni_aio_stop(&p->tmaio);
+	nni_aio_stop(&p->pingaio);
+}
+
+static int
+mqtt_stream_pipe_init(void *arg, nni_pipe *npipe)
+{
+	mqtt_stream_pipe *p = arg;
+	p->npipe             = npipe;
+
+	p->ack_len[0]  = 0;
+	p->ack_len[1]  = 0;
+	p->ack_fill    = 0;
+	p->ack_sending = false;
+	p->ack_stalled = false;
+	p->last_tx     = nni_clock();
+	p->last_rx     = p->last_tx;
+	p->ping_time   = 0;
+	p->pinging     = false;
+	if (p->keepalive > 0) {
+		nni_sleep_aio(p->keepalive, &p->tmaio);
+	}
+	return (0);
+}
+
+static void
+mqtt_stream_pipe_fini(void *arg)
+{
+	mqtt_stream_pipe *p = arg;
+	mqtt_stream_ep *  ep;
+
+	mqtt_stream_pipe_stop(p);
+	if ((ep = p->ep) != NULL) {
+		nni_mtx_lock(&ep->mtx);
+		nni_list_node_remove(&p->node);
+		ep->refcnt--;
+		if (ep->fini && (ep->refcnt == 0)) {
+			nni_reap(&stream_ep_reap_list, ep);
+		}
+		nni_mtx_unlock(&ep->mtx);
+	}
+
+	nni_aio_free(p->rxaio);
+	nni_aio_free(p->txaio);
+	nni_aio_free(p->qsaio);
+	nni_aio_free(p->negoaio);
+	nng_stream_free(p->conn);
+	nni_msg_free(p->rxmsg);
+	nni_msg_free(p->connack);
+	if (p->rxbuf != NULL) {
+		nni_free(p->rxbuf, MQTT_RECV_BUF);
+	}
+	nni_mtx_fini(&p->mtx);
+	nni_aio_fini(&p->tmaio);
+	nni_aio_fini(&p->pingaio);
+	NNI_FREE_STRUCT(p);
+}
+
+static void
+mqtt_stream_pipe_reap(mqtt_stream_pipe *p)
+{
+	if (!nni_atomic_flag_test_and_set(&p->reaped)) {
+		if (p->conn != NULL) {
+			nng_stream_close(p->conn);
+		}
+		nni_reap(&stream_pipe_reap_list, p);
+	}
+}
+
+static int
+mqtt_stream_pipe_alloc(mqtt_stream_pipe **pipep)
+{
+	mqtt_stream_pipe *p;
+	int               rv;
+
+	if ((p = NNI_ALLOC_STRUCT(p)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	nni_mtx_init(&p->mtx);
+	// alloc timer aio first, but only start it when nego is completed
+	nni_aio_init(&p->tmaio, mqtt_pipe_timer_cb, p);
+	nni_aio_init(&p->pingaio, mqtt_stream_pipe_ping_cb, p);
+	if (((rv = nni_aio_alloc(&p->txaio, mqtt_stream_pipe_send_cb, p)) !=
+	        0) ||
+	    ((rv = nni_aio_alloc(&p->rxaio, mqtt_stream_pipe_recv_cb, p)) !=
+	        0) ||
+	    ((rv = nni_aio_alloc(
+	          &p->qsaio, mqtt_stream_pipe_qos_send_cb, p)) != 0) ||
+	    ((rv = nni_aio_alloc(&p->negoaio, mqtt_stream_pipe_nego_cb, p)) !=
+	        0)) {
+		mqtt_stream_pipe_fini(p);
+		return (rv);
+	}
+	if ((p->rxbuf = nni_alloc(MQTT_RECV_BUF)) == NULL) {
+		mqtt_stream_pipe_fini(p);
+		return (NNG_ENOMEM);
+	}
+	nni_aio_list_init(&p->recvq);
+	nni_aio_list_init(&p->sendq);
+	nni_atomic_flag_reset(&p->reaped);
+
+	*pipep = p;
+
+	return (0);
+}
+
+static void
+mqtt_stream_ep_match(mqtt_stream_ep *ep)
+{
+	nni_aio *         aio;
+	mqtt_stream_pipe *p;
+
+	if (((aio = ep->useraio) == NULL) ||
+	    ((p = nni_list_first(&ep->waitpipes)) == NULL)) {
+		return;
+	}
+	nni_list_remove(&ep->waitpipes, p);
+	nni_list_append(&ep->busypipes, p);
+	ep->useraio = NULL;
+	p->rcvmax   = ep->rcvmax;
+	nni_aio_set_output(aio, 0, p);
+	nni_aio_finish_sync(aio, 0, 0);
+}
+
+static void
+mqtt_stream_pipe_nego_cb(void *arg)
+{
+	mqtt_stream_pipe *p   = arg;
+	mqtt_stream_ep *  ep  = p->ep;
+	nni_aio *         aio = p->negoaio;
+	nni_aio *         uaio;
+	int               rv;
+	int               var_int;
+	uint8_t           pos = 0;
+
+	nni_mtx_lock(&ep->mtx);
+
+	if ((rv = nni_aio_result(aio)) != 0) {
+		goto error;
+	}
+	// We start transmitting before we receive.
+	if (p->gottxhead < p->wanttxhead) {
+		p->gottxhead += nni_aio_count(aio);
+	} else if (p->gotrxhead < p->wantrxhead) {
+		p->gotrxhead += nni_aio_count(aio);
+	}
+
+	if (p->gottxhead < p->wanttxhead) {
+		nni_iov iov;
+		iov.iov_len = p->wanttxhead - p->gottxhead;
+		iov.iov_buf = &p->txlen[p->gottxhead];
+		// send it down...
+		nni_aio_set_iov(aio, 1, &iov);
+		nng_stream_send(p->conn, aio);
+		nni_mtx_unlock(&ep->mtx);
+		return;
+	}
+
+	// receving fixed header
+	if (p->gotrxhead == 0 ||
+	    (p->gotrxhead <= 5 && p->rxlen[p->gotrxhead - 1] > 0x7f &&
+	        p->rxmsg == NULL)) {
+		nni_iov iov;
+		iov.iov_buf = &p->rxlen[p->gotrxhead];
+		if (p->gotrxhead == 0) {
+			iov.iov_len = p->wantrxhead - p->gotrxhead;
+		} else {
+			iov.iov_len = 1;
+		}
+		nni_aio_set_iov(aio, 1, &iov);
+		nng_stream_recv(p->conn, aio);
+		nni_mtx_unlock(&ep->mtx);
+		return;
+	}
+
+	// finish recevied fixed header
+	if (p->rxmsg == NULL) {
+		if ((p->rxlen[0] & 0x20) != 0x20) {
+			rv = NNG_EPROTO;
+			goto error;
+		}
+
+		pos = 0;
+		if ((rv = mqtt_get_remaining_length(p->rxlen, p->gotrxhead,
+		         (uint32_t *) &var_int, &pos)) != 0) {
+			goto error;
+		}
+		// No server needs more than the buffer for its CONNACK.
+		if (((size_t) var_int > MQTT_RECV_BUF) ||
+		    ((ep->rcvmax > 0) && ((size_t) var_int > ep->rcvmax))) {
+			rv = NNG_EMSGSIZE;
+			goto error;
+		}
+
+		if ((rv = nni_mqtt_msg_alloc(&p->rxmsg, var_int)) != 0) {
+			rv = NNG_ENOMEM;
+			goto error;
+		}
+
+		nni_msg_header_append(p->rxmsg, p->rxlen, pos + 1);
+		nni_mqtt_msg_set_protocol_version(p->rxmsg, p->version);
+
+		p->wantrxhead = var_int + 1 + pos;
+		// A v5 CONNACK may carry properties after the two bytes.
+		if (var_int < 2 ||
+		    (p->version != MQTT_VERSION_5_0 && var_int != 2)) {
+			rv = NNG_EPROTO;
+			goto error;
+		}
+	}
+	// remaining length
+	if (p->gotrxhead < p->wantrxhead) {
+		nni_iov iov;
+		iov.iov_len = p->wantrxhead - p->gotrxhead;
+		iov.iov_buf = nni_msg_body(p->rxmsg) +
+		    (p->gotrxhead - nni_msg_header_len(p->rxmsg));
+		nni_aio_set_iov(aio, 1, &iov);
+		nng_stream_recv(p->conn, aio);
+		nni_mtx_unlock(&ep->mtx);
+		return;
+	}
+	if (p->gotrxhead >= p->wantrxhead) {
+		// The protocol gets the CONNACK as the first message, so
+		// that it can see whether the server kept the session.
+		rv         = nni_mqtt_msg_decode(p->rxmsg);
+		p->connack = p->rxmsg;
+		p->rxmsg   = NULL;
+		// Keep the server's limits, for the protocol to honor.
+		if (rv == MQTT_SUCCESS && p->version == MQTT_VERSION_5_0) {
+			uint32_t val;
+			if (nni_mqtt_msg_get_prop_int(p->connack,
+			        NNG_MQTT_PROP_RECEIVE_MAX, &val) == 0 &&
+			    val > 0) {
+				p->rcv_max = (uint16_t) val;
+			}
+			if (nni_mqtt_msg_get_prop_int(p->connack,
+			        NNG_MQTT_PROP_MAX_PACKET_SIZE, &val) == 0) {
+				p->max_packet = val;
+			}
+		}
+	}
+
+	// We are ready now.  We put this in the wait list, and
+	// then try to run the matcher.
+	nni_list_remove(&ep->negopipes, p);
+	nni_list_append(&ep->waitpipes, p);
+
+	if (rv == MQTT_SUCCESS) {
+		mqtt_stream_ep_match(ep);
+	}
+	nni_mtx_unlock(&ep->mtx);
+
+	return;
+
+error:
+	// If the connection is closed, we need to pass back a different
+	// error code.  This is necessary to avoid a problem where the
+	// closed status is confused with the accept file descriptor
+	// being closed.
+	if (rv == NNG_ECLOSED) {
+		rv = NNG_ECONNSHUT;
+	}
+	nng_stream_close(p->conn);
+
+	if (p->rxmsg != NULL) {
+		nni_msg_free(p->rxmsg);
+		p->rxmsg = NULL;
+	}
+
+	if ((uaio = ep->useraio) != NULL) {
+		ep->useraio = NULL;
+		nni_aio_finish_error(uaio, rv);
+	}
+	nni_mtx_unlock(&ep->mtx);
+	mqtt_stream_pipe_reap(p);
+}
+
+// Acknowledgements of received publishes collect in one half of acks
+// while the other half is being written, and then go out together, so a
+// burst of them costs one write instead of one each, and no allocations.
+// Must be called with the lock held.
+static void
+mqtt_stream_pipe_ack_flush(mqtt_stream_pipe *p)
+{
+	nni_iov iov;
+
+	if (p->ack_sending || (p->ack_len[p->ack_fill] == 0)) {
+		return;
+	}
+	iov.iov_buf    = p->acks[p->ack_fill];
+	iov.iov_len    = p->ack_len[p->ack_fill];
+	p->ack_fill    = 1 - p->ack_fill;
+	p->ack_sending = true;
+	nni_aio_set_iov(p->qsaio, 1, &iov);
+	nng_stream_send(p->conn, p->qsaio);
+}
+
+static void
+mqtt_stream_pipe_qos_send_cb(void *arg)
+{
+	mqtt_stream_pipe *p     = arg;
+	nni_aio *         qsaio = p->qsaio;
+
+	nni_mtx_lock(&p->mtx);
+	if (nni_aio_result(qsaio) != 0) {
+		nni_mtx_unlock(&p->mtx);
+		mqtt_stream_pipe_close(p);
+		return;
+	}
+	p->last_tx = nni_clock();
+	nni_aio_iov_advance(qsaio, nni_aio_count(qsaio));
+	if (nni_aio_iov_count(qsaio) > 0) {
+		nng_stream_send(p->conn, qsaio);
+		nni_mtx_unlock(&p->mtx);
+		return;
+	}
+	p->ack_len[1 - p->ack_fill] = 0;
+	p->ack_sending              = false;
+	mqtt_stream_pipe_ack_flush(p);
+	if (p->ack_stalled) {
+		p->ack_stalled = false;
+		mqtt_stream_pipe_recv_start(p);
+	}
+	nni_mtx_unlock(&p->mtx);
+}
+
+static void
+mqtt_stream_pipe_send_cb(void *arg)
+{
+	mqtt_stream_pipe *p = arg;
+	int               rv;
+	nni_aio *         aio;
+	size_t            n;
+	nni_msg *         msg;
+	nni_aio *         txaio = p->txaio;
+
+	nni_mtx_lock(&p->mtx);
+	aio = nni_list_first(&p->sendq);
+
+	if ((rv = nni_aio_result(txaio)) != 0) {
+		nni_pipe_bump_error(p->npipe, rv);
+		// Intentionally we do not queue up another transfer.
+		// There's an excellent chance that the pipe is no longer
+		// usable, with a partial transfer.
+		// The protocol should see this error, and close the
+		// pipe itself, we hope.
+		nni_aio_list_remove(aio);
+		nni_mtx_unlock(&p->mtx);
+		nni_aio_finish_error(aio, rv);
+		return;
+	}
+
+	p->last_tx = nni_clock();
+	n          = nni_aio_count(txaio);
+	nni_aio_iov_advance(txaio, n);
+	if (nni_aio_iov_count(txaio) > 0) {
+		nng_stream_send(p->conn, txaio);
+		nni_mtx_unlock(&p->mtx);
+		return;
+	}
+
+	nni_aio_list_remove(aio);
+	mqtt_stream_pipe_send_start(p);
+
+	msg = nni_aio_get_msg(aio);
+	n   = nni_msg_len(msg);
+	nni_pipe_bump_tx(p->npipe, n);
+	nni_mtx_unlock(&p->mtx);
+
+	nni_aio_set_msg(aio, NULL);
+	nni_msg_free(msg);
+	nni_aio_finish_sync(aio, 0, n);
+}
+
+// Bytes are read into rxbuf as many at a time as fit, and packets are
+// copied out of it, so that a burst of small packets costs one read rather
+// than two or three each.  Returns 0 with the first complete packet in
+// *msgp, or NNG_EAGAIN if more must be read.  The start of a packet too
+// large for the buffer moves to a message of its own, rxmsg, for the rest
+// to be read straight into.  A packet over NNG_OPT_RECVMAXSZ is refused
+// as soon as its length is known.
+static int
+mqtt_stream_pipe_recv_frame(mqtt_stream_pipe *p, nni_msg **msgp)
+{
+	uint8_t *buf = p->rxbuf + p->rxpos;
+	uint32_t len = 0;
+	size_t   hlen;
+	size_t   n;
+	nni_msg *msg;
+	int      rv;
+
+	// the remaining length takes up to four bytes
+	for (n = 1;; n++) {
+		if (n > 4) {
+			return (NNG_EMSGSIZE);
+		}
+		if (n >= p->rxcnt) {
+			return (NNG_EAGAIN);
+		}
+		len |= (uint32_t) (buf[n] & 0x7f) << (7 * (n - 1));
+		if ((buf[n] & 0x80) == 0) {
+			break;
+		}
+	}
+	hlen = n + 1;
+	if ((p->rcvmax > 0) && (len > p->rcvmax)) {
+		return (NNG_EMSGSIZE);
+	}
+	if (hlen + len > p->rxcnt && hlen + len <= MQTT_RECV_BUF) {
+		return (NNG_EAGAIN);
+	}
+	// Only what has arrived is allocated for now.
+	n = p->rxcnt - hlen < len ? p->rxcnt - hlen : len;
+	if ((rv = nni_msg_alloc(&msg, n)) != 0) {
+		return (rv);
+	}
+	if ((rv = nni_msg_header_append(msg, buf, hlen)) != 0) {
+		nni_msg_free(msg);
+		return (rv);
+	}
+	if (n > 0) {
+		memcpy(nni_msg_body(msg), buf + hlen, n);
+	}
+	p->rxpos += hlen + n;
+	p->rxcnt -= hlen + n;
+	if (n < len) {
+		p->rxmsg  = msg;
+		p->rxgot  = n;
+		p->rxwant = len;
+		return (NNG_EAGAIN);
+	}
+	*msgp = msg;
+	return (0);
+}
+
+// Reads the rest of a large packet straight into its message, or else as
+// much as fits in the buffer after what is left in it.  The message grows
+// as its body arrives, by no more than it has already, so a peer cannot
+// make us allocate much more than it really sends.
+static int
+mqtt_stream_pipe_recv_more(mqtt_stream_pipe *p)
+{
+	nni_iov iov;
+	size_t  len;
+	int     rv;
+
+	if (p->rxmsg != NULL) {
+		if ((len = nni_msg_len(p->rxmsg)) == p->rxgot) {
+			len += len < MQTT_RECV_BUF ? MQTT_RECV_BUF : len;
+			if (len > p->rxwant) {
+				len = p->rxwant;
+			}
+			if ((rv = nni_msg_realloc(p->rxmsg, len)) != 0) {
+				return (rv);
+			}
+		}
+		iov.iov_buf = (uint8_t *) nni_msg_body(p->rxmsg) + p->rxgot;
+		iov.iov_len = nni_msg_len(p->rxmsg) - p->rxgot;
+	} else {
+		if (p->rxpos > 0) {
+			memmove(p->rxbuf, p->rxbuf + p->rxpos, p->rxcnt);
+			p->rxpos = 0;
+		}
+		iov.iov_buf = p->rxbuf + p->rxcnt;
+		iov.iov_len = MQTT_RECV_BUF - p->rxcnt;
+	}
+	nni_aio_set_iov(p->rxaio, 1, &iov);
+	nng_stream_recv(p->conn, p->rxaio);
+	return (0);
+}
+
+// Hands a received packet to the first waiting aio, which is returned for
+// the caller to finish, and queues the ack of a QoS publish or PUBREL.
+static nni_aio *
+mqtt_stream_pipe_recv_done(mqtt_stream_pipe *p, nni_msg *msg)
+{
+	nni_aio *aio   = nni_list_first(&p->recvq);
+	uint8_t  type  = *(uint8_t *) nni_msg_header(msg) & 0xf0;
+	uint8_t  flags = *(uint8_t *) nni_msg_header(msg) & 0x0f;
+	bool     ack   = false;
+
+	// set the payload pointer of msg according to packet_type
+	if (type == 0x30) {
+		uint8_t  qos_pac;
+		uint16_t pid;
+		// should we seperate the 2 phase work of QoS into 2 aios?
+
+		qos_pac = nni_msg_get_pub_qos(msg);
+		if (qos_pac > 0) {
+			if (qos_pac == 1) {
+				p->txlen[0] = 0X40;
+			} else if (qos_pac == 2) {
+				p->txlen[0] = 0X50;
+			}
+			p->txlen[1] = 0x02;
+			pid         = nni_msg_get_pub_pid(msg);
+			NNI_PUT16(p->txlen + 2, pid);
+			// the protocol turns a malformed one away
+			ack = (pid != 0);
+		}
+	} else if (type == 0x60 && flags == 0x02) {
+		p->txlen[0] = 0x70;
+		p->txlen[1] = 0x02;
+		memcpy(p->txlen + 2, nni_msg_body(msg), 2);
+		ack = true;
+	}
+
+	if (ack == true) {
+		memcpy(p->acks[p->ack_fill] + p->ack_len[p->ack_fill], p->txlen,
+		    4);
+		p->ack_len[p->ack_fill] += 4;
+		mqtt_stream_pipe_ack_flush(p);
+	}
+	// With no room left for another ack, reading waits for the write to
+	// finish rather than have one dropped.
+	if (p->ack_len[p->ack_fill] == sizeof(p->acks[0])) {
+		p->ack_stalled = true;
+	}
+
+	nni_aio_list_remove(aio);
+	nni_pipe_bump_rx(p->npipe, nni_msg_len(msg));
+	nni_aio_set_msg(aio, msg);
+	return (aio);
+}
+
+static void
+mqtt_stream_pipe_recv_cb(void *arg)
+{
+	nni_aio *         aio;
+	uint32_t          rv;
+	size_t            n;
+	nni_msg *         msg   = NULL;
+	mqtt_stream_pipe *p     = arg;
+	nni_aio *         rxaio = p->rxaio;
+
+	nni_mtx_lock(&p->mtx);
+
+	aio = nni_list_first(&p->recvq);
+
+	if ((rv = nni_aio_result(rxaio)) != 0) {
+		goto recv_error;
+	}
+
+	// anything from the server answers a ping
+	p->last_rx   = nni_clock();
+	p->ping_time = 0;
+
+	n = nni_aio_count(rxaio);
+	if (p->rxmsg != NULL) {
+		p->rxgot += n;
+		if (p->rxgot < p->rxwant) {
+			if ((rv = mqtt_stream_pipe_recv_more(p)) != 0) {
+				goto recv_error;
+			}
+			nni_mtx_unlock(&p->mtx);
+			return;
+		}
+		msg      = p->rxmsg;
+		p->rxmsg = NULL;
+	} else {
+		p->rxcnt += n;
+		rv = mqtt_stream_pipe_recv_frame(p, &msg);
+		if (rv == NNG_EAGAIN) {
+			if ((rv = mqtt_stream_pipe_recv_more(p)) != 0) {
+				goto recv_error;
+			}
+			nni_mtx_unlock(&p->mtx);
+			return;
+		}
+		if (rv != 0) {
+			goto recv_error;
+		}
+	}
+
+	// We read a message completely.  Let the user know the good news,
+	// and go on with the next one, which may be in the buffer already.
+	aio = mqtt_stream_pipe_recv_done(p, msg);
+	n   = nni_msg_len(msg);
+	if (!p->ack_stalled && !nni_list_empty(&p->recvq)) {
+		mqtt_stream_pipe_recv_start(p);
+	}
+	nni_mtx_unlock(&p->mtx);
+
+	nni_aio_finish_sync(aio, 0, n);
+	return;
+
+recv_error:
+	nni_aio_list_remove(aio);
+	msg      = p->rxmsg;
+	p->rxmsg = NULL;
+	nni_pipe_bump_error(p->npipe, rv);
+	nni_mtx_unlock(&p->mtx);
+
+	nni_msg_free(msg);
+	nni_aio_finish_error(aio, rv);
+}
+
+static void
+mqtt_stream_pipe_send_cancel(nni_aio *aio, void *arg, int rv)
+{
+	mqtt_stream_pipe *p = arg;
+
+	nni_mtx_lock(&p->mtx);
+	if (!nni_aio_list_active(aio)) {
+		nni_mtx_unlock(&p->mtx);
+		return;
+	}
+	// If this is being sent, then cancel the pending transfer.
+	// The callback on the txaio will cause the user aio to
+	// be canceled too.
+	if (nni_list_first(&p->sendq) == aio) {
+		nni_aio_abort(p->txaio, rv);
+		nni_mtx_unlock(&p->mtx);
+		return;
+	}
+	nni_aio_list_remove(aio);
+	nni_mtx_unlock(&p->mtx);
+
+	nni_aio_finish_error(aio, rv);
+}
+
+static void
+mqtt_stream_pipe_send_start(mqtt_stream_pipe *p)
+{
+	nni_aio *   aio;
+	nni_aio *   txaio;
+	nni_msg *   msg;
+	const void *payload;
+	size_t      len;
+	int         niov;
+	nni_iov     iov[3];
+
+	if (p->closed) {
+		while ((aio = nni_list_first(&p->sendq)) != NULL) {
+			nni_list_remove(&p->sendq, aio);
+			nni_aio_finish_error(aio, NNG_ECLOSED);
+		}
+		return;
+	}
+
+	if ((aio = nni_list_first(&p->sendq)) == NULL) {
+		return;
+	}
+
+	// This runs to send the message.
+	msg = nni_aio_get_msg(aio);
+
+	txaio = p->txaio;
+	niov  = 0;
+
+	if (nni_msg_header_len(msg) > 0) {
+		iov[niov].iov_buf = nni_msg_header(msg);
+		iov[niov].iov_len = nni_msg_header_len(msg);
+		niov++;
+	}
+	if (nni_msg_len(msg) > 0) {
+		iov[niov].iov_buf = nni_msg_body(msg);
+		iov[niov].iov_len = nni_msg_len(msg);
+		niov++;
+	}
+	// A payload the application lent us goes straight from its buffer.
+	if ((payload = nni_mqtt_msg_payload_ref(msg, &len)) != NULL &&
+	    len > 0) {
+		iov[niov].iov_buf = (void *) payload;
+		iov[niov].iov_len = len;
+		niov++;
+	}
+	nni_aio_set_iov(txaio, niov, iov);
+	nng_stream_send(p->conn, txaio);
+}
+
+static void
+mqtt_stream_pipe_send(void *arg, nni_aio *aio)
+{
+	mqtt_stream_pipe *p = arg;
+	int               rv;
+
+	if (nni_aio_begin(aio) != 0) {
+		return;
+	}
+	nni_mtx_lock(&p->mtx);
+	if ((rv = nni_aio_schedule(aio, mqtt_stream_pipe_send_cancel, p)) !=
+	    0) {
+		nni_mtx_unlock(&p->mtx);
+		nni_aio_finish_error(aio, rv);
+		return;
+	}
+	nni_list_append(&p->sendq, aio);
+	if (nni_list_first(&p->sendq) == aio) {
+		mqtt_stream_pipe_send_start(p);
+	}
+	nni_mtx_unlock(&p->mtx);
+}
+
+static void
+mqtt_stream_pipe_recv_cancel(nni_aio *aio, void *arg, int rv)
+{
+	mqtt_stream_pipe *p = arg;
+
+	nni_mtx_lock(&p->mtx);
+	if (!nni_aio_list_active(aio)) {
+		nni_mtx_unlock(&p->mtx);
+		return;
+	}
+	// If receive in progress, then cancel the pending transfer.
+	// The callback on the rxaio will cause the user aio to
+	// be canceled too.
+	if (nni_list_first(&p->recvq) == aio) {
+		nni_aio_abort(p->rxaio, rv);
+		nni_mtx_unlock(&p->mtx);
+		return;
+	}
+	nni_aio_list_remove(aio);
+	nni_mtx_unlock(&p->mtx);
+	nni_aio_finish_error(aio, rv);
+}
+
+static void
+mqtt_stream_pipe_recv_start(mqtt_stream_pipe *p)
+{
+	nni_aio *aio;
+	nni_msg *msg = NULL;
+	int      rv;
+
+	if (p->closed) {
+		while ((aio = nni_list_first(&p->recvq)) != NULL) {
+			nni_list_remove(&p->recvq, aio);
+			nni_aio_finish_error(aio, NNG_ECLOSED);
+		}
+		return;
+	}
+	if (nni_list_empty(&p->recvq)) {
+		return;
+	}
+
+	// Take the next packet from the buffer if it is all there, and only
+	// read from the connection otherwise.
+	if (p->rxmsg != NULL ||
+	    (rv = mqtt_stream_pipe_recv_frame(p, &msg)) == NNG_EAGAIN) {
+		if ((rv = mqtt_stream_pipe_recv_more(p)) == 0) {
+			return;
+		}
+	}
+	if (rv != 0) {
+		aio = nni_list_first(&p->recvq);
+		nni_aio_list_remove(aio);
+		nni_pipe_bump_error(p->npipe, rv);
+		nni_aio_finish_error(aio, rv);
+		return;
+	}
+	aio = mqtt_stream_pipe_recv_done(p, msg);
+	nni_aio_finish(aio, 0, nni_msg_len(msg));
+}
+
+static void
+mqtt_stream_pipe_recv(void *arg, nni_aio *aio)
+{
+	mqtt_stream_pipe *p = arg;
+	int               rv;
+
+	if (nni_aio_begin(aio) != 0) {
+		return;
+	}
+	nni_mtx_lock(&p->mtx);
+	if (p->connack != NULL) {
+		nni_msg *msg = p->connack;
+		p->connack   = NULL;
+		nni_mtx_unlock(&p->mtx);
+		nni_aio_set_msg(aio, msg);
+		nni_aio_finish(aio, 0, nni_msg_len(msg));
+		return;
+	}
+	if ((rv = nni_aio_schedule(aio, mqtt_stream_pipe_recv_cancel, p)) !=
+	    0) {
+		nni_mtx_unlock(&p->mtx);
+		nni_aio_finish_error(aio, rv);
+		return;
+	}
+
+	nni_list_append(&p->recvq, aio);
+	if ((nni_list_first(&p->recvq) == aio) && !p->ack_stalled) {
+		mqtt_stream_pipe_recv_start(p);
+	}
+	nni_mtx_unlock(&p->mtx);
+}
+
+static uint16_t
+mqtt_stream_pipe_peer(void *arg)
+{
+	mqtt_stream_pipe *p = arg;
+
+	return (p->peer);
+}
+
+static int
+mqtt_stream_pipe_get_recv_max(void *arg, void *v, size_t *szp, nni_opt_type t)
+{
+	mqtt_stream_pipe *p = arg;
+	return (nni_copyout_int(p->rcv_max, v, szp, t));
+}
+
+static int
+mqtt_stream_pipe_get_max_packet(void *arg, void *v, size_t *szp, nni_opt_type t)
+{
+	mqtt_stream_pipe *p = arg;
+	return (nni_copyout_size(p->max_packet, v, szp, t));
+}
+
+static const nni_option mqtt_stream_pipe_opts[] = {
+	{
+	    .o_name = NNG_OPT_MQTT_RECEIVE_MAX,
+	    .o_get  = mqtt_stream_pipe_get_recv_max,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_MAX_PACKET_SIZE,
+	    .o_get  = mqtt_stream_pipe_get_max_packet,
+	},
+	// terminate list
+	{
+	    .o_name = NULL,
+	},
+};
+
+static int
+mqtt_stream_pipe_getopt(
+    void *arg, const char *name, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_stream_pipe *p = arg;
+	int               rv;
+
+	rv = nni_getopt(mqtt_stream_pipe_opts, name, p, buf, szp, t);
+	if (rv == NNG_ENOTSUP) {
+		rv = nni_stream_get(p->conn, name, buf, szp, t);
+	}
+	return (rv);
+}
+
+static void
+mqtt_stream_pipe_start(
+    mqtt_stream_pipe *p, nng_stream *conn, mqtt_stream_ep *ep)
+{
+	nni_iov  iov[2];
+	nni_msg *connmsg;
+	int      rv, niov = 0;
+
+	ep->refcnt++;
+
+	p->conn  = conn;
+	p->ep    = ep;
+	p->proto = ep->proto;
+
+	rv = nni_dialer_getopt(ep->ndialer, NNG_OPT_MQTT_CONNMSG, &connmsg,
+	    NULL, NNI_TYPE_POINTER);
+	if (!connmsg) {
+		nni_list_append(&ep->waitpipes, p);
+		// 60s as the default keepalive timeout.
+		p->keepalive = 60 * 1000;
+		mqtt_stream_ep_match(ep);
+		return;
+	}
+	if ((rv = nni_mqtt_msg_encode(connmsg)) != 0) {
+		nni_list_append(&ep->waitpipes, p);
+		mqtt_stream_ep_match(ep);
+		return;
+	}
+
+	p->gotrxhead = 0;
+	p->gottxhead = 0;
+	// TODO TX length for MQTT 5
+	p->wantrxhead = 2;
+	p->wanttxhead = nni_msg_header_len(connmsg) + nni_msg_len(connmsg);
+	p->rxmsg      = NULL;
+	p->keepalive  = nni_mqtt_msg_get_connect_keep_alive(connmsg) * 1000;
+	p->version    = nni_mqtt_msg_get_connect_proto_version(connmsg);
+	p->rcv_max    = 0xffffu;
+	p->max_packet = 0;
+
+	if (nni_msg_header_len(connmsg) > 0) {
+		iov[niov].iov_buf = nni_msg_header(connmsg);
+		iov[niov].iov_len = nni_msg_header_len(connmsg);
+		niov++;
+	}
+	if (nni_msg_len(connmsg) > 0) {
+		iov[niov].iov_buf = nni_msg_body(connmsg);
+		iov[niov].iov_len = nni_msg_len(connmsg);
+		niov++;
+	}
+	nni_aio_set_iov(p->negoaio, niov, iov);
+	nni_list_append(&ep->negopipes, p);
+
+	nni_aio_set_timeout(p->negoaio, 10000); // 10 sec timeout to negotiate
+	nng_stream_send(p->conn, p->negoaio);
+}
+
+static void
+mqtt_stream_ep_fini(void *arg)
+{
+	mqtt_stream_ep *ep = arg;
+
+	nni_mtx_lock(&ep->mtx);
+	ep->fini = true;
+	if (ep->refcnt != 0) {
+		nni_mtx_unlock(&ep->mtx);
+		return;
+	}
+	nni_mtx_unlock(&ep->mtx);
+	nni_aio_stop(ep->timeaio);
+	nni_aio_stop(ep->connaio);
+	nng_stream_dialer_free(ep->dialer);
+	nng_stream_listener_free(ep->listener);
+	nni_aio_free(ep->timeaio);
+	nni_aio_free(ep->connaio);
+
+	nni_mtx_fini(&ep->mtx);
+	NNI_FREE_STRUCT(ep);
+}
+
+static void
+mqtt_stream_ep_close(void *arg)
+{
+	mqtt_stream_ep *  ep = arg;
+	mqtt_stream_pipe *p;
+
+	nni_mtx_lock(&ep->mtx);
+
+	ep->closed = true;
+	nni_aio_close(ep->timeaio);
+	if (ep->dialer != NULL) {
+		nng_stream_dialer_close(ep->dialer);
+	}
+	if (ep->listener != NULL) {
+		nng_stream_listener_close(ep->listener);
+	}
+	NNI_LIST_FOREACH (&ep->negopipes, p) {
+		mqtt_stream_pipe_close(p);
+	}
+	NNI_LIST_FOREACH (&ep->waitpipes, p) {
+		mqtt_stream_pipe_close(p);
+	}
+	NNI_LIST_FOREACH (&ep->busypipes, p) {
+		mqtt_stream_pipe_close(p);
+	}
+	if (ep->useraio != NULL) {
+		nni_aio_finish_error(ep->useraio, NNG_ECLOSED);
+		ep->useraio = NULL;
+	}
+
+	nni_mtx_unlock(&ep->mtx);
+}
+
+// This parses off the optional source address that this transport uses.
+// The special handling of this URL format is quite honestly an historical
+// mistake, which we would remove if we could.
+static int
+mqtt_stream_url_parse_source(
+    nng_url *url, nng_sockaddr *sa, const nng_url *surl)
+{
+	int      af;
+	char *   semi;
+	char *   src;
+	size_t   len;
+	int      rv;
+	nni_aio *aio;
+
+	// We modify the URL.  This relies on the fact that the underlying
+	// transport does not free this, so we can just use references.
+
+	*url = *surl;
+
+	if ((semi = strchr(url->u_hostname, ';')) == NULL) {
+		memset(sa, 0, sizeof(*sa));
+		return (0);
+	}
+
+	len             = (size_t) (semi - url->u_hostname);
+	url->u_hostname = semi + 1;
+
+	// A scheme ending in 4 or 6 keeps to that address family.
+	switch (surl->u_scheme[strlen(surl->u_scheme) - 1]) {
+	case '4':
+		af = NNG_AF_INET;
+		break;
+	case '6':
+		af = NNG_AF_INET6;
+		break;
+	default:
+		af = NNG_AF_UNSPEC;
+		break;
+	}
+
+	if ((src = nni_alloc(len + 1)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	memcpy(src, surl->u_hostname, len);
+	src[len] = '\0';
+
+	if ((rv = nni_aio_alloc(&aio, NULL, NULL)) != 0) {
+		nni_free(src, len + 1);
+		return (rv);
+	}
+
+	nni_resolv_ip(src, "0", af, true, sa, aio);
+	nni_aio_wait(aio);
+	rv = nni_aio_result(aio);
+	nni_aio_free(aio);
+	nni_free(src, len + 1);
+	return (rv);
+}
+
+static void
+mqtt_stream_timer_cb(void *arg)
+{
+	mqtt_stream_ep *ep = arg;
+	if (nni_aio_result(ep->timeaio) == 0) {
+		nng_stream_listener_accept(ep->listener, ep->connaio);
+	}
+}
+
+static void
+mqtt_stream_accept_cb(void *arg)
+{
+	mqtt_stream_ep *  ep  = arg;
+	nni_aio *         aio = ep->connaio;
+	mqtt_stream_pipe *p;
+	int               rv;
+	nng_stream *      conn;
+
+	nni_mtx_lock(&ep->mtx);
+
+	if ((rv = nni_aio_result(aio)) != 0) {
+		goto error;
+	}
+
+	conn = nni_aio_get_output(aio, 0);
+	if ((rv = mqtt_stream_pipe_alloc(&p)) != 0) {
+		nng_stream_free(conn);
+		goto error;
+	}
+
+	if (ep->closed) {
+		mqtt_stream_pipe_fini(p);
+		nng_stream_free(conn);
+		rv = NNG_ECLOSED;
+		goto error;
+	}
+	mqtt_stream_pipe_start(p, conn, ep);
+	nng_stream_listener_accept(ep->listener, ep->connaio);
+	nni_mtx_unlock(&ep->mtx);
+	return;
+
+error:
+	// When an error here occurs, let's send a notice up to the consumer.
+	// That way it can be reported properly.
+	if ((aio = ep->useraio) != NULL) {
+		ep->useraio = NULL;
+		nni_aio_finish_error(aio, rv);
+	}
+	switch (rv) {
+
+	case NNG_ENOMEM:
+	case NNG_ENOFILES:
+		nng_sleep_aio(10, ep->timeaio);
+		break;
+
+	default:
+		if (!ep->closed) {
+			nng_stream_listener_accept(ep->listener, ep->connaio);
+		}
+		break;
+	}
+	nni_mtx_unlock(&ep->mtx);
+}
+
+static void
+mqtt_stream_dial_cb(void *arg)
+{
+	mqtt_stream_ep *  ep  = arg;
+	nni_aio *         aio = ep->connaio;
+	mqtt_stream_pipe *p;
+	int               rv;
+	nng_stream *      conn;
+
+	if ((rv = nni_aio_result(aio)) != 0) {
+		goto error;
+	}
+
+	conn = nni_aio_get_output(aio, 0);
+	if ((rv = mqtt_stream_pipe_alloc(&p)) != 0) {
+		nng_stream_free(conn);
+		goto error;
+	}
+	nni_mtx_lock(&ep->mtx);
+	if (ep->closed) {
+		mqtt_stream_pipe_fini(p);
+		nng_stream_free(conn);
+		rv = NNG_ECLOSED;
+		nni_mtx_unlock(&ep->mtx);
+		goto error;
+	} else {
+		mqtt_stream_pipe_start(p, conn, ep);
+	}
+	nni_mtx_unlock(&ep->mtx);
+	return;
+
+error:
+	// Error connecting.  We need to pass this straight back
+	// to the user.
+	nni_mtx_lock(&ep->mtx);
+	if ((aio = ep->useraio) != NULL) {
+		ep->useraio = NULL;
+		nni_aio_finish_error(aio, rv);
+	}
+	nni_mtx_unlock(&ep->mtx);
+}
+
+static int
+mqtt_stream_ep_init(mqtt_stream_ep **epp, nng_url *url, nni_sock *sock)
+{
+	mqtt_stream_ep *ep;
+
+	if ((ep = NNI_ALLOC_STRUCT(ep)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	nni_mtx_init(&ep->mtx);
+	NNI_LIST_INIT(&ep->busypipes, mqtt_stream_pipe, node);
+	NNI_LIST_INIT(&ep->waitpipes, mqtt_stream_pipe, node);
+	NNI_LIST_INIT(&ep->negopipes, mqtt_stream_pipe, node);
+
+	ep->proto = nni_sock_proto_id(sock);
+	ep->url   = url;
+
+#ifdef NNG_ENABLE_STATS
+	static const nni_stat_info rcv_max_info = {
+		.si_name   = "rcv_max",
+		.si_desc   = "maximum receive size",
+		.si_type   = NNG_STAT_LEVEL,
+		.si_unit   = NNG_UNIT_BYTES,
+		.si_atomic = true,
+	};
+	nni_stat_init(&ep->st_rcv_max, &rcv_max_info);
+#endif
+
+	*epp = ep;
+	return (0);
+}
+
+// WebSocket streams carry MQTT in binary messages of the "mqtt"
+// subprotocol, and are the only ones with a use for a path.  rv is from
+// setting the subprotocol, which streams of other kinds do not know.
+static int
+mqtt_stream_check_ws(int rv, const nng_url *url)
+{
+	if (rv != NNG_ENOTSUP) {
+		return (rv);
+	}
+	if ((strlen(url->u_path) != 0) && (strcmp(url->u_path, "/") != 0)) {
+		return (NNG_EADDRINVAL);
+	}
+	return (0);
+}
+
+static int
+mqtt_stream_dialer_init(void **dp, nng_url *url, nni_dialer *ndialer)
+{
+	mqtt_stream_ep *ep;
+	int             rv;
+	nng_sockaddr    srcsa;
+	nni_sock *      sock = nni_dialer_sock(ndialer);
+	nng_url         myurl;
+
+	// Check for invalid URL components.  The path is checked once we
+	// know the stream.
+	if ((url->u_fragment != NULL) || (url->u_userinfo != NULL) ||
+	    (url->u_query != NULL) || (strlen(url->u_hostname) == 0) ||
+	    (strlen(url->u_port) == 0)) {
+		return (NNG_EADDRINVAL);
+	}
+
+	if ((rv = mqtt_stream_url_parse_source(&myurl, &srcsa, url)) != 0) {
+		return (rv);
+	}
+
+	if ((rv = mqtt_stream_ep_init(&ep, url, sock)) != 0) {
+		return (rv);
+	}
+	ep->ndialer = ndialer;
+
+	if (((rv = nni_aio_alloc(&ep->connaio, mqtt_stream_dial_cb, ep)) !=
+	        0) ||
+	    ((rv = nng_stream_dialer_alloc_url(&ep->dialer, &myurl)) != 0)) {
+		mqtt_stream_ep_fini(ep);
+		return (rv);
+	}
+	rv = nni_stream_dialer_set(ep->dialer, NNG_OPT_WS_PROTOCOL,
+	    MQTT_WS_PROTOCOL, sizeof(MQTT_WS_PROTOCOL), NNI_TYPE_STRING);
+	if ((rv = mqtt_stream_check_ws(rv, url)) != 0) {
+		mqtt_stream_ep_fini(ep);
+		return (rv);
+	}
+	if ((srcsa.s_family != NNG_AF_UNSPEC) &&
+	    ((rv = nni_stream_dialer_set(ep->dialer, NNG_OPT_LOCADDR, &srcsa,
+	          sizeof(srcsa), NNI_TYPE_SOCKADDR)) != 0)) {
+		mqtt_stream_ep_fini(ep);
+		return (rv);
+	}
+	*dp = ep;
+	return (0);
+}
+
+static int
+mqtt_stream_listener_init(void **lp, nng_url *url, nni_listener *nlistener)
+{
+	mqtt_stream_ep *ep;
+	int             rv;
+	nni_sock *      sock = nni_listener_sock(nlistener);
+
+	// Check for invalid URL components.
+	if ((url->u_fragment != NULL) || (url->u_userinfo != NULL) ||
+	    (url->u_query != NULL)) {
+		return (NNG_EADDRINVAL);
+	}
+
+	if ((rv = mqtt_stream_ep_init(&ep, url, sock)) != 0) {
+		return (rv);
+	}
+
+	if (((rv = nni_aio_alloc(&ep->connaio, mqtt_stream_accept_cb, ep)) !=
+	        0) ||
+	    ((rv = nni_aio_alloc(&ep->timeaio, mqtt_stream_timer_cb, ep)) !=
+	        0) ||
+	    ((rv = nng_stream_listener_alloc_url(&ep->listener, url)) != 0)) {
+		mqtt_stream_ep_fini(ep);
+		return (rv);
+	}
+	rv = nni_stream_listener_set(ep->listener, NNG_OPT_WS_PROTOCOL,
+	    MQTT_WS_PROTOCOL, sizeof(MQTT_WS_PROTOCOL), NNI_TYPE_STRING);
+	if ((rv = mqtt_stream_check_ws(rv, url)) != 0) {
+		mqtt_stream_ep_fini(ep);
+		return (rv);
+	}
+#ifdef NNG_ENABLE_STATS
+	nni_listener_add_stat(nlistener, &ep->st_rcv_max);
+#endif
+
+	*lp = ep;
+	return (0);
+}
+
+static void
+mqtt_stream_ep_cancel(nni_aio *aio, void *arg, int rv)
+{
+	mqtt_stream_ep *ep = arg;
+	nni_mtx_lock(&ep->mtx);
+	if (ep->useraio == aio) {
+		ep->useraio = NULL;
+		nni_aio_finish_error(aio, rv);
+	}
+	nni_mtx_unlock(&ep->mtx);
+}
+
+static void
+mqtt_stream_ep_connect(void *arg, nni_aio *aio)
+{
+	mqtt_stream_ep *ep = arg;
+	int             rv;
+
+	if (nni_aio_begin(aio) != 0) {
+		return;
+	}
+	nni_mtx_lock(&ep->mtx);
+	if (ep->closed) {
+		nni_mtx_unlock(&ep->mtx);
+		nni_aio_finish_error(aio, NNG_ECLOSED);
+		return;
+	}
+	if (ep->useraio != NULL) {
+		nni_mtx_unlock(&ep->mtx);
+		nni_aio_finish_error(aio, NNG_EBUSY);
+		return;
+	}
+	if ((rv = nni_aio_schedule(aio, mqtt_stream_ep_cancel, ep)) != 0) {
+		nni_mtx_unlock(&ep->mtx);
+		nni_aio_finish_error(aio, rv);
+		return;
+	}
+	ep->useraio = aio;
+
+	nng_stream_dialer_dial(ep->dialer, ep->connaio);
+	nni_mtx_unlock(&ep->mtx);
+}
+
+static int
+mqtt_stream_ep_get_url(void *arg, void *v, size_t *szp, nni_opt_type t)
+{
+	mqtt_stream_ep *ep = arg;
+	char *          s;
+	int             rv;
+	int             port = 0;
+
+	if (ep->listener != NULL) {
+		(void) nng_stream_listener_get_int(
+		    ep->listener, NNG_OPT_TCP_BOUND_PORT, &port);
+	}
+
+	if ((rv = nni_url_asprintf_port(&s, ep->url, port)) == 0) {
+		rv = nni_copyout_str(s, v, szp, t);
+		nni_strfree(s);
+	}
+	return (rv);
+}
+
+static int
+mqtt_stream_ep_get_recvmaxsz(void *arg, void *v, size_t *szp, nni_opt_type t)
+{
+	mqtt_stream_ep *ep = arg;
+	int             rv;
+
+	nni_mtx_lock(&ep->mtx);
+	rv = nni_copyout_size(ep->rcvmax, v, szp, t);
+	nni_mtx_unlock(&ep->mtx);
+	return (rv);
+}
+
+static int
+mqtt_stream_ep_set_recvmaxsz(
+    void *arg, const void *v, size_t sz, nni_opt_type t)
+{
+	mqtt_stream_ep *ep = arg;
+	size_t          val;
+	int             rv;
+	if ((rv = nni_copyin_size(&val, v, sz, 0, NNI_MAXSZ, t)) == 0) {
+		mqtt_stream_pipe *p;
+		nni_mtx_lock(&ep->mtx);
+		ep->rcvmax = val;
+		NNI_LIST_FOREACH (&ep->waitpipes, p) {
+			p->rcvmax = val;
+		}
+		NNI_LIST_FOREACH (&ep->negopipes, p) {
+			p->rcvmax = val;
+		}
+		NNI_LIST_FOREACH (&ep->busypipes, p) {
+			p->rcvmax = val;
+		}
+		nni_mtx_unlock(&ep->mtx);
+#ifdef NNG_ENABLE_STATS
+		nni_stat_set_value(&ep->st_rcv_max, val);
+#endif
+	}
+	return (rv);
+}
+
+static int
+mqtt_stream_ep_get_connmsg(void *arg, void *v, size_t *szp, nni_opt_type t)
+{
+	mqtt_stream_ep *ep = arg;
+	int             rv;
+
+	nni_copyout_ptr(ep->connmsg, v, szp, t);
+	rv = 0;
+
+	return (rv);
+}
+
+static int
+mqtt_stream_ep_set_connmsg(
+    void *arg, const void *v, size_t sz, nni_opt_type t)
+{
+	mqtt_stream_ep *ep = arg;
+	int             rv;
+
+	nni_mtx_lock(&ep->mtx);
+	nni_copyin_ptr(&ep->connmsg, v, sz, t);
+	nni_mtx_unlock(&ep->mtx);
+	rv = 0;
+
+	return (rv);
+}
+
+static int
+mqtt_stream_ep_bind(void *arg)
+{
+	mqtt_stream_ep *ep = arg;
+	int             rv;
+
+	nni_mtx_lock(&ep->mtx);
+	rv = nng_stream_listener_listen(ep->listener);
+	nni_mtx_unlock(&ep->mtx);
+
+	return (rv);
+}
+
+static void
+mqtt_stream_ep_accept(void *arg, nni_aio *aio)
+{
+	mqtt_stream_ep *ep = arg;
+	int             rv;
+
+	if (nni_aio_begin(aio) != 0) {
+		return;
+	}
+	nni_mtx_lock(&ep->mtx);
+	if (ep->closed) {
+		nni_mtx_unlock(&ep->mtx);
+		nni_aio_finish_error(aio, NNG_ECLOSED);
+		return;
+	}
+	if (ep->useraio != NULL) {
+		nni_mtx_unlock(&ep->mtx);
+		nni_aio_finish_error(aio, NNG_EBUSY);
+		return;
+	}
+	if ((rv = nni_aio_schedule(aio, mqtt_stream_ep_cancel, ep)) != 0) {
+		nni_mtx_unlock(&ep->mtx);
+		nni_aio_finish_error(aio, rv);
+		return;
+	}
+	ep->useraio = aio;
+	if (!ep->started) {
+		ep->started = true;
+		nng_stream_listener_accept(ep->listener, ep->connaio);
+	} else {
+		mqtt_stream_ep_match(ep);
+	}
+	nni_mtx_unlock(&ep->mtx);
+}
+
+nni_sp_pipe_ops nni_mqtt_stream_pipe_ops = {
+	.p_init   = mqtt_stream_pipe_init,
+	.p_fini   = mqtt_stream_pipe_fini,
+	.p_stop   = mqtt_stream_pipe_stop,
+	.p_send   = mqtt_stream_pipe_send,
+	.p_recv   = mqtt_stream_pipe_recv,
+	.p_close  = mqtt_stream_pipe_close,
+	.p_peer   = mqtt_stream_pipe_peer,
+	.p_getopt = mqtt_stream_pipe_getopt,
+};
+
+static const nni_option mqtt_stream_ep_opts[] = {
+	{
+	    .o_name = NNG_OPT_RECVMAXSZ,
+	    .o_get  = mqtt_stream_ep_get_recvmaxsz,
+	    .o_set  = mqtt_stream_ep_set_recvmaxsz,
+	},
+	{
+	    .o_name = NNG_OPT_URL,
+	    .o_get  = mqtt_stream_ep_get_url,
+	},
+	{
+	    .o_name = NNG_OPT_MQTT_CONNMSG,
+	    .o_get  = mqtt_stream_ep_get_connmsg,
+	    .o_set  = mqtt_stream_ep_set_connmsg,
+	},
+	// terminate list
+	{
+	    .o_name = NULL,
+	},
+};
+
+static int
+mqtt_stream_dialer_getopt(
+    void *arg, const char *name, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_stream_ep *ep = arg;
+	int             rv;
+
+	rv = nni_getopt(mqtt_stream_ep_opts, name, ep, buf, szp, t);
+	if (rv == NNG_ENOTSUP) {
+		rv = nni_stream_dialer_get(ep->dialer, name, buf, szp, t);
+	}
+	return (rv);
+}
+
+static int
+mqtt_stream_dialer_setopt(
+    void *arg, const char *name, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_stream_ep *ep = arg;
+	int             rv;
+
+	// Our own options come first: the WebSocket stream takes
+	// NNG_OPT_RECVMAXSZ too, but does not apply it in stream mode.
+	rv = nni_setopt(mqtt_stream_ep_opts, name, ep, buf, sz, t);
+	if (rv == NNG_ENOTSUP) {
+		rv = nni_stream_dialer_set(ep->dialer, name, buf, sz, t);
+	}
+	return (rv);
+}
+
+static int
+mqtt_stream_listener_getopt(
+    void *arg, const char *name, void *buf, size_t *szp, nni_type t)
+{
+	mqtt_stream_ep *ep = arg;
+	int             rv;
+
+	rv = nni_getopt(mqtt_stream_ep_opts, name, ep, buf, szp, t);
+	if (rv == NNG_ENOTSUP) {
+		rv = nni_stream_listener_get(ep->listener, name, buf, szp, t);
+	}
+	return (rv);
+}
+
+static int
+mqtt_stream_listener_setopt(
+    void *arg, const char *name, const void *buf, size_t sz, nni_type t)
+{
+	mqtt_stream_ep *ep = arg;
+	int             rv;
+
+	rv = nni_setopt(mqtt_stream_ep_opts, name, ep, buf, sz, t);
+	if (rv == NNG_ENOTSUP) {
+		rv = nni_stream_listener_set(ep->listener, name, buf, sz, t);
+	}
+	return (rv);
+}
+
+nni_sp_dialer_ops nni_mqtt_stream_dialer_ops = {
+	.d_init    = mqtt_stream_dialer_init,
+	.d_fini    = mqtt_stream_ep_fini,
+	.d_connect = mqtt_stream_ep_connect,
+	.d_close   = mqtt_stream_ep_close,
+	.d_getopt  = mqtt_stream_dialer_getopt,
+	.d_setopt  = mqtt_stream_dialer_setopt,
+};
+
+nni_sp_listener_ops nni_mqtt_stream_listener_ops = {
+	.l_init   = mqtt_stream_listener_init,
+	.l_fini   = mqtt_stream_ep_fini,
+	.l_bind   = mqtt_stream_ep_bind,
+	.l_accept = mqtt_stream_ep_accept,
+	.l_close  = mqtt_stream_ep_close,
+	.l_getopt = mqtt_stream_listener_getopt,
+	.l_setopt = mqtt_stream_listener_setopt,
+};
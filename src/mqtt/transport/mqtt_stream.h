@@ -0,0 +1,25 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef MQTT_TRANSPORT_MQTT_STREAM_H
+#define MQTT_TRANSPORT_MQTT_STREAM_H
+
+#include "core/nng_impl.h"
+
+// The MQTT client framing, over whatever nng_stream the URL scheme of a
+// dialer or listener selects in core/stream.c.  A transport is just its
+// schemes registered with these operations.
+extern void nni_mqtt_stream_init(void);
+extern void nni_mqtt_stream_fini(void);
+
+extern nni_sp_dialer_ops   nni_mqtt_stream_dialer_ops;
+extern nni_sp_listener_ops nni_mqtt_stream_listener_ops;
+extern nni_sp_pipe_ops     nni_mqtt_stream_pipe_ops;
+
+#endif // MQTT_TRANSPORT_MQTT_STREAM_H
@@ -0,0 +1,49 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include "core/nng_impl.h"
+#include "mqtt/transport/mqtt_stream.h"
+
+// MQTT over WebSocket.  The framing is in mqtt_stream.c, which asks the
+// WebSocket stream for the "mqtt" subprotocol.  The stream is used as a
+// byte stream, so a large packet is read into its message as it arrives
+// rather than gathered into a WebSocket message first.
+
+static nni_sp_tran mqtt_ws_tran = {
+	.tran_scheme   = "mqtt-ws",
+	.tran_dialer   = &nni_mqtt_stream_dialer_ops,
+	.tran_listener = &nni_mqtt_stream_listener_ops,
+	.tran_pipe     = &nni_mqtt_stream_pipe_ops,
+	.tran_init     = nni_mqtt_stream_init,
+	.tran_fini     = nni_mqtt_stream_fini,
+};
+
+static nni_sp_tran mqtt_wss_tran = {
+	.tran_scheme   = "mqtt-wss",
+	.tran_dialer   = &nni_mqtt_stream_dialer_ops,
+	.tran_listener = &nni_mqtt_stream_listener_ops,
+	.tran_pipe     = &nni_mqtt_stream_pipe_ops,
+	.tran_init     = nni_mqtt_stream_init,
+	.tran_fini     = nni_mqtt_stream_fini,
+};
+
+#ifndef NNG_ELIDE_DEPRECATED
+int
+nng_mqtt_ws_register(void)
+{
+	return (nni_init());
+}
+#endif
+
+void
+nni_mqtt_ws_register(void)
+{
+	nni_mqtt_tran_register(&mqtt_ws_tran);
+	nni_mqtt_tran_register(&mqtt_wss_tran);
+}
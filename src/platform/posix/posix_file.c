@@ -92,6 +92,74 @@ nni_plat_file_put(const char *name, const void *data, size_t len)
 	return (rv);
 }
 
+// nni_plat_file_log_open opens the named file to add to its end,
+// creating the file if it does not exist yet.
+int
+nni_plat_file_log_open(const char *name, nni_plat_flog *lg)
+{
+	int fd;
+	int rv;
+
+	if (strchr(name, '/') != NULL) {
+		if ((rv = nni_plat_make_parent_dirs(name)) != 0) {
+			return (rv);
+		}
+	}
+
+	if ((fd = open(name, O_WRONLY | O_CREAT | O_APPEND,
+	         S_IRUSR | S_IWUSR)) < 0) {
+		return (nni_plat_errno(errno));
+	}
+	lg->fd = fd;
+	return (0);
+}
+
+int
+nni_plat_file_log_write(nni_plat_flog *lg, const void *data, size_t len)
+{
+	const char *ptr = data;
+	ssize_t     n;
+
+	while (len > 0) {
+		if ((n = write(lg->fd, ptr, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (nni_plat_errno(errno));
+		}
+		ptr += n;
+		len -= (size_t) n;
+	}
+	return (0);
+}
+
+int
+nni_plat_file_log_sync(nni_plat_flog *lg)
+{
+	if (fsync(lg->fd) != 0) {
+		return (nni_plat_errno(errno));
+	}
+	return (0);
+}
+
+void
+nni_plat_file_log_close(nni_plat_flog *lg)
+{
+	(void) close(lg->fd);
+	lg->fd = -1;
+}
+
+// nni_plat_file_rename renames a file, replacing any file that already
+// has the new name.
+int
+nni_plat_file_rename(const char *from, const char *to)
+{
+	if (rename(from, to) != 0) {
+		return (nni_plat_errno(errno));
+	}
+	return (0);
+}
+
 // nni_plat_file_get reads the entire named file, allocating storage
 // to receive the data and returning the data and the size in the
 // reference arguments.
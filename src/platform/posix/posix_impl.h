@@ -97,6 +97,10 @@ struct nni_plat_flock {
 	int fd;
 };
 
+struct nni_plat_flog {
+	int fd;
+};
+
 #define NNG_PLATFORM_DIR_SEP "/"
 
 #ifdef NNG_HAVE_STDATOMIC
@@ -115,6 +115,66 @@ done:
 	return (rv);
 }
 
+// nni_plat_file_log_open opens the named file to add to its end,
+// creating the file if it does not exist yet.
+int
+nni_plat_file_log_open(const char *name, nni_plat_flog *lg)
+{
+	HANDLE h;
+	int    rv;
+
+	if ((rv = nni_plat_make_parent_dirs(name)) != 0) {
+		return (rv);
+	}
+
+	h = CreateFile(name, FILE_APPEND_DATA, FILE_SHARE_READ, NULL,
+	    OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		return (nni_win_error(GetLastError()));
+	}
+	lg->h = h;
+	return (0);
+}
+
+int
+nni_plat_file_log_write(nni_plat_flog *lg, const void *data, size_t len)
+{
+	DWORD nwrite;
+
+	if (!WriteFile(lg->h, data, (DWORD) len, &nwrite, NULL)) {
+		return (nni_win_error(GetLastError()));
+	}
+	NNI_ASSERT(nwrite == len);
+	return (0);
+}
+
+int
+nni_plat_file_log_sync(nni_plat_flog *lg)
+{
+	if (!FlushFileBuffers(lg->h)) {
+		return (nni_win_error(GetLastError()));
+	}
+	return (0);
+}
+
+void
+nni_plat_file_log_close(nni_plat_flog *lg)
+{
+	(void) CloseHandle(lg->h);
+	lg->h = INVALID_HANDLE_VALUE;
+}
+
+// nni_plat_file_rename renames a file, replacing any file that already
+// has the new name.
+int
+nni_plat_file_rename(const char *from, const char *to)
+{
+	if (!MoveFileEx(from, to, MOVEFILE_REPLACE_EXISTING)) {
+		return (nni_win_error(GetLastError()));
+	}
+	return (0);
+}
+
 // nni_plat_file_get reads the entire named file, allocating storage
 // to receive the data and returning the data and the size in the
 // reference arguments.
@@ -103,6 +103,10 @@ struct nni_plat_flock {
 	HANDLE h;
 };
 
+struct nni_plat_flog {
+	HANDLE h;
+};
+
 extern int nni_win_error(int);
 
 extern int nni_win_tcp_conn_init(nni_tcp_conn **, SOCKET);
@@ -35,6 +35,14 @@ static struct {
 	    .upper = "wss",
 	    .lower = "tls+tcp",
 	},
+	{
+	    .upper = "mqtt-ws",
+	    .lower = "tcp",
+	},
+	{
+	    .upper = "mqtt-wss",
+	    .lower = "tls+tcp",
+	},
 	{
 	    .upper = "http4",
 	    .lower = "tcp4",
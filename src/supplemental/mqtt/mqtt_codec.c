@@ -8,6 +8,11 @@
 static void nni_mqtt_msg_append_u8(nni_msg *, uint8_t);
 static void nni_mqtt_msg_append_u16(nni_msg *, uint16_t);
 static void nni_mqtt_msg_append_byte_str(nni_msg *, nni_mqtt_buffer *);
+static void nni_mqtt_msg_append_varint(nni_msg *, uint32_t);
+
+static void nni_mqtt_msg_append_props(nni_msg *, nni_mqtt_proto_data *);
+static int  nni_mqtt_msg_read_props(nni_msg *, struct pos_buf *);
+static int  mqtt_msg_props_own(nni_msg *, nni_mqtt_proto_data *);
 
 static void nni_mqtt_msg_encode_fixed_header(nni_msg *, nni_mqtt_proto_data *);
 static int  nni_mqtt_msg_encode_connect(nni_msg *);
@@ -37,6 +42,7 @@ static int nni_mqtt_msg_decode_unsubscribe(nni_msg *);
 static int nni_mqtt_msg_decode_unsuback(nni_msg *);
 static int nni_mqtt_msg_decode_base(nni_msg *);
 
+static void mqtt_msg_payload_ref_free(nni_mqtt_proto_data *);
 static void destory_connect(nni_mqtt_proto_data *);
 static void destory_publish(nni_mqtt_proto_data *);
 static void destory_subscribe(nni_mqtt_proto_data *);
@@ -51,6 +57,9 @@ static void dup_unsubscribe(nni_mqtt_proto_data *, nni_mqtt_proto_data *);
 
 static void mqtt_msg_content_free(nni_mqtt_proto_data *);
 
+// Packets other than CONNECT carry properties when the connection is v5.
+#define MQTT_IS_V5(mqtt) ((mqtt)->version == MQTT_VERSION_5_0)
+
 typedef struct {
 	nni_mqtt_packet_type packet_type;
 	int (*encode)(nni_msg *);
@@ -91,11 +100,15 @@ static mqtt_msg_codec_handler codec_handler[] = {
 int
 nni_mqtt_msg_encode(nni_msg *msg)
 {
+	nni_mqtt_proto_data *mqtt = nni_mqtt_msg_proto_data(msg);
+
+	// Properties still in the body go with the rest of it.
+	if ((mqtt == NULL) || (mqtt_msg_props_own(msg, mqtt) != 0)) {
+		return MQTT_ERR_NOMEM;
+	}
 	nni_msg_clear(msg);
 	nni_msg_header_clear(msg);
 
-	nni_mqtt_proto_data *mqtt = nni_msg_get_proto_data(msg);
-
 	for (size_t i = 0;
 	     i < sizeof(codec_handler) / sizeof(mqtt_msg_codec_handler); i++) {
 		if (codec_handler[i].packet_type ==
@@ -174,6 +187,9 @@ mqtt_msg_content_free(nni_mqtt_proto_data *mqtt)
 	default:
 		break;
 	}
+	mqtt_msg_payload_ref_free(mqtt);
+	mqtt_buf_free(&mqtt->props);
+	mqtt->prop_len = 0;
 }
 
 int
@@ -188,6 +204,13 @@ nni_mqtt_msg_free(void *self)
 	return (1);
 }
 
+// Releases what the data refers to, for data kept in the message's block.
+void
+nni_mqtt_msg_fini(void *self)
+{
+	mqtt_msg_content_free(self);
+}
+
 int
 nni_mqtt_msg_dup(void **dest, const void *src)
 {
@@ -196,6 +219,10 @@ nni_mqtt_msg_dup(void **dest, const void *src)
 
 	mqtt = NNI_ALLOC_STRUCT(mqtt);
 	memcpy(mqtt, (nni_mqtt_proto_data *) src, sizeof(nni_mqtt_proto_data));
+	mqtt_buf_dup(&mqtt->props, &s->props);
+	if (mqtt->payload_ref != NULL) {
+		nni_atomic_inc(&mqtt->payload_ref->refs);
+	}
 
 	switch (mqtt->fixed_header.common.packet_type) {
 	case NNG_MQTT_CONNECT:
@@ -387,6 +414,27 @@ nni_mqtt_msg_append_byte_str(nni_msg *msg, nni_mqtt_buffer *str)
 	nni_msg_append(msg, str->buf, str->length);
 }
 
+static void
+nni_mqtt_msg_append_varint(nni_msg *msg, uint32_t val)
+{
+	uint8_t        bytes[4] = { 0 };
+	struct pos_buf buf      = { .curpos = &bytes[0],
+                .endpos                 = &bytes[sizeof(bytes)] };
+
+	int len = write_variable_length_value(val, &buf);
+	nni_msg_append(msg, bytes, len);
+}
+
+// Writes the property block of a v5 packet, length first.
+static void
+nni_mqtt_msg_append_props(nni_msg *msg, nni_mqtt_proto_data *mqtt)
+{
+	nni_mqtt_msg_append_varint(msg, mqtt->props.length);
+	if (mqtt->props.length > 0) {
+		nni_msg_append(msg, mqtt->props.buf, mqtt->props.length);
+	}
+}
+
 static void
 nni_mqtt_msg_encode_fixed_header(nni_msg *msg, nni_mqtt_proto_data *data)
 {
@@ -433,6 +481,13 @@ nni_mqtt_msg_encode_connect(nni_msg *msg)
 		    (const uint8_t *) client_id, (uint32_t) strlen(client_id));
 	}
 
+	/* Properties */
+	if (var_header->protocol_version == MQTT_VERSION_5_0) {
+		poslength += byte_number_for_variable_length(
+		                 mqtt->props.length) +
+		    mqtt->props.length;
+	}
+
 	poslength += var_header->protocol_name.length;
 	/* add the length of payload part */
 	mqtt_connect_payload *payload = &mqtt->payload.connect;
@@ -443,6 +498,9 @@ nni_mqtt_msg_encode_connect(nni_msg *msg)
 	if (payload->will_topic.length > 0) {
 		poslength += 2 + payload->will_topic.length;
 		var_header->conn_flags.will_flag = 1;
+		if (var_header->protocol_version == MQTT_VERSION_5_0) {
+			poslength += 1; /* for empty Will Properties */
+		}
 	}
 	/* Will Message */
 	if (payload->will_msg.length > 0) {
@@ -476,6 +534,11 @@ nni_mqtt_msg_encode_connect(nni_msg *msg)
 	/* Keep Alive */
 	nni_mqtt_msg_append_u16(msg, var_header->keep_alive);
 
+	/* Properties */
+	if (var_header->protocol_version == MQTT_VERSION_5_0) {
+		nni_mqtt_msg_append_props(msg, mqtt);
+	}
+
 	/* Now we are in payload part */
 
 	/* Client Identifier */
@@ -487,6 +550,9 @@ nni_mqtt_msg_encode_connect(nni_msg *msg)
 		if (!(var_header->conn_flags.will_flag)) {
 			return MQTT_ERR_PROTOCOL;
 		}
+		if (var_header->protocol_version == MQTT_VERSION_5_0) {
+			nni_mqtt_msg_append_u8(msg, 0);
+		}
 		nni_mqtt_msg_append_byte_str(msg, &payload->will_topic);
 	} else {
 		if (var_header->conn_flags.will_flag) {
@@ -543,6 +609,12 @@ nni_mqtt_msg_encode_connack(nni_msg *msg)
 
 	mqtt_connack_vhdr *var_header = &mqtt->var_header.connack;
 
+	if (MQTT_IS_V5(mqtt)) {
+		poslength += byte_number_for_variable_length(
+		                 mqtt->props.length) +
+		    mqtt->props.length;
+	}
+
 	mqtt->fixed_header.remaining_length = (uint32_t) poslength;
 	nni_mqtt_msg_encode_fixed_header(msg, mqtt);
 
@@ -553,6 +625,10 @@ nni_mqtt_msg_encode_connack(nni_msg *msg)
 	nni_mqtt_msg_append_u8(
 	    msg, *(uint8_t *) &var_header->conn_return_code);
 
+	if (MQTT_IS_V5(mqtt)) {
+		nni_mqtt_msg_append_props(msg, mqtt);
+	}
+
 	return MQTT_SUCCESS;
 }
 
@@ -565,6 +641,11 @@ nni_mqtt_msg_encode_subscribe(nni_msg *msg)
 	int poslength = 0;
 
 	poslength += 2; /* for Packet Identifier */
+	if (MQTT_IS_V5(mqtt)) {
+		poslength += byte_number_for_variable_length(
+		                 mqtt->props.length) +
+		    mqtt->props.length;
+	}
 
 	mqtt_subscribe_payload *spld = &mqtt->payload.subscribe;
 
@@ -584,6 +665,9 @@ nni_mqtt_msg_encode_subscribe(nni_msg *msg)
 	mqtt_subscribe_vhdr *var_header = &mqtt->var_header.subscribe;
 	/* Packet Id */
 	nni_mqtt_msg_append_u16(msg, var_header->packet_id);
+	if (MQTT_IS_V5(mqtt)) {
+		nni_mqtt_msg_append_props(msg, mqtt);
+	}
 
 	/* Subscribe topic_arr */
 	for (size_t i = 0; i < spld->topic_count; i++) {
@@ -607,12 +691,20 @@ nni_mqtt_msg_encode_suback(nni_msg *msg)
 	mqtt_suback_payload *spld       = &mqtt->payload.suback;
 
 	poslength += spld->ret_code_count;
+	if (MQTT_IS_V5(mqtt)) {
+		poslength += byte_number_for_variable_length(
+		                 mqtt->props.length) +
+		    mqtt->props.length;
+	}
 
 	mqtt->fixed_header.remaining_length = (uint32_t) poslength;
 	nni_mqtt_msg_encode_fixed_header(msg, mqtt);
 
 	/* Packet Identifier */
 	nni_mqtt_msg_append_u16(msg, var_header->packet_id);
+	if (MQTT_IS_V5(mqtt)) {
+		nni_mqtt_msg_append_props(msg, mqtt);
+	}
 
 	/* Return Codes */
 	nni_msg_append(msg, spld->ret_code_arr, spld->ret_code_count);
@@ -634,13 +726,21 @@ nni_mqtt_msg_encode_publish(nni_msg *msg)
 	if (mqtt->fixed_header.publish.qos > 0) {
 		poslength += 2; /* for Packet Identifier */
 	}
-	poslength += mqtt->payload.publish.payload.length;
+	mqtt_publish_vhdr *var_header = &mqtt->var_header.publish;
+
+	/* Properties */
+	if (MQTT_IS_V5(mqtt)) {
+		poslength += byte_number_for_variable_length(
+		                 mqtt->props.length) +
+		    mqtt->props.length;
+	}
+	poslength += mqtt->payload_ref != NULL
+	    ? mqtt->payload_ref->len
+	    : mqtt->payload.publish.payload.length;
 	mqtt->fixed_header.remaining_length = (uint32_t) poslength;
 
 	nni_mqtt_msg_encode_fixed_header(msg, mqtt);
 
-	mqtt_publish_vhdr *var_header = &mqtt->var_header.publish;
-
 	/* Topic Name */
 	nni_mqtt_msg_append_byte_str(msg, &var_header->topic_name);
 
@@ -649,8 +749,13 @@ nni_mqtt_msg_encode_publish(nni_msg *msg)
 		nni_mqtt_msg_append_u16(msg, var_header->packet_id);
 	}
 
-	/* Payload */
-	if (mqtt->payload.publish.payload.length > 0) {
+	if (MQTT_IS_V5(mqtt)) {
+		nni_mqtt_msg_append_props(msg, mqtt);
+	}
+
+	/* Payload, unless the transport writes it from the application */
+	if (mqtt->payload_ref == NULL &&
+	    mqtt->payload.publish.payload.length > 0) {
 		nni_msg_append(msg, mqtt->payload.publish.payload.buf,
 		    mqtt->payload.publish.payload.length);
 	}
@@ -744,6 +849,11 @@ nni_mqtt_msg_encode_unsubscribe(nni_msg *msg)
 	int poslength = 0;
 
 	poslength += 2; /* for Packet Identifier */
+	if (MQTT_IS_V5(mqtt)) {
+		poslength += byte_number_for_variable_length(
+		                 mqtt->props.length) +
+		    mqtt->props.length;
+	}
 
 	mqtt_unsubscribe_payload *uspld = &mqtt->payload.unsubscribe;
 
@@ -762,6 +872,9 @@ nni_mqtt_msg_encode_unsubscribe(nni_msg *msg)
 	mqtt_unsubscribe_vhdr *var_header = &mqtt->var_header.unsubscribe;
 	/* Packet Id */
 	nni_mqtt_msg_append_u16(msg, var_header->packet_id);
+	if (MQTT_IS_V5(mqtt)) {
+		nni_mqtt_msg_append_props(msg, mqtt);
+	}
 
 	/* Unsubscribe topic_arr */
 	for (size_t i = 0; i < uspld->topic_count; i++) {
@@ -868,12 +981,27 @@ nni_mqtt_msg_decode_connect(nni_msg *msg)
 	if (ret != 0) {
 		return MQTT_ERR_PROTOCOL;
 	}
+	/* Properties */
+	if (mqtt->var_header.connect.protocol_version == MQTT_VERSION_5_0 &&
+	    nni_mqtt_msg_read_props(msg, &buf) != 0) {
+		return MQTT_ERR_PROTOCOL;
+	}
 	/* Client Identifier */
 	ret = read_utf8_str(&buf, &mqtt->payload.connect.client_id);
 	if (ret != 0) {
 		return MQTT_ERR_PROTOCOL;
 	}
 	if (mqtt->var_header.connect.conn_flags.will_flag) {
+		/* Will Properties, which are not kept */
+		if (mqtt->var_header.connect.protocol_version ==
+		    MQTT_VERSION_5_0) {
+			uint32_t wlen;
+			if (read_packet_length(&buf, &wlen) != 0 ||
+			    (size_t)(buf.endpos - buf.curpos) < wlen) {
+				return MQTT_ERR_PROTOCOL;
+			}
+			buf.curpos += wlen;
+		}
 		/* Will Topic */
 		ret = read_utf8_str(&buf, &mqtt->payload.connect.will_topic);
 		if (ret != 0) {
@@ -920,11 +1048,18 @@ nni_mqtt_msg_decode_connack(nni_msg *msg)
 	}
 
 	/* Connect Return Code */
-	result = read_byte(&buf, &mqtt->var_header.connack.connack_flags);
+	result = read_byte(&buf, &mqtt->var_header.connack.conn_return_code);
 	if (result != 0) {
 		return MQTT_ERR_PROTOCOL;
 	}
 
+	/* Properties, which may be left out entirely */
+	if (MQTT_IS_V5(mqtt) && buf.curpos < buf.endpos) {
+		if (nni_mqtt_msg_read_props(msg, &buf) != 0) {
+			return MQTT_ERR_PROTOCOL;
+		}
+	}
+
 	return MQTT_SUCCESS;
 }
 
@@ -1014,6 +1149,12 @@ nni_mqtt_msg_decode_suback(nni_msg *msg)
 		return MQTT_ERR_PROTOCOL;
 	}
 
+	if (MQTT_IS_V5(mqtt)) {
+		if (nni_mqtt_msg_read_props(msg, &buf) != 0) {
+			return MQTT_ERR_PROTOCOL;
+		}
+	}
+
 	/* Suback Return Codes */
 	mqtt->payload.suback.ret_code_count = buf.endpos - buf.curpos;
 
@@ -1042,8 +1183,7 @@ static int
 nni_mqtt_msg_decode_publish(nni_msg *msg)
 {
 	int                  ret;
-	int                  packid_length = 0;
-	nni_mqtt_proto_data *mqtt          = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *mqtt = nni_msg_get_proto_data(msg);
 
 	uint8_t *body   = nni_msg_body(msg);
 	size_t   length = nni_msg_len(msg);
@@ -1064,18 +1204,21 @@ nni_mqtt_msg_decode_publish(nni_msg *msg)
 		if (ret != MQTT_SUCCESS) {
 			return MQTT_ERR_PROTOCOL;
 		}
-		packid_length = 2;
+	}
+
+	/* Properties, left where they are until asked for */
+	if (MQTT_IS_V5(mqtt)) {
+		if (nni_mqtt_msg_read_props(msg, &buf) != 0) {
+			return MQTT_ERR_PROTOCOL;
+		}
 	}
 
 	/* Payload */
-	/* No length information for payload. The length of the payload can be
-	   calculated by subtracting the length of the variable header from the
-	   Remaining Length field that is in the Fixed Header. It is valid for
-	   a PUBLISH Packet to contain a zero length payload.*/
+	/* No length information for payload. The payload is whatever is left
+	   of the packet after the variable header. It is valid for a PUBLISH
+	   Packet to contain a zero length payload.*/
 	mqtt->payload.publish.payload.length =
-	    mqtt->fixed_header.remaining_length -
-	    (2 /* Length bytes of Topic Name */ +
-	        mqtt->var_header.publish.topic_name.length + packid_length);
+	    (uint32_t)(buf.endpos - buf.curpos);
 	mqtt->payload.publish.payload.buf =
 	    (mqtt->payload.publish.payload.length > 0) ? buf.curpos : NULL;
 
@@ -1401,6 +1544,478 @@ read_packet_length(struct pos_buf *buf, uint32_t *length)
 	return 0;
 }
 
+// The wire types of MQTT 5.0 property values.
+enum mqtt_prop_type {
+	MQTT_PROP_NONE,
+	MQTT_PROP_BYTE,
+	MQTT_PROP_U16,
+	MQTT_PROP_U32,
+	MQTT_PROP_VARINT,
+	MQTT_PROP_STR, // UTF-8 string or binary data
+	MQTT_PROP_PAIR,
+};
+
+static enum mqtt_prop_type
+mqtt_prop_type(uint8_t id)
+{
+	switch (id) {
+	case NNG_MQTT_PROP_PAYLOAD_FORMAT:
+	case NNG_MQTT_PROP_REQUEST_PROBLEM_INFO:
+	case NNG_MQTT_PROP_REQUEST_RESPONSE_INFO:
+	case NNG_MQTT_PROP_MAX_QOS:
+	case NNG_MQTT_PROP_RETAIN_AVAILABLE:
+	case NNG_MQTT_PROP_WILDCARD_SUB_AVAILABLE:
+	case NNG_MQTT_PROP_SUB_ID_AVAILABLE:
+	case NNG_MQTT_PROP_SHARED_SUB_AVAILABLE:
+		return (MQTT_PROP_BYTE);
+	case NNG_MQTT_PROP_SERVER_KEEP_ALIVE:
+	case NNG_MQTT_PROP_RECEIVE_MAX:
+	case NNG_MQTT_PROP_TOPIC_ALIAS_MAX:
+	case NNG_MQTT_PROP_TOPIC_ALIAS:
+		return (MQTT_PROP_U16);
+	case NNG_MQTT_PROP_MESSAGE_EXPIRY:
+	case NNG_MQTT_PROP_SESSION_EXPIRY:
+	case NNG_MQTT_PROP_WILL_DELAY:
+	case NNG_MQTT_PROP_MAX_PACKET_SIZE:
+		return (MQTT_PROP_U32);
+	case NNG_MQTT_PROP_SUBSCRIPTION_ID:
+		return (MQTT_PROP_VARINT);
+	case NNG_MQTT_PROP_CONTENT_TYPE:
+	case NNG_MQTT_PROP_RESPONSE_TOPIC:
+	case NNG_MQTT_PROP_CORRELATION_DATA:
+	case NNG_MQTT_PROP_ASSIGNED_CLIENT_ID:
+	case NNG_MQTT_PROP_AUTH_METHOD:
+	case NNG_MQTT_PROP_AUTH_DATA:
+	case NNG_MQTT_PROP_RESPONSE_INFO:
+	case NNG_MQTT_PROP_SERVER_REFERENCE:
+	case NNG_MQTT_PROP_REASON_STRING:
+		return (MQTT_PROP_STR);
+	case NNG_MQTT_PROP_USER_PROPERTY:
+		return (MQTT_PROP_PAIR);
+	default:
+		return (MQTT_PROP_NONE);
+	}
+}
+
+// Skips over the value of one property, whose identifier has been read.
+static int
+mqtt_prop_skip(struct pos_buf *buf, uint8_t id)
+{
+	uint32_t len;
+	mqtt_buf str;
+
+	switch (mqtt_prop_type(id)) {
+	case MQTT_PROP_BYTE:
+		len = 1;
+		break;
+	case MQTT_PROP_U16:
+		len = 2;
+		break;
+	case MQTT_PROP_U32:
+		len = 4;
+		break;
+	case MQTT_PROP_VARINT:
+		return (read_packet_length(buf, &len) == 0 ? 0
+		                                           : MQTT_ERR_PROTOCOL);
+	case MQTT_PROP_PAIR:
+		if (read_str_data(buf, &str) != 0) {
+			return MQTT_ERR_PROTOCOL;
+		}
+		// FALLTHROUGH
+	case MQTT_PROP_STR:
+		return (read_str_data(buf, &str) == 0 ? 0 : MQTT_ERR_PROTOCOL);
+	default:
+		return MQTT_ERR_PROTOCOL;
+	}
+	if ((size_t)(buf->endpos - buf->curpos) < len) {
+		return MQTT_ERR_PROTOCOL;
+	}
+	buf->curpos += len;
+	return 0;
+}
+
+// Reads the length of the property block of a received packet and steps
+// over it, noting where it is.  The properties themselves are only looked
+// at by the getters.
+static int
+nni_mqtt_msg_read_props(nni_msg *msg, struct pos_buf *buf)
+{
+	nni_mqtt_proto_data *mqtt = nni_msg_get_proto_data(msg);
+	uint32_t             len;
+
+	if (read_packet_length(buf, &len) != 0 ||
+	    (size_t)(buf->endpos - buf->curpos) < len) {
+		return MQTT_ERR_PROTOCOL;
+	}
+	mqtt->prop_off = (uint32_t)(buf->curpos - (uint8_t *) nni_msg_body(msg));
+	mqtt->prop_len = len;
+	buf->curpos += len;
+	return 0;
+}
+
+// Points buf at the properties of msg, wherever they are.
+static void
+mqtt_msg_props(nni_msg *msg, nni_mqtt_proto_data *mqtt, struct pos_buf *buf)
+{
+	if (mqtt == NULL) {
+		// an undecoded MQTT 3.1.1 PUBLISH, which has none
+		buf->curpos = NULL;
+		buf->endpos = NULL;
+	} else if (mqtt->props.buf != NULL) {
+		buf->curpos = mqtt->props.buf;
+		buf->endpos = mqtt->props.buf + mqtt->props.length;
+	} else {
+		buf->curpos = (uint8_t *) nni_msg_body(msg) + mqtt->prop_off;
+		buf->endpos = buf->curpos + mqtt->prop_len;
+	}
+}
+
+// Copies properties that are still in the body out of it, before the body
+// is changed.
+static int
+mqtt_msg_props_own(nni_msg *msg, nni_mqtt_proto_data *mqtt)
+{
+	if (mqtt->props.buf == NULL && mqtt->prop_len > 0) {
+		if (mqtt_buf_create(&mqtt->props,
+		        (uint8_t *) nni_msg_body(msg) + mqtt->prop_off,
+		        mqtt->prop_len) != 0) {
+			return (NNG_ENOMEM);
+		}
+		mqtt->prop_len = 0;
+	}
+	return (0);
+}
+
+// Rewrites the properties of msg without those with identifier del, and
+// with the encoded property add, if any, at the end.
+static int
+mqtt_msg_props_edit(
+    nni_msg *msg, uint8_t del, const uint8_t *add, uint32_t add_len)
+{
+	nni_mqtt_proto_data *mqtt = nni_mqtt_msg_proto_data(msg);
+	struct pos_buf       buf;
+	mqtt_buf             props = { 0 };
+	uint8_t *            start;
+	uint8_t              id;
+	uint32_t             len = add_len;
+
+	if (mqtt == NULL) {
+		return (NNG_ENOMEM);
+	}
+	// Once to size the result, and again to fill it.
+	for (int pass = 0; pass < 2; pass++) {
+		mqtt_msg_props(msg, mqtt, &buf);
+		while (buf.curpos < buf.endpos) {
+			start = buf.curpos;
+			id    = *buf.curpos++;
+			if (mqtt_prop_skip(&buf, id) != 0) {
+				return (NNG_EPROTO);
+			}
+			if (id == del) {
+				continue;
+			}
+			if (pass == 0) {
+				len += (uint32_t)(buf.curpos - start);
+			} else {
+				memcpy(props.buf + props.length, start,
+				    buf.curpos - start);
+				props.length += (uint32_t)(buf.curpos - start);
+			}
+		}
+		if (pass == 0) {
+			if (len > 0 && (props.buf = nni_alloc(len)) == NULL) {
+				return (NNG_ENOMEM);
+			}
+		}
+	}
+	if (add_len > 0) {
+		memcpy(props.buf + props.length, add, add_len);
+		props.length += add_len;
+	}
+	mqtt_buf_free(&mqtt->props);
+	mqtt->props    = props;
+	mqtt->prop_len = 0;
+	return (0);
+}
+
+// The size a PUBLISH takes on the wire, fixed header included, worked out
+// without encoding it.
+static void
+mqtt_msg_payload_ref_free(nni_mqtt_proto_data *mqtt)
+{
+	mqtt_payload_ref *ref = mqtt->payload_ref;
+
+	mqtt->payload_ref = NULL;
+	if (ref != NULL && nni_atomic_dec_nv(&ref->refs) == 0) {
+		if (ref->release != NULL) {
+			ref->release(ref->arg);
+		}
+		NNI_FREE_STRUCT(ref);
+	}
+}
+
+// Sets the payload of a PUBLISH to an application buffer, which is not
+// copied but written to the connection from where it is.  release is
+// called with arg once no message refers to the buffer any more.  A NULL
+// buf drops the buffer set before.
+int
+nni_mqtt_msg_set_publish_payload_ref(nni_msg *msg, void *buf, uint32_t len,
+    void (*release)(void *), void *arg)
+{
+	nni_mqtt_proto_data *mqtt = nni_mqtt_msg_proto_data(msg);
+	mqtt_payload_ref *   ref  = NULL;
+
+	if (mqtt == NULL) {
+		return (NNG_ENOMEM);
+	}
+	if (buf != NULL) {
+		if ((ref = NNI_ALLOC_STRUCT(ref)) == NULL) {
+			return (NNG_ENOMEM);
+		}
+		nni_atomic_init(&ref->refs);
+		nni_atomic_set(&ref->refs, 1);
+		ref->buf     = buf;
+		ref->len     = len;
+		ref->release = release;
+		ref->arg     = arg;
+		if (mqtt->is_copied) {
+			mqtt_buf_free(&mqtt->payload.publish.payload);
+		}
+	}
+	mqtt_msg_payload_ref_free(mqtt);
+	mqtt->payload_ref = ref;
+	return (0);
+}
+
+// Returns the payload that goes on the wire after an encoded message, or
+// NULL when all of it is in the message.
+const void *
+nni_mqtt_msg_payload_ref(nni_msg *msg, size_t *lenp)
+{
+	nni_mqtt_proto_data *mqtt = nni_msg_get_proto_data(msg);
+
+	if (mqtt == NULL || mqtt->payload_ref == NULL) {
+		return (NULL);
+	}
+	*lenp = mqtt->payload_ref->len;
+	return (mqtt->payload_ref->buf);
+}
+
+uint32_t
+nni_mqtt_msg_get_publish_packet_size(nni_msg *msg)
+{
+	nni_mqtt_proto_data *mqtt = nni_msg_get_proto_data(msg);
+	uint32_t             len;
+	uint32_t             plen;
+
+	len = 2 + mqtt->var_header.publish.topic_name.length;
+	len += mqtt->payload_ref != NULL ? mqtt->payload_ref->len
+	                                 : mqtt->payload.publish.payload.length;
+	if (mqtt->fixed_header.publish.qos > 0) {
+		len += 2;
+	}
+	if (MQTT_IS_V5(mqtt)) {
+		plen = mqtt->props.buf != NULL ? mqtt->props.length
+		                               : mqtt->prop_len;
+		len += byte_number_for_variable_length(plen) + plen;
+	}
+	return (1 + byte_number_for_variable_length(len) + len);
+}
+
+// Finds property id, leaving buf at its value.
+static int
+mqtt_prop_find(struct pos_buf *buf, uint8_t id)
+{
+	uint8_t pid;
+
+	while (buf->curpos < buf->endpos) {
+		// Identifiers are varints, but all of them fit in one byte.
+		pid = *buf->curpos++;
+		if (pid == id) {
+			return (0);
+		}
+		if (mqtt_prop_skip(buf, pid) != 0) {
+			return (NNG_EPROTO);
+		}
+	}
+	return (NNG_ENOENT);
+}
+
+int
+nni_mqtt_msg_get_prop_int(nni_msg *msg, uint8_t id, uint32_t *val)
+{
+	nni_mqtt_proto_data *mqtt = nni_msg_get_proto_data(msg);
+	enum mqtt_prop_type  type = mqtt_prop_type(id);
+	struct pos_buf       buf;
+	uint8_t              u8;
+	uint16_t             u16;
+	int                  rv;
+
+	if (type == MQTT_PROP_NONE || type == MQTT_PROP_STR ||
+	    type == MQTT_PROP_PAIR) {
+		return (NNG_EINVAL);
+	}
+	mqtt_msg_props(msg, mqtt, &buf);
+	if ((rv = mqtt_prop_find(&buf, id)) != 0) {
+		return (rv);
+	}
+	switch (type) {
+	case MQTT_PROP_BYTE:
+		rv   = read_byte(&buf, &u8);
+		*val = u8;
+		break;
+	case MQTT_PROP_U16:
+		rv   = read_uint16(&buf, &u16);
+		*val = u16;
+		break;
+	case MQTT_PROP_U32:
+		if (buf.endpos - buf.curpos < 4) {
+			rv = MQTT_ERR_PROTOCOL;
+		} else {
+			NNI_GET32(buf.curpos, *val);
+			rv = 0;
+		}
+		break;
+	default:
+		rv = read_packet_length(&buf, val);
+		break;
+	}
+	return (rv == 0 ? 0 : NNG_EPROTO);
+}
+
+int
+nni_mqtt_msg_get_prop_str(nni_msg *msg, uint8_t id, mqtt_buf *val)
+{
+	nni_mqtt_proto_data *mqtt = nni_msg_get_proto_data(msg);
+	struct pos_buf       buf;
+	int                  rv;
+
+	if (mqtt_prop_type(id) != MQTT_PROP_STR) {
+		return (NNG_EINVAL);
+	}
+	mqtt_msg_props(msg, mqtt, &buf);
+	if ((rv = mqtt_prop_find(&buf, id)) != 0) {
+		return (rv);
+	}
+	return (read_str_data(&buf, val) == 0 ? 0 : NNG_EPROTO);
+}
+
+int
+nni_mqtt_msg_get_user_prop(
+    nni_msg *msg, uint32_t index, mqtt_buf *name, mqtt_buf *value)
+{
+	nni_mqtt_proto_data *mqtt = nni_msg_get_proto_data(msg);
+	struct pos_buf       buf;
+	int                  rv;
+
+	mqtt_msg_props(msg, mqtt, &buf);
+	for (;;) {
+		if ((rv = mqtt_prop_find(&buf, NNG_MQTT_PROP_USER_PROPERTY)) !=
+		    0) {
+			return (rv);
+		}
+		if (read_str_data(&buf, name) != 0 ||
+		    read_str_data(&buf, value) != 0) {
+			return (NNG_EPROTO);
+		}
+		if (index-- == 0) {
+			return (0);
+		}
+	}
+}
+
+int
+nni_mqtt_msg_set_prop_int(nni_msg *msg, uint8_t id, uint32_t val)
+{
+	uint8_t        prop[5];
+	struct pos_buf buf = { .curpos = &prop[1],
+		.endpos        = &prop[sizeof(prop)] };
+
+	prop[0] = id;
+	switch (mqtt_prop_type(id)) {
+	case MQTT_PROP_BYTE:
+		if (val > 0xff) {
+			return (NNG_EINVAL);
+		}
+		write_byte((uint8_t) val, &buf);
+		break;
+	case MQTT_PROP_U16:
+		if (val > 0xffff) {
+			return (NNG_EINVAL);
+		}
+		write_uint16((uint16_t) val, &buf);
+		break;
+	case MQTT_PROP_U32:
+		NNI_PUT32(buf.curpos, val);
+		buf.curpos += 4;
+		break;
+	case MQTT_PROP_VARINT:
+		if (val == 0 || val > MQTT_MAX_MSG_LEN) {
+			return (NNG_EINVAL);
+		}
+		write_variable_length_value(val, &buf);
+		break;
+	default:
+		return (NNG_EINVAL);
+	}
+	return (mqtt_msg_props_edit(msg, id, prop, buf.curpos - prop));
+}
+
+int
+nni_mqtt_msg_set_prop_str(
+    nni_msg *msg, uint8_t id, const uint8_t *data, uint32_t len)
+{
+	uint8_t *prop;
+	int      rv;
+
+	if (mqtt_prop_type(id) != MQTT_PROP_STR || len > 0xffff) {
+		return (NNG_EINVAL);
+	}
+	if ((prop = nni_alloc(len + 3)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	prop[0] = id;
+	NNI_PUT16(prop + 1, len);
+	if (len > 0) {
+		memcpy(prop + 3, data, len);
+	}
+	rv = mqtt_msg_props_edit(msg, id, prop, len + 3);
+	nni_free(prop, len + 3);
+	return (rv);
+}
+
+int
+nni_mqtt_msg_add_user_prop(nni_msg *msg, const char *name, const char *value)
+{
+	size_t   nlen = strlen(name);
+	size_t   vlen = strlen(value);
+	uint32_t len  = (uint32_t)(nlen + vlen + 5);
+	uint8_t *prop;
+	int      rv;
+
+	if (nlen > 0xffff || vlen > 0xffff) {
+		return (NNG_EINVAL);
+	}
+	if ((prop = nni_alloc(len)) == NULL) {
+		return (NNG_ENOMEM);
+	}
+	prop[0] = NNG_MQTT_PROP_USER_PROPERTY;
+	NNI_PUT16(prop + 1, nlen);
+	memcpy(prop + 3, name, nlen);
+	NNI_PUT16(prop + 3 + nlen, vlen);
+	memcpy(prop + 5 + nlen, value, vlen);
+	// Identifier 0 is not a property, so nothing is removed.
+	rv = mqtt_msg_props_edit(msg, 0, prop, len);
+	nni_free(prop, len);
+	return (rv);
+}
+
+int
+nni_mqtt_msg_del_prop(nni_msg *msg, uint8_t id)
+{
+	return (mqtt_msg_props_edit(msg, id, NULL, 0));
+}
+
 int
 mqtt_get_remaining_length(uint8_t *packet, uint32_t len,
     uint32_t *remainning_length, uint8_t *used_bytes)
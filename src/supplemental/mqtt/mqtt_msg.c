@@ -6,15 +6,39 @@ static nni_proto_msg_ops proto_msg_ops = {
 
 	.msg_free = nni_mqtt_msg_free,
 
-	.msg_dup = nni_mqtt_msg_dup
+	.msg_dup = nni_mqtt_msg_dup,
+
+	.msg_fini = nni_mqtt_msg_fini,
 };
 
+// Sets a two byte property, where zero stands for leaving it out.
+static void
+mqtt_msg_set_prop_u16(nni_msg *msg, uint8_t id, uint16_t val)
+{
+	if (val == 0) {
+		nni_mqtt_msg_del_prop(msg, id);
+	} else {
+		nni_mqtt_msg_set_prop_int(msg, id, val);
+	}
+}
+
+static uint16_t
+mqtt_msg_get_prop_u16(nni_msg *msg, uint8_t id)
+{
+	uint32_t val;
+
+	return (nni_mqtt_msg_get_prop_int(msg, id, &val) == 0 ? (uint16_t) val
+	                                                      : 0);
+}
+
 int
 nni_mqtt_msg_proto_data_alloc(nni_msg *msg)
 {
 	nni_mqtt_proto_data *proto_data;
 
-	if ((proto_data = NNI_ALLOC_STRUCT(proto_data)) == NULL) {
+	// This is in the message's own block, usually.
+	if ((proto_data = nni_msg_proto_alloc(msg, sizeof(*proto_data))) ==
+	    NULL) {
 		return NNG_ENOMEM;
 	}
 
@@ -25,9 +49,74 @@ nni_mqtt_msg_proto_data_alloc(nni_msg *msg)
 
 void
 nni_mqtt_msg_proto_data_free(nni_msg *msg)
+{
+	nni_msg_set_proto_data(msg, NULL, NULL);
+}
+
+// Returns the protocol data of a message.  A PUBLISH received on an MQTT
+// 3.1.1 connection comes without, as its topic, payload and flags are read
+// from the packet itself; it is decoded here the first time anything else
+// is asked of it.
+nni_mqtt_proto_data *
+nni_mqtt_msg_proto_data(nni_msg *msg)
 {
 	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
-	nni_mqtt_msg_free(proto_data);
+
+	if ((proto_data == NULL) &&
+	    (nni_mqtt_msg_proto_data_alloc(msg) == 0)) {
+		proto_data          = nni_msg_get_proto_data(msg);
+		proto_data->version = MQTT_VERSION_3_1_1;
+		(void) nni_mqtt_msg_decode(msg);
+	}
+	return (proto_data);
+}
+
+// Returns the protocol data of a message for reading, without decoding an
+// undecoded PUBLISH.  Such a message has none of what the getters using
+// this ask for, so they see it all zero.
+static const nni_mqtt_proto_data *
+mqtt_msg_proto_data_peek(nni_msg *msg)
+{
+	static const nni_mqtt_proto_data none;
+	const nni_mqtt_proto_data *      proto_data;
+
+	if ((proto_data = nni_msg_get_proto_data(msg)) == NULL) {
+		return (&none);
+	}
+	return (proto_data);
+}
+
+// Checks that a PUBLISH received on an MQTT 3.1.1 connection is well
+// formed, so that it can be left undecoded.
+int
+nni_mqtt_msg_check_publish(nni_msg *msg)
+{
+	uint8_t *hdr = nni_msg_header(msg);
+	size_t   len = nni_msg_len(msg);
+	uint16_t tlen;
+	uint8_t  qos;
+
+	if ((nni_msg_header_len(msg) < 2) || ((hdr[0] & 0xf0) != 0x30) ||
+	    (len < 2)) {
+		return (NNG_EPROTO);
+	}
+	qos = (hdr[0] & 0x06) >> 1;
+	NNI_GET16((uint8_t *) nni_msg_body(msg), tlen);
+	if ((qos > 2) || (len < (size_t) tlen + (qos > 0 ? 4 : 2))) {
+		return (NNG_EPROTO);
+	}
+	return (0);
+}
+
+// Where the payload of an undecoded PUBLISH starts.
+static size_t
+mqtt_msg_raw_payload_off(nni_msg *msg)
+{
+	uint8_t *body = nni_msg_body(msg);
+	uint16_t tlen;
+
+	NNI_GET16(body, tlen);
+	return ((size_t) tlen + (nni_msg_get_pub_qos(msg) > 0 ? 4 : 2));
 }
 
 int
@@ -49,8 +138,11 @@ nni_mqtt_msg_alloc(nni_msg **msg, size_t sz)
 void
 nni_mqtt_msg_set_packet_type(nni_msg *msg, nni_mqtt_packet_type packet_type)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
 
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->fixed_header.common.packet_type = packet_type;
 }
 
@@ -59,13 +151,42 @@ nni_mqtt_msg_get_packet_type(nni_msg *msg)
 {
 	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
 
+	if (proto_data == NULL) {
+		return (((uint8_t *) nni_msg_header(msg))[0] >> 4);
+	}
 	return proto_data->fixed_header.common.packet_type;
 }
 
 void
-nni_mqtt_msg_set_packet_id(nni_msg *msg, uint16_t packet_id)
+nni_mqtt_msg_set_protocol_version(nni_msg *msg, uint8_t version)
+{
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
+	proto_data->version = version;
+}
+
+uint8_t
+nni_mqtt_msg_get_protocol_version(nni_msg *msg)
 {
 	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return (MQTT_VERSION_3_1_1);
+	}
+	return proto_data->version;
+}
+
+void
+nni_mqtt_msg_set_packet_id(nni_msg *msg, uint16_t packet_id)
+{
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	switch (proto_data->fixed_header.common.packet_type) {
 	case NNG_MQTT_PUBACK:
 		proto_data->var_header.puback.packet_id = packet_id;
@@ -104,6 +225,10 @@ uint16_t
 nni_mqtt_msg_get_packet_id(nni_msg *msg)
 {
 	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return (nni_mqtt_msg_get_publish_packet_id(msg));
+	}
 	switch (proto_data->fixed_header.common.packet_type) {
 	case NNG_MQTT_PUBACK:
 		return proto_data->var_header.puback.packet_id;
@@ -133,8 +258,11 @@ nni_mqtt_msg_get_packet_id(nni_msg *msg)
 void
 nni_mqtt_msg_set_publish_qos(nni_msg *msg, uint8_t qos)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
 
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->fixed_header.publish.qos = qos;
 }
 
@@ -143,13 +271,20 @@ nni_mqtt_msg_get_publish_qos(nni_msg *msg)
 {
 	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
 
+	if (proto_data == NULL) {
+		return (nni_msg_get_pub_qos(msg));
+	}
 	return proto_data->fixed_header.publish.qos;
 }
 
 void
 nni_mqtt_msg_set_publish_retain(nni_msg *msg, bool retain)
 {
-	nni_mqtt_proto_data *proto_data         = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->fixed_header.publish.retain = (uint8_t) retain;
 }
 
@@ -157,13 +292,21 @@ bool
 nni_mqtt_msg_get_publish_retain(nni_msg *msg)
 {
 	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return ((((uint8_t *) nni_msg_header(msg))[0] & 0x01) != 0);
+	}
 	return proto_data->fixed_header.publish.retain;
 }
 
 void
 nni_mqtt_msg_set_publish_dup(nni_msg *msg, bool dup)
 {
-	nni_mqtt_proto_data *proto_data      = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->fixed_header.publish.dup = (uint8_t) dup;
 }
 
@@ -171,13 +314,21 @@ bool
 nni_mqtt_msg_get_publish_dup(nni_msg *msg)
 {
 	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return ((((uint8_t *) nni_msg_header(msg))[0] & 0x08) != 0);
+	}
 	return proto_data->fixed_header.publish.dup;
 }
 
 void
 nni_mqtt_msg_set_publish_topic(nni_msg *msg, const char *topic)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	mqtt_buf_create(&proto_data->var_header.publish.topic_name,
 	    (uint8_t *) topic, (uint32_t) strlen(topic));
 	proto_data->is_copied = true;
@@ -187,6 +338,15 @@ const char *
 nni_mqtt_msg_get_publish_topic(nni_msg *msg, uint32_t *topic_len)
 {
 	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	uint8_t *            body;
+	uint16_t             len;
+
+	if (proto_data == NULL) {
+		body = nni_msg_body(msg);
+		NNI_GET16(body, len);
+		*topic_len = len;
+		return ((const char *) body + 2);
+	}
 	*topic_len = proto_data->var_header.publish.topic_name.length;
 	return (const char *) proto_data->var_header.publish.topic_name.buf;
 }
@@ -194,7 +354,12 @@ nni_mqtt_msg_get_publish_topic(nni_msg *msg, uint32_t *topic_len)
 void
 nni_mqtt_msg_set_publish_payload(nni_msg *msg, uint8_t *payload, uint32_t len)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
+	(void) nni_mqtt_msg_set_publish_payload_ref(msg, NULL, 0, NULL, NULL);
 	mqtt_buf_create(
 	    &proto_data->payload.publish.payload, payload, (uint32_t) len);
 	proto_data->is_copied = true;
@@ -204,14 +369,41 @@ uint8_t *
 nni_mqtt_msg_get_publish_payload(nni_msg *msg, uint32_t *outlen)
 {
 	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	size_t               off;
+
+	if (proto_data == NULL) {
+		off     = mqtt_msg_raw_payload_off(msg);
+		*outlen = (uint32_t) (nni_msg_len(msg) - off);
+		return ((uint8_t *) nni_msg_body(msg) + off);
+	}
+	if (proto_data->payload_ref != NULL) {
+		*outlen = proto_data->payload_ref->len;
+		return (proto_data->payload_ref->buf);
+	}
 	*outlen = proto_data->payload.publish.payload.length;
 	return proto_data->payload.publish.payload.buf;
 }
 
+void
+nni_mqtt_msg_set_publish_topic_alias(nni_msg *msg, uint16_t alias)
+{
+	mqtt_msg_set_prop_u16(msg, NNG_MQTT_PROP_TOPIC_ALIAS, alias);
+}
+
+uint16_t
+nni_mqtt_msg_get_publish_topic_alias(nni_msg *msg)
+{
+	return mqtt_msg_get_prop_u16(msg, NNG_MQTT_PROP_TOPIC_ALIAS);
+}
+
 void
 nni_mqtt_msg_set_publish_packet_id(nni_msg *msg, uint16_t packet_id)
 {
-	nni_mqtt_proto_data *proto_data          = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.publish.packet_id = packet_id;
 }
 
@@ -219,76 +411,109 @@ uint16_t
 nni_mqtt_msg_get_publish_packet_id(nni_msg *msg)
 {
 	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	uint8_t *            body;
+	uint16_t             len;
+	uint16_t             pid;
+
+	if (proto_data == NULL) {
+		if (nni_msg_get_pub_qos(msg) == 0) {
+			return (0);
+		}
+		body = nni_msg_body(msg);
+		NNI_GET16(body, len);
+		NNI_GET16(body + 2 + len, pid);
+		return (pid);
+	}
 	return proto_data->var_header.publish.packet_id;
 }
 
 void
 nni_mqtt_msg_set_puback_packet_id(nni_msg *msg, uint16_t packet_id)
 {
-	nni_mqtt_proto_data *proto_data         = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.puback.packet_id = packet_id;
 }
 
 uint16_t
 nni_mqtt_msg_get_puback_packet_id(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.puback.packet_id;
 }
 
 uint16_t
 nni_mqtt_msg_get_pubrec_packet_id(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.pubrec.packet_id;
 }
 
 void
 nni_mqtt_msg_set_pubrec_packet_id(nni_msg *msg, uint16_t packet_id)
 {
-	nni_mqtt_proto_data *proto_data         = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.pubrec.packet_id = packet_id;
 }
 
 uint16_t
 nni_mqtt_msg_get_pubrel_packet_id(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.pubrel.packet_id;
 }
 
 void
 nni_mqtt_msg_set_pubrel_packet_id(nni_msg *msg, uint16_t packet_id)
 {
-	nni_mqtt_proto_data *proto_data         = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.pubrel.packet_id = packet_id;
 }
 
 uint16_t
 nni_mqtt_msg_get_pubcomp_packet_id(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.pubcomp.packet_id;
 }
 
 void
 nni_mqtt_msg_set_pubcomp_packet_id(nni_msg *msg, uint16_t packet_id)
 {
-	nni_mqtt_proto_data *proto_data          = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.pubcomp.packet_id = packet_id;
 }
 
 uint16_t
 nni_mqtt_msg_get_subscribe_packet_id(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.subscribe.packet_id;
 }
 
 void
 nni_mqtt_msg_set_subscribe_packet_id(nni_msg *msg, uint16_t packet_id)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.subscribe.packet_id = packet_id;
 }
 
@@ -296,8 +521,11 @@ void
 nni_mqtt_msg_set_subscribe_topics(
     nni_msg *msg, nni_mqtt_topic_qos *topics, uint32_t topic_count)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
 
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->payload.subscribe.topic_arr =
 	    nni_mqtt_topic_qos_array_create(topic_count);
 	proto_data->payload.subscribe.topic_count = topic_count;
@@ -313,7 +541,7 @@ nni_mqtt_msg_set_subscribe_topics(
 nni_mqtt_topic_qos *
 nni_mqtt_msg_get_subscribe_topics(nni_msg *msg, uint32_t *topic_count)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	*topic_count = proto_data->payload.subscribe.topic_count;
 	return proto_data->payload.subscribe.topic_arr;
 }
@@ -321,14 +549,18 @@ nni_mqtt_msg_get_subscribe_topics(nni_msg *msg, uint32_t *topic_count)
 uint16_t
 nni_mqtt_msg_get_suback_packet_id(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.suback.packet_id;
 }
 
 void
 nni_mqtt_msg_set_suback_packet_id(nni_msg *msg, uint16_t packet_id)
 {
-	nni_mqtt_proto_data *proto_data         = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.suback.packet_id = packet_id;
 }
 
@@ -336,7 +568,11 @@ void
 nni_mqtt_msg_set_suback_return_codes(
     nni_msg *msg, uint8_t *ret_codes, uint32_t ret_codes_count)
 {
-	nni_mqtt_proto_data *proto_data         = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->payload.suback.ret_code_arr = nni_alloc(ret_codes_count);
 	memcpy(proto_data->payload.suback.ret_code_arr, ret_codes,
 	    ret_codes_count);
@@ -347,7 +583,7 @@ nni_mqtt_msg_set_suback_return_codes(
 uint8_t *
 nni_mqtt_msg_get_suback_return_codes(nni_msg *msg, uint32_t *ret_codes_count)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	*ret_codes_count = proto_data->payload.suback.ret_code_count;
 	return proto_data->payload.suback.ret_code_arr;
 }
@@ -355,14 +591,18 @@ nni_mqtt_msg_get_suback_return_codes(nni_msg *msg, uint32_t *ret_codes_count)
 uint16_t
 nni_mqtt_msg_get_unsubscribe_packet_id(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.unsubscribe.packet_id;
 }
 
 void
 nni_mqtt_msg_set_unsubscribe_packet_id(nni_msg *msg, uint16_t packet_id)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.unsubscribe.packet_id = packet_id;
 }
 
@@ -370,8 +610,11 @@ void
 nni_mqtt_msg_set_unsubscribe_topics(
     nni_msg *msg, nni_mqtt_topic *topics, uint32_t topic_count)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
 
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->payload.unsubscribe.topic_arr =
 	    nni_mqtt_topic_array_create(topic_count);
 	proto_data->payload.unsubscribe.topic_count = topic_count;
@@ -387,7 +630,7 @@ nni_mqtt_msg_set_unsubscribe_topics(
 nni_mqtt_topic *
 nni_mqtt_msg_get_unsubscribe_topics(nni_msg *msg, uint32_t *topic_count)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	*topic_count = proto_data->payload.unsubscribe.topic_count;
 	return (nni_mqtt_topic *) proto_data->payload.unsubscribe.topic_arr;
 }
@@ -395,21 +638,29 @@ nni_mqtt_msg_get_unsubscribe_topics(nni_msg *msg, uint32_t *topic_count)
 void
 nni_mqtt_msg_set_unsuback_packet_id(nni_msg *msg, uint16_t packet_id)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.unsuback.packet_id = packet_id;
 }
 
 uint16_t
 nni_mqtt_msg_get_unsuback_packet_id(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.unsuback.packet_id;
 }
 
 void
 nni_mqtt_msg_set_connect_clean_session(nni_msg *msg, bool clean_session)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.connect.conn_flags.clean_session =
 	    clean_session;
 }
@@ -417,70 +668,102 @@ nni_mqtt_msg_set_connect_clean_session(nni_msg *msg, bool clean_session)
 void
 nni_mqtt_msg_set_connect_will_retain(nni_msg *msg, bool will_retain)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.connect.conn_flags.will_retain = will_retain;
 }
 
 void
 nni_mqtt_msg_set_connect_will_qos(nni_msg *msg, uint8_t will_qos)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.connect.conn_flags.will_qos = will_qos;
 }
 
 void
 nni_mqtt_msg_set_connect_proto_version(nni_msg *msg, uint8_t version)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.connect.protocol_version = version;
 }
 
 void
 nni_mqtt_msg_set_connect_keep_alive(nni_msg *msg, uint16_t keep_alive)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.connect.keep_alive = keep_alive;
 }
 
 bool
 nni_mqtt_msg_get_connect_clean_session(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.connect.conn_flags.clean_session;
 }
 
 bool
 nni_mqtt_msg_get_connect_will_retain(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.connect.conn_flags.will_retain;
 }
 
 uint8_t
 nni_mqtt_msg_get_connect_will_qos(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.connect.conn_flags.will_qos;
 }
 
 uint8_t
 nni_mqtt_msg_get_connect_proto_version(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.connect.protocol_version;
 }
 
 uint16_t
 nni_mqtt_msg_get_connect_keep_alive(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.connect.keep_alive;
 }
 
+void
+nni_mqtt_msg_set_connect_topic_alias_max(nni_msg *msg, uint16_t max)
+{
+	mqtt_msg_set_prop_u16(msg, NNG_MQTT_PROP_TOPIC_ALIAS_MAX, max);
+}
+
+uint16_t
+nni_mqtt_msg_get_connect_topic_alias_max(nni_msg *msg)
+{
+	return mqtt_msg_get_prop_u16(msg, NNG_MQTT_PROP_TOPIC_ALIAS_MAX);
+}
+
 void
 nni_mqtt_msg_set_connect_client_id(nni_msg *msg, const char *client_id)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	mqtt_buf_create(&proto_data->payload.connect.client_id,
 	    (const uint8_t *) client_id, (uint32_t) strlen(client_id));
 	proto_data->is_copied = true;
@@ -489,7 +772,11 @@ nni_mqtt_msg_set_connect_client_id(nni_msg *msg, const char *client_id)
 void
 nni_mqtt_msg_set_connect_will_topic(nni_msg *msg, const char *will_topic)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	mqtt_buf_create(&proto_data->payload.connect.will_topic,
 	    (const uint8_t *) will_topic, (uint32_t) strlen(will_topic));
 	proto_data->is_copied = true;
@@ -499,7 +786,11 @@ void
 nni_mqtt_msg_set_connect_will_msg(
     nni_msg *msg, uint8_t *will_msg, uint32_t len)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	mqtt_buf_create(&proto_data->payload.connect.will_msg,
 	    (const uint8_t *) will_msg, len);
 	proto_data->is_copied = true;
@@ -508,7 +799,11 @@ nni_mqtt_msg_set_connect_will_msg(
 void
 nni_mqtt_msg_set_connect_user_name(nni_msg *msg, const char *user_name)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	mqtt_buf_create(&proto_data->payload.connect.user_name,
 	    (const uint8_t *) user_name, (uint32_t) strlen(user_name));
 	proto_data->is_copied = true;
@@ -517,7 +812,11 @@ nni_mqtt_msg_set_connect_user_name(nni_msg *msg, const char *user_name)
 void
 nni_mqtt_msg_set_connect_password(nni_msg *msg, const char *password)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	mqtt_buf_create(&proto_data->payload.connect.password,
 	    (const uint8_t *) password, (uint32_t) strlen(password));
 	proto_data->is_copied = true;
@@ -526,21 +825,21 @@ nni_mqtt_msg_set_connect_password(nni_msg *msg, const char *password)
 const char *
 nni_mqtt_msg_get_connect_client_id(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return (const char *) proto_data->payload.connect.client_id.buf;
 }
 
 const char *
 nni_mqtt_msg_get_connect_will_topic(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return (const char *) proto_data->payload.connect.will_topic.buf;
 }
 
 uint8_t *
 nni_mqtt_msg_get_connect_will_msg(nni_msg *msg, uint32_t *len)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	*len = proto_data->payload.connect.will_msg.length;
 	return proto_data->payload.connect.will_msg.buf;
 }
@@ -548,51 +847,74 @@ nni_mqtt_msg_get_connect_will_msg(nni_msg *msg, uint32_t *len)
 const char *
 nni_mqtt_msg_get_connect_user_name(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return (const char *) proto_data->payload.connect.user_name.buf;
 }
 
 const char *
 nni_mqtt_msg_get_connect_password(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return (const char *) proto_data->payload.connect.password.buf;
 }
 
 void
 nni_mqtt_msg_set_connack_return_code(nni_msg *msg, uint8_t code)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.connack.conn_return_code = code;
 }
 
 void
 nni_mqtt_msg_set_connack_flags(nni_msg *msg, uint8_t flags)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->var_header.connack.connack_flags = flags;
 }
 
 uint8_t
 nni_mqtt_msg_get_connack_return_code(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.connack.conn_return_code;
 }
 
 uint8_t
 nni_mqtt_msg_get_connack_flags(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->var_header.connack.connack_flags;
 }
 
+void
+nni_mqtt_msg_set_connack_topic_alias_max(nni_msg *msg, uint16_t max)
+{
+	mqtt_msg_set_prop_u16(msg, NNG_MQTT_PROP_TOPIC_ALIAS_MAX, max);
+}
+
+uint16_t
+nni_mqtt_msg_get_connack_topic_alias_max(nni_msg *msg)
+{
+	return mqtt_msg_get_prop_u16(msg, NNG_MQTT_PROP_TOPIC_ALIAS_MAX);
+}
+
 void
 nni_mqtt_msg_dump(
     nni_msg *msg, uint8_t *buffer, uint32_t len, bool print_bytes)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
 
+	if (proto_data == NULL) {
+		return;
+	}
 	mqtt_buf mqbuf = { .buf = buffer, .length = len };
 
 	nni_msg *mqtt_data;
@@ -665,13 +987,17 @@ nni_mqtt_topic_qos_array_free(nni_mqtt_topic_qos *topic_qos, size_t n)
 nni_aio *
 nni_mqtt_msg_get_aio(nni_msg *msg)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	const nni_mqtt_proto_data *proto_data = mqtt_msg_proto_data_peek(msg);
 	return proto_data->aio;
 }
 
 void
 nni_mqtt_msg_set_aio(nni_msg *msg, nni_aio *aio)
 {
-	nni_mqtt_proto_data *proto_data = nni_msg_get_proto_data(msg);
+	nni_mqtt_proto_data *proto_data = nni_mqtt_msg_proto_data(msg);
+
+	if (proto_data == NULL) {
+		return;
+	}
 	proto_data->aio = aio;
 }
\ No newline at end of file
@@ -159,6 +159,16 @@ typedef struct {
 	mqtt_buf payload;
 } mqtt_publish_payload;
 
+/* An application buffer a PUBLISH carries instead of a copied payload.
+   Duplicates of the message share it, and the last one releases it. */
+typedef struct {
+	nni_atomic_int refs;
+	void *         buf;
+	uint32_t       len;
+	void (*release)(void *);
+	void *arg;
+} mqtt_payload_ref;
+
 typedef struct {
 	mqtt_topic_qos *topic_arr; /* array of mqtt_topic_qos instances
 	                              continuous in memory */
@@ -213,10 +223,20 @@ typedef struct mqtt_fixed_hdr_t {
 typedef struct mqtt_msg_t {
 	/* Fixed header part */
 	nni_aio * aio;  //QoS AIO
+	uint8_t   version; /* protocol level of the connection, 0 for 3.1.1 */
 	mqtt_fixed_hdr             fixed_header;
 	union mqtt_variable_header var_header;
 	union mqtt_payload         payload;
 
+	/* encoded without the payload, which is written from here */
+	mqtt_payload_ref *payload_ref;
+
+	/* v5 properties: those of a decoded packet are left in the body, at
+	   prop_off, until something changes them; props holds our own */
+	mqtt_buf props;
+	uint32_t prop_off;
+	uint32_t prop_len;
+
 	uint8_t used_bytes : 4; /* byte count for used remainingLength
 	                         representation This information (combined with
 	                         packetType and packetFlags)  may be used to
@@ -256,6 +276,9 @@ extern int  nni_mqtt_msg_proto_data_alloc(nni_msg *);
 extern void nni_mqtt_msg_proto_data_free(nni_msg *);
 extern int  nni_mqtt_msg_free(void *self);
 extern int  nni_mqtt_msg_dup(void **dest, const void *src);
+extern void nni_mqtt_msg_fini(void *self);
+extern nni_mqtt_proto_data *nni_mqtt_msg_proto_data(nni_msg *);
+extern int                  nni_mqtt_msg_check_publish(nni_msg *);
 
 // mqtt message alloc/encode/decode
 extern int nni_mqtt_msg_alloc(nni_msg **, size_t);
@@ -266,6 +289,23 @@ extern int nni_mqtt_msg_decode(nni_msg *);
 extern void nni_mqtt_msg_set_packet_type(nni_msg *, nni_mqtt_packet_type);
 extern nni_mqtt_packet_type nni_mqtt_msg_get_packet_type(nni_msg *);
 
+// The protocol level of the connection a packet is sent or received on,
+// which decides whether it carries MQTT 5.0 properties.  A CONNECT uses
+// its own protocol version instead.
+extern void    nni_mqtt_msg_set_protocol_version(nni_msg *, uint8_t);
+extern uint8_t nni_mqtt_msg_get_protocol_version(nni_msg *);
+
+// MQTT 5.0 properties, see nng_mqtt_msg_set_property_int() and friends.
+// These return 0 or an NNG error.
+extern int  nni_mqtt_msg_get_prop_int(nni_msg *, uint8_t, uint32_t *);
+extern int  nni_mqtt_msg_get_prop_str(nni_msg *, uint8_t, mqtt_buf *);
+extern int  nni_mqtt_msg_get_user_prop(nni_msg *, uint32_t, mqtt_buf *, mqtt_buf *);
+extern int  nni_mqtt_msg_set_prop_int(nni_msg *, uint8_t, uint32_t);
+extern int  nni_mqtt_msg_set_prop_str(
+     nni_msg *, uint8_t, const uint8_t *, uint32_t);
+extern int  nni_mqtt_msg_add_user_prop(nni_msg *, const char *, const char *);
+extern int  nni_mqtt_msg_del_prop(nni_msg *, uint8_t);
+
 // mqtt packet id
 // NOTE: not all packet have a packet id field
 extern void     nni_mqtt_msg_set_packet_id(nni_msg *, uint16_t);
@@ -292,12 +332,16 @@ extern const char *nni_mqtt_msg_get_connect_will_topic(nni_msg *);
 extern bool        nni_mqtt_msg_get_connect_will_retain(nni_msg *);
 extern uint8_t *   nni_mqtt_msg_get_connect_will_msg(nni_msg *, uint32_t *);
 extern uint8_t     nni_mqtt_msg_get_connect_will_qos(nni_msg *);
+extern void     nni_mqtt_msg_set_connect_topic_alias_max(nni_msg *, uint16_t);
+extern uint16_t nni_mqtt_msg_get_connect_topic_alias_max(nni_msg *);
 
 // mqtt conack
 extern void    nni_mqtt_msg_set_connack_return_code(nni_msg *, uint8_t);
 extern void    nni_mqtt_msg_set_connack_flags(nni_msg *, uint8_t);
 extern uint8_t nni_mqtt_msg_get_connack_return_code(nni_msg *);
 extern uint8_t nni_mqtt_msg_get_connack_flags(nni_msg *);
+extern void     nni_mqtt_msg_set_connack_topic_alias_max(nni_msg *, uint16_t);
+extern uint16_t nni_mqtt_msg_get_connack_topic_alias_max(nni_msg *);
 
 // mqtt publish
 extern void        nni_mqtt_msg_set_publish_qos(nni_msg *, uint8_t);
@@ -312,6 +356,12 @@ extern void        nni_mqtt_msg_set_publish_packet_id(nni_msg *, uint16_t);
 extern uint16_t    nni_mqtt_msg_get_publish_packet_id(nni_msg *);
 extern void nni_mqtt_msg_set_publish_payload(nni_msg *, uint8_t *, uint32_t);
 extern uint8_t *nni_mqtt_msg_get_publish_payload(nni_msg *, uint32_t *);
+extern int      nni_mqtt_msg_set_publish_payload_ref(
+         nni_msg *, void *, uint32_t, void (*)(void *), void *);
+extern const void *nni_mqtt_msg_payload_ref(nni_msg *, size_t *);
+extern uint32_t    nni_mqtt_msg_get_publish_packet_size(nni_msg *);
+extern void     nni_mqtt_msg_set_publish_topic_alias(nni_msg *, uint16_t);
+extern uint16_t nni_mqtt_msg_get_publish_topic_alias(nni_msg *);
 
 // mqtt puback
 extern uint16_t nni_mqtt_msg_get_puback_packet_id(nni_msg *);
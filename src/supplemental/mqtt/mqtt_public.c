@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "mqtt_msg.h"
 
 int
@@ -132,6 +134,18 @@ nng_mqtt_msg_get_connect_keep_alive(nng_msg *msg)
 	return nni_mqtt_msg_get_connect_keep_alive(msg);
 }
 
+void
+nng_mqtt_msg_set_connect_topic_alias_max(nng_msg *msg, uint16_t max)
+{
+	nni_mqtt_msg_set_connect_topic_alias_max(msg, max);
+}
+
+uint16_t
+nng_mqtt_msg_get_connect_topic_alias_max(nng_msg *msg)
+{
+	return nni_mqtt_msg_get_connect_topic_alias_max(msg);
+}
+
 const char *
 nng_mqtt_msg_get_connect_client_id(nng_msg *msg)
 {
@@ -186,6 +200,12 @@ nng_mqtt_msg_get_connack_flags(nng_msg *msg)
 	return nni_mqtt_msg_get_connack_flags(msg);
 }
 
+uint16_t
+nng_mqtt_msg_get_connack_topic_alias_max(nng_msg *msg)
+{
+	return nni_mqtt_msg_get_connack_topic_alias_max(msg);
+}
+
 void
 nng_mqtt_msg_set_publish_qos(nng_msg *msg, uint8_t qos)
 {
@@ -258,6 +278,17 @@ nng_mqtt_msg_get_publish_payload(nng_msg *msg, uint32_t *len)
 	return nni_mqtt_msg_get_publish_payload(msg, len);
 }
 
+int
+nng_mqtt_msg_set_publish_payload_ref(nng_msg *msg, void *buf, uint32_t len,
+    void (*release)(void *), void *arg)
+{
+	if (buf == NULL) {
+		return (NNG_EINVAL);
+	}
+	return (nni_mqtt_msg_set_publish_payload_ref(
+	    msg, buf, len, release, arg));
+}
+
 uint16_t
 nng_mqtt_msg_get_puback_packet_id(nng_msg *msg)
 {
@@ -434,6 +465,112 @@ nng_mqtt_topic_qos_array_free(nng_mqtt_topic_qos *topic_qos, size_t n)
 	nni_mqtt_topic_qos_array_free(topic_qos, n);
 }
 
+int
+nng_mqtt_msg_set_property_int(
+    nng_msg *msg, nng_mqtt_property_id id, uint32_t val)
+{
+	return nni_mqtt_msg_set_prop_int(msg, (uint8_t) id, val);
+}
+
+int
+nng_mqtt_msg_get_property_int(
+    nng_msg *msg, nng_mqtt_property_id id, uint32_t *val)
+{
+	return nni_mqtt_msg_get_prop_int(msg, (uint8_t) id, val);
+}
+
+int
+nng_mqtt_msg_set_property_str(nng_msg *msg, nng_mqtt_property_id id,
+    const uint8_t *data, uint32_t len)
+{
+	return nni_mqtt_msg_set_prop_str(msg, (uint8_t) id, data, len);
+}
+
+int
+nng_mqtt_msg_get_property_str(nng_msg *msg, nng_mqtt_property_id id,
+    const uint8_t **data, uint32_t *len)
+{
+	mqtt_buf str;
+	int      rv;
+
+	if ((rv = nni_mqtt_msg_get_prop_str(msg, (uint8_t) id, &str)) == 0) {
+		*data = str.buf;
+		*len  = str.length;
+	}
+	return (rv);
+}
+
+int
+nng_mqtt_msg_add_user_property(
+    nng_msg *msg, const char *name, const char *value)
+{
+	return nni_mqtt_msg_add_user_prop(msg, name, value);
+}
+
+int
+nng_mqtt_msg_get_user_property(nng_msg *msg, uint32_t index,
+    nng_mqtt_buffer *name, nng_mqtt_buffer *value)
+{
+	return nni_mqtt_msg_get_user_prop(msg, index, name, value);
+}
+
+int
+nng_mqtt_set_msg_expiry(nng_msg *msg, nng_duration dur)
+{
+	if (dur == NNG_DURATION_INFINITE) {
+		return (nni_mqtt_msg_del_prop(
+		    msg, NNG_MQTT_PROP_MESSAGE_EXPIRY));
+	}
+	if (dur < 0) {
+		return (NNG_EINVAL);
+	}
+	// The property is in whole seconds.
+	return (nni_mqtt_msg_set_prop_int(msg, NNG_MQTT_PROP_MESSAGE_EXPIRY,
+	    (uint32_t)((dur + 999) / 1000)));
+}
+
+int
+nng_mqtt_get_msg_expiry(nng_msg *msg, nng_duration *dur)
+{
+	uint32_t secs;
+	int      rv;
+
+	rv = nni_mqtt_msg_get_prop_int(msg, NNG_MQTT_PROP_MESSAGE_EXPIRY, &secs);
+	if (rv == NNG_ENOENT) {
+		*dur = NNG_DURATION_INFINITE;
+		return (0);
+	}
+	if (rv == 0) {
+		*dur = secs > INT32_MAX / 1000 ? INT32_MAX
+		                               : (nng_duration)(secs * 1000);
+	}
+	return (rv);
+}
+
+int
+nng_mqtt_set_msg_format(nng_msg *msg, nng_mqtt_msg_format_t fmt)
+{
+	return (nni_mqtt_msg_set_prop_int(
+	    msg, NNG_MQTT_PROP_PAYLOAD_FORMAT, (uint32_t) fmt));
+}
+
+int
+nng_mqtt_get_msg_format(nng_msg *msg, nng_mqtt_msg_format_t *fmt)
+{
+	uint32_t val;
+	int      rv;
+
+	rv = nni_mqtt_msg_get_prop_int(msg, NNG_MQTT_PROP_PAYLOAD_FORMAT, &val);
+	if (rv == NNG_ENOENT) {
+		*fmt = nng_mqtt_msg_format_binary;
+		return (0);
+	}
+	if (rv == 0) {
+		*fmt = (nng_mqtt_msg_format_t) val;
+	}
+	return (rv);
+}
+
 int
 nng_mqtt_set_connect_cb(nng_socket sock, nng_pipe_cb cb, void *arg)
 {
@@ -452,3 +589,89 @@ nng_mqtt_msg_dump(
 {
 	nni_mqtt_msg_dump(msg, buffer, len, print_bytes);
 }
+
+// Builds a SUBSCRIBE or UNSUBSCRIBE for one topic filter.  The client
+// merges those sent close together into a single packet.
+static int
+mqtt_sub_msg_alloc(nng_msg **msgp, nng_mqtt_packet_type type, const char *topic)
+{
+	nng_msg *msg;
+	int      rv;
+
+	if ((rv = nni_mqtt_msg_alloc(&msg, 0)) != 0) {
+		return (rv);
+	}
+	nni_mqtt_msg_set_packet_type(msg, (nni_mqtt_packet_type) type);
+	if (type == NNG_MQTT_SUBSCRIBE) {
+		nni_mqtt_topic_qos tq;
+		tq.topic.buf    = (uint8_t *) topic;
+		tq.topic.length = (uint32_t) strlen(topic);
+		tq.qos          = 0;
+		nni_mqtt_msg_set_subscribe_topics(msg, &tq, 1);
+	} else {
+		nni_mqtt_topic tp;
+		tp.buf    = (uint8_t *) topic;
+		tp.length = (uint32_t) strlen(topic);
+		nni_mqtt_msg_set_unsubscribe_topics(msg, &tp, 1);
+	}
+	*msgp = msg;
+	return (0);
+}
+
+static int
+mqtt_sub_aio(nng_socket sock, nng_mqtt_packet_type type, const char *topic,
+    nng_aio *aio)
+{
+	nng_msg *msg;
+	int      rv;
+
+	if ((rv = mqtt_sub_msg_alloc(&msg, type, topic)) != 0) {
+		return (rv);
+	}
+	nng_aio_set_msg(aio, msg);
+	nng_send_aio(sock, aio);
+	return (0);
+}
+
+static int
+mqtt_sub_sync(nng_socket sock, nng_mqtt_packet_type type, const char *topic)
+{
+	nng_aio *aio;
+	int      rv;
+
+	if ((rv = nng_aio_alloc(&aio, NULL, NULL)) != 0) {
+		return (rv);
+	}
+	if ((rv = mqtt_sub_aio(sock, type, topic, aio)) == 0) {
+		nng_aio_wait(aio);
+		if ((rv = nng_aio_result(aio)) != 0) {
+			nng_msg_free(nng_aio_get_msg(aio));
+		}
+	}
+	nng_aio_free(aio);
+	return (rv);
+}
+
+int
+nng_mqtt_subscribe(nng_socket sock, const char *topic)
+{
+	return (mqtt_sub_sync(sock, NNG_MQTT_SUBSCRIBE, topic));
+}
+
+int
+nng_mqtt_subscribe_aio(nng_socket sock, const char *topic, nng_aio *aio)
+{
+	return (mqtt_sub_aio(sock, NNG_MQTT_SUBSCRIBE, topic, aio));
+}
+
+int
+nng_mqtt_unsubscribe(nng_socket *sock, const char *topic)
+{
+	return (mqtt_sub_sync(*sock, NNG_MQTT_UNSUBSCRIBE, topic));
+}
+
+int
+nng_mqtt_unsubscribe_aio(nng_socket *sock, const char *topic, nng_aio *aio)
+{
+	return (mqtt_sub_aio(*sock, NNG_MQTT_UNSUBSCRIBE, topic, aio));
+}
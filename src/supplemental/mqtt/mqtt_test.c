@@ -506,6 +506,105 @@ test_decode_suback(void)
 	nng_msg_free(msg);
 }
 
+void
+test_v5_properties(void)
+{
+	nng_msg *       msg;
+	nng_msg *       msg2;
+	uint32_t        val;
+	const uint8_t * str;
+	uint32_t        len;
+	nng_mqtt_buffer name;
+	nng_mqtt_buffer value;
+	nng_duration    dur;
+
+	NUTS_PASS(nng_mqtt_msg_alloc(&msg, 0));
+	nng_mqtt_msg_set_packet_type(msg, NNG_MQTT_PUBLISH);
+	nni_mqtt_msg_set_protocol_version(msg, MQTT_VERSION_5_0);
+	nng_mqtt_msg_set_publish_topic(msg, "a/b");
+	nng_mqtt_msg_set_publish_payload(msg, (uint8_t *) "hi", 2);
+
+	NUTS_FAIL(nng_mqtt_msg_get_property_int(
+	              msg, NNG_MQTT_PROP_MESSAGE_EXPIRY, &val),
+	    NNG_ENOENT);
+	NUTS_FAIL(nng_mqtt_msg_set_property_int(
+	              msg, NNG_MQTT_PROP_CONTENT_TYPE, 1),
+	    NNG_EINVAL);
+	NUTS_FAIL(nng_mqtt_msg_set_property_int(
+	              msg, NNG_MQTT_PROP_PAYLOAD_FORMAT, 256),
+	    NNG_EINVAL);
+	NUTS_PASS(nng_mqtt_set_msg_expiry(msg, 1500));
+	NUTS_PASS(nng_mqtt_msg_set_property_str(msg,
+	    NNG_MQTT_PROP_CONTENT_TYPE, (const uint8_t *) "text/plain", 10));
+	NUTS_PASS(nng_mqtt_msg_add_user_property(msg, "k1", "v1"));
+	NUTS_PASS(nng_mqtt_msg_add_user_property(msg, "k2", "v2"));
+	// Replaces the first one.
+	NUTS_PASS(nng_mqtt_set_msg_expiry(msg, 60000));
+	NUTS_PASS(nng_mqtt_msg_encode(msg));
+
+	// 5 topic, 1 length, 5 expiry, 13 content type, 9 + 9 user, 2 payload
+	NUTS_TRUE(nng_msg_len(msg) == 44);
+	NUTS_TRUE(((uint8_t *) nng_msg_body(msg))[5] == 36);
+
+	// Decode a copy of what went out on the wire.
+	NUTS_PASS(nng_mqtt_msg_alloc(&msg2, 0));
+	NUTS_PASS(nng_msg_header_append(
+	    msg2, nng_msg_header(msg), nng_msg_header_len(msg)));
+	NUTS_PASS(nng_msg_append(msg2, nng_msg_body(msg), nng_msg_len(msg)));
+	nni_mqtt_msg_set_protocol_version(msg2, MQTT_VERSION_5_0);
+	NUTS_PASS(nng_mqtt_msg_decode(msg2));
+	nng_msg_free(msg);
+
+	NUTS_PASS(nng_mqtt_get_msg_expiry(msg2, &dur));
+	NUTS_TRUE(dur == 60000);
+	NUTS_PASS(nng_mqtt_msg_get_property_str(
+	    msg2, NNG_MQTT_PROP_CONTENT_TYPE, &str, &len));
+	NUTS_TRUE(len == 10 && memcmp(str, "text/plain", 10) == 0);
+	// Nothing was copied out of the message.
+	NUTS_TRUE(str > (uint8_t *) nng_msg_body(msg2) &&
+	    str < (uint8_t *) nng_msg_body(msg2) + nng_msg_len(msg2));
+	NUTS_PASS(nng_mqtt_msg_get_user_property(msg2, 1, &name, &value));
+	NUTS_TRUE(name.length == 2 && memcmp(name.buf, "k2", 2) == 0);
+	NUTS_TRUE(value.length == 2 && memcmp(value.buf, "v2", 2) == 0);
+	NUTS_FAIL(nng_mqtt_msg_get_user_property(msg2, 2, &name, &value),
+	    NNG_ENOENT);
+	NUTS_TRUE(nng_mqtt_msg_get_publish_payload(msg2, &len)[0] == 'h');
+
+	// Changing one keeps the rest.
+	NUTS_PASS(nng_mqtt_set_msg_expiry(msg2, NNG_DURATION_INFINITE));
+	NUTS_PASS(nng_mqtt_get_msg_expiry(msg2, &dur));
+	NUTS_TRUE(dur == NNG_DURATION_INFINITE);
+	NUTS_PASS(nng_mqtt_msg_get_user_property(msg2, 0, &name, &value));
+	NUTS_TRUE(name.length == 2 && memcmp(name.buf, "k1", 2) == 0);
+	nng_msg_free(msg2);
+}
+
+void
+test_v5_properties_lazy(void)
+{
+	nng_msg *msg;
+	uint32_t val;
+
+	// A topic alias, then a property cut short.
+	uint8_t publish[] = { 0x30, 0x0b, 0x00, 0x01, 't', 0x05, 0x23, 0x00,
+		0x07, 0x02, 0x00, 0x00, 'x' };
+
+	NUTS_PASS(nng_mqtt_msg_alloc(&msg, 0));
+	NUTS_PASS(nng_msg_header_append(msg, publish, 2));
+	NUTS_PASS(nng_msg_append(msg, publish + 2, sizeof(publish) - 2));
+	nni_mqtt_msg_set_protocol_version(msg, MQTT_VERSION_5_0);
+
+	// Decoding does not look inside the properties.
+	NUTS_PASS(nng_mqtt_msg_decode(msg));
+	NUTS_PASS(nng_mqtt_msg_get_property_int(
+	    msg, NNG_MQTT_PROP_TOPIC_ALIAS, &val));
+	NUTS_TRUE(val == 7);
+	NUTS_FAIL(nng_mqtt_msg_get_property_int(
+	              msg, NNG_MQTT_PROP_MESSAGE_EXPIRY, &val),
+	    NNG_EPROTO);
+	nng_msg_free(msg);
+}
+
 TEST_LIST = {
 	{ "alloc message", test_alloc },
 	{ "dup message", test_dup },
@@ -525,5 +624,7 @@ TEST_LIST = {
 	{ "decode publish", test_decode_publish },
 	{ "decode puback", test_decode_puback },
 	{ "decode suback", test_decode_suback },
+	{ "v5 properties", test_v5_properties },
+	{ "v5 properties lazy", test_v5_properties_lazy },
 	{ NULL, NULL },
 };
@@ -664,7 +664,12 @@ ws_write_cb(void *arg)
 	}
 
 	if (aio != NULL) {
-		nni_aio_iov_advance(aio, frame->len);
+		// A message goes on from where this frame ended.  A stream
+		// sends one frame at a time, and like any other stream
+		// leaves it to the caller to advance the iov.
+		if (!ws->isstream) {
+			nni_aio_iov_advance(aio, frame->len);
+		}
 		nni_aio_bump_count(aio, frame->len);
 		if (frame->final) {
 			frame->aio = NULL;
@@ -1455,6 +1460,7 @@ static void
 ws_listener_free(void *arg)
 {
 	nni_ws_listener *l = arg;
+	nni_ws *         ws;
 	ws_header *      hdr;
 
 	ws_listener_close(l);
@@ -1463,6 +1469,11 @@ ws_listener_free(void *arg)
 	while (!nni_list_empty(&l->reply)) {
 		nni_cv_wait(&l->cv);
 	}
+	// Connections that were never accepted are ours to free.
+	while ((ws = nni_list_first(&l->pend)) != NULL) {
+		nni_list_remove(&l->pend, ws);
+		ws_reap(ws);
+	}
 	nni_mtx_unlock(&l->mtx);
 
 	if (l->handler != NULL) {
@@ -2756,6 +2767,12 @@ ws_str_recv(void *arg, nng_aio *aio)
 		return;
 	}
 	nni_mtx_lock(&ws->mtx);
+	// Nothing more is read once closed, so this would never finish.
+	if (ws->closed) {
+		nni_mtx_unlock(&ws->mtx);
+		nni_aio_finish_error(aio, NNG_ECLOSED);
+		return;
+	}
 	if ((rv = nni_aio_schedule(aio, ws_read_cancel, ws)) != 0) {
 		nni_mtx_unlock(&ws->mtx);
 		nni_aio_finish_error(aio, rv);